@@ -135,6 +135,8 @@ public:
         roi->y2 = rect.y2 + delta_pix;
     }
 
+    virtual int getTileSize(const OfxPointD& /*renderScale*/, const CImgBilateralParams& /*params*/) OVERRIDE FINAL { return kCImgTileSizeDefault; }
+
     virtual void render(const OFX::RenderArguments &args, const CImgBilateralParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
@@ -501,6 +501,8 @@ public:
         }
     }
 
+    virtual int getTileSize(const OfxPointD& /*renderScale*/, const CImgBlurParams& /*params*/) OVERRIDE FINAL { return kCImgTileSizeDefault; }
+
     virtual void render(const OFX::RenderArguments &args, const CImgBlurParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
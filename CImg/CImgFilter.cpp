@@ -18,6 +18,13 @@
 
 #include "CImgFilter.h"
 
+#include <cfloat>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CIMGFILTER_SSE2
+#endif
+
 #ifdef HAVE_THREAD_LOCAL
 thread_local OFX::ImageEffect *tls::gImageEffect = 0;
 
@@ -248,6 +255,20 @@ CImgFilterPluginHelperBase::describeInContextEnd(OFX::ImageEffectDescriptor &des
 
 
 
+/* run a processor, without calling the multithread suite from a thread that was spawned by it
+   (this is the case when tiles are processed in parallel) */
+static void
+process(OFX::PixelProcessorFilterBase & processor)
+{
+    if (OFX::MultiThread::isSpawnedThread()) {
+        processor.preProcess();
+        processor.multiThreadFunction(0, 1);
+        processor.postProcess();
+    } else {
+        processor.process();
+    }
+}
+
 /* set up and run a copy processor */
 void
 CImgFilterPluginHelperBase::setupAndFill(OFX::PixelProcessorFilterBase & processor,
@@ -269,7 +290,7 @@ CImgFilterPluginHelperBase::setupAndFill(OFX::PixelProcessorFilterBase & process
     processor.setRenderWindow(renderWindow);
 
     // Call the base class process member, this will call the derived templated process code
-    processor.process();
+    process(processor);
 }
 
 
@@ -333,7 +354,129 @@ CImgFilterPluginHelperBase::setupAndCopy(OFX::PixelProcessorFilterBase & process
     processor.setPremultMaskMix(premult, premultChannel, mix);
 
     // Call the base class process member, this will call the derived templated process code
-    processor.process();
+    process(processor);
+}
+
+// unpremultiply the four channels of a pixel, as PixelCopierUnPremult does
+static inline void
+unpremultRGBA(const float *src, bool premult, int premultChannel, float unp[4])
+{
+    const float alpha = src[premultChannel];
+    const bool doUnpremult = premult && alpha > FLT_EPSILON;
+    for (int c = 0; c < 3; ++c) {
+        unp[c] = doUnpremult ? (src[c] / alpha) : src[c];
+    }
+    unp[3] = src[3];
+}
+
+#ifdef CIMGFILTER_SSE2
+// unpremultiply four pixels stored as planes
+static inline void
+unpremultRGBA(const __m128 src[4], bool premult, int premultChannel, __m128 unp[4])
+{
+    const __m128 alpha = src[premultChannel];
+    const __m128 doUnpremult = premult ? _mm_cmpgt_ps(alpha, _mm_set1_ps(FLT_EPSILON)) : _mm_setzero_ps();
+    for (int c = 0; c < 3; ++c) {
+        unp[c] = _mm_or_ps(_mm_and_ps(doUnpremult, _mm_div_ps(src[c], alpha)), _mm_andnot_ps(doUnpremult, src[c]));
+    }
+    unp[3] = src[3];
+}
+#endif
+
+void
+CImgFilterPluginHelperBase::deinterleaveRGBA(const float *src,
+                                             int n,
+                                             bool premult,
+                                             int premultChannel,
+                                             float* const planes[4])
+{
+    assert(0 <= premultChannel && premultChannel < 4);
+    int i = 0;
+#ifdef CIMGFILTER_SSE2
+    for (; i + 4 <= n; i += 4, src += 16) {
+        __m128 p[4] = { _mm_loadu_ps(src), _mm_loadu_ps(src + 4), _mm_loadu_ps(src + 8), _mm_loadu_ps(src + 12) };
+        _MM_TRANSPOSE4_PS(p[0], p[1], p[2], p[3]);
+        __m128 unp[4];
+        unpremultRGBA(p, premult, premultChannel, unp);
+        for (int c = 0; c < 4; ++c) {
+            if (planes[c]) {
+                _mm_storeu_ps(planes[c] + i, unp[c]);
+            }
+        }
+    }
+#endif
+    for (; i < n; ++i, src += 4) {
+        float unp[4];
+        unpremultRGBA(src, premult, premultChannel, unp);
+        for (int c = 0; c < 4; ++c) {
+            if (planes[c]) {
+                planes[c][i] = unp[c];
+            }
+        }
+    }
+}
+
+void
+CImgFilterPluginHelperBase::interleaveRGBA(const float* const planes[4],
+                                           const float *src,
+                                           int n,
+                                           bool premult,
+                                           int premultChannel,
+                                           double mix,
+                                           float *dst)
+{
+    assert(0 <= premultChannel && premultChannel < 4);
+    const float fmix = (float)mix;
+    int i = 0;
+#ifdef CIMGFILTER_SSE2
+    const __m128 vmix = _mm_set1_ps(fmix);
+    const __m128 vmix1 = _mm_set1_ps(1.f - fmix);
+    for (; i + 4 <= n; i += 4, src += 16, dst += 16) {
+        __m128 s[4] = { _mm_loadu_ps(src), _mm_loadu_ps(src + 4), _mm_loadu_ps(src + 8), _mm_loadu_ps(src + 12) };
+        _MM_TRANSPOSE4_PS(s[0], s[1], s[2], s[3]);
+        __m128 p[4];
+        unpremultRGBA(s, premult, premultChannel, p);
+        for (int c = 0; c < 4; ++c) {
+            if (planes[c]) {
+                p[c] = _mm_loadu_ps(planes[c] + i);
+            }
+        }
+        if (premult) {
+            const __m128 alpha = p[premultChannel];
+            for (int c = 0; c < 3; ++c) {
+                p[c] = _mm_mul_ps(p[c], alpha);
+            }
+        }
+        if (fmix != 1.f) {
+            for (int c = 0; c < 4; ++c) {
+                p[c] = _mm_add_ps(_mm_mul_ps(p[c], vmix), _mm_mul_ps(s[c], vmix1));
+            }
+        }
+        _MM_TRANSPOSE4_PS(p[0], p[1], p[2], p[3]);
+        _mm_storeu_ps(dst, p[0]);
+        _mm_storeu_ps(dst + 4, p[1]);
+        _mm_storeu_ps(dst + 8, p[2]);
+        _mm_storeu_ps(dst + 12, p[3]);
+    }
+#endif
+    for (; i < n; ++i, src += 4, dst += 4) {
+        float p[4];
+        unpremultRGBA(src, premult, premultChannel, p);
+        for (int c = 0; c < 4; ++c) {
+            if (planes[c]) {
+                p[c] = planes[c][i];
+            }
+        }
+        if (premult) {
+            const float alpha = p[premultChannel];
+            for (int c = 0; c < 3; ++c) {
+                p[c] *= alpha;
+            }
+        }
+        for (int c = 0; c < 4; ++c) {
+            dst[c] = (fmix == 1.f) ? p[c] : (p[c] * fmix + src[c] * (1.f - fmix));
+        }
+    }
 }
 
 
@@ -28,9 +28,12 @@
 #include <cassert>
 #include <memory>
 #include <algorithm>
+#include <new>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
 #include "ofxsPixelProcessor.h"
 #include "ofxsCopier.h"
 #include "ofxsCoords.h"
@@ -94,6 +97,17 @@
 
 //#define CIMG_DEBUG
 
+// default size of the tiles, for plugins that support tiled processing (see getTileSize())
+#define kCImgTileSizeDefault 512
+// tiles are enlarged to be at least kCImgTileMarginRatio times the margin required by the filter,
+// but never beyond kCImgTileSizeMax, so that the memory used by each tile stays bounded
+#define kCImgTileMarginRatio 8
+#define kCImgTileSizeMax 2048
+// the processWindow is only tiled if the RoI of a tile (including the margin) is at most
+// 1/kCImgTileAreaRatio of the RoI of the processWindow. The number of tiles processed at once is
+// also limited so that they never use more memory than processing the whole processWindow at once.
+#define kCImgTileAreaRatio 4
+
 // use the locally-downloaded CImg.h
 //
 // To download the latest CImg.h, use:
@@ -229,6 +243,18 @@ protected:
                  bool maskInvert);
 
 
+    // convert n packed float RGBA pixels to planes (unpremultiplied if premult is true).
+    // planes[c] may be NULL if channel c is not needed.
+    static
+    void
+    deinterleaveRGBA(const float *src, int n, bool premult, int premultChannel, float* const planes[4]);
+
+    // convert n pixels to packed float RGBA (premultiplied if premult is true), mixed with src.
+    // Channels for which planes[c] is NULL are taken from src.
+    static
+    void
+    interleaveRGBA(const float* const planes[4], const float *src, int n, bool premult, int premultChannel, double mix, float *dst);
+
     // utility functions
     static
     bool
@@ -305,6 +331,11 @@ public:
     // 0: Black/Dirichlet, 1: Nearest/Neumann, 2: Repeat/Periodic
     virtual int getBoundary(const Params& /*params*/) { return 0; }
 
+    // size of the tiles used to process the render window, or 0 to process it at once (the default).
+    // Tiles are processed independently and in parallel, each with a margin given by getRoI(), which bounds
+    // the memory used by large renders. Only plugins that support tiles may return a non-zero value.
+    virtual int getTileSize(const OfxPointD& /*renderScale*/, const Params& /*params*/) { return 0; }
+
     //static void describe(OFX::ImageEffectDescriptor &desc, bool supportsTiles);
 
     static OFX::PageParamDescriptor*
@@ -331,6 +362,119 @@ public:
                                                                   processAlpha,
                                                                   processIsSecret);
     }
+
+private:
+    // everything that is needed to render a part of the render window
+    struct RenderData
+    {
+        RenderData(const OFX::RenderArguments &args_, const Params& params_)
+        : args(args_)
+        , params(params_)
+        {
+        }
+
+        const OFX::RenderArguments &args;
+        const Params& params;
+        OfxRectI dstRoD;
+        const OFX::Image* src;
+        const OFX::Image* mask;
+        const void *srcPixelData;
+        OfxRectI srcBounds;
+        OFX::PixelComponentEnum srcPixelComponents;
+        int srcPixelComponentCount;
+        OFX::BitDepthEnum srcBitDepth;
+        int srcRowBytes;
+        int srcBoundary;
+        void *dstPixelData;
+        OfxRectI dstBounds;
+        OFX::PixelComponentEnum dstPixelComponents;
+        int dstPixelComponentCount;
+        OFX::BitDepthEnum dstBitDepth;
+        int dstRowBytes;
+        bool premult;
+        int premultChannel;
+        double mix;
+        bool maskInvert;
+        bool doMasking;
+        bool processR;
+        bool processG;
+        bool processB;
+        bool processA;
+    };
+
+    // process the tiles in parallel: each thread takes the next tile to be processed
+    class TileProcessor : public OFX::MultiThread::Processor
+    {
+    public:
+        TileProcessor(CImgFilterPluginHelper &plugin, const RenderData& data, const std::vector<OfxRectI>& tiles)
+        : _plugin(plugin)
+        , _data(data)
+        , _tiles(tiles)
+        , _nextTile(0)
+        , _mutex()
+        , _status(kOfxStatOK)
+        , _badAlloc(false)
+        {
+        }
+
+        // rethrow the first error caught by the processing threads (must be called from the thread that called multiThread())
+        void rethrowError() const
+        {
+            if (_badAlloc) {
+                throw std::bad_alloc();
+            }
+            if (_status != kOfxStatOK) {
+                OFX::throwSuiteStatusException(_status);
+            }
+        }
+
+    private:
+        virtual void multiThreadFunction(unsigned int /*threadId*/, unsigned int /*nThreads*/) OVERRIDE FINAL
+        {
+            // no exception may cross the host thread boundary: the first error is kept, and rethrown by rethrowError()
+            for (;;) {
+                size_t i;
+                {
+                    OFX::MultiThread::AutoMutex lock(_mutex);
+                    if (_nextTile >= _tiles.size() || _status != kOfxStatOK || _badAlloc || _plugin.abort()) {
+                        return;
+                    }
+                    i = _nextTile++;
+                }
+                try {
+                    _plugin.processWindowCImg(_data, _tiles[i]);
+                } catch (const cimg_library::CImgAbortException&) {
+                    // the render was aborted: the other threads stop when they check abort()
+                } catch (const OFX::Exception::Suite &e) {
+                    setError(e.status(), false);
+                } catch (const std::bad_alloc&) {
+                    setError(kOfxStatErrMemory, true);
+                } catch (...) {
+                    setError(kOfxStatFailed, false);
+                }
+            }
+        }
+
+        void setError(OfxStatus status, bool badAlloc)
+        {
+            OFX::MultiThread::AutoMutex lock(_mutex);
+            if (_status == kOfxStatOK && !_badAlloc) {
+                _status = (status == kOfxStatOK) ? kOfxStatFailed : status;
+                _badAlloc = badAlloc;
+            }
+        }
+
+        CImgFilterPluginHelper &_plugin;
+        const RenderData& _data;
+        const std::vector<OfxRectI>& _tiles;
+        size_t _nextTile;
+        OFX::MultiThread::Mutex _mutex; //< protects _nextTile, _status and _badAlloc
+        OfxStatus _status; //< the first error, kOfxStatOK if there was none
+        bool _badAlloc; //< the first error was a std::bad_alloc
+    };
+
+    // copy the RoI of processWindow to a cimg, process it, and copy the result to processWindow in dst
+    void processWindowCImg(const RenderData& data, const OfxRectI& processWindow);
 };
 
 
@@ -614,17 +758,130 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
     }
     assert(mix != 0.); // mix == 0. should give an empty processWindow
 
+    RenderData data(args, params);
+    data.dstRoD = dstRoD;
+    data.src = src.get();
+    data.mask = mask.get();
+    data.srcPixelData = srcPixelData;
+    data.srcBounds = srcBounds;
+    data.srcPixelComponents = srcPixelComponents;
+    data.srcPixelComponentCount = srcPixelComponentCount;
+    data.srcBitDepth = srcBitDepth;
+    data.srcRowBytes = srcRowBytes;
+    data.srcBoundary = srcBoundary;
+    data.dstPixelData = dstPixelData;
+    data.dstBounds = dstBounds;
+    data.dstPixelComponents = dstPixelComponents;
+    data.dstPixelComponentCount = dstPixelComponentCount;
+    data.dstBitDepth = dstBitDepth;
+    data.dstRowBytes = dstRowBytes;
+    data.premult = premult;
+    data.premultChannel = premultChannel;
+    data.mix = mix;
+    data.maskInvert = maskInvert;
+    data.doMasking = doMasking;
+    data.processR = processR;
+    data.processG = processG;
+    data.processB = processB;
+    data.processA = processA;
+
+    // split the processWindow into tiles, if the plugin supports it
+    std::vector<OfxRectI> tiles;
+    int tileSize = _supportsTiles ? getTileSize(renderScale, params) : 0;
+    // the maximum number of tiles processed at once, each using its own cimg
+    unsigned int maxConcurrentTiles = 1;
+    if (tileSize > 0) {
+        // enlarge the tiles if the margin required by the filter is large, so that
+        // the overlapping areas do not dominate the processing time
+        OfxRectI roi;
+        getRoI(processWindow, renderScale, params, &roi);
+        int margin = std::max(std::max(processWindow.x1 - roi.x1, roi.x2 - processWindow.x2),
+                              std::max(processWindow.y1 - roi.y1, roi.y2 - processWindow.y2));
+        tileSize = std::min(std::max(tileSize, kCImgTileMarginRatio * margin), std::max(tileSize, kCImgTileSizeMax));
+        // with a large margin, the RoI of each tile is not much smaller than the RoI of the
+        // processWindow: tiling would only multiply the memory used by the number of threads
+        const double tileRoIArea = (double)(tileSize + 2 * margin) * (tileSize + 2 * margin);
+        const double roiArea = (double)(roi.x2 - roi.x1) * (roi.y2 - roi.y1);
+        if (tileRoIArea * kCImgTileAreaRatio > roiArea) {
+            tileSize = 0;
+        } else {
+            maxConcurrentTiles = (unsigned int)(roiArea / tileRoIArea); // at least kCImgTileAreaRatio
+        }
+    }
+    if (tileSize > 0) {
+        if (processWindow.x2 - processWindow.x1 > tileSize || processWindow.y2 - processWindow.y1 > tileSize) {
+            for (int y = processWindow.y1; y < processWindow.y2; y += tileSize) {
+                for (int x = processWindow.x1; x < processWindow.x2; x += tileSize) {
+                    OfxRectI tile;
+                    tile.x1 = x;
+                    tile.x2 = std::min(x + tileSize, processWindow.x2);
+                    tile.y1 = y;
+                    tile.y2 = std::min(y + tileSize, processWindow.y2);
+                    tiles.push_back(tile);
+                }
+            }
+        }
+    }
+    if (tiles.empty()) {
+        processWindowCImg(data, processWindow);
+
+        return;
+    }
+
+    // process the tiles, each tile is processed independently by one thread
+    // (at most maxConcurrentTiles at once, see kCImgTileAreaRatio)
+    unsigned int nThreads = OFX::MultiThread::isSpawnedThread() ? 1 : std::min(std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)tiles.size()), maxConcurrentTiles);
+    if (nThreads <= 1) {
+        for (std::vector<OfxRectI>::const_iterator it = tiles.begin(); it != tiles.end() && !abort(); ++it) {
+            processWindowCImg(data, *it);
+        }
+    } else {
+        TileProcessor processor(*this, data, tiles);
+        processor.multiThread(nThreads);
+        processor.rethrowError();
+    }
+}
+
+template <class Params, bool sourceIsOptional>
+void
+CImgFilterPluginHelper<Params,sourceIsOptional>::processWindowCImg(const RenderData& data,
+                                                                   const OfxRectI& processWindow)
+{
+    const OFX::RenderArguments &args = data.args;
+    const Params& params = data.params;
+    const double time = args.time;
+    const OfxPointD& renderScale = args.renderScale;
+    const OFX::Image* src = data.src;
+    const OFX::Image* mask = data.mask;
+    const void *srcPixelData = data.srcPixelData;
+    OfxRectI srcBounds = data.srcBounds;
+    OFX::PixelComponentEnum srcPixelComponents = data.srcPixelComponents;
+    int srcPixelComponentCount = data.srcPixelComponentCount;
+    OFX::BitDepthEnum srcBitDepth = data.srcBitDepth;
+    int srcRowBytes = data.srcRowBytes;
+    const int srcBoundary = data.srcBoundary;
+    void *dstPixelData = data.dstPixelData;
+    const OfxRectI& dstBounds = data.dstBounds;
+    const OFX::PixelComponentEnum dstPixelComponents = data.dstPixelComponents;
+    const int dstPixelComponentCount = data.dstPixelComponentCount;
+    const OFX::BitDepthEnum dstBitDepth = data.dstBitDepth;
+    const int dstRowBytes = data.dstRowBytes;
+    const bool premult = data.premult;
+    const int premultChannel = data.premultChannel;
+    const double mix = data.mix;
+    const bool maskInvert = data.maskInvert;
+    const bool doMasking = data.doMasking;
+
     // compute the src ROI (should be consistent with getRegionsOfInterest())
     OfxRectI srcRoI;
     getRoI(processWindow, renderScale, params, &srcRoI);
 
     // intersect against the destination RoD
-    bool intersect = OFX::Coords::rectIntersection(srcRoI, dstRoD, &srcRoI);
+    bool intersect = OFX::Coords::rectIntersection(srcRoI, data.dstRoD, &srcRoI);
     if (!intersect) {
-        src.reset(0);
+        src = 0;
         srcPixelData = NULL;
         srcBounds.x1 = srcBounds.y1 = srcBounds.x2 = srcBounds.y2 = 0;
-        srcRoD.x1 = srcRoD.y1 = srcRoD.x2 = srcRoD.y2 = 0;
         srcPixelComponents = _srcClip ? _srcClip->getPixelComponents() : OFX::ePixelComponentNone;
         srcPixelComponentCount = 0;
         srcBitDepth = _srcClip ? _srcClip->getPixelDepth() : OFX::eBitDepthNone;
@@ -665,59 +922,16 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
     // 3- process the cimg
     // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
     // 5- copy+premult+max+mix tmp to dst (only processWindow)
-
-    //////////////////////////////////////////////////////////////////////////////////////////
-    // 1- copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
-
-    const OfxRectI tmpBounds = srcRoI;
-    const OFX::PixelComponentEnum tmpPixelComponents = srcPixelComponents;
-    const int tmpPixelComponentCount = srcNComponents; // don't use srcPixelComponentCount, which may be zero
-    const OFX::BitDepthEnum tmpBitDepth = OFX::eBitDepthFloat;
-    const int tmpWidth = tmpBounds.x2 - tmpBounds.x1;
-    const int tmpHeight = tmpBounds.y2 - tmpBounds.y1;
-    const size_t tmpRowBytes = (size_t)tmpPixelComponentCount * getComponentBytes(tmpBitDepth) * tmpWidth;
-    size_t tmpSize = tmpRowBytes * tmpHeight;
-
-    assert(tmpSize > 0);
-    std::auto_ptr<OFX::ImageMemory> tmpData(new OFX::ImageMemory(tmpSize, this));
-    float *tmpPixelData = (float*)tmpData->lock();
-
-    {
-        std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
-        if (!src.get()) {
-            // no src, fill with black & transparent
-            fred.reset(new OFX::BlackFiller<float>(*this, dstPixelComponentCount));
-        } else {
-            if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-                fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
-            } else if (dstPixelComponentCount == 4) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 4>(*this));
-            } else if (dstPixelComponentCount == 3) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 3>(*this));
-            } else if (dstPixelComponentCount == 2) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 2>(*this));
-            }  else if (dstPixelComponentCount == 1) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 1>(*this));
-            }
-        }
-        assert(fred.get());
-        if (fred.get()) {
-            setupAndCopy(*fred, time, srcRoI, src.get(), mask.get(),
-                         srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, srcBoundary,
-                         tmpPixelData, tmpBounds, tmpPixelComponents, tmpPixelComponentCount, tmpBitDepth, tmpRowBytes,
-                         premult, premultChannel, mix, maskInvert);
-        }
-    }
-    if (abort()) {
-        return;
-    }
-
-    //////////////////////////////////////////////////////////////////////////////////////////
-    // 2- extract channels to be processed from tmp to a cimg of size srcRoI (and do the interleaved to coplanar conversion)
+    //
+    // If src and dst are float RGBA, src contains srcRoI, and there is no mask, steps 1-2 and 4-5 are done
+    // in a single pass each, directly between the host images and the cimg, without using the tmp image.
+    const bool directCopy = (src && srcBitDepth == OFX::eBitDepthFloat && srcPixelComponentCount == 4 &&
+                             dstBitDepth == OFX::eBitDepthFloat && dstPixelComponentCount == 4 && srcNComponents == 4 &&
+                             !doMasking &&
+                             srcBounds.x1 <= srcRoI.x1 && srcRoI.x2 <= srcBounds.x2 &&
+                             srcBounds.y1 <= srcRoI.y1 && srcRoI.y2 <= srcBounds.y2 &&
+                             srcRoI.x1 <= processWindow.x1 && processWindow.x2 <= srcRoI.x2 &&
+                             srcRoI.y1 <= processWindow.y1 && processWindow.y2 <= srcRoI.y2);
 
     // allocate the cimg data to hold the src ROI
     int cimgSpectrum;
@@ -726,16 +940,16 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
     } else {
         switch(srcPixelComponents) {
             case OFX::ePixelComponentAlpha:
-                cimgSpectrum = (int)processA;
+                cimgSpectrum = (int)data.processA;
                 break;
             case OFX::ePixelComponentXY:
-                cimgSpectrum = (int)processR + (int)processG + (int) processB;
+                cimgSpectrum = (int)data.processR + (int)data.processG + (int)data.processB;
                 break;
             case OFX::ePixelComponentRGB:
-                cimgSpectrum = (int)processR + (int)processG + (int) processB;
+                cimgSpectrum = (int)data.processR + (int)data.processG + (int)data.processB;
                 break;
             case OFX::ePixelComponentRGBA:
-                cimgSpectrum = (int)processR + (int)processG + (int) processB + (int)processA;
+                cimgSpectrum = (int)data.processR + (int)data.processG + (int)data.processB + (int)data.processA;
                 break;
             default:
                 cimgSpectrum = 0;
@@ -753,7 +967,7 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
         assert(srcNComponents == cimgSpectrum);
     } else {
         if (srcNComponents == 1) {
-            if (processA) {
+            if (data.processA) {
                 assert(cimgSpectrum == 1);
                 srcChannel[0] = 0;
             } else {
@@ -761,36 +975,107 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
             }
         } else {
             int c = 0;
-            if (processR) {
+            if (data.processR) {
                 srcChannel[c] = 0;
                 ++c;
             }
-            if (processG) {
+            if (data.processG) {
                 srcChannel[c] = 1;
                 ++c;
             }
-            if (processB) {
+            if (data.processB) {
                 srcChannel[c] = 2;
                 ++c;
             }
-            if (processA && srcNComponents >= 4) {
+            if (data.processA && srcNComponents >= 4) {
                 srcChannel[c] = 3;
                 ++c;
             }
             assert(c == cimgSpectrum);
         }
     }
+
+    //////////////////////////////////////////////////////////////////////////////////////////
+    // 1- copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
+
+    const OfxRectI tmpBounds = srcRoI;
+    const OFX::PixelComponentEnum tmpPixelComponents = srcPixelComponents;
+    const int tmpPixelComponentCount = srcNComponents; // don't use srcPixelComponentCount, which may be zero
+    const OFX::BitDepthEnum tmpBitDepth = OFX::eBitDepthFloat;
+    const int tmpWidth = tmpBounds.x2 - tmpBounds.x1;
+    const int tmpHeight = tmpBounds.y2 - tmpBounds.y1;
+    const size_t tmpRowBytes = (size_t)tmpPixelComponentCount * getComponentBytes(tmpBitDepth) * tmpWidth;
+    size_t tmpSize = directCopy ? 0 : tmpRowBytes * tmpHeight;
+
+    assert(tmpSize > 0 || directCopy);
+    std::auto_ptr<OFX::ImageMemory> tmpData(tmpSize ? new OFX::ImageMemory(tmpSize, this) : 0);
+    float *tmpPixelData = tmpSize ? (float*)tmpData->lock() : NULL;
+
+    if (!directCopy) {
+        std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
+        if (!src) {
+            // no src, fill with black & transparent
+            fred.reset(new OFX::BlackFiller<float>(*this, dstPixelComponentCount));
+        } else {
+            if (dstPixelComponents == OFX::ePixelComponentRGBA) {
+                fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
+            } else if (dstPixelComponentCount == 4) {
+                // just copy, no premult
+                fred.reset(new OFX::PixelCopier<float, 4>(*this));
+            } else if (dstPixelComponentCount == 3) {
+                // just copy, no premult
+                fred.reset(new OFX::PixelCopier<float, 3>(*this));
+            } else if (dstPixelComponentCount == 2) {
+                // just copy, no premult
+                fred.reset(new OFX::PixelCopier<float, 2>(*this));
+            }  else if (dstPixelComponentCount == 1) {
+                // just copy, no premult
+                fred.reset(new OFX::PixelCopier<float, 1>(*this));
+            }
+        }
+        assert(fred.get());
+        if (fred.get()) {
+            setupAndCopy(*fred, time, srcRoI, src, mask,
+                         srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, srcBoundary,
+                         tmpPixelData, tmpBounds, tmpPixelComponents, tmpPixelComponentCount, tmpBitDepth, tmpRowBytes,
+                         premult, premultChannel, mix, maskInvert);
+        }
+    }
+    if (abort()) {
+        return;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////
+    // 2- extract channels to be processed from tmp to a cimg of size srcRoI (and do the interleaved to coplanar conversion)
+
+    // planes of the cimg, indexed by src channel (NULL if the channel is not processed)
+    float *cimgPlane[4] = { NULL, NULL, NULL, NULL };
+    std::auto_ptr<OFX::ImageMemory> cimgData(cimgSize ? new OFX::ImageMemory(cimgSize, this) : 0);
     if (cimgSize) { // may be zero if no channel is processed
-        std::auto_ptr<OFX::ImageMemory> cimgData(new OFX::ImageMemory(cimgSize, this));
         float *cimgPixelData = (float*)cimgData->lock();
         cimg_library::CImg<float> cimg(cimgPixelData, cimgWidth, cimgHeight, 1, cimgSpectrum, true);
 
 
-        for (int c=0; c < cimgSpectrum; ++c) {
-            float *dst = cimg.data(0,0,0,c);
-            const float *src = tmpPixelData + srcChannel[c];
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, src += srcNComponents, ++dst) {
-                *dst = *src;
+        if (directCopy) {
+            for (int c = 0; c < cimgSpectrum; ++c) {
+                cimgPlane[srcChannel[c]] = cimg.data(0,0,0,c);
+            }
+            for (int y = srcRoI.y1; y < srcRoI.y2; ++y) {
+                const float *srcPix = (const float*)((const char*)srcPixelData + (size_t)(y - srcBounds.y1) * srcRowBytes) + (srcRoI.x1 - srcBounds.x1) * 4;
+                const size_t offset = (size_t)(y - srcRoI.y1) * cimgWidth;
+                float *planes[4];
+                for (int c = 0; c < 4; ++c) {
+                    planes[c] = cimgPlane[c] ? (cimgPlane[c] + offset) : NULL;
+                }
+                deinterleaveRGBA(srcPix, cimgWidth, premult, premultChannel, planes);
+            }
+        } else {
+            for (int c=0; c < cimgSpectrum; ++c) {
+                float *dst = cimg.data(0,0,0,c);
+                const float *src = tmpPixelData + srcChannel[c];
+                for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, src += srcNComponents, ++dst) {
+                    *dst = *src;
+                }
             }
         }
         if (abort()) {
@@ -821,15 +1106,16 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
         //////////////////////////////////////////////////////////////////////////////////////////
         // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
 
-        // We copy the whole srcRoI. This could be optimized to copy only renderWindow
-        for (int c=0; c < cimgSpectrum; ++c) {
-            const float *src = cimg.data(0,0,0,c);
-            float *dst = tmpPixelData + srcChannel[c];
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, ++src, dst += srcNComponents) {
-                *dst = *src;
+        if (!directCopy) {
+            // We copy the whole srcRoI. This could be optimized to copy only renderWindow
+            for (int c=0; c < cimgSpectrum; ++c) {
+                const float *src = cimg.data(0,0,0,c);
+                float *dst = tmpPixelData + srcChannel[c];
+                for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, ++src, dst += srcNComponents) {
+                    *dst = *src;
+                }
             }
         }
-
     }
     if (abort()) {
         return;
@@ -838,6 +1124,22 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
     //////////////////////////////////////////////////////////////////////////////////////////
     // 5- copy+premult+max+mix tmp to dst (only processWindow)
 
+    if (directCopy) {
+        // steps 4 and 5 at once: the channels that were not processed are taken from src
+        const int width = processWindow.x2 - processWindow.x1;
+        for (int y = processWindow.y1; y < processWindow.y2; ++y) {
+            const float *srcPix = (const float*)((const char*)srcPixelData + (size_t)(y - srcBounds.y1) * srcRowBytes) + (processWindow.x1 - srcBounds.x1) * 4;
+            float *dstPix = (float*)((char*)dstPixelData + (size_t)(y - dstBounds.y1) * dstRowBytes) + (processWindow.x1 - dstBounds.x1) * 4;
+            const size_t offset = (size_t)(y - srcRoI.y1) * cimgWidth + (processWindow.x1 - srcRoI.x1);
+            const float *planes[4];
+            for (int c = 0; c < 4; ++c) {
+                planes[c] = cimgPlane[c] ? (cimgPlane[c] + offset) : NULL;
+            }
+            interleaveRGBA(planes, srcPix, width, premult, premultChannel, mix, dstPix);
+        }
+
+        return;
+    }
     {
         std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
         if (dstPixelComponents == OFX::ePixelComponentRGBA) {
@@ -874,7 +1176,7 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
         }
         assert(fred.get());
         if (fred.get()) {
-            setupAndCopy(*fred, time, processWindow, src.get(), mask.get(),
+            setupAndCopy(*fred, time, processWindow, src, mask,
                          tmpPixelData, tmpBounds, tmpPixelComponents, tmpPixelComponentCount, tmpBitDepth, tmpRowBytes, 0,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes,
                          premult, premultChannel, mix, maskInvert);
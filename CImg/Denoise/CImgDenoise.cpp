@@ -156,6 +156,8 @@ public:
         roi->y2 = rect.y2 + delta_pix;
     }
 
+    virtual int getTileSize(const OfxPointD& /*renderScale*/, const CImgDenoiseParams& /*params*/) OVERRIDE FINAL { return kCImgTileSizeDefault; }
+
     virtual void render(const OFX::RenderArguments &args, const CImgDenoiseParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
@@ -120,6 +120,8 @@ public:
         roi->y2 = rect.y2 + delta_pix_y;
     }
 
+    virtual int getTileSize(const OfxPointD& /*renderScale*/, const CImgMedianParams& /*params*/) OVERRIDE FINAL { return kCImgTileSizeDefault; }
+
     virtual void render(const OFX::RenderArguments &args, const CImgMedianParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
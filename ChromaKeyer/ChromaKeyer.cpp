@@ -25,12 +25,16 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <memory>
+#include <vector>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
 
 #include "ofxsProcessing.H"
 #include "ofxsMacros.h"
+#include "ofxsChannelLut.h"
+#include "ofxsColorRow.h"
 
 #define kPluginName "ChromaKeyerOFX"
 #define kPluginGrouping "Keyer"
@@ -43,7 +47,7 @@
 
 #define kPluginIdentifier "net.sf.openfx.ChromaKeyerPlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -151,6 +155,7 @@ protected:
     OutputModeEnum _outputMode;
     SourceAlphaEnum _sourceAlpha;
     double _sinKey, _cosKey, _xKey, _ys;
+    OFX::ColorRow::Matrix34 _ycbcrMatrix; // RGB to YCbCr, see rgb2ycbcr()
 
 public:
     
@@ -172,8 +177,25 @@ public:
     , _cosKey(0)
     , _xKey(0)
     , _ys(0)
+    , _ycbcrMatrix()
     {
         _keyColor.r = _keyColor.g = _keyColor.b = 0.;
+        // the YCbCr of the primaries, used to convert whole rows
+        for (int c = 0; c < 3; ++c) {
+            double y, cb, cr;
+            rgb2ycbcr(c == 0, c == 1, c == 2, &y, &cb, &cr);
+            _ycbcrMatrix.m[0][c] = (float)y;
+            _ycbcrMatrix.m[1][c] = (float)cb;
+            _ycbcrMatrix.m[2][c] = (float)cr;
+        }
+    }
+
+    // the contribution of the value v of channel c to Y, Cb and Cr, see OFX::ChannelLut
+    void fillEntry(int c, double v, float *entry) const
+    {
+        for (int k = 0; k < 3; ++k) {
+            entry[k] = (float)(_ycbcrMatrix.m[k][c] * v);
+        }
     }
     
     void setSrcImgs(const OFX::Image *srcImg, const OFX::Image *bgImg, const OFX::Image *inMaskImg, const OFX::Image *outMaskImg)
@@ -290,17 +312,97 @@ class ChromaKeyerProcessor : public ChromaKeyerProcessorBase
 public:
     ChromaKeyerProcessor(OFX::ImageEffect &instance)
     : ChromaKeyerProcessorBase(instance)
+    , _lut()
     {
     }
 
 private:
+    void preProcess()
+    {
+        // integer images: tabulate the contribution of each channel to Y, Cb and Cr
+        const double nPixels = (double)(_renderWindow.x2 - _renderWindow.x1) * (_renderWindow.y2 - _renderWindow.y1);
+        if (OFX::ChannelLut<3>::isWorthBuilding(maxValue, nPixels)) {
+            _lut.reset(new OFX::ChannelLut<3>(maxValue, *this));
+        }
+    }
+
+    // the Y, Cb and Cr of the source pixels of row y, from x1 to x2
+    void ycbcrRow(int x1, int x2, int y, float *fgy, float *fgcb, float *fgcr)
+    {
+        if (_lut.get()) {
+            for (int x = x1; x < x2; ++x) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                float f[3] = {0.f, 0.f, 0.f};
+                if (srcPix) {
+                    _lut->features(srcPix, f);
+                }
+                fgy[x - x1] = f[0];
+                fgcb[x - x1] = f[1];
+                fgcr[x - x1] = f[2];
+            }
+        } else {
+            for (int x = x1; x < x2; ++x) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                fgy[x - x1] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[0]) : 0.f;
+                fgcb[x - x1] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[1]) : 0.f;
+                fgcr[x - x1] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[2]) : 0.f;
+            }
+            // convert the whole row at once, in place
+            OFX::ColorRow::affine(_ycbcrMatrix, x2 - x1, fgy, fgcb, fgcr, fgy, fgcb, fgcr);
+        }
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow)
     {
+        // select the kernel specialized for the output mode and the source alpha
+        switch (_outputMode) {
+            case eOutputModeIntermediate:
+                processForOutputMode<eOutputModeIntermediate>(procWindow);
+                break;
+            case eOutputModePremultiplied:
+                processForOutputMode<eOutputModePremultiplied>(procWindow);
+                break;
+            case eOutputModeUnpremultiplied:
+                processForOutputMode<eOutputModeUnpremultiplied>(procWindow);
+                break;
+            case eOutputModeComposite:
+                processForOutputMode<eOutputModeComposite>(procWindow);
+                break;
+        }
+    }
+
+    template <OutputModeEnum outputMode>
+    void processForOutputMode(const OfxRectI &procWindow)
+    {
+        switch (_sourceAlpha) {
+            case eSourceAlphaIgnore:
+                process<outputMode, eSourceAlphaIgnore>(procWindow);
+                break;
+            case eSourceAlphaAddToInsideMask:
+                process<outputMode, eSourceAlphaAddToInsideMask>(procWindow);
+                break;
+            case eSourceAlphaNormal:
+                process<outputMode, eSourceAlphaNormal>(procWindow);
+                break;
+        }
+    }
+
+    template <OutputModeEnum outputMode, SourceAlphaEnum sourceAlpha>
+    void process(const OfxRectI &procWindow)
+    {
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> rowBuf((size_t)width * 3);
+        float *rowY = &rowBuf[0];
+        float *rowCb = &rowBuf[width];
+        float *rowCr = &rowBuf[(size_t)2 * width];
+
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
 
+            ycbcrRow(procWindow.x1, procWindow.x2, y, rowY, rowCb, rowCr);
+
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
             assert(dstPix);
 
@@ -312,7 +414,7 @@ private:
                 const PIX *outMaskPix = (const PIX *)  (_outMaskImg ? _outMaskImg->getPixelAddress(x, y) : 0);
 
                 float inMask = inMaskPix ? *inMaskPix : 0.f;
-                if (_sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4 && srcPix) {
+                if (sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4 && srcPix) {
                     // take the max of inMask and the source Alpha
                     inMask = std::max(inMask, sampleToFloat<PIX,maxValue>(srcPix[3]));
                 }
@@ -345,8 +447,9 @@ private:
                     // first, we need to compute YCbCr coordinates.
 
 
-                    double fgy, fgcb, fgcr;
-                    rgb2ycbcr(fgr, fgg, fgb, &fgy, &fgcb, &fgcr);
+                    double fgy = rowY[x - procWindow.x1];
+                    double fgcb = rowCb[x - procWindow.x1];
+                    double fgcr = rowCr[x - procWindow.x1];
                     //assert(-0.5 <= fgcb && fgcb <= 0.5); // may crash on superblacks/superwhites
                     //assert(-0.5 <= fgcr && fgcr <= 0.5);
 
@@ -413,7 +516,7 @@ private:
                     //////////////////////
                     // STEP C: Foreground suppressor
 
-                    if (_outputMode != eOutputModeIntermediate) {
+                    if (outputMode != eOutputModeIntermediate) {
                         // The foreground suppressor reduces foreground color information by implementing X = X – KFG, with the key color being clamped to the black level.
 
                         //fgx = fgx - Kfg;
@@ -494,10 +597,10 @@ private:
                 double fga = 1. - Kbg;
                 //double fga = Kbg;
                 assert(fga >= 0. && fga <= 1.);
-                double compAlpha = (_outputMode == eOutputModeComposite &&
-                                    _sourceAlpha == eSourceAlphaNormal &&
+                double compAlpha = (outputMode == eOutputModeComposite &&
+                                    sourceAlpha == eSourceAlphaNormal &&
                                     srcPix) ? sampleToFloat<PIX,maxValue>(srcPix[3]) : 1.;
-                switch (_outputMode) {
+                switch (outputMode) {
                     case eOutputModeIntermediate:
                         for (int c = 0; c < 3; ++c) {
                             dstPix[c] = srcPix ? srcPix[c] : 0;
@@ -531,6 +634,8 @@ private:
         }
     }
 
+private:
+    std::auto_ptr<OFX::ChannelLut<3> > _lut;
 };
 
 
@@ -32,6 +32,7 @@
 #include "ofxsProcessing.H"
 #include "ofxsMaskMix.h"
 #include "ofxsCoords.h"
+#include "ofxsParametricLut.h"
 #include "ofxsMacros.h"
 
 #define kPluginName "ColorCorrectOFX"
@@ -43,8 +44,9 @@
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: cache the tone ranges lookup table across renders
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -294,6 +296,7 @@ public:
     , _processA(false)
     , _clampBlack(true)
     , _clampWhite(true)
+    , _lookupTable(0)
     {
         
     }
@@ -304,6 +307,8 @@ public:
 
     void doMasking(bool v) {_doMasking = v;}
 
+    void setLut(const OFX::ParametricLut *lut) {_lookupTable = lut;}
+
     void setColorControlValues(const ColorControlGroup& master,
                                const ColorControlGroup& shadow,
                                const ColorControlGroup& midtone,
@@ -373,17 +378,19 @@ private:
 
     double interpolate(int curve, double value)
     {
+        assert(_lookupTable);
+        const float *table = _lookupTable->getTable(curve);
         if (value < 0.) {
-            return _lookupTable[curve][0];
+            return table[0];
         } else if (value >= 1.) {
-            return _lookupTable[curve][LUT_MAX_PRECISION];
+            return table[LUT_MAX_PRECISION];
         } else {
             double i_d = std::floor(value * LUT_MAX_PRECISION);
             int i = (int)i_d;
             assert(i < LUT_MAX_PRECISION);
             double alpha = value * LUT_MAX_PRECISION - i_d;
             assert(0. <= alpha && alpha < 1.);
-            return _lookupTable[curve][i] * (1.-alpha) + _lookupTable[curve][i] * alpha;
+            return table[i] * (1.-alpha) + table[i] * alpha;
         }
     }
 
@@ -404,7 +411,7 @@ protected:
         return std::max(0., std::min(value, double(maxValue)));
     }
 
-    double _lookupTable[2][LUT_MAX_PRECISION + 1];
+    const OFX::ParametricLut *_lookupTable;
 };
 
 
@@ -414,16 +421,21 @@ class ColorCorrecter : public ColorCorrecterBase
 {
     
 public:
-    ColorCorrecter(OFX::ImageEffect &instance, const OFX::RenderArguments &args, bool supportsParametricParameter)
+    ColorCorrecter(OFX::ImageEffect &instance, const OFX::RenderArguments &args, OFX::ParametricParam *rangesParam)
     : ColorCorrecterBase(instance,args)
+    , _rangesParam(rangesParam)
+    , _time(args.time)
     {
-        const double time = args.time;
-        // build the LUT
-        OFX::ParametricParam  *lookupTable = 0;
-        if (supportsParametricParameter) {
-            lookupTable = instance.fetchParametricParam(kParamColorCorrectToneRanges);
-        }
+    }
+
+    // build the LUT, called by OFX::ParametricLutCache::acquire() if it is not cached
+    void fillLut(OFX::ParametricLut &lut)
+    {
+        assert(lut.getKey().nTables == 2 && lut.getKey().nbValues == LUT_MAX_PRECISION);
+        const double time = _time;
+        OFX::ParametricParam *lookupTable = _rangesParam;
         for (int curve = 0; curve < 2; ++curve) {
+            float *table = lut.getTable(curve);
             for (int position = 0; position <= LUT_MAX_PRECISION; ++position) {
                 // position to evaluate the param at
                 double parametricPos = double(position)/LUT_MAX_PRECISION;
@@ -447,10 +459,9 @@ public:
                     }
                 }
                 // set that in the lut
-                _lookupTable[curve][position] = (float)clamp<PIX>(value, maxValue);
+                table[position] = (float)clamp<PIX>(value, maxValue);
             }
         }
-
     }
 
     void multiThreadProcessImages(OfxRectI procWindow)
@@ -558,6 +569,9 @@ private:
             }
         }
     }
+
+    OFX::ParametricParam *_rangesParam;
+    double _time;
 };
 
 namespace {
@@ -654,6 +668,16 @@ private:
     /* set up and run a processor */
     void setupAndProcess(ColorCorrecterBase &, const OFX::RenderArguments &args);
 
+    template <class PIX, int nComponents, int maxValue>
+    void renderForBitDepth(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL
+    {
+        _lutCache.clear();
+    }
+
     virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
 
     /** @brief called when a clip has just been changed in some way (a rewire maybe) */
@@ -711,6 +735,7 @@ private:
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
+    OFX::ParametricLutCache _lutCache;
 };
 
 
@@ -826,6 +851,27 @@ ColorCorrectPlugin::setupAndProcess(ColorCorrecterBase &processor, const OFX::Re
     processor.process();
 }
 
+template <class PIX, int nComponents, int maxValue>
+void
+ColorCorrectPlugin::renderForBitDepth(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth)
+{
+    ColorCorrecter<PIX, nComponents, maxValue> fred(*this, args, _rangesParam);
+
+    // the LUT is only rebuilt when the tone ranges or the image format change,
+    // and it is shared by all the tiles
+    OFX::ParametricLutKey key;
+    if (_rangesParam) {
+        OFX::ofxsParametricParamGetCurves(_rangesParam, 2, args.time, &key.curves);
+    }
+    key.nbValues = LUT_MAX_PRECISION;
+    key.nTables = 2;
+    key.variant = (int)dstBitDepth;
+    const OFX::ParametricLut *lut = _lutCache.acquire(key, fred);
+    OFX::ParametricLutHolder_RAII lutHolder(_lutCache, lut);
+    fred.setLut(lut);
+    setupAndProcess(fred, args);
+}
+
 // the overridden render function
 void
 ColorCorrectPlugin::render(const OFX::RenderArguments &args)
@@ -841,18 +887,15 @@ ColorCorrectPlugin::render(const OFX::RenderArguments &args)
     if (dstComponents == OFX::ePixelComponentRGBA) {
         switch (dstBitDepth) {
             case OFX::eBitDepthUByte: {
-                ColorCorrecter<unsigned char, 4, 255> fred(*this, args, _supportsParametricParameter);
-                setupAndProcess(fred, args);
+                renderForBitDepth<unsigned char, 4, 255>(args, dstBitDepth);
                 break;
             }
             case OFX::eBitDepthUShort: {
-                ColorCorrecter<unsigned short, 4, 65535> fred(*this, args, _supportsParametricParameter);
-                setupAndProcess(fred, args);
+                renderForBitDepth<unsigned short, 4, 65535>(args, dstBitDepth);
                 break;
             }
             case OFX::eBitDepthFloat: {
-                ColorCorrecter<float, 4, 1> fred(*this, args, _supportsParametricParameter);
-                setupAndProcess(fred, args);
+                renderForBitDepth<float, 4, 1>(args, dstBitDepth);
                 break;
             }
             default:
@@ -863,18 +906,15 @@ ColorCorrectPlugin::render(const OFX::RenderArguments &args)
         assert(dstComponents == OFX::ePixelComponentRGB);
         switch (dstBitDepth) {
             case OFX::eBitDepthUByte: {
-                ColorCorrecter<unsigned char, 3, 255> fred(*this, args, _supportsParametricParameter);
-                setupAndProcess(fred, args);
+                renderForBitDepth<unsigned char, 3, 255>(args, dstBitDepth);
                 break;
             }
             case OFX::eBitDepthUShort: {
-                ColorCorrecter<unsigned short, 3, 65535> fred(*this, args, _supportsParametricParameter);
-                setupAndProcess(fred, args);
+                renderForBitDepth<unsigned short, 3, 65535>(args, dstBitDepth);
                 break;
             }
             case OFX::eBitDepthFloat: {
-                ColorCorrecter<float, 3, 1> fred(*this, args, _supportsParametricParameter);
-                setupAndProcess(fred, args);
+                renderForBitDepth<float, 3, 1>(args, dstBitDepth);
                 break;
             }
             default:
@@ -998,6 +1038,15 @@ ColorCorrectPlugin::changedClip(const InstanceChangedArgs &args, const std::stri
     //std::cout << "changedClip OK!\n";
 }
 
+void
+ColorCorrectPlugin::changedParam(const InstanceChangedArgs &/*args*/, const std::string &paramName)
+{
+    if (paramName == kParamColorCorrectToneRanges) {
+        // the tone ranges changed: the cached LUT is stale
+        _lutCache.clear();
+    }
+}
+
 
 mDeclarePluginFactory(ColorCorrectPluginFactory, {}, {});
 
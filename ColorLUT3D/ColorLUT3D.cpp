@@ -0,0 +1,1070 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX ColorLUT3D plugin.
+ */
+
+#include "ColorLUT3D.h"
+
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COLORLUT3D_SSE2
+#endif
+
+#include "ofxsProcessing.H"
+#include "ofxsMaskMix.h"
+#include "ofxsCoords.h"
+#include "ofxsMultiThread.h"
+#include "ofxsRefCountedCache.h"
+#include "ofxsMacros.h"
+
+#define kPluginName "ColorLUT3DOFX"
+#define kPluginGrouping "Color"
+#define kPluginDescription \
+"Bake a chain of color operations into a 3D lookup table, and apply it in a single pass.\n" \
+"In \"Lattice\" mode, the output is an image of the lattice points of the 3D LUT. Connect it to the input of the chain of color operations (Grade, ColorCorrect, Saturation, HSVTool, ColorMatrix, ColorLookup...) to be baked.\n" \
+"In \"Apply\" mode, connect the output of the chain to the Lattice input: the lattice is read back as a 3D LUT, which is applied to the Source input with tetrahedral interpolation. " \
+"The LUT is cached, and only read again when the lattice image changes.\n" \
+"The lattice size and shaper parameters must be the same in both modes. " \
+"The baked operations must not depend on the position of the pixels, nor on their neighbors. " \
+"Input values outside of the shaper range are clamped to it.\n" \
+"Each lattice point is a block of " kLatticeBlockSizeString "x" kLatticeBlockSizeString " pixels, so that the LUT is the same at render scales down to 1/" kLatticeBlockSizeString ". At lower render scales, the lattice is subsampled: render at a higher scale for the final result."
+#define kPluginIdentifier "net.sf.openfx.ColorLUT3D"
+// History:
+// version 1.0: initial version
+// version 1.1: lattice points are blocks of pixels, so that the LUT does not depend on the render scale
+#define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
+
+// Each lattice point is a kLatticeBlockSize x kLatticeBlockSize block of full-resolution pixels,
+// and it is read at the center of the block: the generated and read points are the same
+// for render scales down to 1/kLatticeBlockSize.
+#define kLatticeBlockSize 4
+#define kLatticeBlockSizeString "4"
+
+#define kSupportsTiles 1
+#define kSupportsMultiResolution 1
+#define kSupportsRenderScale 1
+#define kSupportsMultipleClipPARs false
+#define kSupportsMultipleClipDepths false
+#define kRenderThreadSafety eRenderFullySafe
+
+#define kClipLattice "Lattice"
+#define kClipLatticeHint "The lattice image, output by a ColorLUT3D in \"Lattice\" mode and processed by the color operations to be baked."
+
+#define kParamMode "mode"
+#define kParamModeLabel "Mode"
+#define kParamModeHint "Output the lattice image, or apply the 3D LUT read from the Lattice input to the Source input."
+#define kParamModeOptionApply "Apply"
+#define kParamModeOptionApplyHint "Apply the 3D LUT read from the Lattice input to the Source input."
+#define kParamModeOptionLattice "Lattice"
+#define kParamModeOptionLatticeHint "Output the lattice image, to be processed by the color operations to be baked."
+enum ModeEnum {
+    eModeApply = 0,
+    eModeLattice,
+};
+
+#define kParamLatticeSize "latticeSize"
+#define kParamLatticeSizeLabel "Lattice Size"
+#define kParamLatticeSizeHint "Number of lattice points along each axis of the 3D LUT."
+#define kParamLatticeSizeOption17 "17"
+#define kParamLatticeSizeOption33 "33"
+#define kParamLatticeSizeOption65 "65"
+enum LatticeSizeEnum {
+    eLatticeSize17 = 0,
+    eLatticeSize33,
+    eLatticeSize65,
+};
+
+#define kParamShaper "shaper"
+#define kParamShaperLabel "Shaper"
+#define kParamShaperHint "Spacing of the lattice points along each axis."
+#define kParamShaperOptionLinear "Linear"
+#define kParamShaperOptionLinearHint "Evenly spaced lattice points, for display-referred images."
+#define kParamShaperOptionLog "Log"
+#define kParamShaperOptionLogHint "Lattice points evenly spaced in log2(1 + x - min), for scene-linear (HDR) images."
+enum ShaperEnum {
+    eShaperLinear = 0,
+    eShaperLog,
+};
+
+#define kParamShaperRange "shaperRange"
+#define kParamShaperRangeLabel "Shaper Range"
+#define kParamShaperRangeHint "Range of input values covered by the lattice. Values outside of this range are clamped to it."
+
+using namespace OFX;
+
+static int
+latticeSize(LatticeSizeEnum e)
+{
+    switch (e) {
+        case eLatticeSize17:
+            return 17;
+        case eLatticeSize33:
+            return 33;
+        case eLatticeSize65:
+            return 65;
+    }
+
+    return 33;
+}
+
+/// Maps input values to the [0,1] lattice coordinates, and back.
+struct Shaper
+{
+    ShaperEnum type;
+    double min;
+    double max;
+    double logMax; // log2(1 + max - min)
+
+    Shaper(ShaperEnum t, double rangeMin, double rangeMax)
+    : type(t)
+    , min(std::min(rangeMin, rangeMax))
+    , max(std::max(rangeMin, rangeMax))
+    , logMax(0.)
+    {
+        if (min == max) {
+            // avoid divisions by zero
+            max = min + 1.;
+        }
+        logMax = std::log(1. + (max - min)) / std::log(2.);
+    }
+
+    // lattice coordinate of value, in [0,1]
+    float toLattice(float value) const
+    {
+        double t;
+        if (type == eShaperLog) {
+            t = std::log(1. + std::max(0., value - min)) / std::log(2.) / logMax;
+        } else {
+            t = (value - min) / (max - min);
+        }
+
+        return (float)std::max(0., std::min(t, 1.));
+    }
+
+    // value at lattice coordinate t in [0,1]
+    double fromLattice(double t) const
+    {
+        if (type == eShaperLog) {
+            return min + std::pow(2., t * logMax) - 1.;
+        }
+
+        return min + t * (max - min);
+    }
+
+    bool operator==(const Shaper &other) const
+    {
+        return type == other.type && min == other.min && max == other.max;
+    }
+};
+
+/// A 3D LUT read from a lattice image: size^3 RGB points, padded to 4 floats, red varying fastest.
+class Lut3D
+: public OFX::RefCountedCacheEntry
+{
+public:
+    Lut3D(const std::string &uniqueID, double time, int size, const Shaper &shaper, const OfxPointD &renderScale)
+    : OFX::RefCountedCacheEntry()
+    , _uniqueID(uniqueID)
+    , _time(time)
+    , _size(size)
+    , _shaper(shaper)
+    , _renderScale(renderScale)
+    , _data((size_t)size * size * size * 4, 0.f)
+    {
+    }
+
+    bool matches(const std::string &uniqueID, double time, int size, const Shaper &shaper, const OfxPointD &renderScale) const
+    {
+        return (!_uniqueID.empty() &&
+                uniqueID == _uniqueID &&
+                time == _time &&
+                size == _size &&
+                shaper == _shaper &&
+                renderScale.x == _renderScale.x &&
+                renderScale.y == _renderScale.y);
+    }
+
+    int getSize() const { return _size; }
+
+    const Shaper &getShaper() const { return _shaper; }
+
+    float *getPoint(int r, int g, int b)
+    {
+        return &_data[4 * (r + _size * (g + _size * (size_t)b))];
+    }
+
+    const float *getData() const { return &_data[0]; }
+
+private:
+    std::string _uniqueID;
+    double _time;
+    int _size;
+    Shaper _shaper;
+    OfxPointD _renderScale;
+    std::vector<float> _data;
+};
+
+/// Reads the lattice points from a lattice image.
+/// Lattice point (r,g,b) is the block of full-resolution pixels starting at ((r + size * g) * kLatticeBlockSize, b * kLatticeBlockSize),
+/// and it is read at the center of the block.
+/// Returns false if the lattice image does not contain all the points.
+template <class PIX, int maxValue>
+static bool
+readLattice(const OFX::Image *lattice,
+            Lut3D *lut)
+{
+    const int size = lut->getSize();
+    const int nComponents = lattice->getPixelComponentCount();
+    if (nComponents < 3) {
+        return false;
+    }
+    const OfxPointD rs = lattice->getRenderScale();
+    for (int b = 0; b < size; ++b) {
+        const int y = (int)std::floor((b + 0.5) * kLatticeBlockSize * rs.y);
+        for (int g = 0; g < size; ++g) {
+            for (int r = 0; r < size; ++r) {
+                const int x = (int)std::floor((r + size * g + 0.5) * kLatticeBlockSize * rs.x);
+                const PIX *pix = (const PIX *)lattice->getPixelAddress(x, y);
+                if (!pix) {
+                    return false;
+                }
+                float *p = lut->getPoint(r, g, b);
+                p[0] = pix[0] / (float)maxValue;
+                p[1] = pix[1] / (float)maxValue;
+                p[2] = pix[2] / (float)maxValue;
+                p[3] = 0.f;
+            }
+        }
+    }
+
+    return true;
+}
+
+/// Reads a Lut3D for Lut3DCache::acquire(), see OFX::RefCountedCache::acquire().
+template <class PIX, int maxValue>
+class Lut3DBuilder
+{
+public:
+    Lut3DBuilder(const OFX::Image *lattice, double time, int size, const Shaper &shaper)
+    : _lattice(lattice)
+    , _uniqueID(lattice->getUniqueIdentifier())
+    , _time(time)
+    , _size(size)
+    , _shaper(shaper)
+    , _renderScale(lattice->getRenderScale())
+    {
+    }
+
+    bool isCacheable() const { return !_uniqueID.empty(); }
+
+    bool matches(const Lut3D &lut) const
+    {
+        return lut.matches(_uniqueID, _time, _size, _shaper, _renderScale);
+    }
+
+    Lut3D *build()
+    {
+        std::auto_ptr<Lut3D> lut(new Lut3D(_uniqueID, _time, _size, _shaper, _renderScale));
+        if (!readLattice<PIX, maxValue>(_lattice, lut.get())) {
+            return 0;
+        }
+
+        return lut.release();
+    }
+
+private:
+    const OFX::Image *_lattice;
+    std::string _uniqueID;
+    double _time;
+    int _size;
+    Shaper _shaper;
+    OfxPointD _renderScale;
+};
+
+/// The last 3D LUT read by an effect instance, shared by all its renders.
+class Lut3DCache
+: public OFX::RefCountedCache<Lut3D>
+{
+public:
+    /// Returns the 3D LUT read from the lattice image, reading it if it is not cached,
+    /// or NULL if the lattice image is incomplete.
+    /// The result must be given back to release().
+    template <class PIX, int maxValue>
+    const Lut3D *acquire(const OFX::Image *lattice,
+                         double time,
+                         int size,
+                         const Shaper &shaper)
+    {
+        assert(lattice);
+        Lut3DBuilder<PIX, maxValue> builder(lattice, time, size, shaper);
+
+        // if the host does not identify images, the LUT cannot be shared
+        return OFX::RefCountedCache<Lut3D>::acquire(builder, builder.isCacheable());
+    }
+};
+
+/// Releases a 3D LUT, even in case of exceptions.
+typedef OFX::RefCountedCacheHolder_RAII<Lut3D> Lut3DHolder_RAII;
+
+/// Tetrahedral interpolation in the size^3 lattice data, at lattice coordinates (r,g,b) in [0,1].
+/// The lattice cube around the point is cut into 6 tetrahedra along its main diagonal,
+/// and the result is interpolated between the 4 vertices of the tetrahedron containing the point.
+static inline void
+tetrahedral(const float *data,
+            int size,
+            float r,
+            float g,
+            float b,
+            float *out)
+{
+    const int n = size - 1;
+    float fr = r * n;
+    float fg = g * n;
+    float fb = b * n;
+    const int ir = std::min((int)fr, n - 1);
+    const int ig = std::min((int)fg, n - 1);
+    const int ib = std::min((int)fb, n - 1);
+    fr -= ir;
+    fg -= ig;
+    fb -= ib;
+    const int dr = 4;
+    const int dg = 4 * size;
+    const int db = 4 * size * size;
+    const float *c000 = data + ir * dr + ig * dg + ib * db;
+    const float *c111 = c000 + dr + dg + db;
+    const float *c1;
+    const float *c2;
+    float w0, w1, w2, w3;
+    if (fr > fg) {
+        if (fg > fb) {
+            // r > g > b
+            c1 = c000 + dr;
+            c2 = c000 + dr + dg;
+            w0 = 1.f - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb;
+        } else if (fr > fb) {
+            // r > b >= g
+            c1 = c000 + dr;
+            c2 = c000 + dr + db;
+            w0 = 1.f - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg;
+        } else {
+            // b >= r > g
+            c1 = c000 + db;
+            c2 = c000 + dr + db;
+            w0 = 1.f - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg;
+        }
+    } else {
+        if (fb > fg) {
+            // b > g >= r
+            c1 = c000 + db;
+            c2 = c000 + dg + db;
+            w0 = 1.f - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr;
+        } else if (fb > fr) {
+            // g >= b > r
+            c1 = c000 + dg;
+            c2 = c000 + dg + db;
+            w0 = 1.f - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr;
+        } else {
+            // g >= r >= b
+            c1 = c000 + dg;
+            c2 = c000 + dr + dg;
+            w0 = 1.f - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb;
+        }
+    }
+#ifdef COLORLUT3D_SSE2
+    __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c000), _mm_set1_ps(w0)),
+                                     _mm_mul_ps(_mm_loadu_ps(c1), _mm_set1_ps(w1))),
+                          _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c2), _mm_set1_ps(w2)),
+                                     _mm_mul_ps(_mm_loadu_ps(c111), _mm_set1_ps(w3))));
+    float tmp[4];
+    _mm_storeu_ps(tmp, v);
+    out[0] = tmp[0];
+    out[1] = tmp[1];
+    out[2] = tmp[2];
+#else
+    for (int c = 0; c < 3; ++c) {
+        out[c] = w0 * c000[c] + w1 * c1[c] + w2 * c2[c] + w3 * c111[c];
+    }
+#endif
+}
+
+class ColorLUT3DProcessorBase : public OFX::ImageProcessor
+{
+protected:
+    const OFX::Image *_srcImg;
+    const OFX::Image *_maskImg;
+    bool _doMasking;
+    bool _premult;
+    int _premultChannel;
+    double _mix;
+    bool _maskInvert;
+    const Lut3D *_lut;
+
+public:
+    ColorLUT3DProcessorBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _maskImg(0)
+    , _doMasking(false)
+    , _premult(false)
+    , _premultChannel(3)
+    , _mix(1.)
+    , _maskInvert(false)
+    , _lut(0)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    void setMaskImg(const OFX::Image *v, bool maskInvert) {_maskImg = v; _maskInvert = maskInvert;}
+
+    void doMasking(bool v) {_doMasking = v;}
+
+    void setLut(const Lut3D *lut) {_lut = lut;}
+
+    void setValues(bool premult,
+                   int premultChannel,
+                   double mix)
+    {
+        _premult = premult;
+        _premultChannel = premultChannel;
+        _mix = mix;
+    }
+};
+
+// applies the 3D LUT
+template <class PIX, int nComponents, int maxValue>
+class ColorLUT3DProcessor : public ColorLUT3DProcessorBase
+{
+public:
+    ColorLUT3DProcessor(OFX::ImageEffect &instance)
+    : ColorLUT3DProcessorBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        assert(nComponents == 3 || nComponents == 4);
+        assert(_dstImg && _lut);
+        const Shaper &shaper = _lut->getShaper();
+        const float *data = _lut->getData();
+        const int size = _lut->getSize();
+        float unpPix[4];
+        float tmpPix[4];
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                ofxsUnPremult<PIX, nComponents, maxValue>(srcPix, unpPix, _premult, _premultChannel);
+                tetrahedral(data, size,
+                            shaper.toLattice(unpPix[0]),
+                            shaper.toLattice(unpPix[1]),
+                            shaper.toLattice(unpPix[2]),
+                            tmpPix);
+                tmpPix[3] = unpPix[3];
+                ofxsPremultMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, _premult, _premultChannel, x, y, srcPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+                dstPix += nComponents;
+            }
+        }
+    }
+};
+
+// outputs the lattice image
+template <class PIX, int nComponents, int maxValue>
+class LatticeGenerator : public OFX::ImageProcessor
+{
+public:
+    LatticeGenerator(OFX::ImageEffect &instance, int size, const Shaper &shaper, const OfxPointD &renderScale)
+    : OFX::ImageProcessor(instance)
+    , _size(size)
+    , _renderScale(renderScale)
+    , _values(size)
+    {
+        for (int i = 0; i < size; ++i) {
+            _values[i] = (float)shaper.fromLattice(i / (double)(size - 1));
+        }
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        assert(nComponents == 3 || nComponents == 4);
+        assert(_dstImg);
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            // the lattice point of the full-resolution pixel, see readLattice()
+            const int b = std::max(0, std::min((int)std::floor((y + 0.5) / (_renderScale.y * kLatticeBlockSize)), _size - 1));
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                const int i = std::max(0, std::min((int)std::floor((x + 0.5) / (_renderScale.x * kLatticeBlockSize)), _size * _size - 1));
+                const float rgb[3] = { _values[i % _size], _values[i / _size], _values[b] };
+                for (int c = 0; c < 3; ++c) {
+                    dstPix[c] = floatToPix(rgb[c]);
+                }
+                if (nComponents == 4) {
+                    dstPix[3] = (PIX)maxValue;
+                }
+                dstPix += nComponents;
+            }
+        }
+    }
+
+    static PIX floatToPix(float v)
+    {
+        if (maxValue == 1) {
+            return (PIX)v;
+        }
+
+        return (PIX)std::max(0.f, std::min(v * maxValue + 0.5f, (float)maxValue));
+    }
+
+    int _size;
+    OfxPointD _renderScale;
+    std::vector<float> _values;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** @brief The plugin that does our work */
+class ColorLUT3DPlugin : public OFX::ImageEffect
+{
+public:
+    ColorLUT3DPlugin(OfxImageEffectHandle handle)
+    : ImageEffect(handle)
+    , _dstClip(0)
+    , _srcClip(0)
+    , _latticeClip(0)
+    , _maskClip(0)
+    , _mode(0)
+    , _latticeSize(0)
+    , _shaper(0)
+    , _shaperRange(0)
+    , _premult(0)
+    , _premultChannel(0)
+    , _mix(0)
+    , _maskApply(0)
+    , _maskInvert(0)
+    , _lutCache()
+    {
+        _dstClip = fetchClip(kOfxImageEffectOutputClipName);
+        assert(_dstClip && (_dstClip->getPixelComponents() == ePixelComponentRGB ||
+                            _dstClip->getPixelComponents() == ePixelComponentRGBA));
+        _srcClip = getContext() == OFX::eContextGenerator ? NULL : fetchClip(kOfxImageEffectSimpleSourceClipName);
+        assert((!_srcClip && getContext() == OFX::eContextGenerator) ||
+               (_srcClip && (_srcClip->getPixelComponents() == ePixelComponentRGB ||
+                             _srcClip->getPixelComponents() == ePixelComponentRGBA)));
+        _latticeClip = fetchClip(kClipLattice);
+        assert(_latticeClip && (_latticeClip->getPixelComponents() == ePixelComponentRGB ||
+                                _latticeClip->getPixelComponents() == ePixelComponentRGBA));
+        _maskClip = fetchClip(getContext() == OFX::eContextPaint ? "Brush" : "Mask");
+        assert(!_maskClip || _maskClip->getPixelComponents() == ePixelComponentAlpha);
+        _mode = fetchChoiceParam(kParamMode);
+        _latticeSize = fetchChoiceParam(kParamLatticeSize);
+        _shaper = fetchChoiceParam(kParamShaper);
+        _shaperRange = fetchDouble2DParam(kParamShaperRange);
+        assert(_mode && _latticeSize && _shaper && _shaperRange);
+        _premult = fetchBooleanParam(kParamPremult);
+        _premultChannel = fetchChoiceParam(kParamPremultChannel);
+        assert(_premult && _premultChannel);
+        _mix = fetchDoubleParam(kParamMix);
+        _maskApply = paramExists(kParamMaskApply) ? fetchBooleanParam(kParamMaskApply) : 0;
+        _maskInvert = fetchBooleanParam(kParamMaskInvert);
+        assert(_mix && _maskInvert);
+    }
+
+private:
+    /* Override the render */
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    template <int nComponents>
+    void renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
+    template <class PIX, int nComponents, int maxValue>
+    void renderApply(const OFX::RenderArguments &args);
+
+    template <class PIX, int nComponents, int maxValue>
+    void renderLattice(const OFX::RenderArguments &args);
+
+    virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
+
+    virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
+
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    virtual void getClipPreferences(OFX::ClipPreferencesSetter &clipPreferences) OVERRIDE FINAL;
+
+    /** @brief called when a clip has just been changed in some way (a rewire maybe) */
+    virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL
+    {
+        _lutCache.clear();
+    }
+
+    /* the lattice RoD, in canonical coordinates */
+    OfxRectD getLatticeRoD(double time, double par);
+
+    Shaper getShaper(double time);
+
+private:
+    // do not need to delete these, the ImageEffect is managing them for us
+    OFX::Clip *_dstClip;
+    OFX::Clip *_srcClip;
+    OFX::Clip *_latticeClip;
+    OFX::Clip *_maskClip;
+    OFX::ChoiceParam *_mode;
+    OFX::ChoiceParam *_latticeSize;
+    OFX::ChoiceParam *_shaper;
+    OFX::Double2DParam *_shaperRange;
+    OFX::BooleanParam *_premult;
+    OFX::ChoiceParam *_premultChannel;
+    OFX::DoubleParam *_mix;
+    OFX::BooleanParam *_maskApply;
+    OFX::BooleanParam *_maskInvert;
+    Lut3DCache _lutCache;
+};
+
+OfxRectD
+ColorLUT3DPlugin::getLatticeRoD(double time, double par)
+{
+    const int size = latticeSize((LatticeSizeEnum)_latticeSize->getValueAtTime(time));
+    OfxRectD rod;
+    rod.x1 = 0.;
+    rod.y1 = 0.;
+    rod.x2 = size * size * kLatticeBlockSize * par;
+    rod.y2 = size * kLatticeBlockSize;
+
+    return rod;
+}
+
+Shaper
+ColorLUT3DPlugin::getShaper(double time)
+{
+    double rangeMin, rangeMax;
+    _shaperRange->getValueAtTime(time, rangeMin, rangeMax);
+
+    return Shaper((ShaperEnum)_shaper->getValueAtTime(time), rangeMin, rangeMax);
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+ColorLUT3DPlugin::renderApply(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+    std::auto_ptr<OFX::Image> dst(_dstClip->fetchImage(time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    OFX::BitDepthEnum         dstBitDepth    = dst->getPixelDepth();
+    OFX::PixelComponentEnum   dstComponents  = dst->getPixelComponents();
+    if (dstBitDepth != _dstClip->getPixelDepth() ||
+        dstComponents != _dstClip->getPixelComponents()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    std::auto_ptr<const OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
+                                        _srcClip->fetchImage(time) : 0);
+    if (src.get()) {
+        if (src->getRenderScale().x != args.renderScale.x ||
+            src->getRenderScale().y != args.renderScale.y ||
+            (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        OFX::BitDepthEnum    srcBitDepth      = src->getPixelDepth();
+        OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
+        if (srcBitDepth != dstBitDepth || srcComponents != dstComponents) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
+    }
+    std::auto_ptr<const OFX::Image> lattice(_latticeClip->isConnected() ?
+                                            _latticeClip->fetchImage(time) : 0);
+    if (!lattice.get()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "The Lattice input is not connected");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (lattice->getRenderScale().x != args.renderScale.x ||
+        lattice->getRenderScale().y != args.renderScale.y) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (lattice->getPixelDepth() != dstBitDepth) {
+        OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+    }
+    bool doMasking = ((!_maskApply || _maskApply->getValueAtTime(time)) && _maskClip && _maskClip->isConnected());
+    std::auto_ptr<const OFX::Image> mask(doMasking ? _maskClip->fetchImage(time) : 0);
+    if (mask.get()) {
+        if (mask->getRenderScale().x != args.renderScale.x ||
+            mask->getRenderScale().y != args.renderScale.y ||
+            (mask->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && mask->getField() != args.fieldToRender)) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+
+    // the LUT is only read again when the lattice image changes, and it is shared by all the tiles
+    const int size = latticeSize((LatticeSizeEnum)_latticeSize->getValueAtTime(time));
+    const Lut3D *lut = _lutCache.acquire<PIX, maxValue>(lattice.get(), time, size, getShaper(time));
+    Lut3DHolder_RAII lutHolder(_lutCache, lut);
+    if (!lut) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "The Lattice input does not contain the lattice image, check the lattice size");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    ColorLUT3DProcessor<PIX, nComponents, maxValue> processor(*this);
+    if (doMasking) {
+        bool maskInvert;
+        _maskInvert->getValueAtTime(time, maskInvert);
+        processor.doMasking(true);
+        processor.setMaskImg(mask.get(), maskInvert);
+    }
+    processor.setDstImg(dst.get());
+    processor.setSrcImg(src.get());
+    processor.setLut(lut);
+    processor.setRenderWindow(args.renderWindow);
+    bool premult;
+    int premultChannel;
+    _premult->getValueAtTime(time, premult);
+    _premultChannel->getValueAtTime(time, premultChannel);
+    double mix;
+    _mix->getValueAtTime(time, mix);
+    processor.setValues(premult, premultChannel, mix);
+    processor.process();
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+ColorLUT3DPlugin::renderLattice(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+    std::auto_ptr<OFX::Image> dst(_dstClip->fetchImage(time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getPixelDepth() != _dstClip->getPixelDepth() ||
+        dst->getPixelComponents() != _dstClip->getPixelComponents()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    const int size = latticeSize((LatticeSizeEnum)_latticeSize->getValueAtTime(time));
+    LatticeGenerator<PIX, nComponents, maxValue> processor(*this, size, getShaper(time), args.renderScale);
+    processor.setDstImg(dst.get());
+    processor.setRenderWindow(args.renderWindow);
+    processor.process();
+}
+
+template <int nComponents>
+void
+ColorLUT3DPlugin::renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth)
+{
+    const bool lattice = (ModeEnum)_mode->getValueAtTime(args.time) == eModeLattice;
+    switch (dstBitDepth) {
+        case OFX::eBitDepthUByte: {
+            if (lattice) {
+                renderLattice<unsigned char, nComponents, 255>(args);
+            } else {
+                renderApply<unsigned char, nComponents, 255>(args);
+            }
+            break;
+        }
+        case OFX::eBitDepthUShort: {
+            if (lattice) {
+                renderLattice<unsigned short, nComponents, 65535>(args);
+            } else {
+                renderApply<unsigned short, nComponents, 65535>(args);
+            }
+            break;
+        }
+        case OFX::eBitDepthFloat: {
+            if (lattice) {
+                renderLattice<float, nComponents, 1>(args);
+            } else {
+                renderApply<float, nComponents, 1>(args);
+            }
+            break;
+        }
+        default:
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+void
+ColorLUT3DPlugin::render(const OFX::RenderArguments &args)
+{
+    OFX::BitDepthEnum       dstBitDepth    = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+
+    assert(kSupportsMultipleClipPARs   || !_srcClip || _srcClip->getPixelAspectRatio() == _dstClip->getPixelAspectRatio());
+    assert(kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth());
+    assert(dstComponents == OFX::ePixelComponentRGB || dstComponents == OFX::ePixelComponentRGBA);
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        renderForComponents<4>(args, dstBitDepth);
+    } else {
+        assert(dstComponents == OFX::ePixelComponentRGB);
+        renderForComponents<3>(args, dstBitDepth);
+    }
+}
+
+bool
+ColorLUT3DPlugin::isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &/*identityTime*/)
+{
+    if ((ModeEnum)_mode->getValueAtTime(args.time) == eModeLattice) {
+        return false;
+    }
+    double mix;
+    _mix->getValueAtTime(args.time, mix);
+    if (mix == 0. /*|| (!red && !green && !blue && !alpha)*/) {
+        identityClip = _srcClip;
+        return true;
+    }
+
+    bool doMasking = ((!_maskApply || _maskApply->getValueAtTime(args.time)) && _maskClip && _maskClip->isConnected());
+    if (doMasking) {
+        bool maskInvert;
+        _maskInvert->getValueAtTime(args.time, maskInvert);
+        if (!maskInvert) {
+            OfxRectI maskRoD;
+            OFX::Coords::toPixelEnclosing(_maskClip->getRegionOfDefinition(args.time), args.renderScale, _maskClip->getPixelAspectRatio(), &maskRoD);
+            // effect is identity if the renderWindow doesn't intersect the mask RoD
+            if (!OFX::Coords::rectIntersection<OfxRectI>(args.renderWindow, maskRoD, 0)) {
+                identityClip = _srcClip;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool
+ColorLUT3DPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod)
+{
+    if ((ModeEnum)_mode->getValueAtTime(args.time) != eModeLattice) {
+        // use the default RoD
+        return false;
+    }
+    rod = getLatticeRoD(args.time, _dstClip->getPixelAspectRatio());
+
+    return true;
+}
+
+void
+ColorLUT3DPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois)
+{
+    if ((ModeEnum)_mode->getValueAtTime(args.time) != eModeApply || !_latticeClip->isConnected()) {
+        return;
+    }
+    // the whole lattice is needed to render any pixel
+    rois.setRegionOfInterest(*_latticeClip, getLatticeRoD(args.time, _latticeClip->getPixelAspectRatio()));
+}
+
+void
+ColorLUT3DPlugin::getClipPreferences(OFX::ClipPreferencesSetter &clipPreferences)
+{
+    if ((ModeEnum)_mode->getValue() == eModeLattice) {
+        // the lattice alpha is 1
+        clipPreferences.setOutputPremultiplication(eImageOpaque);
+    }
+}
+
+void
+ColorLUT3DPlugin::changedClip(const InstanceChangedArgs &args, const std::string &clipName)
+{
+    if (clipName == kOfxImageEffectSimpleSourceClipName && _srcClip && args.reason == OFX::eChangeUserEdit) {
+        switch (_srcClip->getPreMultiplication()) {
+            case eImageOpaque:
+                _premult->setValue(false);
+                break;
+            case eImagePreMultiplied:
+                _premult->setValue(true);
+                break;
+            case eImageUnPreMultiplied:
+                _premult->setValue(false);
+                break;
+        }
+    }
+}
+
+
+mDeclarePluginFactory(ColorLUT3DPluginFactory, {}, {});
+
+void
+ColorLUT3DPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
+{
+    desc.setLabel(kPluginName);
+    desc.setPluginGrouping(kPluginGrouping);
+    desc.setPluginDescription(kPluginDescription);
+
+    desc.addSupportedContext(eContextFilter);
+    desc.addSupportedContext(eContextGeneral);
+    desc.addSupportedContext(eContextPaint);
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
+    desc.addSupportedBitDepth(eBitDepthFloat);
+
+    desc.setSingleInstance(false);
+    desc.setHostFrameThreading(false);
+    desc.setSupportsMultiResolution(kSupportsMultiResolution);
+    desc.setSupportsTiles(kSupportsTiles);
+    desc.setTemporalClipAccess(false);
+    desc.setRenderTwiceAlways(false);
+    desc.setSupportsMultipleClipPARs(kSupportsMultipleClipPARs);
+    desc.setSupportsMultipleClipDepths(kSupportsMultipleClipDepths);
+    desc.setRenderThreadSafety(kRenderThreadSafety);
+}
+
+void
+ColorLUT3DPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context)
+{
+    ClipDescriptor *srcClip = desc.defineClip(kOfxImageEffectSimpleSourceClipName);
+    assert(srcClip);
+    srcClip->addSupportedComponent(ePixelComponentRGBA);
+    srcClip->addSupportedComponent(ePixelComponentRGB);
+    srcClip->setTemporalClipAccess(false);
+    srcClip->setSupportsTiles(kSupportsTiles);
+    srcClip->setIsMask(false);
+
+    ClipDescriptor *latticeClip = desc.defineClip(kClipLattice);
+    assert(latticeClip);
+    latticeClip->setHint(kClipLatticeHint);
+    latticeClip->addSupportedComponent(ePixelComponentRGBA);
+    latticeClip->addSupportedComponent(ePixelComponentRGB);
+    latticeClip->setTemporalClipAccess(false);
+    latticeClip->setSupportsTiles(kSupportsTiles);
+    latticeClip->setIsMask(false);
+    latticeClip->setOptional(true);
+
+    ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
+    assert(dstClip);
+    dstClip->addSupportedComponent(ePixelComponentRGBA);
+    dstClip->addSupportedComponent(ePixelComponentRGB);
+    dstClip->setSupportsTiles(kSupportsTiles);
+
+    ClipDescriptor *maskClip = (context == eContextPaint) ? desc.defineClip("Brush") : desc.defineClip("Mask");
+    maskClip->addSupportedComponent(ePixelComponentAlpha);
+    maskClip->setTemporalClipAccess(false);
+    if (context != eContextPaint) {
+        maskClip->setOptional(true);
+    }
+    maskClip->setSupportsTiles(kSupportsTiles);
+    maskClip->setIsMask(true);
+
+    // make some pages and to things in
+    PageParamDescriptor *page = desc.definePageParam("Controls");
+
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamMode);
+        param->setLabel(kParamModeLabel);
+        param->setHint(kParamModeHint);
+        assert(param->getNOptions() == eModeApply);
+        param->appendOption(kParamModeOptionApply, kParamModeOptionApplyHint);
+        assert(param->getNOptions() == eModeLattice);
+        param->appendOption(kParamModeOptionLattice, kParamModeOptionLatticeHint);
+        param->setDefault((int)eModeApply);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamLatticeSize);
+        param->setLabel(kParamLatticeSizeLabel);
+        param->setHint(kParamLatticeSizeHint);
+        assert(param->getNOptions() == eLatticeSize17);
+        param->appendOption(kParamLatticeSizeOption17);
+        assert(param->getNOptions() == eLatticeSize33);
+        param->appendOption(kParamLatticeSizeOption33);
+        assert(param->getNOptions() == eLatticeSize65);
+        param->appendOption(kParamLatticeSizeOption65);
+        param->setDefault((int)eLatticeSize33);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamShaper);
+        param->setLabel(kParamShaperLabel);
+        param->setHint(kParamShaperHint);
+        assert(param->getNOptions() == eShaperLinear);
+        param->appendOption(kParamShaperOptionLinear, kParamShaperOptionLinearHint);
+        assert(param->getNOptions() == eShaperLog);
+        param->appendOption(kParamShaperOptionLog, kParamShaperOptionLogHint);
+        param->setDefault((int)eShaperLinear);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        Double2DParamDescriptor *param = desc.defineDouble2DParam(kParamShaperRange);
+        param->setLabel(kParamShaperRangeLabel);
+        param->setDimensionLabels("min", "max");
+        param->setHint(kParamShaperRangeHint);
+        param->setDefault(0., 1.);
+        param->setDisplayRange(0., 0., 1., 1.);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    ofxsPremultDescribeParams(desc, page);
+    ofxsMaskMixDescribeParams(desc, page);
+}
+
+OFX::ImageEffect*
+ColorLUT3DPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
+{
+    return new ColorLUT3DPlugin(handle);
+}
+
+void getColorLUT3DPluginID(OFX::PluginFactoryArray &ids)
+{
+    static ColorLUT3DPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+    ids.push_back(&p);
+}
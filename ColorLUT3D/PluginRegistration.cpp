@@ -0,0 +1,12 @@
+#include "ColorLUT3D.h"
+
+namespace OFX
+{
+    namespace Plugin
+    {
+        void getPluginIDs(OFX::PluginFactoryArray &ids)
+        {
+            getColorLUT3DPluginID(ids);
+        }
+    }
+}
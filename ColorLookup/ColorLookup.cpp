@@ -40,6 +40,7 @@ using std::isnan;
 #include "ofxsProcessing.H"
 #include "ofxsMaskMix.h"
 #include "ofxsCoords.h"
+#include "ofxsParametricLut.h"
 #include "ofxsMacros.h"
 
 #define kPluginName "ColorLookupOFX"
@@ -49,8 +50,11 @@ using std::isnan;
 "The master curve is combined with the red, green and blue curves, but not with the alpha curve.\n" \
 "Computation is faster for values that are within the given range."
 #define kPluginIdentifier "net.sf.openfx.ColorLookupPlugin"
+// History:
+// version 1.0: initial version
+// version 1.1: cache the lookup table across renders, add the HDR parameters
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -101,6 +105,14 @@ using std::isnan;
 #define kParamRangeLabel "Range"
 #define kParamRangeHint "Expected range for input values. Within this range, a lookup table is used for faster computation."
 
+#define kParamHDR "hdr"
+#define kParamHDRLabel "HDR"
+#define kParamHDRHint "Outside of the range, use lookup tables with a logarithmic spacing that cover the HDR range, and extrapolate linearly beyond it, instead of evaluating the curves for each pixel. This is much faster on HDR images, but slightly less accurate outside of the range."
+
+#define kParamHDRRange "hdrRange"
+#define kParamHDRRangeLabel "HDR Range"
+#define kParamHDRRangeHint "Range of input values covered by the HDR lookup tables. Beyond this range, the curves are extrapolated linearly."
+
 #define kParamClampBlack "clampBlack"
 #define kParamClampBlackLabel "Clamp Black"
 #define kParamClampBlackHint "All colors below 0 on output are set to 0."
@@ -216,13 +228,16 @@ class ColorLookupProcessor : public ColorLookupProcessorBase
 {
 public:
     // ctor
-    ColorLookupProcessor(OFX::ImageEffect &instance, const OFX::RenderArguments &args, OFX::ParametricParam  *lookupTableParam, double rangeMin, double rangeMax, bool clampBlack, bool clampWhite)
+    ColorLookupProcessor(OFX::ImageEffect &instance, const OFX::RenderArguments &args, OFX::ParametricParam  *lookupTableParam, double rangeMin, double rangeMax, bool hdr, double hdrMin, double hdrMax, bool clampBlack, bool clampWhite)
     : ColorLookupProcessorBase(instance, clampBlack, clampWhite)
+    , _lookupTable(0)
     , _lookupTableParam(lookupTableParam)
     , _rangeMin(std::min(rangeMin,rangeMax))
     , _rangeMax(std::max(rangeMin,rangeMax))
+    , _hdr(hdr)
+    , _hdrLogBelow(0.)
+    , _hdrLogAbove(0.)
     {
-        // build the LUT
         assert(_lookupTableParam);
         _time = args.time;
         if (_rangeMin == _rangeMax) {
@@ -232,20 +247,72 @@ public:
         assert((PIX)maxValue == maxValue);
         // except for float, maxValue is the same as nbValues
         assert(maxValue == 1 || (maxValue == nbValues));
+        if (_hdr) {
+            // the HDR tables sample d = log(1 + distance to the range / range width)
+            // uniformly, from 0 to the HDR range bounds
+            const double w = _rangeMax - _rangeMin;
+            _hdrLogBelow = std::log(1. + std::max(0., _rangeMin - std::min(hdrMin, hdrMax)) / w);
+            _hdrLogAbove = std::log(1. + std::max(0., std::max(hdrMin, hdrMax) - _rangeMax) / w);
+        }
+        for (int c = 0; c < nComponents; ++c) {
+            _slopeBelow[c] = 0.f;
+            _slopeAbove[c] = 0.f;
+        }
+    }
+
+    // the number of tables in the LUT
+    static int nTables(bool hdr)
+    {
+        return hdr ? 3 * nComponents : nComponents;
+    }
+
+    // build the LUT, called by OFX::ParametricLutCache::acquire() if it is not cached
+    void fillLut(OFX::ParametricLut &lut)
+    {
+        assert(lut.getKey().nTables == nTables(_hdr) && lut.getKey().nbValues == nbValues);
         for (int component = 0; component < nComponents; ++component) {
-            _lookupTable[component].resize(nbValues+1);
-            int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
+            float *table = lut.getTable(component);
             for (int position = 0; position <= nbValues; ++position) {
                 // position to evaluate the param at
                 double parametricPos = _rangeMin + (_rangeMax - _rangeMin) * double(position)/nbValues;
 
-                // evaluate the parametric param
-                double value = _lookupTableParam->getValue(lutIndex, _time, parametricPos);
-                if (nComponents != 1 && lutIndex != kCurveAlpha) {
-                    value += _lookupTableParam->getValue(kCurveMaster, _time, parametricPos) - parametricPos;
-                }
                 // set that in the lut
-                _lookupTable[component][position] = (float)clamp<PIX>(value, maxValue);
+                table[position] = evaluate(component, parametricPos);
+            }
+            if (_hdr) {
+                float *tableBelow = lut.getTable(nComponents + component);
+                float *tableAbove = lut.getTable(2 * nComponents + component);
+                for (int position = 0; position <= nbValues; ++position) {
+                    tableBelow[position] = evaluate(component, belowPos(position));
+                    tableAbove[position] = evaluate(component, abovePos(position));
+                }
+            }
+        }
+    }
+
+    void setLut(const OFX::ParametricLut *lut)
+    {
+        _lookupTable = lut;
+        if (_hdr) {
+            // slopes of the last segments, for linear extrapolation beyond the HDR range
+            // (if the HDR range does not extend the range, use the ends of the main table)
+            const double dx = (_rangeMax - _rangeMin) / nbValues;
+            for (int c = 0; c < nComponents; ++c) {
+                const float *table = _lookupTable->getTable(c);
+                const float *tableBelow = _lookupTable->getTable(nComponents + c);
+                const float *tableAbove = _lookupTable->getTable(2 * nComponents + c);
+                if (_hdrLogBelow > 0.) {
+                    double dxBelow = belowPos(nbValues - 1) - belowPos(nbValues);
+                    _slopeBelow[c] = (float)((tableBelow[nbValues - 1] - tableBelow[nbValues]) / dxBelow);
+                } else {
+                    _slopeBelow[c] = (float)((table[1] - table[0]) / dx);
+                }
+                if (_hdrLogAbove > 0.) {
+                    double dxAbove = abovePos(nbValues) - abovePos(nbValues - 1);
+                    _slopeAbove[c] = (float)((tableAbove[nbValues] - tableAbove[nbValues - 1]) / dxAbove);
+                } else {
+                    _slopeAbove[c] = (float)((table[nbValues] - table[nbValues - 1]) / dx);
+                }
             }
         }
     }
@@ -295,33 +362,75 @@ private:
         }
     }
 
+    // evaluate the parametric param (slow)
+    float evaluate(int component, double value)
+    {
+        int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
+        double ret = _lookupTableParam->getValue(lutIndex, _time, value);
+        if (nComponents != 1 && lutIndex != kCurveAlpha) {
+            ret += _lookupTableParam->getValue(kCurveMaster, _time, value) - value;
+        }
+        return (float)clamp<PIX>(ret, maxValue);
+    }
+
+    // positions of the samples of the HDR tables
+    double belowPos(int position) const
+    {
+        return _rangeMin - (_rangeMax - _rangeMin) * (std::exp(_hdrLogBelow * position / nbValues) - 1.);
+    }
+
+    double abovePos(int position) const
+    {
+        return _rangeMax + (_rangeMax - _rangeMin) * (std::exp(_hdrLogAbove * position / nbValues) - 1.);
+    }
+
+    // linear interpolation in a table, x is in [0,1]
+    static float lookup(const float *table, float x)
+    {
+        int i = (int)(x * nbValues);
+        assert(0 <= i && i <= nbValues);
+        float alpha = std::max(0.f,std::min(x * nbValues - i, 1.f));
+        float a = table[i];
+        float b = (i  < nbValues) ? table[i+1] : 0.f;
+        return a * (1.f - alpha) + b * alpha;
+    }
+
     // on input to interpolate, value should be normalized to the [0-1] range
     float interpolate(int component, float value) {
         if (value < _rangeMin || _rangeMax < value) {
-            // slow version
-            int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
-            double ret = _lookupTableParam->getValue(lutIndex, _time, value);
-            if (nComponents != 1 && lutIndex != kCurveAlpha) {
-                ret += _lookupTableParam->getValue(kCurveMaster, _time, value) - value;
+            if (!_hdr) {
+                // slow version
+                return evaluate(component, value);
             }
-            return (float)clamp<PIX>(ret, maxValue);;
+            const bool below = value < _rangeMin;
+            // distance to the range, on the same logarithmic scale as the HDR tables
+            double d = std::log(1. + (below ? (_rangeMin - value) : (value - _rangeMax)) / (_rangeMax - _rangeMin));
+            double dMax = below ? _hdrLogBelow : _hdrLogAbove;
+            const float *table = _lookupTable->getTable((below ? 1 : 2) * nComponents + component);
+            if (d < dMax) {
+                return lookup(table, (float)(d / dMax));
+            }
+            // beyond the HDR range: extrapolate linearly
+            double last = below ? belowPos(nbValues) : abovePos(nbValues);
+            double ret = table[nbValues] + (below ? _slopeBelow[component] : _slopeAbove[component]) * (value - last);
+            return (float)clamp<PIX>(ret, maxValue);
         } else {
             float x = (float)(value - _rangeMin) / (float)(_rangeMax - _rangeMin);
-            int i = (int)(x * nbValues);
-            assert(0 <= i && i <= nbValues);
-            float alpha = std::max(0.f,std::min(x * nbValues - i, 1.f));
-            float a = _lookupTable[component][i];
-            float b = (i  < nbValues) ? _lookupTable[component][i+1] : 0.f;
-            return a * (1.f - alpha) + b * alpha;
+            return lookup(_lookupTable->getTable(component), x);
         }
     }
 
 private:
-    std::vector<float> _lookupTable[nComponents];
+    const OFX::ParametricLut *_lookupTable;
     OFX::ParametricParam*  _lookupTableParam;
     double _time;
     double _rangeMin;
     double _rangeMax;
+    bool _hdr;
+    double _hdrLogBelow; // log of (1 + the HDR extent below the range, in range widths)
+    double _hdrLogAbove; // log of (1 + the HDR extent above the range, in range widths)
+    float _slopeBelow[nComponents];
+    float _slopeAbove[nComponents];
 };
 
 using namespace OFX;
@@ -352,6 +461,10 @@ public:
         _lookupTable = fetchParametricParam(kParamLookupTable);
         _range = fetchDouble2DParam(kParamRange);
         assert(_lookupTable && _range);
+        _hdr = fetchBooleanParam(kParamHDR);
+        _hdrRange = fetchDouble2DParam(kParamHDRRange);
+        assert(_hdr && _hdrRange);
+        _hdrRange->setEnabled(_hdr->getValue());
         _source = fetchRGBAParam(kParamSource);
         _target = fetchRGBAParam(kParamTarget);
         assert(_source && _target);
@@ -378,10 +491,25 @@ private:
     template <int nComponents>
     void renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
 
+    template <class PIX, int nComponents, int maxValue, int nbValues>
+    void renderForBitDepth(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
+    virtual void purgeCaches() OVERRIDE FINAL
+    {
+        _lutCache.clear();
+    }
+
     void setupAndProcess(ColorLookupProcessorBase &, const OFX::RenderArguments &args);
     
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL
     {
+        if (paramName == kParamLookupTable) {
+            // the curves changed: the cached LUT is stale
+            _lutCache.clear();
+        }
+        if (paramName == kParamHDR) {
+            _hdrRange->setEnabled(_hdr->getValueAtTime(args.time));
+        }
         if (paramName == kParamSetMaster && args.reason == eChangeUserEdit) {
             double source[4];
             double target[4];
@@ -504,6 +632,8 @@ private:
     OFX::Clip *_maskClip;
     OFX::ParametricParam  *_lookupTable;
     OFX::Double2DParam* _range;
+    OFX::BooleanParam* _hdr;
+    OFX::Double2DParam* _hdrRange;
     OFX::RGBAParam* _source;
     OFX::RGBAParam* _target;
     OFX::BooleanParam* _clampBlack;
@@ -513,6 +643,7 @@ private:
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
+    OFX::ParametricLutCache _lutCache;
 };
 
 
@@ -594,28 +725,54 @@ ColorLookupPlugin::setupAndProcess(ColorLookupProcessorBase &processor,
     processor.process();
 }
 
-// the internal render function
-template <int nComponents>
+template <class PIX, int nComponents, int maxValue, int nbValues>
 void
-ColorLookupPlugin::renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth)
+ColorLookupPlugin::renderForBitDepth(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth)
 {
-    double rangeMin, rangeMax;
+    OFX::ParametricLutKey key;
+    bool hdr;
+    double hdrMin = 0., hdrMax = 0.;
     bool clampBlack, clampWhite;
-    _range->getValueAtTime(args.time, rangeMin, rangeMax);
+    _range->getValueAtTime(args.time, key.rangeMin, key.rangeMax);
+    _hdr->getValueAtTime(args.time, hdr);
+    if (hdr) {
+        _hdrRange->getValueAtTime(args.time, hdrMin, hdrMax);
+    }
     _clampBlack->getValueAtTime(args.time, clampBlack);
     _clampWhite->getValueAtTime(args.time, clampWhite);
+    typedef ColorLookupProcessor<PIX, nComponents, maxValue, nbValues> Processor;
+    Processor fred(*this, args, _lookupTable, key.rangeMin, key.rangeMax, hdr, hdrMin, hdrMax, clampBlack, clampWhite);
+
+    // the LUT is only rebuilt when the curves, the ranges, the clamping or the image format change,
+    // and it is shared by all the tiles
+    OFX::ofxsParametricParamGetCurves(_lookupTable, kCurveNb, args.time, &key.curves);
+    key.nbValues = nbValues;
+    key.nTables = Processor::nTables(hdr);
+    key.variant = ((int)dstBitDepth << 2) | ((int)clampBlack << 1) | (int)clampWhite;
+    if (hdr) {
+        key.values.push_back(hdrMin);
+        key.values.push_back(hdrMax);
+    }
+    const OFX::ParametricLut *lut = _lutCache.acquire(key, fred);
+    OFX::ParametricLutHolder_RAII lutHolder(_lutCache, lut);
+    fred.setLut(lut);
+    setupAndProcess(fred, args);
+}
+
+// the internal render function
+template <int nComponents>
+void
+ColorLookupPlugin::renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth)
+{
     switch(dstBitDepth) {
         case OFX::eBitDepthUByte: {
-            ColorLookupProcessor<unsigned char, nComponents, 255, 255> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite);
-            setupAndProcess(fred, args);
+            renderForBitDepth<unsigned char, nComponents, 255, 255>(args, dstBitDepth);
         }   break;
         case OFX::eBitDepthUShort: {
-            ColorLookupProcessor<unsigned short, nComponents, 65535, 65535> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite);
-            setupAndProcess(fred, args);
+            renderForBitDepth<unsigned short, nComponents, 65535, 65535>(args, dstBitDepth);
         }   break;
         case OFX::eBitDepthFloat: {
-            ColorLookupProcessor<float, nComponents, 1, 1023> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite);
-            setupAndProcess(fred, args);
+            renderForBitDepth<float, nComponents, 1, 1023>(args, dstBitDepth);
         }   break;
         default :
             OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
@@ -771,6 +928,28 @@ ColorLookupPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OF
             page->addChild(*param);
         }
     }
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamHDR);
+        param->setLabel(kParamHDRLabel);
+        param->setHint(kParamHDRHint);
+        param->setDefault(false);
+        param->setAnimates(true);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        Double2DParamDescriptor *param = desc.defineDouble2DParam(kParamHDRRange);
+        param->setLabel(kParamHDRRangeLabel);
+        param->setDimensionLabels("min", "max");
+        param->setHint(kParamHDRRangeHint);
+        param->setDefault(-1., 1024.);
+        param->setDisplayRange(-1., -1., 1024., 1024.);
+        param->setAnimates(true);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         OFX::ParametricParamDescriptor* param = desc.defineParametricParam(kParamLookupTable);
         assert(param);
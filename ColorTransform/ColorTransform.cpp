@@ -23,6 +23,7 @@
 #include "ColorTransform.h"
 
 #include <cmath>
+#include <vector>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -31,6 +32,7 @@
 #include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
 #include "ofxsLut.h"
+#include "ofxsColorRow.h"
 
 #define kPluginRGBToHSVName "RGBToHSVOFX"
 #define kPluginRGBToHSVDescription "Convert from RGB to HSV color model (hue, saturation, value, as defined by A. R. Smith in 1978). H is in degrees, S and V are in the same units as RGB."
@@ -96,7 +98,7 @@
 #define kPluginGrouping "Color/Transform"
 
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -184,9 +186,87 @@ class ColorTransformProcessor : public ColorTransformProcessorBase
 public:
     ColorTransformProcessor(OFX::ImageEffect &instance)
     : ColorTransformProcessorBase(instance)
+    , _matrix()
     {
+        // the affine conversions are applied as a matrix, taken from the OFX::Color functions
+        switch (transform) {
+            case eColorTransformRGBToYCbCr:
+                _matrix = OFX::ColorRow::Matrix34(OFX::Color::rgb_to_ycbcr);
+                break;
+            case eColorTransformYCbCrToRGB:
+                _matrix = OFX::ColorRow::Matrix34(OFX::Color::ycbcr_to_rgb);
+                break;
+            case eColorTransformRGBToYUV:
+                _matrix = OFX::ColorRow::Matrix34(OFX::Color::rgb_to_yuv);
+                break;
+            case eColorTransformYUVToRGB:
+                _matrix = OFX::ColorRow::Matrix34(OFX::Color::yuv_to_rgb);
+                break;
+            case eColorTransformRGBToXYZ:
+            case eColorTransformRGBToLab:
+                _matrix = OFX::ColorRow::Matrix34(OFX::Color::rgb_to_xyz_rec709);
+                break;
+            case eColorTransformXYZToRGB:
+            case eColorTransformLabToRGB:
+                _matrix = OFX::ColorRow::Matrix34(OFX::Color::xyz_rec709_to_rgb);
+                break;
+            default:
+                break;
+        }
+        // the Lab white point is the XYZ of the RGB white
+        OFX::Color::rgb_to_xyz_rec709(1.f, 1.f, 1.f, &_white[0], &_white[1], &_white[2]);
     }
-    
+
+private:
+    // convert the n pixels of a row in place
+    void convertRow(int n, float *x, float *y, float *z)
+    {
+        switch (transform) {
+            case eColorTransformRGBToHSV:
+                OFX::ColorRow::rgb_to_hsv(n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformHSVToRGB:
+                OFX::ColorRow::hsv_to_rgb(n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformRGBToHSL:
+                OFX::ColorRow::rgb_to_hsl(n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformHSLToRGB:
+                OFX::ColorRow::hsl_to_rgb(n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformRGBToHSI:
+                OFX::ColorRow::rgb_to_hsi(n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformHSIToRGB:
+                OFX::ColorRow::hsi_to_rgb(n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformRGBToYCbCr:
+            case eColorTransformYCbCrToRGB:
+            case eColorTransformRGBToYUV:
+            case eColorTransformYUVToRGB:
+            case eColorTransformRGBToXYZ:
+            case eColorTransformXYZToRGB:
+                OFX::ColorRow::affine(_matrix, n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformRGBToLab:
+                OFX::ColorRow::affine(_matrix, n, x, y, z, x, y, z);
+                OFX::ColorRow::xyz_to_lab(_white, n, x, y, z, x, y, z);
+                break;
+
+            case eColorTransformLabToRGB:
+                OFX::ColorRow::lab_to_xyz(_white, n, x, y, z, x, y, z);
+                OFX::ColorRow::affine(_matrix, n, x, y, z, x, y, z);
+                break;
+        }
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow)
     {
         assert(nComponents == 3 || nComponents == 4);
@@ -195,77 +275,36 @@ public:
         float tmpPix[4];
         const bool dounpremult = _premult && fromRGB(transform);
         const bool dopremult = _premult && toRGB(transform);
-        
+        // one row of unpremultiplied pixels, one array per channel, converted at once
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> rowBuf((size_t)width * 4);
+        float *row[4];
+        for (int c = 0; c < 4; ++c) {
+            row[c] = &rowBuf[(size_t)c * width];
+        }
+
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if (_effect.abort()) {
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
                 const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
                 ofxsUnPremult<PIX, nComponents, maxValue>(srcPix, unpPix, dounpremult, _premultChannel);
-                switch (transform) {
-                    case eColorTransformRGBToHSV:
-                        OFX::Color::rgb_to_hsv(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformHSVToRGB:
-                        OFX::Color::hsv_to_rgb(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformRGBToHSL:
-                        OFX::Color::rgb_to_hsl(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformHSLToRGB:
-                        OFX::Color::hsl_to_rgb(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformRGBToHSI:
-                        OFX::Color::rgb_to_hsi(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformHSIToRGB:
-                        OFX::Color::hsi_to_rgb(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-
-                    case eColorTransformRGBToYCbCr:
-                        OFX::Color::rgb_to_ycbcr(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformYCbCrToRGB:
-                        OFX::Color::ycbcr_to_rgb(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-                        
-                    case eColorTransformRGBToYUV:
-                        OFX::Color::rgb_to_yuv(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformYUVToRGB:
-                        OFX::Color::yuv_to_rgb(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-                        
-                    case eColorTransformRGBToXYZ:
-                        OFX::Color::rgb_to_xyz_rec709(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformXYZToRGB:
-                        OFX::Color::xyz_rec709_to_rgb(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformRGBToLab:
-                        OFX::Color::rgb_to_lab(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
-
-                    case eColorTransformLabToRGB:
-                        OFX::Color::lab_to_rgb(unpPix[0], unpPix[1], unpPix[2], &tmpPix[0], &tmpPix[1], &tmpPix[2]);
-                        break;
+                for (int c = 0; c < 4; ++c) {
+                    row[c][x - procWindow.x1] = unpPix[c];
+                }
+            }
+
+            convertRow(width, row[0], row[1], row[2]);
 
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                for (int c = 0; c < 4; ++c) {
+                    tmpPix[c] = row[c][x - procWindow.x1];
                 }
-                tmpPix[3] = unpPix[3];
                 ofxsPremultMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, dopremult, _premultChannel, x, y, srcPix, /*doMasking=*/false, /*maskImg=*/NULL, /*mix=*/1.f, /*maskInvert=*/false, dstPix);
                 // increment the dst pixel
                 dstPix += nComponents;
@@ -273,6 +312,9 @@ public:
         }
 
    }
+
+    OFX::ColorRow::Matrix34 _matrix;
+    float _white[3];
 };
 
 
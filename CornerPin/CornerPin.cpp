@@ -46,6 +46,8 @@
 
 #include "ofxsOGLTextRenderer.h"
 #include "ofxsTransform3x3.h"
+#include "ofxsCoords.h"
+#include "ofxsMipmapCache.h"
 
 #define kPluginName "CornerPinOFX"
 #define kPluginMaskedName "CornerPinMaskedOFX"
@@ -58,8 +60,11 @@
 "This plugin concatenates transforms."
 #define kPluginIdentifier "net.sf.openfx.CornerPinPlugin"
 #define kPluginMaskedIdentifier "net.sf.openfx.CornerPinMaskedPlugin"
+// History:
+// version 1.0: initial version
+// version 1.1: add the mipmap parameter
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define POINT_SIZE 5
 #define POINT_TOLERANCE 6
@@ -297,6 +302,8 @@ public:
     , _copyFromButton(0)
     , _copyToButton(0)
     , _copyInputButton(0)
+    , _mipmap(0)
+    , _mipmapCache()
     {
         // NON-GENERIC
         for (int i = 0; i < 4; ++i) {
@@ -315,6 +322,7 @@ public:
         _copyToButton = fetchPushButtonParam(kParamCopyTo);
         _copyInputButton = fetchPushButtonParam(kParamCopyInputRoD);
         assert(_copyInputButton && _copyToButton && _copyFromButton);
+        _mipmap = paramExists(kParamMipmap) ? fetchBooleanParam(kParamMipmap) : 0;
     }
 private:
     
@@ -346,6 +354,19 @@ private:
     /** @brief called when a clip has just been changed in some way (a rewire maybe) */
     //virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    // The inverse transform in canonical coordinates, or false if it has to be blurred.
+    bool getInverseTransformCanonicalNoBlur(double time, OFX::Matrix3x3* invtransform) const;
+
+    // If the mipmap parameter is set, the transform is rendered using a mipmap,
+    // else (or with motion blur) it goes through Transform3x3Plugin::render().
+    bool getInverseTransformPixel(const OFX::RenderArguments &args, const OFX::Image *src, OFX::Matrix3x3* invtransform);
+
 private:
     // NON-GENERIC
     OFX::Double2DParam* _to[4];
@@ -358,6 +379,8 @@ private:
     OFX::PushButtonParam* _copyFromButton;
     OFX::PushButtonParam* _copyToButton;
     OFX::PushButtonParam* _copyInputButton;
+    OFX::BooleanParam* _mipmap;
+    OFX::MipmapCache _mipmapCache;
 };
 
 
@@ -539,6 +562,100 @@ void CornerPinPlugin::changedParam(const OFX::InstanceChangedArgs &args, const s
 //    }
 //}
 
+bool
+CornerPinPlugin::getInverseTransformCanonicalNoBlur(double time,
+                                                    OFX::Matrix3x3* invtransform) const
+{
+    if (_motionblur && _motionblur->getValueAtTime(time) != 0.) {
+        return false;
+    }
+    if (_directionalBlur && _directionalBlur->getValueAtTime(time)) {
+        return false;
+    }
+    bool invert = false;
+    if (_invert) {
+        _invert->getValueAtTime(time, invert);
+    }
+
+    return getInverseTransformCanonical(time, 1., invert, invtransform);
+}
+
+// Returns the inverse transform in pixel coordinates, or false if it has to be blurred.
+bool
+CornerPinPlugin::getInverseTransformPixel(const OFX::RenderArguments &args,
+                                          const OFX::Image *src,
+                                          OFX::Matrix3x3* invtransform)
+{
+    OFX::Matrix3x3 invtransformCanonical;
+    if (!getInverseTransformCanonicalNoBlur(args.time, &invtransformCanonical)) {
+        return false;
+    }
+    *invtransform = OFX::ofxsMipmapInverseTransformPixel(invtransformCanonical, args, src, _dstClip);
+
+    return true;
+}
+
+// the overridden render function
+void
+CornerPinPlugin::render(const OFX::RenderArguments &args)
+{
+    bool mipmap = false;
+    if (_mipmap) {
+        _mipmap->getValueAtTime(args.time, mipmap);
+    }
+    if (!mipmap) {
+        Transform3x3Plugin::render(args);
+
+        return;
+    }
+    std::auto_ptr<const OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
+                                        _srcClip->fetchImage(args.time) : 0);
+    if (src.get()) {
+        if ( (src->getRenderScale().x != args.renderScale.x) ||
+            ( src->getRenderScale().y != args.renderScale.y) ||
+            ( (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) ) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+    OFX::Matrix3x3 invtransform;
+    if (!getInverseTransformPixel(args, src.get(), &invtransform)) {
+        // motion blur
+        src.reset();
+        Transform3x3Plugin::render(args);
+
+        return;
+    }
+    OFX::ofxsMipmapRenderTransform(*this, _mipmapCache, args, src.get(), invtransform,
+                                   _srcClip, _dstClip, _maskClip, _filter, _clamp, _blackOutside, _mix, _maskApply, _maskInvert);
+}
+
+// override the roi call
+// The mipmap is built from the whole source RoD.
+void
+CornerPinPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                      OFX::RegionOfInterestSetter &rois)
+{
+    const double time = args.time;
+    bool mipmap = false;
+    if (_mipmap) {
+        _mipmap->getValueAtTime(time, mipmap);
+    }
+    OFX::Matrix3x3 invtransform;
+    if (!_srcClip || !mipmap || !getInverseTransformCanonicalNoBlur(time, &invtransform)) {
+        Transform3x3Plugin::getRegionsOfInterest(args, rois);
+
+        return;
+    }
+    rois.setRegionOfInterest(*_srcClip, _srcClip->getRegionOfDefinition(time));
+}
+
+void
+CornerPinPlugin::purgeCaches()
+{
+    _mipmapCache.clear();
+}
+
 class CornerPinTransformInteract : public OFX::OverlayInteract
 {
 public:
@@ -1184,6 +1301,8 @@ void CornerPinPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 
     CornerPinPluginDescribeInContext(desc, context, page);
 
+    ofxsMipmapDescribeParams(desc, page);
+
     Transform3x3DescribeInContextEnd(desc, context, page, false, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
 }
 
@@ -1217,6 +1336,8 @@ void CornerPinMaskedPluginFactory::describeInContext(OFX::ImageEffectDescriptor
 
     CornerPinPluginDescribeInContext(desc, context, page);
 
+    ofxsMipmapDescribeParams(desc, page);
+
     Transform3x3DescribeInContextEnd(desc, context, page, true, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
 }
 
@@ -36,6 +36,7 @@
 #include "Distortion.h"
 
 #include <cmath>
+#include <limits>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -48,6 +49,8 @@
 #endif
 
 #include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsRefCountedCache.h"
 #include "ofxsProcessing.H"
 #include "ofxsCoords.h"
 #include "ofxsMaskMix.h"
@@ -89,17 +92,17 @@
 #define kPluginLensDistortionIdentifier "net.sf.openfx.LensDistortion"
 
 /* LensDistortion TODO:
- - cache the STmap for a set of input parameter and input image size
  - output the STmap (which is not frame-varying even if the input changes, so isIdentity should use this on Natron if no parameter is animated)
- - compute the inverse map and undistort
  - implement other distortion models (PFBarrel, OpenCV)
 */
 
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: LensDistortion: cache the distortion map, compute its Jacobian
+// version 2.2: LensDistortion: add the Redistort direction
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -203,6 +206,19 @@ enum DistortionModelEnum {
     eDistortionModelNuke,
 };
 
+#define kParamDirection "direction"
+#define kParamDirectionLabel "Direction"
+#define kParamDirectionHint "Whether the distortion model is applied as is, or inverted."
+#define kParamDirectionOptionUndistort "Undistort"
+#define kParamDirectionOptionUndistortHint "The source image is sampled at the position given by the distortion model: this removes the lens distortion from the source image."
+#define kParamDirectionOptionRedistort "Redistort"
+#define kParamDirectionOptionRedistortHint "The inverse of Undistort: the lens distortion is applied to the source image. The inverse of the distortion model is solved numerically, and pixels where it has no solution are black."
+
+enum DirectionEnum {
+    eDirectionUndistort = 0,
+    eDirectionRedistort,
+};
+
 #define kParamK1 "k1"
 #define kParamK1Label "K1"
 #define kParamK1Hint "First radial distortion coefficient (coefficient for r^2)."
@@ -235,8 +251,470 @@ enum DistortionModelEnum {
 #define kParamAsymmetricLabel "Asymmetric"
 #define kParamAsymmetricHint "Asymmetric distortion (only for anamorphic lens)."
 
+#define kDistortionMapMaxPixels (64*1024*1024) // do not cache maps larger than this (24 bytes per pixel)
+#define kInverseGridStep 8 // spacing of the grid nodes where the inverse distortion is solved, in pixels
+#define kInverseMaxIterations 20
+#define kInverseTolerance 1e-3 // in pixels
+
 using namespace OFX;
 
+// Parameters of the LensDistortion model. srcRoD is the region of definition of the source
+// clip, in pixels at the current render scale: the distortion is normalized by its largest half-dimension.
+// It does not depend on the bounds of the source image given by the host, which may differ between tiles.
+struct LensDistortionParams
+{
+    DirectionEnum direction;
+    DistortionModelEnum model;
+    double par;
+    double k1, k2, k3;
+    double p1, p2;
+    double cx, cy;
+    double squeeze;
+    double ax, ay;
+    OfxRectI srcRoD;
+
+    LensDistortionParams()
+    : direction(eDirectionUndistort)
+    , model(eDistortionModelNuke)
+    , par(1.)
+    , k1(0.), k2(0.), k3(0.)
+    , p1(0.), p2(0.)
+    , cx(0.), cy(0.)
+    , squeeze(1.)
+    , ax(0.), ay(0.)
+    {
+        srcRoD.x1 = srcRoD.y1 = srcRoD.x2 = srcRoD.y2 = 0;
+    }
+
+    bool operator==(const LensDistortionParams &o) const
+    {
+        return (direction == o.direction && model == o.model && par == o.par &&
+                k1 == o.k1 && k2 == o.k2 && k3 == o.k3 &&
+                p1 == o.p1 && p2 == o.p2 &&
+                cx == o.cx && cy == o.cy &&
+                squeeze == o.squeeze &&
+                ax == o.ax && ay == o.ay &&
+                srcRoD.x1 == o.srcRoD.x1 && srcRoD.y1 == o.srcRoD.y1 &&
+                srcRoD.x2 == o.srcRoD.x2 && srcRoD.y2 == o.srcRoD.y2);
+    }
+};
+
+// Nuke's distortion function, reverse engineered from the resulting images on a checkerboard (and a little science, too)
+static inline void
+distort_nuke(double xu, double yu, // undistorted position in normalized coordinates ([-1..1] on the largest image dimension, (0,0 at image center))
+             double k1, double k2, // radial distortion
+             double cx, double cy, // distortion center, (0,0) at center of image
+             double squeeze, // anamorphic squeeze
+             double ax, double ay, // asymmetric distortion
+             double *xd, double *yd) // distorted position in normalized coordinates
+{
+    // nuke?
+    // k1 = radial distortion 1
+    // k2 = radial distortion 2
+    // squeeze = anamorphic squeeze
+    // p1 = asymmetric distortion x
+    // p2 = asymmetric distortion y
+    double x = (xu - cx);
+    double y = (yu - cy);
+    double x2 = x*x, y2 = y*y;
+    double r2 = x2 + y2;
+    double k2r2pk1 = k2*r2 + k1;
+    //double kry = 1 + ((k2r2pk1 + ay)*x2 + k2r2pk1*y2);
+    double kry = 1 + (k2r2pk1*r2 + ay*x2);
+    *yd = (y/kry) + cy;
+    //double krx = 1 + (k2r2pk1*x2 + (k2r2pk1 + ax)*y2)/squeeze;
+    double krx = 1 + (k2r2pk1*r2 + ax*y2)/squeeze;
+    *xd = (x/krx) + cx;
+}
+
+#if 0
+// see https://github.com/Itseez/opencv/blob/master/modules/imgproc/src/undistort.cpp
+static inline void
+distort_opencv(double xu, double yu, // undistorted position in normalized coordinates ([-1..1] on the largest image dimension, (0,0 at image center))
+        double k1, double k2, double k3,
+        double p1, double p2,
+        double cx, double cy,
+        double squeeze,
+        double *xd, double *yd) // distorted position in normalized coordinates
+{
+    // opencv
+    const double k4 = 0.;
+    const double k5 = 0.;
+    const double k6 = 0.;
+    const double s1 = 0.;
+    const double s2 = 0.;
+    const double s3 = 0.;
+    const double s4 = 0.;
+    double x = (xu - cx)*squeeze;
+    double y = yu - cy;
+    double x2 = x*x, y2 = y*y;
+    double r2 = x2 + y2;
+    double _2xy = 2*x*y;
+    double kr = (1 + ((k3*r2 + k2)*r2 + k1)*r2)/(1 + ((k6*r2 + k5)*r2 + k4)*r2);
+    *xd = ((x*kr + p1*_2xy + p2*(r2 + 2*x2) + s1*r2+s2*r2*r2))/squeeze + cx;
+    *yd = (y*kr + p1*(r2 + 2*y2) + p2*_2xy + s3*r2+s4*r2*r2) + cy;
+}
+#endif
+
+// source position (in pixel coordinates) of the output position (x,y)
+static inline void
+lensDistortionPosition(const LensDistortionParams &p,
+                       double x, double y,
+                       double *sx, double *sy)
+{
+    const OfxRectI &b = p.srcRoD;
+    double fx = (b.x2-b.x1)/2.;
+    double fy = (b.y2-b.y1)/2.;
+    double f = std::max(fx, fy); // TODO: distortion scaling param for LensDistortion?
+    switch (p.model) {
+        case eDistortionModelNuke: {
+            double xu = p.par * (x - (b.x2+b.x1)/2.)/f;
+            double yu = (y - (b.y2+b.y1)/2.)/f;
+            distort_nuke(xu, yu,
+                         p.k1, p.k2, p.cx, p.cy, p.squeeze, p.ax, p.ay,
+                         sx, sy);
+            *sx /= p.par;
+        }
+            break;
+    }
+    *sx *= f;
+    *sx += (b.x2+b.x1)/2.;
+    *sy *= f;
+    *sy += (b.y2+b.y1)/2.;
+}
+
+// An entry of the distortion map: the source position for the center of an output pixel,
+// and its Jacobian (sxx = dsx/dx, sxy = dsx/dy, etc.)
+struct DistortionMapEntry
+{
+    float sx, sy;
+    float sxx, sxy, syx, syy;
+};
+
+// compute the map entry at pixel (x,y): the Jacobian is computed from the neighbours at x+-1 and y+-1
+static inline void
+lensDistortionMapEntry(const LensDistortionParams &p, int x, int y, DistortionMapEntry *e)
+{
+    double sx, sy, sxn, syn, sxp, syp;
+    lensDistortionPosition(p, x + 0.5, y + 0.5, &sx, &sy);
+    e->sx = (float)sx;
+    e->sy = (float)sy;
+    lensDistortionPosition(p, x + 1.5, y + 0.5, &sxn, &syn);
+    lensDistortionPosition(p, x - 0.5, y + 0.5, &sxp, &syp);
+    e->sxx = (float)((sxn - sxp) / 2.);
+    e->syx = (float)((syn - syp) / 2.);
+    lensDistortionPosition(p, x + 0.5, y + 1.5, &sxn, &syn);
+    lensDistortionPosition(p, x + 0.5, y - 0.5, &sxp, &syp);
+    e->sxy = (float)((sxn - sxp) / 2.);
+    e->syy = (float)((syn - syp) / 2.);
+}
+
+// An entry of the inverse map where the solver did not converge: the pixel will be black
+// (transparent), whether or not blackOutside is checked
+static inline void
+lensDistortionInverseFailed(DistortionMapEntry *e)
+{
+    e->sx = e->sy = std::numeric_limits<float>::infinity();
+    e->sxx = e->syy = 1.f;
+    e->sxy = e->syx = 0.f;
+}
+
+// Solve lensDistortionPosition(p, sx, sy) = (x, y) using Newton iterations, starting from (sx0, sy0).
+// The Jacobian of the inverse map is the inverse of the Jacobian of the model at the solution.
+static bool
+lensDistortionInverse(const LensDistortionParams &p,
+                      double x, double y,
+                      double sx0, double sy0,
+                      DistortionMapEntry *e)
+{
+    const double h = 0.5; // step for the Jacobian of the model, in pixels
+    double u = sx0;
+    double v = sy0;
+    for (int i = 0; i < kInverseMaxIterations; ++i) {
+        double fx, fy, fxn, fyn, fxp, fyp;
+        lensDistortionPosition(p, u, v, &fx, &fy);
+        lensDistortionPosition(p, u + h, v, &fxn, &fyn);
+        lensDistortionPosition(p, u - h, v, &fxp, &fyp);
+        double a = (fxn - fxp) / (2 * h);
+        double c = (fyn - fyp) / (2 * h);
+        lensDistortionPosition(p, u, v + h, &fxn, &fyn);
+        lensDistortionPosition(p, u, v - h, &fxp, &fyp);
+        double b = (fxn - fxp) / (2 * h);
+        double d = (fyn - fyp) / (2 * h);
+        double det = a * d - b * c;
+        if (det == 0. || !(det == det) || std::fabs(det) == std::numeric_limits<double>::infinity()) {
+            return false;
+        }
+        double ex = fx - x;
+        double ey = fy - y;
+        if (std::fabs(ex) < kInverseTolerance && std::fabs(ey) < kInverseTolerance) {
+            e->sx = (float)u;
+            e->sy = (float)v;
+            e->sxx = (float)(d / det);
+            e->sxy = (float)(-b / det);
+            e->syx = (float)(-c / det);
+            e->syy = (float)(a / det);
+
+            return true;
+        }
+        u -= (d * ex - b * ey) / det;
+        v -= (a * ey - c * ex) / det;
+    }
+
+    return false;
+}
+
+// compute the inverse map entry at pixel (x,y), without a guess from the neighbours
+static inline void
+lensDistortionInverseEntry(const LensDistortionParams &p, int x, int y, DistortionMapEntry *e)
+{
+    if (!lensDistortionInverse(p, x + 0.5, y + 0.5, x + 0.5, y + 0.5, e)) {
+        lensDistortionInverseFailed(e);
+    }
+}
+
+// The LensDistortion map for a parameter set and render scale.
+// The lens parameters are usually constant over a shot, so the map is computed once and shared
+// by all the renders of the instance (see DistortionPlugin::acquireMap()).
+class DistortionMap
+: public OFX::RefCountedCacheEntry
+{
+public:
+    DistortionMap(const LensDistortionParams &params, const OfxPointD &renderScale, const OfxRectI &bounds, OFX::ImageEffect *effect)
+    : OFX::RefCountedCacheEntry()
+    , _params(params)
+    , _renderScale(renderScale)
+    , _bounds(bounds)
+    , _mem(new OFX::ImageMemory(sizeof(DistortionMapEntry) * (size_t)(bounds.x2 - bounds.x1) * (size_t)(bounds.y2 - bounds.y1), effect))
+    , _data((DistortionMapEntry*)_mem->lock())
+    {
+    }
+
+    ~DistortionMap()
+    {
+        _mem->unlock();
+    }
+
+    bool matches(const LensDistortionParams &params, const OfxPointD &renderScale, const OfxRectI &bounds) const
+    {
+        return (_params == params &&
+                _renderScale.x == renderScale.x && _renderScale.y == renderScale.y &&
+                _bounds.x1 == bounds.x1 && _bounds.y1 == bounds.y1 &&
+                _bounds.x2 == bounds.x2 && _bounds.y2 == bounds.y2);
+    }
+
+    const OfxRectI &getBounds() const { return _bounds; }
+
+    const LensDistortionParams &getParams() const { return _params; }
+
+    // pointer to the entry at (bounds.x1, y)
+    const DistortionMapEntry *getRow(int y) const
+    {
+        return (y < _bounds.y1 || y >= _bounds.y2) ? 0 : _data + (size_t)(y - _bounds.y1) * (_bounds.x2 - _bounds.x1);
+    }
+
+    DistortionMapEntry *getRow(int y)
+    {
+        return (y < _bounds.y1 || y >= _bounds.y2) ? 0 : _data + (size_t)(y - _bounds.y1) * (_bounds.x2 - _bounds.x1);
+    }
+
+private:
+    LensDistortionParams _params;
+    OfxPointD _renderScale;
+    OfxRectI _bounds;
+    std::auto_ptr<OFX::ImageMemory> _mem;
+    DistortionMapEntry *_data;
+};
+
+// Fill the map rows, splitting them between threads.
+// For Redistort, the inverse is first solved on a coarse grid (the guess for each node is
+// extrapolated from its left or bottom neighbour), and then bilinearly interpolated.
+class DistortionMapBuilder : public OFX::MultiThread::Processor
+{
+public:
+    DistortionMapBuilder(OFX::ImageEffect &effect, DistortionMap &map)
+    : _effect(effect)
+    , _map(map)
+    , _pass(ePassForward)
+    , _grid()
+    , _gridWidth(0)
+    , _gridHeight(0)
+    {
+    }
+
+    void build()
+    {
+        if (_map.getParams().direction == eDirectionUndistort) {
+            _pass = ePassForward;
+            multiThread();
+        } else {
+            const OfxRectI &bounds = _map.getBounds();
+            // nodes at bounds.x1 + i*kInverseGridStep, the last one at or after bounds.x2 - 1
+            _gridWidth = (bounds.x2 - bounds.x1 - 1) / kInverseGridStep + 2;
+            _gridHeight = (bounds.y2 - bounds.y1 - 1) / kInverseGridStep + 2;
+            _grid.resize((size_t)_gridWidth * _gridHeight);
+            _pass = ePassInverseGrid;
+            multiThread();
+            if (_effect.abort()) {
+                return;
+            }
+            _pass = ePassInverseRefine;
+            multiThread();
+        }
+    }
+
+private:
+    enum PassEnum {
+        ePassForward,
+        ePassInverseGrid,
+        ePassInverseRefine,
+    };
+
+    static void range(int n, unsigned int threadId, unsigned int nThreads, int *i1, int *i2)
+    {
+        *i1 = (int)(((long long)n * threadId) / nThreads);
+        *i2 = (int)(((long long)n * (threadId + 1)) / nThreads);
+    }
+
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const OfxRectI &bounds = _map.getBounds();
+        const LensDistortionParams &params = _map.getParams();
+        switch (_pass) {
+            case ePassForward: {
+                int y1, y2;
+                range(bounds.y2 - bounds.y1, threadId, nThreads, &y1, &y2);
+                for (int y = bounds.y1 + y1; y < bounds.y1 + y2; ++y) {
+                    if (_effect.abort()) {
+                        return;
+                    }
+                    DistortionMapEntry *e = _map.getRow(y);
+                    for (int x = bounds.x1; x < bounds.x2; ++x, ++e) {
+                        lensDistortionMapEntry(params, x, y, e);
+                    }
+                }
+            }
+                break;
+            case ePassInverseGrid: {
+                const double step = kInverseGridStep;
+                int j1, j2;
+                range(_gridHeight, threadId, nThreads, &j1, &j2);
+                for (int j = j1; j < j2; ++j) {
+                    if (_effect.abort()) {
+                        return;
+                    }
+                    double y = bounds.y1 + j * step + 0.5;
+                    DistortionMapEntry *row = &_grid[(size_t)j * _gridWidth];
+                    const DistortionMapEntry *below = (j > j1) ? row - _gridWidth : 0;
+                    for (int i = 0; i < _gridWidth; ++i) {
+                        double x = bounds.x1 + i * step + 0.5;
+                        // first-order guess from a solved neighbour
+                        double sx0 = x, sy0 = y;
+                        if (i > 0 && row[i-1].sx != std::numeric_limits<float>::infinity()) {
+                            sx0 = row[i-1].sx + row[i-1].sxx * step;
+                            sy0 = row[i-1].sy + row[i-1].syx * step;
+                        } else if (below && below[i].sx != std::numeric_limits<float>::infinity()) {
+                            sx0 = below[i].sx + below[i].sxy * step;
+                            sy0 = below[i].sy + below[i].syy * step;
+                        }
+                        if (!lensDistortionInverse(params, x, y, sx0, sy0, &row[i]) &&
+                            !lensDistortionInverse(params, x, y, x, y, &row[i])) {
+                            lensDistortionInverseFailed(&row[i]);
+                        }
+                    }
+                }
+            }
+                break;
+            case ePassInverseRefine: {
+                int y1, y2;
+                range(bounds.y2 - bounds.y1, threadId, nThreads, &y1, &y2);
+                for (int y = bounds.y1 + y1; y < bounds.y1 + y2; ++y) {
+                    if (_effect.abort()) {
+                        return;
+                    }
+                    int j = (y - bounds.y1) / kInverseGridStep;
+                    float ty = ((y - bounds.y1) % kInverseGridStep) / (float)kInverseGridStep;
+                    const DistortionMapEntry *g0 = &_grid[(size_t)j * _gridWidth];
+                    const DistortionMapEntry *g1 = g0 + _gridWidth;
+                    DistortionMapEntry *e = _map.getRow(y);
+                    for (int x = bounds.x1; x < bounds.x2; ++x, ++e) {
+                        int i = (x - bounds.x1) / kInverseGridStep;
+                        float tx = ((x - bounds.x1) % kInverseGridStep) / (float)kInverseGridStep;
+                        const DistortionMapEntry &e00 = g0[i];
+                        const DistortionMapEntry &e10 = g0[i+1];
+                        const DistortionMapEntry &e01 = g1[i];
+                        const DistortionMapEntry &e11 = g1[i+1];
+                        if (e00.sx == std::numeric_limits<float>::infinity() ||
+                            e10.sx == std::numeric_limits<float>::infinity() ||
+                            e01.sx == std::numeric_limits<float>::infinity() ||
+                            e11.sx == std::numeric_limits<float>::infinity()) {
+                            lensDistortionInverseFailed(e);
+                            continue;
+                        }
+                        float w00 = (1 - tx) * (1 - ty);
+                        float w10 = tx * (1 - ty);
+                        float w01 = (1 - tx) * ty;
+                        float w11 = tx * ty;
+                        e->sx = w00 * e00.sx + w10 * e10.sx + w01 * e01.sx + w11 * e11.sx;
+                        e->sy = w00 * e00.sy + w10 * e10.sy + w01 * e01.sy + w11 * e11.sy;
+                        e->sxx = w00 * e00.sxx + w10 * e10.sxx + w01 * e01.sxx + w11 * e11.sxx;
+                        e->sxy = w00 * e00.sxy + w10 * e10.sxy + w01 * e01.sxy + w11 * e11.sxy;
+                        e->syx = w00 * e00.syx + w10 * e10.syx + w01 * e01.syx + w11 * e11.syx;
+                        e->syy = w00 * e00.syy + w10 * e10.syy + w01 * e01.syy + w11 * e11.syy;
+                    }
+                }
+            }
+                break;
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    DistortionMap &_map;
+    PassEnum _pass;
+    std::vector<DistortionMapEntry> _grid; // inverse solved at the grid nodes
+    int _gridWidth;
+    int _gridHeight;
+};
+
+// Computes a DistortionMap for DistortionPlugin::acquireMap(), see OFX::RefCountedCache::acquire().
+// The map is computed while holding the cache lock: concurrent renders of the same frame
+// (or of the next frames) would need the same map anyway.
+class DistortionMapCacheBuilder
+{
+public:
+    DistortionMapCacheBuilder(OFX::ImageEffect &effect, const LensDistortionParams &params, const OfxPointD &renderScale, const OfxRectI &bounds)
+    : _effect(effect)
+    , _params(params)
+    , _renderScale(renderScale)
+    , _bounds(bounds)
+    {
+    }
+
+    bool matches(const DistortionMap &map) const
+    {
+        return map.matches(_params, _renderScale, _bounds);
+    }
+
+    DistortionMap *build()
+    {
+        std::auto_ptr<DistortionMap> map(new DistortionMap(_params, _renderScale, _bounds, &_effect));
+        DistortionMapBuilder builder(_effect, *map);
+        builder.build();
+        if (_effect.abort()) {
+            // the map may be incomplete
+            return 0;
+        }
+
+        return map.release();
+    }
+
+private:
+    OFX::ImageEffect &_effect;
+    const LensDistortionParams &_params;
+    OfxPointD _renderScale;
+    OfxRectI _bounds;
+};
+
 class DistortionProcessorBase : public OFX::ImageProcessor
 {
 protected:
@@ -257,18 +735,8 @@ protected:
     double _vScale;
     WrapEnum _uWrap;
     WrapEnum _vWrap;
-    DistortionModelEnum _distortionModel;
-    double _par;
-    double _k1;
-    double _k2;
-    double _k3;
-    double _p1;
-    double _p2;
-    double _cx;
-    double _cy;
-    double _squeeze;
-    double _ax;
-    double _ay;
+    LensDistortionParams _lensParams;
+    const DistortionMap *_map;
     bool _blackOutside;
     bool _doMasking;
     double _mix;
@@ -295,18 +763,8 @@ public:
     , _vScale(1.)
     , _uWrap(eWrapClamp)
     , _vWrap(eWrapClamp)
-    , _distortionModel(eDistortionModelNuke)
-    , _par(1.)
-    , _k1(0.)
-    , _k2(0.)
-    , _k3(0.)
-    , _p1(0.)
-    , _p2(0.)
-    , _cx(0.)
-    , _cy(0.)
-    , _squeeze(1.)
-    , _ax(0.)
-    , _ay(0.)
+    , _lensParams()
+    , _map(0)
     , _blackOutside(false)
     , _doMasking(false)
     , _mix(1.)
@@ -320,6 +778,9 @@ public:
 
     void doMasking(bool v) {_doMasking = v;}
 
+    // LensDistortion: the map may be NULL, or may not cover the render window
+    void setLensDistortion(const LensDistortionParams &params, const DistortionMap *map) {_lensParams = params; _map = map;}
+
     void setValues(bool processR,
                    bool processG,
                    bool processB,
@@ -334,13 +795,6 @@ public:
                    double vScale,
                    WrapEnum uWrap,
                    WrapEnum vWrap,
-                   DistortionModelEnum distortionModel,
-                   double par,
-                   double k1, double k2, double k3,
-                   double p1, double p2,
-                   double cx, double cy,
-                   double squeeze,
-                   double ax, double ay,
                    bool blackOutside,
                    double mix)
     {
@@ -358,18 +812,6 @@ public:
         _vScale = vScale;
         _uWrap = uWrap;
         _vWrap = vWrap;
-        _distortionModel = distortionModel;
-        _par = par;
-        _k1 = k1;
-        _k2 = k2;
-        _k3 = k3;
-        _p1 = p1;
-        _p2 = p2;
-        _cx = cx,
-        _cy = cy;
-        _squeeze = squeeze;
-        _ax = ax;
-        _ay = ay;
         _blackOutside = blackOutside;
         _mix = mix;
     }
@@ -378,63 +820,6 @@ private:
 };
 
 
-// Nuke's distortion function, reverse engineered from the resulting images on a checkerboard (and a little science, too)
-static inline void
-distort_nuke(double xu, double yu, // undistorted position in normalized coordinates ([-1..1] on the largest image dimension, (0,0 at image center))
-             double k1, double k2, // radial distortion
-             double cx, double cy, // distortion center, (0,0) at center of image
-             double squeeze, // anamorphic squeeze
-             double ax, double ay, // asymmetric distortion
-             double *xd, double *yd) // distorted position in normalized coordinates
-{
-    // nuke?
-    // k1 = radial distortion 1
-    // k2 = radial distortion 2
-    // squeeze = anamorphic squeeze
-    // p1 = asymmetric distortion x
-    // p2 = asymmetric distortion y
-    double x = (xu - cx);
-    double y = (yu - cy);
-    double x2 = x*x, y2 = y*y;
-    double r2 = x2 + y2;
-    double k2r2pk1 = k2*r2 + k1;
-    //double kry = 1 + ((k2r2pk1 + ay)*x2 + k2r2pk1*y2);
-    double kry = 1 + (k2r2pk1*r2 + ay*x2);
-    *yd = (y/kry) + cy;
-    //double krx = 1 + (k2r2pk1*x2 + (k2r2pk1 + ax)*y2)/squeeze;
-    double krx = 1 + (k2r2pk1*r2 + ax*y2)/squeeze;
-    *xd = (x/krx) + cx;
-}
-
-#if 0
-// see https://github.com/Itseez/opencv/blob/master/modules/imgproc/src/undistort.cpp
-static inline void
-distort_opencv(double xu, double yu, // undistorted position in normalized coordinates ([-1..1] on the largest image dimension, (0,0 at image center))
-        double k1, double k2, double k3,
-        double p1, double p2,
-        double cx, double cy,
-        double squeeze,
-        double *xd, double *yd) // distorted position in normalized coordinates
-{
-    // opencv
-    const double k4 = 0.;
-    const double k5 = 0.;
-    const double k6 = 0.;
-    const double s1 = 0.;
-    const double s2 = 0.;
-    const double s3 = 0.;
-    const double s4 = 0.;
-    double x = (xu - cx)*squeeze;
-    double y = yu - cy;
-    double x2 = x*x, y2 = y*y;
-    double r2 = x2 + y2;
-    double _2xy = 2*x*y;
-    double kr = (1 + ((k3*r2 + k2)*r2 + k1)*r2)/(1 + ((k6*r2 + k5)*r2 + k4)*r2);
-    *xd = ((x*kr + p1*_2xy + p2*(r2 + 2*x2) + s1*r2+s2*r2*r2))/squeeze + cx;
-    *yd = (y*kr + p1*(r2 + 2*y2) + p2*_2xy + s3*r2+s4*r2*r2) + cy;
-}
-#endif
-
 // The "filter" and "clamp" template parameters allow filter-specific optimization
 // by the compiler, using the same generic code for all filters.
 template <class PIX, int nComponents, int maxValue, DistortionPluginEnum plugin, FilterEnum filter, bool clamp>
@@ -523,18 +908,16 @@ private:
         compFromChannel(_uChannel, &uImg, &uComp);
         compFromChannel(_vChannel, &vImg, &vComp);
         int srcx1 = 0, srcx2 = 1, srcy1 = 0, srcy2 = 0;
-        double f = 0, par = 1.;
-        if ((plugin == eDistortionPluginSTMap || plugin == eDistortionPluginLensDistortion) && _srcImg) {
+        if (plugin == eDistortionPluginSTMap && _srcImg) {
             const OfxRectI& srcBounds = _srcImg->getBounds();
             srcx1 = srcBounds.x1;
             srcx2 = srcBounds.x2;
             srcy1 = srcBounds.y1;
             srcy2 = srcBounds.y2;
-            if (plugin == eDistortionPluginLensDistortion) {
-                double fx = (srcBounds.x2-srcBounds.x1)/2.;
-                double fy = (srcBounds.y2-srcBounds.y1)/2.;
-                f = std::max(fx, fy); // TODO: distortion scaling param for LensDistortion?
-            }
+        }
+        OfxRectI mapBounds = {0, 0, 0, 0};
+        if (plugin == eDistortionPluginLensDistortion && _map) {
+            mapBounds = _map->getBounds();
         }
         float tmpPix[4];
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
@@ -543,9 +926,11 @@ private:
             }
 
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            const DistortionMapEntry *mapRow = (plugin == eDistortionPluginLensDistortion && _map) ? _map->getRow(y) : 0;
 
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
                 double sx, sy, sxx, sxy, syx, syy; // the source pixel coordinates and their derivatives
+                bool inverseFailed = false; // LensDistortion Redistort: the inverse did not converge at this pixel
 
                 switch (plugin) {
                     case eDistortionPluginSTMap:
@@ -619,25 +1004,26 @@ private:
                     }
                         break;
                     case eDistortionPluginLensDistortion: {
-                        switch (_distortionModel) {
-                            case eDistortionModelNuke: {
-                                double xu = _par * (x + 0.5 - (srcx2+srcx1)/2.)/f;
-                                double yu = (y + 0.5 - (srcy2+srcy1)/2.)/f;
-                                distort_nuke(xu, yu,
-                                             _k1, _k2, _cx/par, _cy, _squeeze, _ax, _ay,
-                                             &sx, &sy);
-                                sx /= _par;
+                        DistortionMapEntry tmpEntry;
+                        const DistortionMapEntry *e;
+                        if (mapRow && mapBounds.x1 <= x && x < mapBounds.x2) {
+                            e = &mapRow[x - mapBounds.x1];
+                        } else {
+                            // not covered by the cached map
+                            if (_lensParams.direction == eDirectionRedistort) {
+                                lensDistortionInverseEntry(_lensParams, x, y, &tmpEntry);
+                            } else {
+                                lensDistortionMapEntry(_lensParams, x, y, &tmpEntry);
                             }
-                                break;
+                            e = &tmpEntry;
                         }
-                        sx *= f;
-                        sx += (srcx2+srcx1)/2.;
-                        sy *= f;
-                        sy += (srcy2+srcy1)/2.;
-                        sxx = 1; // TODO: Jacobian
-                        sxy = 0;
-                        syx = 0;
-                        syy = 1;
+                        inverseFailed = (e->sx == std::numeric_limits<float>::infinity());
+                        sx = e->sx;
+                        sy = e->sy;
+                        sxx = e->sxx;
+                        sxy = e->sxy;
+                        syx = e->syx;
+                        syy = e->syy;
                     }
                         break;
                 }
@@ -668,7 +1054,11 @@ private:
                     }
                 }
 
-                if (filter == eFilterImpulse) {
+                if (plugin == eDistortionPluginLensDistortion && inverseFailed) {
+                    // the inverse distortion did not converge: the pixel is black, whatever blackOutside is
+                    // (a clamped lookup would smear the edge pixels)
+                    std::fill(tmpPix, tmpPix + 4, 0.f);
+                } else if (filter == eFilterImpulse) {
                     ofxsFilterInterpolate2D<PIX,nComponents,filter,clamp>(sx, sy, _srcImg, _blackOutside, tmpPix);
                 } else {
                     ofxsFilterInterpolate2DSuper<PIX,nComponents,filter,clamp>(sx, sy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
@@ -729,6 +1119,7 @@ public:
     , _uWrap(0)
     , _vWrap(0)
     , _distortionModel(0)
+    , _direction(0)
     , _k1(0)
     , _k2(0)
     , _k3(0)
@@ -779,6 +1170,7 @@ public:
         }
         if (_plugin == eDistortionPluginLensDistortion) {
             _distortionModel = fetchChoiceParam(kParamDistortionModel);
+            _direction = fetchChoiceParam(kParamDirection);
             _k1 = fetchDoubleParam(kParamK1);
             _k2 = fetchDoubleParam(kParamK2);
             _k3 = fetchDoubleParam(kParamK3);
@@ -787,7 +1179,7 @@ public:
             _center = fetchDouble2DParam(kParamCenter);
             _squeeze = fetchDoubleParam(kParamSqueeze);
             _asymmetric = fetchDouble2DParam(kParamAsymmetric);
-            assert(_k1 && _k2 && _k3 && _p1 && _p2 && _center && _squeeze && _asymmetric);
+            assert(_distortionModel && _direction && _k1 && _k2 && _k3 && _p1 && _p2 && _center && _squeeze && _asymmetric);
         }
         _filter = fetchChoiceParam(kParamFilterType);
         _clamp = fetchBooleanParam(kParamFilterClamp);
@@ -801,12 +1193,19 @@ public:
         updateVisibility();
     }
 
+    virtual ~DistortionPlugin()
+    {
+        purgeCaches();
+    }
+
 private:
     // override the roi call
     virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
 
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
 
+    virtual void purgeCaches() OVERRIDE FINAL;
+
     /* Override the render */
     virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
 
@@ -871,6 +1270,7 @@ private:
     OFX::ChoiceParam* _uWrap;
     OFX::ChoiceParam* _vWrap;
     OFX::ChoiceParam* _distortionModel;
+    OFX::ChoiceParam* _direction;
     OFX::DoubleParam* _k1;
     OFX::DoubleParam* _k2;
     OFX::DoubleParam* _k3;
@@ -886,8 +1286,61 @@ private:
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
     DistortionPluginEnum _plugin;
+
+    // LensDistortion: the last map computed for each direction, shared by all renders
+    const DistortionMap *acquireMap(const LensDistortionParams &params, const OfxPointD &renderScale, const OfxRectI &bounds);
+    void releaseMap(const DistortionMap *map);
+
+    struct DistortionMapHolder_RAII
+    {
+        DistortionPlugin *plugin;
+        const DistortionMap *map;
+
+        DistortionMapHolder_RAII(DistortionPlugin *p)
+        : plugin(p)
+        , map(0)
+        {
+        }
+
+        ~DistortionMapHolder_RAII()
+        {
+            plugin->releaseMap(map);
+        }
+    };
+
+    OFX::RefCountedCache<DistortionMap> _mapCache[2]; // indexed by DirectionEnum
 };
 
+const DistortionMap *
+DistortionPlugin::acquireMap(const LensDistortionParams &params,
+                             const OfxPointD &renderScale,
+                             const OfxRectI &bounds)
+{
+    if (bounds.x2 <= bounds.x1 || bounds.y2 <= bounds.y1 ||
+        (double)(bounds.x2 - bounds.x1) * (double)(bounds.y2 - bounds.y1) > kDistortionMapMaxPixels) {
+        // the processor computes the distortion at each pixel
+        return 0;
+    }
+    DistortionMapCacheBuilder builder(*this, params, renderScale, bounds);
+
+    return _mapCache[params.direction].acquire(builder);
+}
+
+void
+DistortionPlugin::releaseMap(const DistortionMap *map)
+{
+    if (map) {
+        _mapCache[map->getParams().direction].release(map);
+    }
+}
+
+void
+DistortionPlugin::purgeCaches()
+{
+    _mapCache[eDirectionUndistort].clear();
+    _mapCache[eDirectionRedistort].clear();
+}
+
 
 void
 DistortionPlugin::getClipPreferences(OFX::ClipPreferencesSetter &clipPreferences)
@@ -1045,28 +1498,39 @@ DistortionPlugin::setupAndProcess(DistortionProcessorBase &processor, const OFX:
         uScale *= args.renderScale.x;
         vScale *= args.renderScale.y;
     }
-    DistortionModelEnum distortionModel = eDistortionModelNuke;
-    double par = 1., k1 = 0., k2 = 0., k3 = 0., p1 = 0., p2 = 0., cx = 0., cy = 0., squeeze = 1., ax = 0., ay = 0.;
+    DistortionMapHolder_RAII mapHolder(this);
     if (_plugin == eDistortionPluginLensDistortion) {
+        LensDistortionParams params;
         int distortionModel_i;
         _distortionModel->getValueAtTime(time, distortionModel_i);
-        distortionModel = (DistortionModelEnum)distortionModel_i;
-        switch (distortionModel) {
+        params.model = (DistortionModelEnum)distortionModel_i;
+        int direction_i;
+        _direction->getValueAtTime(time, direction_i);
+        params.direction = (DirectionEnum)direction_i;
+        switch (params.model) {
             case eDistortionModelNuke:
                 if (_srcClip) {
-                    par = _srcClip->getPixelAspectRatio();
+                    params.par = _srcClip->getPixelAspectRatio();
                 }
-                _k1->getValueAtTime(time, k1);
-                _k2->getValueAtTime(time, k2);
-                //_k3->getValueAtTime(time, k3);
-                //_p1->getValueAtTime(time, p1);
-                //_p2->getValueAtTime(time, p2);
-                _center->getValueAtTime(time, cx, cy);
-                _squeeze->getValueAtTime(time, squeeze);
-                _asymmetric->getValueAtTime(time, ax, ay);
+                _k1->getValueAtTime(time, params.k1);
+                _k2->getValueAtTime(time, params.k2);
+                //_k3->getValueAtTime(time, params.k3);
+                //_p1->getValueAtTime(time, params.p1);
+                //_p2->getValueAtTime(time, params.p2);
+                _center->getValueAtTime(time, params.cx, params.cy);
+                _squeeze->getValueAtTime(time, params.squeeze);
+                _asymmetric->getValueAtTime(time, params.ax, params.ay);
                 break;
         }
-
+        if (src.get()) {
+            // the map only depends on the parameters, the render scale and the RoDs, so that it is shared
+            // by all tiles and frames (source lookups are clamped to the bounds of each source image by the filter)
+            OFX::Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), args.renderScale, _srcClip->getPixelAspectRatio(), &params.srcRoD);
+            OfxRectI mapBounds;
+            OFX::Coords::toPixelEnclosing(_dstClip->getRegionOfDefinition(time), args.renderScale, _dstClip->getPixelAspectRatio(), &mapBounds);
+            mapHolder.map = acquireMap(params, args.renderScale, mapBounds);
+        }
+        processor.setLensDistortion(params, mapHolder.map);
     }
     processor.setValues(processR, processG, processB, processA,
                         transformIsIdentity, srcTransformInverse,
@@ -1074,7 +1538,6 @@ DistortionPlugin::setupAndProcess(DistortionProcessorBase &processor, const OFX:
                         uOffset, vOffset,
                         uScale, vScale,
                         uWrap, vWrap,
-                        distortionModel, par, k1, k2, k3, p1, p2, cx, cy, squeeze, ax, ay,
                         blackOutside, mix);
 
     // Call the base class process member, this will call the derived templated process code
@@ -1615,6 +2078,19 @@ void DistortionPluginFactory<plugin>::describeInContext(OFX::ImageEffectDescript
             }
 
         }
+        {
+            ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamDirection);
+            param->setLabel(kParamDirectionLabel);
+            param->setHint(kParamDirectionHint);
+            assert(param->getNOptions() == eDirectionUndistort);
+            param->appendOption(kParamDirectionOptionUndistort, kParamDirectionOptionUndistortHint);
+            assert(param->getNOptions() == eDirectionRedistort);
+            param->appendOption(kParamDirectionOptionRedistort, kParamDirectionOptionRedistortHint);
+            param->setDefault((int)eDirectionUndistort);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
         {
             DoubleParamDescriptor *param = desc.defineDoubleParam(kParamK1);
             param->setLabel(kParamK1Label);
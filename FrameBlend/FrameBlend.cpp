@@ -29,6 +29,8 @@
 #include <climits> // for kOfxFlagInfiniteMax
 #include <cassert>
 #include <algorithm>
+#include <iterator>
+#include <limits>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
@@ -37,6 +39,7 @@
 #include "ofxsMaskMix.h"
 #include "ofxsCoords.h"
 #include "ofxsMacros.h"
+#include "ofxsFrameCache.h"
 
 #define kPluginName "FrameBlendOFX"
 #define kPluginGrouping "Time"
@@ -49,8 +52,10 @@
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: frame cache for sequence renders
+// version 2.2: incremental mode for sequence renders
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -98,14 +103,64 @@ enum OperationEnum {
     eOperationProduct,
 };
 
+// the kind of pass done by the processor on the accumulators
+enum PassEnum {
+    ePassAdd,     // add the source frames
+    ePassRemove,  // remove the source frames (incremental mode)
+    ePassRepair,  // recompute min/max where a removed frame held the extremum (incremental mode)
+};
+
+// frame number stored in the argmin/argmax image when the extremum is unknown
+#define kArgNone INT_MIN
+
+// true if the accumulator contains Inf or NaN: x - x is 0 for any finite x
+static bool
+hasNonFinite(const float *data,
+             size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if ( !(data[i] - data[i] == 0.f) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static float
+initValue(OperationEnum operation)
+{
+    switch (operation) {
+        case eOperationAverage:
+        case eOperationSum:
+            return 0.;
+        case eOperationMin:
+            return std::numeric_limits<float>::infinity();
+        case eOperationMax:
+            return -std::numeric_limits<float>::infinity();
+        case eOperationProduct:
+            return 1.;
+    }
+    return 0.;
+}
+
 
 #define kParamOutputCountName  "outputCount"
 #define kParamOutputCountLabel "Output Count to Alpha"
 #define kParamOutputCountHint  "Output image count at each pixel to alpha (input must have an alpha channel)."
 
+#define kParamFrameCacheSizeName  "frameCacheSize"
+#define kParamFrameCacheSizeLabel "Frame Cache (MB)"
+#define kParamFrameCacheSizeHint  "Maximum amount of memory (in megabytes) used to keep the input frames between two output frames when rendering a sequence (e.g. when rendering to disk), so that each output frame only fetches the input frames that were not used by the previous one. 0 disables the cache. The cache is never used in interactive renders."
+
+#define kParamIncrementalName  "incremental"
+#define kParamIncrementalLabel "Incremental"
+#define kParamIncrementalHint  "When rendering a sequence (e.g. when rendering to disk), update the result of the previous output frame instead of recomputing it from scratch: the frames that left the range are removed from it, and the frames that entered the range are added. The frames that left the range are taken from the frame cache, so the frame cache must be large enough to hold the whole frame range, or the result is recomputed from scratch. This is only used by the Average, Min, Max and Sum operations."
+
 #define kClipFgMName "FgM"
 
 #define kFrameChunk 4 // how many frames to process simultaneously
+#define kIncrementalResync 64 // recompute from scratch after this many incremental updates, to avoid drifting because of rounding errors
 
 using namespace OFX;
 
@@ -113,10 +168,14 @@ class FrameBlendProcessorBase : public OFX::PixelProcessor
 {
 protected:
     const OFX::Image *_srcImg;
-    std::vector<const OFX::Image*> _srcImgs;
-    std::vector<const OFX::Image*> _fgMImgs;
+    std::vector<OFX::FrameView> _srcImgs;
+    std::vector<OFX::FrameView> _fgMImgs;
+    std::vector<int> _srcTimes;
     float *_accumulatorData;
     unsigned short *_countData;
+    int *_argData;
+    unsigned char *_repairData;
+    PassEnum _pass;
     const OFX::Image *_maskImg;
     bool _processR;
     bool _processG;
@@ -135,8 +194,12 @@ public:
     , _srcImg(0)
     , _srcImgs(0)
     , _fgMImgs(0)
+    , _srcTimes()
     , _accumulatorData(0)
     , _countData(0)
+    , _argData(0)
+    , _repairData(0)
+    , _pass(ePassAdd)
     , _maskImg(0)
     , _processR(true)
     , _processG(true)
@@ -150,11 +213,21 @@ public:
     {
     }
 
-    void setSrcImgs(const OFX::Image *src, const std::vector<const OFX::Image*> &v) {_srcImg = src; _srcImgs = v;}
-    void setFgMImgs(const std::vector<const OFX::Image*> &v) {_fgMImgs = v;}
+    void setSrcImgs(const OFX::Image *src, const std::vector<OFX::FrameView> &v) {_srcImg = src; _srcImgs = v;}
+    void setFgMImgs(const std::vector<OFX::FrameView> &v) {_fgMImgs = v;}
     void setAccumulators(float *accumulatorData, unsigned short *countData)
     {_accumulatorData = accumulatorData; _countData = countData;}
 
+    // incremental mode: frame number of each source image, argmin/argmax image (one int per component),
+    // and pixels that need a repair pass
+    void setIncremental(PassEnum pass, const std::vector<int> &srcTimes, int *argData, unsigned char *repairData)
+    {
+        _pass = pass;
+        _srcTimes = srcTimes;
+        _argData = argData;
+        _repairData = repairData;
+    }
+
     void setMaskImg(const OFX::Image *v, bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
 
     void doMasking(bool v) {_doMasking = v;}
@@ -272,27 +345,11 @@ private:
         assert(1 <= nComponents && nComponents <= 4);
         assert(!_lastPass || _dstPixelData);
         assert(_srcImgs.size() == _fgMImgs.size());
+        assert(_pass == ePassAdd || (!_lastPass && _accumulatorData));
+        assert(_pass != ePassRepair || (_argData && _repairData));
+        assert(!_argData || _srcTimes.size() == _srcImgs.size());
         float tmpPix[nComponents];
-        float initVal = 0.;
-        if (!_accumulatorData) {
-            switch (operation) {
-                case eOperationAverage:
-                    initVal = 0.;
-                    break;
-                case eOperationMin:
-                    initVal = std::numeric_limits<float>::infinity();
-                    break;
-                case eOperationMax:
-                    initVal = -std::numeric_limits<float>::infinity();
-                    break;
-                case eOperationSum:
-                    initVal = 0.;
-                    break;
-                case eOperationProduct:
-                    initVal = 1.;
-                    break;
-            }
-        }
+        const float initVal = initValue(operation);
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if (_effect.abort()) {
@@ -307,31 +364,66 @@ private:
             }
 
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
-                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
                 size_t renderPix = ((_renderWindow.x2 - _renderWindow.x1) * (y - _renderWindow.y1) +
                                     (x - _renderWindow.x1));
+                if (_pass == ePassRepair && !_repairData[renderPix]) {
+                    continue;
+                }
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
                 int count = _countData ? _countData[renderPix] : 0;
                 if (_accumulatorData) {
                     std::copy(&_accumulatorData[renderPix * nComponents], &_accumulatorData[renderPix * nComponents + nComponents], tmpPix);
                 } else {
                     std::fill(tmpPix, tmpPix + nComponents, initVal);
                 }
+                int *argPix = _argData ? &_argData[renderPix * nComponents] : 0;
                 // accumulate
                 for (unsigned i = 0; i < _srcImgs.size(); ++i) {
-                    const PIX *fgMPix = (const PIX *)  (_fgMImgs[i] ? _fgMImgs[i]->getPixelAddress(x, y) : 0);
+                    const PIX *fgMPix = (const PIX *) _fgMImgs[i].getPixelAddress(x, y);
                     if (!fgMPix || *fgMPix <= 0) {
-                        const PIX *srcPixi = (const PIX *)  (_srcImgs[i] ? _srcImgs[i]->getPixelAddress(x, y) : 0);
-                        if (srcPixi) {
+                        const PIX *srcPixi = (const PIX *) _srcImgs[i].getPixelAddress(x, y);
+                        if (srcPixi && _pass == ePassRemove) {
+                            for (int c = 0; c < nComponents; ++c) {
+                                switch (operation) {
+                                    case eOperationAverage:
+                                    case eOperationSum:
+                                        tmpPix[c] -= srcPixi[c];
+                                        break;
+                                    case eOperationMin:
+                                    case eOperationMax:
+                                        // the extremum left the range, it has to be recomputed
+                                        if (argPix[c] == _srcTimes[i]) {
+                                            tmpPix[c] = initVal;
+                                            argPix[c] = kArgNone;
+                                            _repairData[renderPix] = 1;
+                                        }
+                                        break;
+                                    case eOperationProduct:
+                                        assert(false);
+                                        break;
+                                }
+                            }
+                        } else if (srcPixi) {
                             for (int c = 0; c < nComponents; ++c) {
                                 switch (operation) {
                                     case eOperationAverage:
                                         tmpPix[c] += srcPixi[c];
                                         break;
                                     case eOperationMin:
-                                        tmpPix[c] = std::min(tmpPix[c], (float)srcPixi[c]);
+                                        if (srcPixi[c] < tmpPix[c]) {
+                                            tmpPix[c] = srcPixi[c];
+                                            if (argPix) {
+                                                argPix[c] = _srcTimes[i];
+                                            }
+                                        }
                                         break;
                                     case eOperationMax:
-                                        tmpPix[c] = std::max(tmpPix[c], (float)srcPixi[c]);
+                                        if (srcPixi[c] > tmpPix[c]) {
+                                            tmpPix[c] = srcPixi[c];
+                                            if (argPix) {
+                                                argPix[c] = _srcTimes[i];
+                                            }
+                                        }
                                         break;
                                     case eOperationSum:
                                         tmpPix[c] += srcPixi[c];
@@ -342,7 +434,11 @@ private:
                                 }
                             }
                         }
-                        ++count;
+                        if (_pass == ePassAdd) {
+                            ++count;
+                        } else if (_pass == ePassRemove) {
+                            --count;
+                        }
                     }
                 }
                 if (!_lastPass) {
@@ -433,6 +529,10 @@ public:
     , _mix(0)
     , _maskApply(0)
     , _maskInvert(0)
+    , _frameCacheSize(0)
+    , _incremental(0)
+    , _frameCache(this)
+    , _incrementalState()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         assert(_dstClip && (_dstClip->getPixelComponents() == ePixelComponentAlpha ||
@@ -465,6 +565,9 @@ public:
         _maskApply = paramExists(kParamMaskApply) ? fetchBooleanParam(kParamMaskApply) : 0;
         _maskInvert = fetchBooleanParam(kParamMaskInvert);
         assert(_mix && _maskInvert);
+        _frameCacheSize = fetchIntParam(kParamFrameCacheSizeName);
+        _incremental = fetchBooleanParam(kParamIncrementalName);
+        assert(_frameCacheSize && _incremental);
     }
 
 private:
@@ -484,8 +587,26 @@ private:
     /** @brief called when a param has just had its value changed */
     virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void purgeCaches(void) OVERRIDE FINAL;
+
 private:
 
+    /* fetch an input frame, through the frame cache if it is enabled */
+    OFX::FrameView fetchFrame(OFX::Clip *clip, int clipIndex, double t, const OFX::RenderArguments &args, bool checkFormat, OFX::FrameCacheHolder_RAII &holder);
+
+    /* update the accumulators of the previous output frame and render from them. Returns false if this could not be done. */
+    bool processIncremental(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args,
+                            OFX::Image *dst, const OFX::Image *src, const std::vector<int> &frames,
+                            bool processR, bool processG, bool processB, bool processA, bool outputCount, double mix);
+
+    /* run the processor on the given frames, by chunks. Returns false if the render was aborted. */
+    bool accumulateFrames(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args,
+                          const std::vector<int> &frames, PassEnum pass, int *argData, unsigned char *repairData);
+
     template<int nComponents>
     void renderForComponents(const OFX::RenderArguments &args);
 
@@ -513,6 +634,73 @@ private:
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
+    IntParam* _frameCacheSize;
+    BooleanParam* _incremental;
+    OFX::FrameCache _frameCache;
+
+    // accumulators of the last output frame, used by the incremental mode.
+    // They are only kept during non-interactive sequence renders.
+    struct IncrementalState
+    {
+        OFX::MultiThread::Mutex mutex;
+        bool enabled;
+        bool valid;
+        OfxPointD renderScale;
+        OfxRectI renderWindow;
+        OperationEnum operation;
+        int nComponents;
+        bool fgM;
+        std::vector<int> frames; // frames that were accumulated
+        int updates; // incremental updates since the last full computation
+        bool nonFinite; // the accumulator holds Inf or NaN values, which cannot be subtracted
+        std::auto_ptr<OFX::ImageMemory> accumulator;
+        std::auto_ptr<OFX::ImageMemory> count;
+        std::auto_ptr<OFX::ImageMemory> arg;
+        std::auto_ptr<OFX::ImageMemory> repair;
+        float *accumulatorData;
+        unsigned short *countData;
+        int *argData;
+        unsigned char *repairData;
+
+        IncrementalState()
+        : mutex()
+        , enabled(false)
+        , valid(false)
+        , operation(eOperationAverage)
+        , nComponents(0)
+        , fgM(false)
+        , frames()
+        , updates(0)
+        , nonFinite(false)
+        , accumulator()
+        , count()
+        , arg()
+        , repair()
+        , accumulatorData(0)
+        , countData(0)
+        , argData(0)
+        , repairData(0)
+        {
+            renderScale.x = renderScale.y = 1.;
+            renderWindow.x1 = renderWindow.y1 = renderWindow.x2 = renderWindow.y2 = 0;
+        }
+
+        void reset()
+        {
+            valid = false;
+            frames.clear();
+            nonFinite = false;
+            accumulator.reset();
+            count.reset();
+            arg.reset();
+            repair.reset();
+            accumulatorData = 0;
+            countData = 0;
+            argData = 0;
+            repairData = 0;
+        }
+    };
+    IncrementalState _incrementalState;
 };
 
 
@@ -522,28 +710,6 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 // basic plugin render function, just a skelington to instantiate templates from
 
-namespace {
-// Since we cannot hold a std::auto_ptr in the vector we must hold a raw pointer.
-// To ensure that images are always freed even in case of exceptions, use a RAII class.
-struct OptionalImagesHolder_RAII
-{
-    std::vector<const OFX::Image*> images;
-    
-    OptionalImagesHolder_RAII()
-    : images()
-    {
-        
-    }
-    
-    ~OptionalImagesHolder_RAII()
-    {
-        for (unsigned int i = 0; i < images.size(); ++i) {
-            delete images[i];
-        }
-    }
-};
-}
-
 /* set up and run a processor */
 void
 FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args)
@@ -646,6 +812,21 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
     size_t nPixels = (renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
     OperationEnum operation = processor.getOperation();
 
+    if (operation != eOperationProduct && n > 0) {
+        bool incremental = false;
+        _incremental->getValueAtTime(time, incremental);
+        if (incremental) {
+            std::vector<int> frames(n);
+            for (int i = 0; i < n; ++i) {
+                frames[i] = min + i*interval;
+            }
+            if (processIncremental(processor, args, dst.get(), src.get(), frames,
+                                   processR, processG, processB, processA, outputCount, mix)) {
+                return;
+            }
+        }
+    }
+
     // Main processing loop.
     // We process the frame range by chunks, to avoid using too much memory.
     int imin;
@@ -661,22 +842,7 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
                 int dstNComponents = _dstClip->getPixelComponentCount();
                 accumulator.reset(new OFX::ImageMemory(nPixels * dstNComponents * sizeof(float), this));
                 accumulatorData = (float*)accumulator->lock();
-                switch (operation) {
-                    case eOperationAverage:
-                    case eOperationSum:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 0.);
-                        break;
-                    case eOperationMin:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, std::numeric_limits<float>::infinity());
-                        break;
-                    case eOperationMax:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, -std::numeric_limits<float>::infinity());
-                        break;
-                    case eOperationProduct:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 1.);
-                        break;
-                }
-
+                std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, initValue(operation));
             }
             // Initialize count image if operator is average or outputCount is true and output has alpha (use short)
             if (!countData && (operation == eOperationAverage || outputCount)) {
@@ -686,53 +852,25 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
             }
         }
 
-        // fetch the source images
-        OptionalImagesHolder_RAII srcImgs;
-        for (int i = imin; i < imax; ++i) {
-            if (abort()) {
-                return;
-            }
-            const OFX::Image* src = _srcClip ? _srcClip->fetchImage(min + i*interval) : 0;
-            if (src) {
-                if (src->getRenderScale().x != args.renderScale.x ||
-                    src->getRenderScale().y != args.renderScale.y ||
-                    (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
-                OFX::BitDepthEnum    srcBitDepth      = src->getPixelDepth();
-                OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
-                if (srcBitDepth != dstBitDepth || srcComponents != dstComponents) {
-                    OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
-                }
-            }
-            srcImgs.images.push_back(src);
-        }
-        // fetch the foreground mattes
-        OptionalImagesHolder_RAII fgMImgs;
+        // fetch the source images and the foreground mattes
+        OFX::FrameCacheHolder_RAII frames(&_frameCache);
+        std::vector<OFX::FrameView> srcImgs;
+        std::vector<OFX::FrameView> fgMImgs;
+        const bool fgMConnected = _fgMClip && _fgMClip->isConnected();
         for (int i = imin; i < imax; ++i) {
             if (abort()) {
                 return;
             }
-            const OFX::Image* mask = (_fgMClip && _fgMClip->isConnected()) ? _fgMClip->fetchImage(min + i*interval) : 0;
-            if (mask) {
-                assert(_fgMClip->isConnected());
-                if (mask->getRenderScale().x != args.renderScale.x ||
-                    mask->getRenderScale().y != args.renderScale.y ||
-                    (mask->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && mask->getField() != args.fieldToRender)) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
-            }
-            fgMImgs.images.push_back(mask);
+            srcImgs.push_back(_srcClip ? fetchFrame(_srcClip, 0, min + i*interval, args, true, frames) : OFX::FrameView());
+            fgMImgs.push_back(fgMConnected ? fetchFrame(_fgMClip, 1, min + i*interval, args, false, frames) : OFX::FrameView());
         }
 
         // set the images
         if (lastPass) {
             processor.setDstImg(dst.get());
         }
-        processor.setSrcImgs(lastPass ? src.get() : 0, srcImgs.images);
-        processor.setFgMImgs(fgMImgs.images);
+        processor.setSrcImgs(lastPass ? src.get() : 0, srcImgs);
+        processor.setFgMImgs(fgMImgs);
         // set the render window
         processor.setRenderWindow(renderWindow);
         processor.setAccumulators(accumulatorData, countData);
@@ -745,6 +883,257 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
     }
 }
 
+namespace {
+// Unlocks a mutex that was locked with tryLock(), even in case of exceptions.
+struct MutexUnlocker_RAII
+{
+    OFX::MultiThread::Mutex &mutex;
+
+    explicit MutexUnlocker_RAII(OFX::MultiThread::Mutex &m)
+    : mutex(m)
+    {
+    }
+
+    ~MutexUnlocker_RAII()
+    {
+        mutex.unlock();
+    }
+};
+}
+
+bool
+FrameBlendPlugin::processIncremental(FrameBlendProcessorBase &processor,
+                                     const OFX::RenderArguments &args,
+                                     OFX::Image *dst,
+                                     const OFX::Image *src,
+                                     const std::vector<int> &frames,
+                                     bool processR,
+                                     bool processG,
+                                     bool processB,
+                                     bool processA,
+                                     bool outputCount,
+                                     double mix)
+{
+    IncrementalState &st = _incrementalState;
+    // if another frame is being rendered from the accumulators, compute this one from scratch
+    if (!st.mutex.tryLock()) {
+        return false;
+    }
+    MutexUnlocker_RAII unlocker(st.mutex);
+    if (!st.enabled) {
+        return false;
+    }
+
+    const OperationEnum operation = processor.getOperation();
+    const int nComponents = _dstClip->getPixelComponentCount();
+    const bool fgM = _fgMClip && _fgMClip->isConnected();
+    const OfxRectI& renderWindow = args.renderWindow;
+    const size_t nPixels = (renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
+    const bool minmax = (operation == eOperationMin || operation == eOperationMax);
+
+    bool full = (!st.valid ||
+                 st.operation != operation ||
+                 st.nComponents != nComponents ||
+                 st.fgM != fgM ||
+                 st.renderScale.x != args.renderScale.x ||
+                 st.renderScale.y != args.renderScale.y ||
+                 st.renderWindow.x1 != renderWindow.x1 ||
+                 st.renderWindow.y1 != renderWindow.y1 ||
+                 st.renderWindow.x2 != renderWindow.x2 ||
+                 st.renderWindow.y2 != renderWindow.y2 ||
+                 st.updates >= kIncrementalResync);
+
+    // both frame lists are sorted
+    std::vector<int> removed;
+    std::vector<int> added;
+    if (!full) {
+        std::set_difference(st.frames.begin(), st.frames.end(), frames.begin(), frames.end(), std::back_inserter(removed));
+        std::set_difference(frames.begin(), frames.end(), st.frames.begin(), st.frames.end(), std::back_inserter(added));
+        // not worth it if most of the range changed.
+        // sum/average: a non-finite sample cannot be subtracted (Inf - Inf = NaN)
+        full = (removed.size() + added.size() >= frames.size() ||
+                (st.nonFinite && !removed.empty()));
+    }
+
+    // the frames that left the range can only be taken from the frame cache:
+    // the host does not have to give us frames that are not in getFramesNeeded()
+    OFX::FrameCacheHolder_RAII removedFrames(&_frameCache);
+    std::vector<OFX::FrameView> removedSrcImgs;
+    std::vector<OFX::FrameView> removedFgMImgs;
+    for (unsigned i = 0; !full && i < removed.size(); ++i) {
+        const OFX::FrameCache::Entry *entry = _frameCache.acquire(0, removed[i], args.renderScale, renderWindow);
+        if (!entry) {
+            full = true;
+            break;
+        }
+        removedFrames.entries.push_back(entry);
+        removedSrcImgs.push_back(entry->view);
+        if (fgM) {
+            entry = _frameCache.acquire(1, removed[i], args.renderScale, renderWindow);
+            if (!entry) {
+                full = true;
+                break;
+            }
+            removedFrames.entries.push_back(entry);
+            removedFgMImgs.push_back(entry->view);
+        } else {
+            removedFgMImgs.push_back(OFX::FrameView());
+        }
+    }
+
+    // the accumulators are invalid until the update is complete
+    st.valid = false;
+    if (full) {
+        st.reset();
+        st.accumulator.reset(new OFX::ImageMemory(nPixels * nComponents * sizeof(float), this));
+        st.accumulatorData = (float*)st.accumulator->lock();
+        std::fill(st.accumulatorData, st.accumulatorData + nPixels * nComponents, initValue(operation));
+        st.count.reset(new OFX::ImageMemory(nPixels * sizeof(unsigned short), this));
+        st.countData = (unsigned short*)st.count->lock();
+        std::fill(st.countData, st.countData + nPixels, 0);
+        if (minmax) {
+            st.arg.reset(new OFX::ImageMemory(nPixels * nComponents * sizeof(int), this));
+            st.argData = (int*)st.arg->lock();
+            std::fill(st.argData, st.argData + nPixels * nComponents, kArgNone);
+            st.repair.reset(new OFX::ImageMemory(nPixels * sizeof(unsigned char), this));
+            st.repairData = (unsigned char*)st.repair->lock();
+        }
+        st.updates = 0;
+        removed.clear();
+        added = frames;
+    } else {
+        ++st.updates;
+    }
+    if (minmax) {
+        std::fill(st.repairData, st.repairData + nPixels, 0);
+    }
+
+    processor.setRenderWindow(renderWindow);
+    processor.setAccumulators(st.accumulatorData, st.countData);
+    processor.setValues(processR, processG, processB, processA,
+                        false, outputCount, mix);
+
+    // remove the frames that left the range
+    if (!removed.empty()) {
+        processor.setSrcImgs(0, removedSrcImgs);
+        processor.setFgMImgs(removedFgMImgs);
+        processor.setIncremental(ePassRemove, removed, st.argData, st.repairData);
+        processor.process();
+        if (abort()) {
+            return true;
+        }
+    }
+    // add the frames that entered the range
+    if (!accumulateFrames(processor, args, added, ePassAdd, st.argData, st.repairData)) {
+        return true;
+    }
+
+    // min/max: recompute the pixels where the extremum left the range
+    if (minmax && !removed.empty() &&
+        std::find(st.repairData, st.repairData + nPixels, 1) != st.repairData + nPixels) {
+        if (!accumulateFrames(processor, args, frames, ePassRepair, st.argData, st.repairData)) {
+            return true;
+        }
+    }
+
+    // min/max never subtract, so only the sums have to be checked
+    st.nonFinite = !minmax && hasNonFinite(st.accumulatorData, nPixels * nComponents);
+    st.valid = true;
+    st.operation = operation;
+    st.nComponents = nComponents;
+    st.fgM = fgM;
+    st.renderScale = args.renderScale;
+    st.renderWindow = renderWindow;
+    st.frames = frames;
+
+    // render from the accumulators
+    processor.setDstImg(dst);
+    processor.setSrcImgs(src, std::vector<OFX::FrameView>());
+    processor.setFgMImgs(std::vector<OFX::FrameView>());
+    processor.setIncremental(ePassAdd, std::vector<int>(), 0, 0);
+    processor.setValues(processR, processG, processB, processA,
+                        true, outputCount, mix);
+    processor.process();
+
+    return true;
+}
+
+bool
+FrameBlendPlugin::accumulateFrames(FrameBlendProcessorBase &processor,
+                                   const OFX::RenderArguments &args,
+                                   const std::vector<int> &frames,
+                                   PassEnum pass,
+                                   int *argData,
+                                   unsigned char *repairData)
+{
+    const bool fgMConnected = _fgMClip && _fgMClip->isConnected();
+    const int n = (int)frames.size();
+    int imin;
+    int imax = 0;
+    while (imax < n) {
+        imin = imax;
+        imax = std::min(imin + kFrameChunk, n);
+
+        OFX::FrameCacheHolder_RAII holder(&_frameCache);
+        std::vector<OFX::FrameView> srcImgs;
+        std::vector<OFX::FrameView> fgMImgs;
+        std::vector<int> srcTimes(frames.begin() + imin, frames.begin() + imax);
+        for (int i = imin; i < imax; ++i) {
+            if (abort()) {
+                return false;
+            }
+            srcImgs.push_back(_srcClip ? fetchFrame(_srcClip, 0, frames[i], args, true, holder) : OFX::FrameView());
+            fgMImgs.push_back(fgMConnected ? fetchFrame(_fgMClip, 1, frames[i], args, false, holder) : OFX::FrameView());
+        }
+        processor.setSrcImgs(0, srcImgs);
+        processor.setFgMImgs(fgMImgs);
+        processor.setIncremental(pass, srcTimes, argData, repairData);
+        processor.process();
+        if (abort()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+OFX::FrameView
+FrameBlendPlugin::fetchFrame(OFX::Clip *clip, int clipIndex, double t, const OFX::RenderArguments &args, bool checkFormat, OFX::FrameCacheHolder_RAII &holder)
+{
+    const OFX::FrameCache::Entry *entry = _frameCache.acquire(clipIndex, t, args.renderScale, args.renderWindow);
+    if (entry) {
+        holder.entries.push_back(entry);
+        return entry->view;
+    }
+    const OFX::Image* img = clip->fetchImage(t);
+    if (!img) {
+        return OFX::FrameView();
+    }
+    holder.images.push_back(img);
+    if (img->getRenderScale().x != args.renderScale.x ||
+        img->getRenderScale().y != args.renderScale.y ||
+        (img->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && img->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (checkFormat) {
+        OFX::BitDepthEnum    srcBitDepth      = img->getPixelDepth();
+        OFX::PixelComponentEnum srcComponents = img->getPixelComponents();
+        if (srcBitDepth != _dstClip->getPixelDepth() || srcComponents != _dstClip->getPixelComponents()) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
+    }
+    entry = _frameCache.insert(clipIndex, t, args.renderScale, img, args.renderWindow);
+    if (entry) {
+        // the image can be released right away
+        holder.entries.push_back(entry);
+        holder.images.pop_back();
+        delete img;
+        return entry->view;
+    }
+    return OFX::FrameView(img);
+}
+
 // the overridden render function
 void
 FrameBlendPlugin::render(const OFX::RenderArguments &args)
@@ -824,7 +1213,7 @@ template <class PIX, int nComponents, int maxValue, OperationEnum operation>
 void
 FrameBlendPlugin::renderForOperation(const OFX::RenderArguments &args)
 {
-    FrameBlendProcessor<PIX, nComponents, maxValue, eOperationAverage> fred(*this);
+    FrameBlendProcessor<PIX, nComponents, maxValue, operation> fred(*this);
     setupAndProcess(fred, args);
 }
 
@@ -973,6 +1362,39 @@ FrameBlendPlugin::changedParam(const InstanceChangedArgs &args, const std::strin
     }
 }
 
+void
+FrameBlendPlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments &args)
+{
+    // the upstream graph may change between two interactive renders
+    int cacheSize = 0;
+    if (!args.isInteractive) {
+        _frameCacheSize->getValue(cacheSize);
+    }
+    _frameCache.setMaxBytes((size_t)std::max(cacheSize, 0) * 1024 * 1024);
+
+    OFX::MultiThread::AutoMutex l(_incrementalState.mutex);
+    _incrementalState.reset();
+    _incrementalState.enabled = !args.isInteractive;
+}
+
+void
+FrameBlendPlugin::endSequenceRender(const OFX::EndSequenceRenderArguments &/*args*/)
+{
+    _frameCache.setMaxBytes(0);
+
+    OFX::MultiThread::AutoMutex l(_incrementalState.mutex);
+    _incrementalState.reset();
+    _incrementalState.enabled = false;
+}
+
+void
+FrameBlendPlugin::purgeCaches(void)
+{
+    _frameCache.clear();
+
+    OFX::MultiThread::AutoMutex l(_incrementalState.mutex);
+    _incrementalState.reset();
+}
 
 mDeclarePluginFactory(FrameBlendPluginFactory, {}, {});
 
@@ -1166,6 +1588,32 @@ void FrameBlendPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         }
     }
 
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamFrameCacheSizeName);
+        param->setLabel(kParamFrameCacheSizeLabel);
+        param->setHint(kParamFrameCacheSizeHint);
+        param->setRange(0, kOfxFlagInfiniteMax);
+        param->setDisplayRange(0, 4096);
+        param->setDefault(0);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false); // does not change the result
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamIncrementalName);
+        param->setLabel(kParamIncrementalLabel);
+        param->setHint(kParamIncrementalHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false); // does not change the result (except for rounding errors)
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     ofxsMaskMixDescribeParams(desc, page);
 }
 
@@ -25,6 +25,8 @@
 #include <cmath>
 #include <iostream>
 #include <algorithm>
+#include <memory>
+#include <vector>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -43,8 +45,11 @@
 "This plugin concatenates transforms upstream."
 
 #define kPluginIdentifier "net.sf.openfx.GodRays"
+// History:
+// version 1.0: initial version
+// version 1.1: add the doubling parameter, to render the steps by recursive doubling
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsMultipleClipPARs false
 #define kSupportsMultipleClipDepths false
@@ -73,12 +78,302 @@
 #define kParamMaxLabel "Max"
 #define kParamMaxHint "Output the brightest value at each pixel rather than the average."
 
+#define kParamDoubling "doubling"
+#define kParamDoublingLabel "Recursive Doubling"
+#define kParamDoublingHint "When the step transforms are powers of the first step and the step colors decrease geometrically, compute the steps by recursive doubling: log2(steps) warps of intermediate images rather than one interpolation per step and per pixel. Much faster with many steps, but the intermediate images are interpolated linearly, so the result is slightly softer."
+
 #ifndef USE_STEPS
 #define kTransform3x3MotionBlurCount 1000 // number of transforms used in the motion
 #endif
 
+// Recursive doubling is only used if the step transforms are the powers of the first step
+// transform, up to this distance (in pixels) over the whole region of definition, and if the
+// steps colors decrease geometrically.
+#define kGodRaysDoublingMaxError 0.1
+#define kGodRaysDoublingMaxColorError 1e-4
+// The intermediate images may not be larger than this many times the output plus the source
+// regions of definition.
+#define kGodRaysDoublingMaxGrowth 4
+
 using namespace OFX;
 
+// Bounding box of the pixels around the image of rect by H, plus a margin for the interpolation filter.
+// Returns false if the image is not bounded.
+static bool
+transformedBounds(const OFX::Matrix3x3 &H,
+                  const OfxRectI &rect,
+                  int margin,
+                  OfxRectI *bounds)
+{
+    double x1 = 0., y1 = 0., x2 = 0., y2 = 0.;
+    for (int k = 0; k < 4; ++k) {
+        OFX::Point3D p;
+        p.x = (k & 1) ? rect.x2 : rect.x1;
+        p.y = (k & 2) ? rect.y2 : rect.y1;
+        p.z = 1.;
+        OFX::Point3D q = H * p;
+        if (q.z <= 0.) {
+            return false;
+        }
+        double qx = q.x / q.z;
+        double qy = q.y / q.z;
+        if (k == 0) {
+            x1 = x2 = qx;
+            y1 = y2 = qy;
+        } else {
+            x1 = std::min(x1, qx);
+            x2 = std::max(x2, qx);
+            y1 = std::min(y1, qy);
+            y2 = std::max(y2, qy);
+        }
+    }
+    const double limit = (double)kOfxFlagInfiniteMax / 2;
+    if (x1 < -limit || y1 < -limit || x2 > limit || y2 > limit) {
+        return false;
+    }
+    bounds->x1 = (int)std::floor(x1) - margin;
+    bounds->y1 = (int)std::floor(y1) - margin;
+    bounds->x2 = (int)std::ceil(x2) + margin;
+    bounds->y2 = (int)std::ceil(y2) + margin;
+
+    return true;
+}
+
+static size_t
+rectArea(const OfxRectI &r)
+{
+    return (r.x2 > r.x1 && r.y2 > r.y1) ? (size_t)(r.x2 - r.x1) * (size_t)(r.y2 - r.y1) : 0;
+}
+
+// Accumulates S(p) = sum_{i < 2^passes} q^i src(D^i p) (or the max over i), by recursive doubling:
+// S_0 = src, and S_{j+1}(p) = S_j(p) + q^(2^j) S_j(D^(2^j) p).
+// Each pass is a full warp of the previous one, so the cost is log2(steps) passes instead of
+// steps interpolations per pixel.
+// The source is sampled with the selected filter, the intermediate images are interpolated linearly.
+template <class PIX, int nComponents, FilterEnum filter, bool clamp>
+class GodRaysDoubler
+: public OFX::MultiThread::Processor
+{
+public:
+    struct Buffer
+    {
+        OfxRectI bounds;
+        float *data; // nComponents floats per pixel
+    };
+
+    GodRaysDoubler(OFX::ImageEffect &effect,
+                   const OFX::Image *src,
+                   bool blackOutside,
+                   bool max)
+    : _effect(effect)
+    , _src(src)
+    , _blackOutside(blackOutside)
+    , _max(max)
+    , _powers()
+    , _regions()
+    , _pass(0)
+    {
+        _mem[0] = _mem[1] = 0;
+        _buf[0].data = _buf[1].data = 0;
+    }
+
+    ~GodRaysDoubler()
+    {
+        for (int i = 0; i < 2; ++i) {
+            if (_mem[i]) {
+                _mem[i]->unlock();
+                delete _mem[i];
+            }
+        }
+    }
+
+    /// Compute the regions needed by each pass to produce region, and allocate the buffers if allocate is set.
+    /// Returns false if the intermediate images would be larger than maxPixels.
+    bool setup(const OFX::Matrix3x3 &D,
+               const double q[nComponents],
+               int passes,
+               const OfxRectI &region,
+               size_t maxPixels,
+               bool allocate)
+    {
+        assert(passes > 0);
+        _powers.resize(passes);
+        _regions.resize(passes + 1);
+        _powers[0] = D;
+        for (int c = 0; c < nComponents; ++c) {
+            _weights[c].resize(passes);
+            _weights[c][0] = (float)q[c];
+        }
+        for (int j = 1; j < passes; ++j) {
+            _powers[j] = _powers[j - 1] * _powers[j - 1];
+            for (int c = 0; c < nComponents; ++c) {
+                _weights[c][j] = _weights[c][j - 1] * _weights[c][j - 1];
+            }
+        }
+        // pass j computes _regions[j+1] from _regions[j] (the source for j=0)
+        _regions[passes] = region;
+        size_t pixels = rectArea(region);
+        for (int j = passes - 1; j > 0; --j) {
+            OfxRectI r;
+            if ( !transformedBounds(_powers[j], _regions[j + 1], 1, &r) ) {
+                return false;
+            }
+            _regions[j].x1 = std::min(r.x1, _regions[j + 1].x1);
+            _regions[j].y1 = std::min(r.y1, _regions[j + 1].y1);
+            _regions[j].x2 = std::max(r.x2, _regions[j + 1].x2);
+            _regions[j].y2 = std::max(r.y2, _regions[j + 1].y2);
+            if ( (double)(_regions[j].x2 - _regions[j].x1) * (_regions[j].y2 - _regions[j].y1) > (double)maxPixels ) {
+                return false;
+            }
+            pixels = std::max( pixels, rectArea(_regions[j]) );
+        }
+        if (pixels == 0 || pixels > maxPixels) {
+            return false;
+        }
+        if (!allocate) {
+            return true;
+        }
+        for (int i = 0; i < std::min(passes, 2); ++i) {
+            _mem[i] = new OFX::ImageMemory(pixels * nComponents * sizeof(float), &_effect);
+            _buf[i].data = (float*)_mem[i]->lock();
+        }
+
+        return true;
+    }
+
+    /// Run the passes. Returns false if the render was aborted.
+    bool accumulate()
+    {
+        for (_pass = 0; _pass < (int)_powers.size(); ++_pass) {
+            _buf[_pass % 2].bounds = _regions[_pass + 1];
+            multiThread();
+            if ( _effect.abort() ) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    const Buffer &getResult() const
+    {
+        return _buf[(_powers.size() - 1) % 2];
+    }
+
+    /// Interpolate a buffer at (fx,fy), in pixel coordinates. Points outside are clamped to the buffer.
+    static void sample(const Buffer &b, double fx, double fy, float *out)
+    {
+        const int w = b.bounds.x2 - b.bounds.x1;
+        const int h = b.bounds.y2 - b.bounds.y1;
+        if (filter == eFilterImpulse) {
+            int i = std::max( 0, std::min( (int)std::floor(fx) - b.bounds.x1, w - 1 ) );
+            int j = std::max( 0, std::min( (int)std::floor(fy) - b.bounds.y1, h - 1 ) );
+            const float *p = b.data + ( (size_t)j * w + i ) * nComponents;
+            for (int c = 0; c < nComponents; ++c) {
+                out[c] = p[c];
+            }
+
+            return;
+        }
+        // position relative to the pixel centers
+        double u = fx - b.bounds.x1 - 0.5;
+        double v = fy - b.bounds.y1 - 0.5;
+        int i0 = (int)std::floor(u);
+        int j0 = (int)std::floor(v);
+        float fu = (float)(u - i0);
+        float fv = (float)(v - j0);
+        int i1 = std::max( 0, std::min(i0 + 1, w - 1) );
+        int j1 = std::max( 0, std::min(j0 + 1, h - 1) );
+        i0 = std::max( 0, std::min(i0, w - 1) );
+        j0 = std::max( 0, std::min(j0, h - 1) );
+        const float *p00 = b.data + ( (size_t)j0 * w + i0 ) * nComponents;
+        const float *p10 = b.data + ( (size_t)j0 * w + i1 ) * nComponents;
+        const float *p01 = b.data + ( (size_t)j1 * w + i0 ) * nComponents;
+        const float *p11 = b.data + ( (size_t)j1 * w + i1 ) * nComponents;
+        for (int c = 0; c < nComponents; ++c) {
+            out[c] = ( (p00[c] * (1 - fu) + p10[c] * fu) * (1 - fv) +
+                       (p01[c] * (1 - fu) + p11[c] * fu) * fv );
+        }
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const Buffer &prev = _buf[(_pass + 1) % 2]; // unused for the first pass
+        Buffer &cur = _buf[_pass % 2];
+        const OFX::Matrix3x3 &H = _powers[_pass];
+        float w[nComponents];
+        for (int c = 0; c < nComponents; ++c) {
+            w[c] = _weights[c][_pass];
+        }
+        const int width = cur.bounds.x2 - cur.bounds.x1;
+        const int height = cur.bounds.y2 - cur.bounds.y1;
+        const int j1 = (int)( ( (long long)height * threadId ) / nThreads );
+        const int j2 = (int)( ( (long long)height * (threadId + 1) ) / nThreads );
+        float pix0[nComponents];
+        float pix1[nComponents];
+        for (int j = j1; j < j2; ++j) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            const int y = cur.bounds.y1 + j;
+            float *out = cur.data + (size_t)j * width * nComponents;
+            OFX::Point3D p;
+            p.y = y + 0.5;
+            p.z = 1.;
+            for (int x = cur.bounds.x1; x < cur.bounds.x2; ++x, out += nComponents) {
+                p.x = x + 0.5;
+                OFX::Point3D transformed = H * p;
+                if (_pass == 0) {
+                    getSourcePixel(x, y, pix0);
+                    if (transformed.z == 0.) {
+                        std::fill(pix1, pix1 + nComponents, 0.f);
+                    } else {
+                        ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(transformed.x / transformed.z, transformed.y / transformed.z, _src, _blackOutside, pix1);
+                    }
+                } else {
+                    // cur.bounds is within prev.bounds
+                    const float *p0 = prev.data + ( (size_t)(y - prev.bounds.y1) * (prev.bounds.x2 - prev.bounds.x1) + (x - prev.bounds.x1) ) * nComponents;
+                    std::copy(p0, p0 + nComponents, pix0);
+                    if (transformed.z == 0.) {
+                        std::fill(pix1, pix1 + nComponents, 0.f);
+                    } else {
+                        sample(prev, transformed.x / transformed.z, transformed.y / transformed.z, pix1);
+                    }
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    out[c] = _max ? std::max(pix0[c], w[c] * pix1[c]) : (pix0[c] + w[c] * pix1[c]);
+                }
+            }
+        }
+    }
+
+    void getSourcePixel(int x, int y, float *pix) const
+    {
+        const OfxRectI &bounds = _src->getBounds();
+        if (!_blackOutside) {
+            x = std::max( bounds.x1, std::min(x, bounds.x2 - 1) );
+            y = std::max( bounds.y1, std::min(y, bounds.y2 - 1) );
+        }
+        const PIX *p = (const PIX *)_src->getPixelAddress(x, y);
+        for (int c = 0; c < nComponents; ++c) {
+            pix[c] = p ? (float)p[c] : 0.f;
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_src;
+    bool _blackOutside;
+    bool _max;
+    std::vector<OFX::Matrix3x3> _powers; // D^(2^j)
+    std::vector<float> _weights[nComponents]; // q^(2^j)
+    std::vector<OfxRectI> _regions;
+    OFX::ImageMemory *_mem[2];
+    Buffer _buf[2]; // pass j writes to _buf[j%2]
+    int _pass;
+};
+
 class GodRaysProcessorBase
 : public Transform3x3ProcessorBase
 {
@@ -90,6 +385,9 @@ protected:
     int _steps;
 #endif
     bool _max;
+    bool _doubling;
+    OfxRectI _srcRoD; // in pixels
+    OfxRectI _dstRoD; // in pixels
 
 public:
 
@@ -99,10 +397,22 @@ public:
     , _steps(5)
 #endif
     , _max(false)
+    , _doubling(false)
     {
         for (int c=0; c < 4; ++c) {
             _fromColor[c] = _toColor[c] = _gamma[c] = 1.;
         }
+        _srcRoD.x1 = _srcRoD.y1 = _srcRoD.x2 = _srcRoD.y2 = 0;
+        _dstRoD.x1 = _dstRoD.y1 = _dstRoD.x2 = _dstRoD.y2 = 0;
+    }
+
+    /// Allow recursive doubling. Whether it is used only depends on the parameters and on the
+    /// regions of definition (in pixels), so that all the tiles of a frame take the same path.
+    void setDoubling(bool doubling, const OfxRectI &srcRoD, const OfxRectI &dstRoD)
+    {
+        _doubling = doubling;
+        _srcRoD = srcRoD;
+        _dstRoD = dstRoD;
     }
 
     virtual void setValues(const OFX::Matrix3x3* invtransform, //!< non-generic - must be in PIXEL coords
@@ -141,7 +451,12 @@ class GodRaysProcessor
 public:
     GodRaysProcessor(OFX::ImageEffect &instance)
     : GodRaysProcessorBase(instance)
+    , _doubler()
+    , _aborted(false)
     {
+        for (int c = 0; c < nComponents; ++c) {
+            _doublingScale[c] = 1.f;
+        }
     }
 
 private:
@@ -211,10 +526,64 @@ private:
 #endif
     }
 
+    virtual void preProcess() OVERRIDE FINAL
+    {
+        _doubler.reset();
+        _aborted = false;
+        OFX::Matrix3x3 D;
+        double q[nComponents];
+        if ( !_doubling || !_srcImg || (_motionblur == 0.) || !getDoublingParameters(&D, q) ) {
+            return;
+        }
+        int passes = 0;
+        while ( (1 << passes) < (int)_invtransformsize ) {
+            ++passes;
+        }
+        // The intermediate images needed by a tile are within those needed by the whole region of
+        // definition, so the size limit is checked on the latter only.
+        OfxRectI rodRegion;
+        if ( !transformedBounds(_invtransform[0], _dstRoD, 1, &rodRegion) ) {
+            return;
+        }
+        const size_t maxPixels = kGodRaysDoublingMaxGrowth * ( rectArea(_dstRoD) + rectArea(_srcRoD) );
+        {
+            GodRaysDoubler<PIX, nComponents, filter, clamp> rodDoubler(_effect, _srcImg, _blackOutside, _max);
+            if ( !rodDoubler.setup(D, q, passes, rodRegion, maxPixels, false) ) {
+                return;
+            }
+        }
+        OfxRectI region;
+        if ( !transformedBounds(_invtransform[0], _renderWindow, 1, &region) ) {
+            return;
+        }
+        _doubler.reset( new GodRaysDoubler<PIX, nComponents, filter, clamp>(_effect, _srcImg, _blackOutside, _max) );
+        if ( !_doubler->setup(D, q, passes, region, maxPixels, true) ) {
+            // the render window extends outside of the region of definition
+            _doubler.reset();
+
+            return;
+        }
+        if ( !_doubler->accumulate() ) {
+            // aborted: the intermediate images are incomplete
+            _doubler.reset();
+            _aborted = true;
+
+            return;
+        }
+        // _color[i] = _color[0] * q^i
+        for (int c = 0; c < nComponents; ++c) {
+            _doublingScale[c] = _max ? _color[0][c] : _color[0][c] / _invtransformsize;
+        }
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE
     {
         assert(_invtransform);
-        if (_motionblur == 0.) { // no motion blur
+        if (_aborted) {
+            return;
+        } else if ( _doubler.get() ) {
+            return multiThreadProcessImagesDoubling(procWindow);
+        } else if (_motionblur == 0.) { // no motion blur
             return multiThreadProcessImagesNoBlur(procWindow);
         } else { // motion blur
             return multiThreadProcessImagesMotionBlur(procWindow);
@@ -222,6 +591,95 @@ private:
     } // multiThreadProcessImages
 
 private:
+    // Recursive doubling applies if there are 2^n transforms _invtransform[i] = D^i * _invtransform[0],
+    // and if _color[i] = _color[0] * q^i.
+    bool getDoublingParameters(OFX::Matrix3x3 *D,
+                               double q[nComponents]) const
+    {
+        const int n = (int)_invtransformsize;
+        if ( (n < 2) || ( ( n & (n - 1) ) != 0 ) || ( (int)_color.size() != n ) ) {
+            return false;
+        }
+        for (int c = 0; c < nComponents; ++c) {
+            if (_color[0][c] <= 0.) {
+                return false;
+            }
+            q[c] = _color[1][c] / _color[0][c];
+            double qi = 1.;
+            for (int i = 0; i < n; ++i, qi *= q[c]) {
+                if (std::abs(_color[i][c] - _color[0][c] * qi) > kGodRaysDoublingMaxColorError * _color[i][c]) {
+                    return false;
+                }
+            }
+        }
+        double det = ofxsMatDeterminant(_invtransform[0]);
+        if (det == 0.) {
+            return false;
+        }
+        *D = _invtransform[1] * ofxsMatInverse(_invtransform[0], det);
+        // check the powers of D at the corners of the region of definition
+        OFX::Matrix3x3 P = _invtransform[0];
+        for (int i = 1; i < n; ++i) {
+            P = (*D) * P;
+            for (int k = 0; k < 4; ++k) {
+                OFX::Point3D p;
+                p.x = (k & 1) ? _dstRoD.x2 : _dstRoD.x1;
+                p.y = (k & 2) ? _dstRoD.y2 : _dstRoD.y1;
+                p.z = 1.;
+                OFX::Point3D a = _invtransform[i] * p;
+                OFX::Point3D b = P * p;
+                if ( (a.z <= 0.) || (b.z <= 0.) ) {
+                    return false;
+                }
+                double dx = a.x / a.z - b.x / b.z;
+                double dy = a.y / a.z - b.y / b.z;
+                if (dx * dx + dy * dy > kGodRaysDoublingMaxError * kGodRaysDoublingMaxError) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    void multiThreadProcessImagesDoubling(const OfxRectI &procWindow)
+    {
+        float tmpPix[nComponents];
+        const OFX::Matrix3x3 & H = _invtransform[0];
+        const typename GodRaysDoubler<PIX, nComponents, filter, clamp>::Buffer &acc = _doubler->getResult();
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            OFX::Point3D canonicalCoords;
+            canonicalCoords.z = 1;
+            canonicalCoords.y = (double)y + 0.5;
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                canonicalCoords.x = (double)x + 0.5;
+                OFX::Point3D transformed = H * canonicalCoords;
+                if (transformed.z == 0.) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = 0;
+                    }
+                } else {
+                    GodRaysDoubler<PIX, nComponents, filter, clamp>::sample(acc, transformed.x / transformed.z, transformed.y / transformed.z, tmpPix);
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] *= _doublingScale[c];
+                        if (_max) {
+                            tmpPix[c] = std::max(0.f, tmpPix[c]);
+                        }
+                    }
+                }
+
+                ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
+            }
+        }
+    }
+
     void multiThreadProcessImagesNoBlur(const OfxRectI &procWindow)
     {
         float tmpPix[nComponents];
@@ -459,6 +917,9 @@ private:
     };
 
     std::vector<Pix > _color;
+    std::auto_ptr<GodRaysDoubler<PIX, nComponents, filter, clamp> > _doubler;
+    float _doublingScale[nComponents];
+    bool _aborted; // the render was aborted during preProcess()
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -485,6 +946,7 @@ public:
     , _steps(0)
 #endif
     , _max(0)
+    , _doubling(0)
     {
         // NON-GENERIC
         _translate = fetchDouble2DParam(kParamTransformTranslateOld);
@@ -506,8 +968,9 @@ public:
         assert(_steps);
 #endif
         _max = fetchBooleanParam(kParamMax);
+        _doubling = fetchBooleanParam(kParamDoubling);
 
-        assert(_fromColor && _toColor && _gamma && _max);
+        assert(_fromColor && _toColor && _gamma && _max && _doubling);
     }
 
 private:
@@ -550,6 +1013,7 @@ private:
     RGBAParam* _gamma;
     IntParam* _steps;
     BooleanParam* _max;
+    BooleanParam* _doubling;
 };
 
 // overridden is identity
@@ -873,6 +1337,15 @@ GodRaysPlugin::setupAndProcess(GodRaysProcessorBase &processor,
     _toColor->getValueAtTime(time, toColor[0], toColor[1], toColor[2], toColor[3]);
     _gamma->getValueAtTime(time, gamma[0], gamma[1], gamma[2], gamma[3]);
     _max->getValueAtTime(time, max);
+    bool doubling = false;
+    _doubling->getValueAtTime(time, doubling);
+    if (doubling && src.get()) {
+        OfxRectI srcRoD;
+        OfxRectI dstRoD;
+        OFX::Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), args.renderScale, src->getPixelAspectRatio(), &srcRoD);
+        OFX::Coords::toPixelEnclosing(_dstClip->getRegionOfDefinition(time), args.renderScale, dst->getPixelAspectRatio(), &dstRoD);
+        processor.setDoubling(true, srcRoD, dstRoD);
+    }
 #ifdef USE_STEPS
     if (invtransformsize > 1) {
         // instruct the processor to use all transforms
@@ -1137,6 +1610,18 @@ void GodRaysPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, O
         }
     }
 
+    // doubling
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamDoubling);
+        param->setLabel(kParamDoublingLabel);
+        param->setHint(kParamDoublingHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     ofxsMaskMixDescribeParams(desc, page);
 }
 
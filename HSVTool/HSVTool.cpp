@@ -24,6 +24,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <vector>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -32,6 +33,7 @@
 #include "ofxsMaskMix.h"
 #include "ofxsCoords.h"
 #include "ofxsLut.h"
+#include "ofxsColorRow.h"
 #include "ofxsMacros.h"
 
 #define kPluginName "HSVToolOFX"
@@ -52,7 +54,7 @@
 
 #define kPluginIdentifier "net.sf.openfx.HSVToolPlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -373,10 +375,9 @@ public:
         _mix = mix;
     }
 
-    void hsvtool(float r, float g, float b, float *hcoeff, float *scoeff, float *vcoeff, float *rout, float *gout, float *bout)
+    // the coefficients of the hue, saturation and brightness ranges at an HSV color
+    void hsvcoeffs(float h, float s, float v, float *hcoeff, float *scoeff, float *vcoeff)
     {
-        float h, s, v;
-        OFX::Color::rgb_to_hsv(r, g, b, &h, &s, &v);
         const double h0 = _values.hueRange[0];
         const double h1 = _values.hueRange[1];
         const double h0mrolloff = _values.hueRangeWithRolloff[0];
@@ -425,30 +426,43 @@ public:
             *vcoeff = 0.f;
         }
         assert(0 <= *vcoeff && *vcoeff <= 1.);
-        float coeff = std::min(std::min(*hcoeff, *scoeff), *vcoeff);
-        assert(0 <= coeff && coeff <= 1.);
-        if (coeff <= 0.) {
-            *rout = r;
-            *gout = g;
-            *bout = b;
-        } else {
-            h += coeff * (float)_values.hueRotation;
-            s += coeff * (float)_values.satAdjust;
-            if (s < 0) {
-                s = 0;
+    }
+
+    // process the n pixels of a row, stored one array per channel.
+    // r, g and b are modified in place, h, s and v are scratch arrays.
+    void hsvtoolRow(int n, float *r, float *g, float *b, float *hcoeff, float *scoeff, float *vcoeff, float *h, float *s, float *v)
+    {
+        OFX::ColorRow::rgb_to_hsv(n, r, g, b, h, s, v);
+        for (int i = 0; i < n; ++i) {
+            hsvcoeffs(h[i], s[i], v[i], &hcoeff[i], &scoeff[i], &vcoeff[i]);
+            float coeff = std::min(std::min(hcoeff[i], scoeff[i]), vcoeff[i]);
+            assert(0 <= coeff && coeff <= 1.);
+            h[i] += coeff * (float)_values.hueRotation;
+            s[i] += coeff * (float)_values.satAdjust;
+            if (s[i] < 0) {
+                s[i] = 0;
             }
-            v += coeff * (float)_values.valAdjust;
-            OFX::Color::hsv_to_rgb(h, s, v, rout, gout, bout);
+            v[i] += coeff * (float)_values.valAdjust;
         }
-        if (_clampBlack) {
-            *rout = std::max(0.f, *rout);
-            *gout = std::max(0.f, *gout);
-            *bout = std::max(0.f, *bout);
-        }
-        if (_clampWhite) {
-            *rout = std::min(1.f, *rout);
-            *gout = std::min(1.f, *gout);
-            *bout = std::min(1.f, *bout);
+        OFX::ColorRow::hsv_to_rgb(n, h, s, v, h, s, v);
+        for (int i = 0; i < n; ++i) {
+            const float coeff = std::min(std::min(hcoeff[i], scoeff[i]), vcoeff[i]);
+            // the pixels outside of the ranges keep their exact input value
+            if (coeff > 0.) {
+                r[i] = h[i];
+                g[i] = s[i];
+                b[i] = v[i];
+            }
+            if (_clampBlack) {
+                r[i] = std::max(0.f, r[i]);
+                g[i] = std::max(0.f, g[i]);
+                b[i] = std::max(0.f, b[i]);
+            }
+            if (_clampWhite) {
+                r[i] = std::min(1.f, r[i]);
+                g[i] = std::min(1.f, g[i]);
+                b[i] = std::min(1.f, b[i]);
+            }
         }
     }
 
@@ -477,18 +491,39 @@ public:
         float tmpPix[4];
         // only premultiply output if keeping the source alpha
         const bool premultOut = _premult && (_outputAlpha == eOutputAlphaSource);
+        // one row of unpremultiplied pixels, one array per channel, processed at once
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> rowBuf((size_t)width * 10);
+        float *row[10]; // r, g, b, a, hcoeff, scoeff, vcoeff, and three scratch arrays
+        for (int c = 0; c < 10; ++c) {
+            row[c] = &rowBuf[(size_t)c * width];
+        }
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if (_effect.abort()) {
                 break;
             }
 
+            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                ofxsUnPremult<PIX, nComponents, maxValue>(srcPix, unpPix, _premult, _premultChannel);
+                for (int c = 0; c < 4; ++c) {
+                    row[c][x - procWindow.x1] = unpPix[c];
+                }
+            }
+
+            hsvtoolRow(width, row[0], row[1], row[2], row[4], row[5], row[6], row[7], row[8], row[9]);
+
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
 
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
                 const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
-                ofxsUnPremult<PIX, nComponents, maxValue>(srcPix, unpPix, _premult, _premultChannel);
-                float hcoeff, scoeff, vcoeff;
-                hsvtool(unpPix[0], unpPix[1], unpPix[2], &hcoeff, &scoeff, &vcoeff, &tmpPix[0], &tmpPix[1], &tmpPix[2]);
+                const int i = x - procWindow.x1;
+                for (int c = 0; c < 4; ++c) {
+                    tmpPix[c] = row[c][i];
+                }
+                const float hcoeff = row[4][i];
+                const float scoeff = row[5][i];
+                const float vcoeff = row[6][i];
                 ofxsPremultMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, premultOut, _premultChannel, x, y, srcPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
                 // if output alpha is not source alpha, set it to the right value
                 if (nComponents == 4 && _outputAlpha != eOutputAlphaSource) {
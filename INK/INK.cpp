@@ -49,6 +49,8 @@ not their absolute values
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <memory>
+#include <vector>
 
 #ifdef _WINDOWS
 #include <windows.h>
@@ -56,6 +58,7 @@ not their absolute values
 
 #include "ofxsProcessing.H"
 #include "ofxsMacros.h"
+#include "ofxsColorRow.h"
 
 using namespace OFX;
 using namespace std;
@@ -69,7 +72,7 @@ using namespace std;
 
 #define kPluginIdentifier "com.casanico.INK"
 #define kPluginVersionMajor 2 // Increment this if you have broken backwards compatibility.
-#define kPluginVersionMinor 0
+#define kPluginVersionMinor 1
 
 #define kSupportsTiles 1 
 #define kSupportsMultiResolution 1
@@ -203,6 +206,13 @@ protected:
     OutputModeEnum _outputMode;
     SourceAlphaEnum _sourceAlpha;
     double _sinKey, _cosKey, _xKey, _ys;
+    // terms that only depend on the key colour, computed once in setValues
+    int _minK, _midK, _maxK; // which channel of the key colour is min, mid and max
+    bool _keyIsBlack;
+    double _keyMinRatio; // K[minK]/(K[maxK]-bal*K[midK])
+    double _keyMidRatio; // K[midK]/(K[maxK]-(1-bal)*K[minK])
+    double _alphaFactor; // 1+a1/abs(1-a1)
+    double _replaceLum;
 
 public:
     
@@ -231,6 +241,14 @@ public:
     , _cosKey(0)
     , _xKey(0)
     , _ys(0)
+    , _minK(0)
+    , _midK(1)
+    , _maxK(2)
+    , _keyIsBlack(true)
+    , _keyMinRatio(0.)
+    , _keyMidRatio(0.)
+    , _alphaFactor(0.)
+    , _replaceLum(0.)
     {
       _keyColour.r = _keyColour.g = _keyColour.b = 0.;
       _replacementColour.r = _replacementColour.r = _replacementColour.r = 0;
@@ -270,6 +288,41 @@ public:
 	_despillCore = despillCore;
         _outputMode = outputMode;
         _sourceAlpha = sourceAlpha;
+
+	// which channel of the key colour is max
+	_minK = 0;
+	_midK = 1;
+	_maxK = 2;
+	if(_keyColour.b <= _keyColour.r && _keyColour.r <= _keyColour.g ){
+	  _minK = 2;
+	  _midK = 0;
+	  _maxK = 1;
+	} else if (_keyColour.r <= _keyColour.b && _keyColour.b <= _keyColour.g ){
+	  _minK = 0;
+	  _midK = 2;
+	  _maxK = 1;
+	} else if (_keyColour.g <= _keyColour.b && _keyColour.b <= _keyColour.r ){
+	  _minK = 1;
+	  _midK = 2;
+	  _maxK = 0;
+	} else if (_keyColour.g <= _keyColour.r && _keyColour.r <= _keyColour.b ){
+	  _minK = 1;
+	  _midK = 0;
+	  _maxK = 2;
+	} else if (_keyColour.b <= _keyColour.g && _keyColour.g <= _keyColour.r ){
+	  _minK = 2;
+	  _midK = 1;
+	  _maxK = 0;
+	}
+	// K is for Key Colour
+	double K[3] = {_keyColour.r, _keyColour.g, _keyColour.b};
+	double bal = _keyBalance;
+	_keyIsBlack = (K[_minK] == 0. && K[_midK] == 0. && K[_maxK] == 0.);
+	_keyMinRatio = K[_minK]/(K[_maxK]-bal*K[_midK]);
+	_keyMidRatio = K[_midK]/(K[_maxK]-(1-bal)*K[_minK]);
+	double a1 = (1-K[_maxK])+(bal*K[_midK]+(1-bal)*K[_minK]);
+	_alphaFactor = 1+a1/abs(1-a1);
+	_replaceLum = 0.2126 * _replacementColour.r + 0.7152 * _replacementColour.g + 0.0722 * _replacementColour.b;
     }
 };
 
@@ -324,6 +377,78 @@ static PIX floatToSample(double value)
     return PIX(value * maxValue + 0.5);
 }
 
+template <class V>
+inline V
+clamp01(V v)
+{
+    using namespace OFX::ColorRow;
+    return vmax(V(0.f), vmin(v, V(1.f)));
+}
+
+// the despilled channels and the matte of a source pixel, given its channels in the order of the
+// min, mid and max channels of the key colour, for OFX::ColorRow::processRow().
+// The last input is the factor applied to the key amount for despill (one minus the core matte if
+// the core is not despilled).
+// The channel solutions (P[maxK]-bal*P[midK])*min1/(1-min1), where min1 is a ratio of terms that
+// are divided by P[maxK]-bal*P[midK], are simplified so that the only division is by a term that
+// does not depend on the pixel colour. The same goes for the mid channel and the alpha.
+struct INKKey
+{
+    bool keyIsBlack;
+    float lumMin, lumMid, lumMax;
+    float keyAmount;
+    float midpoint, invMidpoint, invOneMinusMidpoint;
+    float shadows, midtones, highlights;
+    float bal;
+    float keyMinRatio, keyMidRatio;
+    float alphaFactor;
+
+    template <class V>
+    void operator()(V pMin, V pMid, V pMax, V amountFactor, V *cMin, V *cMid, V *cMax, V *matte) const
+    {
+        using namespace OFX::ColorRow;
+        if (keyIsBlack) {
+            *cMin = pMin;
+            *cMid = pMid;
+            *cMax = pMax;
+            *matte = V(1.f);
+
+            return;
+        }
+        // tune key amount
+        const V lum = pMin * V(lumMin) + pMid * V(lumMid) + pMax * V(lumMax);
+        const V lowlerp = lum * V(invMidpoint);
+        const V highlerp = (V(1.f) - lum) * V(invOneMinusMidpoint);
+        const V amount = V(keyAmount) * vselect(vle(lum, V(midpoint)),
+                                                (V(1.f) - lowlerp) * V(shadows) + lowlerp * V(midtones),
+                                                highlerp * V(midtones) + (V(1.f) - highlerp) * V(highlights));
+        const V amountRGB = amount * amountFactor;
+        const V a = amountRGB * amountRGB;
+        // solve the min channel
+        const V denMin = V(1.f) - V(1.f - bal) * a * V(keyMinRatio);
+        const V min2 = vselect(veq(denMin, V(0.f)), pMin,
+                               vmin(pMin, (pMin - a * V(keyMinRatio) * (pMax - V(bal) * pMid)) / vselect(veq(denMin, V(0.f)), V(1.f), denMin)));
+        // solve the mid channel
+        const V denMid = V(1.f) - V(bal) * a * V(keyMidRatio);
+        const V mid2 = vselect(veq(denMid, V(0.f)), pMid,
+                               vmin(pMid, (pMid - a * V(keyMidRatio) * (pMax - V(1.f - bal) * pMin)) / vselect(veq(denMid, V(0.f)), V(1.f), denMid)));
+        // solve the max channel
+        const V max1 = vmin(pMax, V(bal) * mid2 + V(1.f - bal) * min2);
+        // solve alpha
+        const V a2 = amount * amount * V(alphaFactor);
+        const V a3 = V(1.f) + (V(bal) * pMid + V(1.f - bal) * pMin - pMax) * a2;
+        const V chanMin = clamp01(min2);
+        const V chanMid = clamp01(mid2);
+        const V alpha = clamp01(vmax(chanMid, vmax(a3, chanMin)));
+        // black pixels and pixels with no key amount are left unchanged
+        const typename V::Mask keep = vor(veq(amountRGB, V(0.f)), veq(vabs(pMin) + vabs(pMid) + vabs(pMax), V(0.f)));
+        *cMin = vselect(keep, pMin, chanMin);
+        *cMid = vselect(keep, pMid, chanMid);
+        *cMax = vselect(keep, pMax, clamp01(max1));
+        *matte = vselect(keep, V(1.f), alpha);
+    }
+};
+
 template <class PIX, int nComponents, int maxValue>
 class INKProcessor : public INKProcessorBase
 {
@@ -336,69 +461,124 @@ public:
 private:
     void multiThreadProcessImages(OfxRectI procWindow)
     {
+        // select the kernel specialized for the output mode and the source alpha
+        switch (_outputMode) {
+            case eOutputModeIntermediate:
+                processForOutputMode<eOutputModeIntermediate>(procWindow);
+                break;
+            case eOutputModePremultiplied:
+                processForOutputMode<eOutputModePremultiplied>(procWindow);
+                break;
+            case eOutputModeUnpremultiplied:
+                processForOutputMode<eOutputModeUnpremultiplied>(procWindow);
+                break;
+            case eOutputModeMatteMonitor:
+                processForOutputMode<eOutputModeMatteMonitor>(procWindow);
+                break;
+            case eOutputModeMatteMonitorPremult:
+                processForOutputMode<eOutputModeMatteMonitorPremult>(procWindow);
+                break;
+        }
+    }
+
+    template <OutputModeEnum outputMode>
+    void processForOutputMode(const OfxRectI &procWindow)
+    {
+        switch (_sourceAlpha) {
+            case eSourceAlphaIgnore:
+                process<outputMode, eSourceAlphaIgnore>(procWindow);
+                break;
+            case eSourceAlphaAddToCore:
+                process<outputMode, eSourceAlphaAddToCore>(procWindow);
+                break;
+            case eSourceAlphaNormal:
+                process<outputMode, eSourceAlphaNormal>(procWindow);
+                break;
+        }
+    }
+
+    template <OutputModeEnum outputMode, SourceAlphaEnum sourceAlpha>
+    void process(const OfxRectI &procWindow)
+    {
+        const int minK = _minK;
+        const int midK = _midK;
+        const int maxK = _maxK;
+	// R is for Replacement Colour
+	const double R[3] = {_replacementColour.r, _replacementColour.g, _replacementColour.b};
+	// the kernel of the key, with the luminance coefficients in min, mid, max order
+	const double lumCoeff[3] = {0.2126, 0.7152, 0.0722};
+	INKKey key;
+	key.keyIsBlack = _keyIsBlack;
+	key.lumMin = (float)lumCoeff[minK];
+	key.lumMid = (float)lumCoeff[midK];
+	key.lumMax = (float)lumCoeff[maxK];
+	key.keyAmount = (float)_keyAmount;
+	key.midpoint = (float)_midpoint;
+	key.invMidpoint = (float)(1. / _midpoint);
+	key.invOneMinusMidpoint = (float)(1. / (1. - _midpoint));
+	key.shadows = (float)_shadows;
+	key.midtones = (float)_midtones;
+	key.highlights = (float)_highlights;
+	key.bal = (float)_keyBalance;
+	key.keyMinRatio = (float)_keyMinRatio;
+	key.keyMidRatio = (float)_keyMidRatio;
+	key.alphaFactor = (float)_alphaFactor;
+
+        // the source channels in min, mid, max order, then the despilled channels (computed in place),
+        // the key amount factor then the matte (in place), the core and the garbage mattes
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> rowBuf((size_t)width * 6);
+        float *rowMin = &rowBuf[0];
+        float *rowMid = &rowBuf[width];
+        float *rowMax = &rowBuf[(size_t)2 * width];
+        float *rowMatte = &rowBuf[(size_t)3 * width];
+        float *rowCore = &rowBuf[(size_t)4 * width];
+        float *rowGarbage = &rowBuf[(size_t)5 * width];
+
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            assert(dstPix);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-
+            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                const int i = x - procWindow.x1;
 	      // inputs
                 const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
-		//bg const PIX *bgPix = (const PIX *)  (_bgImg ? _bgImg->getPixelAddress(x, y) : 0);
                 const PIX *corePix = (const PIX *)  (_coreImg ? _coreImg->getPixelAddress(x, y) : 0);
                 const PIX *garbagePix = (const PIX *)  (_garbageImg ? _garbageImg->getPixelAddress(x, y) : 0);
 
 		// masks
                float core = corePix ? *corePix : 0.f;
-                if (_sourceAlpha == eSourceAlphaAddToCore && nComponents == 4 && srcPix) {
+                if (sourceAlpha == eSourceAlphaAddToCore && nComponents == 4 && srcPix) {
                     //  Add source Alpha to core
 		    core = (core + sampleToFloat<PIX,maxValue>(srcPix[3])) - (core * sampleToFloat<PIX,maxValue>(srcPix[3])) ;
                 }
                 float garbage = garbagePix ? *garbagePix : 0.f;
 
                 // clamp core and garbage in the [0,1] range
-                core = max(0.f,min(core,1.f));
-                garbage = max(0.f,min(garbage,1.f));
-
-	       	// which channel of the key colour is max
-		int minK = 0; 
-		int midK = 1; 
-		int maxK = 2; 
-		if(_keyColour.b <= _keyColour.r && _keyColour.r <= _keyColour.g ){
-		  minK = 2; 
-		  midK = 0; 
-		  maxK = 1; 
-		} else if (_keyColour.r <= _keyColour.b && _keyColour.b <= _keyColour.g ){
-		  minK = 0; 
-		  midK = 2; 
-		  maxK = 1; 
-		} else if (_keyColour.g <= _keyColour.b && _keyColour.b <= _keyColour.r ){
-		  minK = 1; 
-		  midK = 2; 
-		  maxK = 0; 
-		} else if (_keyColour.g <= _keyColour.r && _keyColour.r <= _keyColour.b ){
-		  minK = 1; 
-		  midK = 0; 
-		  maxK = 2; 
-		} else if (_keyColour.b <= _keyColour.g && _keyColour.g <= _keyColour.r ){
-		  minK = 2; 
-		  midK = 1; 
-		  maxK = 0; 
-		}
-		// K is for Key Colour
-		double K[3] = {_keyColour.r, _keyColour.g, _keyColour.b};
-		// R is for Replacement Colour
-		double R[3] = {_replacementColour.r, _replacementColour.g, _replacementColour.b};
+                rowCore[i] = max(0.f,min(core,1.f));
+                rowGarbage[i] = max(0.f,min(garbage,1.f));
+
 		// P is for source pixel
-                double P[3] = {(srcPix ? sampleToFloat<PIX,maxValue>(srcPix[0]) : 0.),
-			       (srcPix ? sampleToFloat<PIX,maxValue>(srcPix[1]) : 0.),
-			       (srcPix ? sampleToFloat<PIX,maxValue>(srcPix[2]) : 0.)};
-		// source pixel luminance
-		double origLum = rgb2luminance(P[0], P[1], P[2]);
+		rowMin[i] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[minK]) : 0.f;
+		rowMid[i] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[midK]) : 0.f;
+		rowMax[i] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[maxK]) : 0.f;
+		// We will apply the core matte to RGB by reducing the key amount
+		rowMatte[i] = _despillCore ? 1.f : (1.f - rowCore[i]);
+            }
+
+            // solve the channels and the matte of the whole row at once, in place
+            OFX::ColorRow::processRow(key, width, rowMin, rowMid, rowMax, rowMatte, rowMin, rowMid, rowMax, rowMatte);
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                const int i = x - procWindow.x1;
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+		//bg const PIX *bgPix = (const PIX *)  (_bgImg ? _bgImg->getPixelAddress(x, y) : 0);
+                const float core = rowCore[i];
+                const float garbage = rowGarbage[i];
 
 		// background
                 //bg double minBg = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[minK]) : 0.;
@@ -406,49 +586,12 @@ private:
                 //bg double maxBg = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[maxK]) : 0.;
 
 		// output pixel channels
-		double chan[3] = {P[0], P[1], P[2]};
-		double currMatte = 1.;
-		double amount = _keyAmount;
-		double lowlerp =  origLum/_midpoint;
-		double highlerp = (1-origLum)/(1-_midpoint);
-
-		// tune key amount
-		if (origLum <= _midpoint) {
-		  amount *= (1- lowlerp) * _shadows + lowlerp * _midtones;
-                } else if (origLum > _midpoint) {
-		  amount *= highlerp * _midtones + (1-highlerp) * _highlights;
-                }
-		
-		double amountRGB = amount;
-		// We will apply the core matte to RGB by reducing the key amount
-		double bal = _keyBalance;
-		if (!_despillCore) {
-		  amountRGB *= (1-(double)core);
-		}
-		if (!(K[minK] == 0. && K[midK] == 0. && K[maxK] == 0.) &&
-		    !(P[minK] == 0. && P[midK] == 0. && P[maxK] == 0.) && !(amountRGB==0.)) {
-		    // solve chan[minK]		
-		    double min1 = (P[minK]/(P[maxK]-bal*P[midK])-amountRGB*amountRGB*K[minK]/(K[maxK]-bal*K[midK]))
-		      / (1+P[minK]/(P[maxK]-bal*P[midK])-(2-bal)*amountRGB*amountRGB*K[minK]/(K[maxK]-bal*K[midK]));
-		    double min2 = min(P[minK],(P[maxK]-bal*P[midK])*min1/(1-min1));    
-		    chan[minK] = max(0.,min(min2,1.));
-		    // solve chan[midK]
-		    double mid1 = (P[midK]/(P[maxK]-(1-bal)*P[minK])-amountRGB*amountRGB*K[midK]/(K[maxK]-(1-bal)*K[minK]))
-		      / (1+P[midK]/(P[maxK]-(1-bal)*P[minK])-(1+bal)*amountRGB*amountRGB*K[midK]/(K[maxK]-(1-bal)*K[minK]));
-		    double mid2 = min(P[midK],(P[maxK]-(1-bal)*P[minK])*mid1/(1-mid1));
-		    chan[midK] = max(0.,min(mid2,1.));
-	  	    // solve chan[maxK]
-		    double max1 = min(P[maxK],(bal*min(P[midK],(P[maxK]-(1-bal)*P[minK])*mid1/(1-mid1))
-						 + (1-bal)*min(P[minK],(P[maxK]-bal*P[midK])*min1/(1-min1))));
-		    chan[maxK] = max(0.,min(max1,1.));
-		    // solve alpha
-		    double a1 = (1-K[maxK])+(bal*K[midK]+(1-bal)*K[minK]);
-		    double a2 = amount*amount*(1+a1/abs(1-a1));
-		    double a3 =  (1-P[maxK])-P[maxK]*(a2-(1+(bal*P[midK]+(1-bal)*P[minK])/P[maxK]*a2));
-		    double a4 = max(chan[midK],max(a3,chan[minK]));
-		    currMatte = max(0.,min(a4,1.)); //alpha
-		}
-                double sourceMatte = (_sourceAlpha == eSourceAlphaNormal && srcPix) ? sampleToFloat<PIX,maxValue>(srcPix[3]) : 1.;
+		double chan[3];
+		chan[minK] = rowMin[i];
+		chan[midK] = rowMid[i];
+		chan[maxK] = rowMax[i];
+		const double currMatte = rowMatte[i];
+                double sourceMatte = (sourceAlpha == eSourceAlphaNormal && srcPix) ? sampleToFloat<PIX,maxValue>(srcPix[3]) : 1.;
 		// add core and garbage mattes and source alpha option 'Multiply'
 		double combMatte = (currMatte+(double)core - currMatte*(double)core) * (1-garbage) * sourceMatte;
 
@@ -460,9 +603,8 @@ private:
 		// SPILL REPLACEMENT		
 		if (_despillCore & !(R[minK] == 0. && R[midK] == 0. && R[maxK] == 0.)) {
 		  // give the spill replace colour the luminance of the despilled pixel
-		  double replaceLum = rgb2luminance(R[0], R[1], R[2]);
 		  double despilledLum = rgb2luminance(chan[0], chan[1], chan[2]);
-		  double lumFactor =  _preserveLuminance*(despilledLum/replaceLum-1.)+1.;
+		  double lumFactor =  _preserveLuminance*(despilledLum/_replaceLum-1.)+1.;
 		  // replacement amount
 		  chan[minK] += lumFactor * _replacementAmount * R[minK] * ((double)core - currMatte*(double)core);
 		  chan[midK] += lumFactor * _replacementAmount * R[midK] * ((double)core - currMatte*(double)core);
@@ -470,7 +612,7 @@ private:
 		}
 		
 		// OUTPUT MODE
-                switch (_outputMode) {
+                switch (outputMode) {
                     case eOutputModeIntermediate:
                         for (int c = 0; c < 3; ++c) {
                             dstPix[c] = srcPix ? srcPix[c] : 0;
@@ -514,7 +656,6 @@ private:
             }
         }
     }
-
 };
 
 
@@ -23,10 +23,15 @@
 #include "ImageStatistics.h"
 
 #include <cmath>
+#include <cstring>
 #include <climits>
 #include <algorithm>
+#include <limits>
+#include <sstream>
+#include <vector>
 
 #include "ofxsProcessing.H"
+#include "ofxsMultiThread.h"
 #include "ofxsRectangleInteract.h"
 #include "ofxsMacros.h"
 #include "ofxsCopier.h"
@@ -69,6 +74,10 @@ using std::isnan;
 #define kSupportsMultipleClipDepths false
 #define kRenderThreadSafety eRenderFullySafe
 
+// Maximum number of frames fetched and analyzed concurrently by "Analyze Sequence".
+// This bounds the number of source images held in memory at the same time.
+#define kSequenceAnalysisMaxFramesInFlight 8
+
 
 #define kParamRestrictToRectangle "restrictToRectangle"
 #define kParamRestrictToRectangleLabel "Restrict to Rectangle"
@@ -94,6 +103,10 @@ using std::isnan;
 #define kParamAutoUpdateLabel "Auto Update"
 #define kParamAutoUpdateHint "Automatically update values when input or rectangle changes if an analysis was performed at current frame. If not checked, values are only updated if the plugin parameters change. "
 
+#define kParamOutputHistogram "outputHistogram"
+#define kParamOutputHistogramLabel "Output Histogram"
+#define kParamOutputHistogramHint "Also store the histogram of each component when analyzing a frame or a sequence. Each line of the histogram parameter contains the component name, the min and max values, followed by the pixel counts in 256 bins evenly spaced between min and max."
+
 #define kParamGroupRGBA "RGBA"
 
 #define kParamStatMin "statMin"
@@ -133,6 +146,22 @@ using std::isnan;
 "• The skewness is unitless.\n" \
 "• Any threshold or rule of thumb is arbitrary, but here is one: If the skewness is greater than 1.0 (or less than -1.0), the skewness is substantial and the distribution is far from symmetrical."
 
+#define kParamStatP1 "statP1"
+#define kParamStatP1Label "1st Percentile"
+#define kParamStatP1Hint "1% of the values are lower than the 1st percentile. Less sensitive to outliers than the minimum."
+
+#define kParamStatMedian "statMedian"
+#define kParamStatMedianLabel "Median"
+#define kParamStatMedianHint "Half of the values are lower than the median. Less sensitive to outliers than the mean."
+
+#define kParamStatP99 "statP99"
+#define kParamStatP99Label "99th Percentile"
+#define kParamStatP99Hint "99% of the values are lower than the 99th percentile. Less sensitive to outliers than the maximum."
+
+#define kParamHistogram "histogram"
+#define kParamHistogramLabel "Histogram"
+#define kParamHistogramHint "Histogram of each component, computed only if Output Histogram is checked."
+
 
 #define kParamGroupHSVL "HSVL"
 
@@ -189,6 +218,22 @@ using std::isnan;
 "• The skewness is unitless.\n" \
 "• Any threshold or rule of thumb is arbitrary, but here is one: If the skewness is greater than 1.0 (or less than -1.0), the skewness is substantial and the distribution is far from symmetrical."
 
+#define kParamStatHSVLP1 "statHSVLP1"
+#define kParamStatHSVLP1Label "HSVL 1st Percentile"
+#define kParamStatHSVLP1Hint kParamStatP1Hint
+
+#define kParamStatHSVLMedian "statHSVLMedian"
+#define kParamStatHSVLMedianLabel "HSVL Median"
+#define kParamStatHSVLMedianHint kParamStatMedianHint
+
+#define kParamStatHSVLP99 "statHSVLP99"
+#define kParamStatHSVLP99Label "HSVL 99th Percentile"
+#define kParamStatHSVLP99Hint kParamStatP99Hint
+
+#define kParamHistogramHSVL "histogramHSVL"
+#define kParamHistogramHSVLLabel "HSVL Histogram"
+#define kParamHistogramHSVLHint kParamHistogramHint
+
 using namespace OFX;
 
 namespace {
@@ -205,638 +250,602 @@ namespace {
         RGBAValues sdev;
         RGBAValues skewness;
         RGBAValues kurtosis;
+        RGBAValues p1;
+        RGBAValues median;
+        RGBAValues p99;
+        std::vector<unsigned long> histogram[4]; // r, g, b, a histograms, with kHistogramOutputBins bins between min and max
     };
 }
 
-class ImageStatisticsProcessorBase : public OFX::ImageProcessor
+/**
+ * @brief min, max and central moments of order 1 to 4 of nComps components.
+ *
+ * Values are added with the online update formulas of Welford (variance) and Terriberry
+ * (higher-order moments), and accumulators are combined with the pairwise formulas of Chan et al.
+ * and Pebay, so that all statistics are computed in a single pass and stay numerically stable
+ * on large images.
+ */
+template <int nComps>
+struct MomentsAccumulator
 {
-protected:
-    OFX::MultiThread::Mutex _mutex; //< this is used so we can multi-thread the analysis and protect the shared results
-    unsigned long _count;
-
-public:
-    ImageStatisticsProcessorBase(OFX::ImageEffect &instance)
-    : OFX::ImageProcessor(instance)
-    , _mutex()
-    , _count(0)
+    double min[nComps];
+    double max[nComps];
+    double mean[nComps];
+    double m2[nComps]; // sum of (x-mean)^2
+    double m3[nComps]; // sum of (x-mean)^3
+    double m4[nComps]; // sum of (x-mean)^4
+    unsigned long count;
+
+    MomentsAccumulator()
+    : count(0)
     {
+        std::fill(min, min + nComps, +std::numeric_limits<double>::infinity());
+        std::fill(max, max + nComps, -std::numeric_limits<double>::infinity());
+        std::fill(mean, mean + nComps, 0.);
+        std::fill(m2, m2 + nComps, 0.);
+        std::fill(m3, m3 + nComps, 0.);
+        std::fill(m4, m4 + nComps, 0.);
     }
 
-    virtual ~ImageStatisticsProcessorBase()
+    template <class T>
+    void add(const T *x)
+    {
+        const double n1 = (double)count;
+        ++count;
+        const double n = (double)count;
+        const double inv_n = 1. / n;
+        for (int c = 0; c < nComps; ++c) {
+            const double v = x[c];
+            const double delta = v - mean[c];
+            const double delta_n = delta * inv_n;
+            const double delta_n2 = delta_n * delta_n;
+            const double term1 = delta * delta_n * n1;
+            mean[c] += delta_n;
+            m4[c] += term1 * delta_n2 * (n * n - 3 * n + 3) + 6 * delta_n2 * m2[c] - 4 * delta_n * m3[c];
+            m3[c] += term1 * delta_n * (n - 2) - 3 * delta_n * m2[c];
+            m2[c] += term1;
+            min[c] = std::min(min[c], v);
+            max[c] = std::max(max[c], v);
+        }
+    }
+
+    void merge(const MomentsAccumulator &other)
     {
+        if (other.count == 0) {
+            return;
+        }
+        if (count == 0) {
+            *this = other;
+            return;
+        }
+        const double na = (double)count;
+        const double nb = (double)other.count;
+        const double n = na + nb;
+        const double n2 = n * n;
+        for (int c = 0; c < nComps; ++c) {
+            const double delta = other.mean[c] - mean[c];
+            const double delta2 = delta * delta;
+            const double m2a = m2[c];
+            const double m3a = m3[c];
+            mean[c] += delta * nb / n;
+            m4[c] += (other.m4[c] + delta2 * delta2 * na * nb * (na * na - na * nb + nb * nb) / (n2 * n)
+                      + 6 * delta2 * (na * na * other.m2[c] + nb * nb * m2a) / n2
+                      + 4 * delta * (na * other.m3[c] - nb * m3a) / n);
+            m3[c] += (other.m3[c] + delta2 * delta * na * nb * (na - nb) / n2
+                      + 3 * delta * (na * other.m2[c] - nb * m2a) / n);
+            m2[c] += other.m2[c] + delta2 * na * nb / n;
+            min[c] = std::min(min[c], other.min[c]);
+            max[c] = std::max(max[c], other.max[c]);
+        }
+        count += other.count;
     }
+};
 
-    virtual void setPrevResults(const Results &results) = 0;
+// Number of bins of the histograms given by the "Output Histogram" option. These bins are evenly spaced
+// between the min and max values.
+#define kHistogramOutputBins 256
 
-    virtual void getResults(Results *results) = 0;
+/**
+ * @brief histogram bins for the values of type T.
+ *
+ * Integer values have one bin per value, so that percentiles are exact. Float values are binned
+ * adaptively, using the 16 most significant bits of their order-preserving integer representation
+ * (sign, exponent and 7 bits of mantissa): the bin width is proportional to the magnitude of the
+ * values (with a relative width of at most 2^-7), so that HDR and negative values are handled
+ * without having to know the range of the image beforehand.
+ */
+template <class T>
+struct HistogramBins;
 
-protected:
+template <>
+struct HistogramBins<unsigned char>
+{
+    static unsigned int nBins() { return 256; }
+    static bool isValid(unsigned char /*v*/) { return true; }
+    static unsigned int bin(unsigned char v) { return v; }
+    static double lower(unsigned int b) { return b; }
+    static double upper(unsigned int b) { return b; }
+};
 
-    template<class PIX, int nComponents, int maxValue>
-    void toRGBA(const PIX *p, RGBAValues* rgba)
+template <>
+struct HistogramBins<unsigned short>
+{
+    static unsigned int nBins() { return 65536; }
+    static bool isValid(unsigned short /*v*/) { return true; }
+    static unsigned int bin(unsigned short v) { return v; }
+    static double lower(unsigned int b) { return b; }
+    static double upper(unsigned int b) { return b; }
+};
+
+template <>
+struct HistogramBins<float>
+{
+    static unsigned int nBins() { return 65536; }
+    static bool isValid(float v) { return !isnan(v); }
+    static unsigned int bin(float v) { return toOrderedBits(v) >> 16; }
+    static double lower(unsigned int b) { return boundValue(b, fromOrderedBits(b << 16)); }
+    static double upper(unsigned int b) { return boundValue(b, fromOrderedBits((b << 16) | 0xffffu)); }
+
+private:
+    // map the float bits to an unsigned int with the same ordering as the float values
+    static unsigned int toOrderedBits(float v)
     {
-        if (nComponents == 4) {
-            rgba->r = p[0]/(double)maxValue;
-            rgba->g = p[1]/(double)maxValue;
-            rgba->b = p[2]/(double)maxValue;
-            rgba->a = p[3]/(double)maxValue;
-        } else if (nComponents == 3) {
-            rgba->r = p[0]/(double)maxValue;
-            rgba->g = p[1]/(double)maxValue;
-            rgba->b = p[2]/(double)maxValue;
-            rgba->a = 0;
-        } else if (nComponents == 2) {
-            rgba->r = p[0]/(double)maxValue;
-            rgba->g = p[1]/(double)maxValue;
-            rgba->b = 0;
-            rgba->a = 0;
-        } else if (nComponents == 1) {
-            rgba->r = 0;
-            rgba->g = 0;
-            rgba->b = 0;
-            rgba->a = p[0]/(double)maxValue;
-        } else {
-            rgba->r = 0;
-            rgba->g = 0;
-            rgba->b = 0;
-            rgba->a = 0;
-        }
+        unsigned int i;
+        std::memcpy(&i, &v, sizeof(i));
+        return (i & 0x80000000u) ? ~i : (i | 0x80000000u);
     }
 
-    template<class PIX, int nComponents, int maxValue>
-    void
-    pixToHSVL(const PIX *p, float hsvl[4])
+    static float fromOrderedBits(unsigned int i)
     {
-        if (nComponents == 4 || nComponents == 3) {
-            float r, g, b;
-            r = p[0]/(float)maxValue;
-            g = p[1]/(float)maxValue;
-            b = p[2]/(float)maxValue;
-            OFX::Color::rgb_to_hsv(r, g, b, &hsvl[0], &hsvl[1], &hsvl[2]);
-            float min = std::min(std::min(r, g), b);
-            float max = std::max(std::max(r, g), b);
-            hsvl[3] = (min + max)/2;
-        } else {
-            hsvl[0] = hsvl[1] = hsvl[2] = hsvl[3] = 0.f;
-        }
+        i = (i & 0x80000000u) ? (i & 0x7fffffffu) : ~i;
+        float v;
+        std::memcpy(&v, &i, sizeof(v));
+        return v;
     }
 
-    template<class PIX, int nComponents, int maxValue>
-    void toComponents(const RGBAValues& rgba, PIX *p)
+    // the bins of -inf and +inf also span NaN bit patterns: their bounds are the infinite value itself
+    static double boundValue(unsigned int b, float v)
     {
-        if (nComponents == 4) {
-            p[0] = rgba.r * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[1] = rgba.g * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[2] = rgba.b * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[3] = rgba.a * maxValue + ((maxValue != 1) ? 0.5 : 0);
-        } else if (nComponents == 3) {
-            p[0] = rgba.r * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[1] = rgba.g * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[2] = rgba.b * maxValue + ((maxValue != 1) ? 0.5 : 0);
-        } else if (nComponents == 2) {
-            p[0] = rgba.r * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[1] = rgba.g * maxValue + ((maxValue != 1) ? 0.5 : 0);
-        } else if (nComponents == 1) {
-            p[0] = rgba.a * maxValue + ((maxValue != 1) ? 0.5 : 0);
+        if (isnan(v)) {
+            return (b & 0x8000u) ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity();
         }
+        return v;
     }
 };
 
-
-template <class PIX, int nComponents, int maxValue>
-class ImageMinMaxMeanProcessor : public ImageStatisticsProcessorBase
+/**
+ * @brief histograms of nComps components of type T, accumulated by a single thread.
+ *
+ * Each thread has its own histogram, and since the counts are integers, merging them gives the same
+ * result whatever the number of threads.
+ */
+template <class T, int nComps>
+struct HistogramAccumulator
 {
-private:
-    double _min[nComponents];
-    double _max[nComponents];
-    double _sum[nComponents];
-public:
-    ImageMinMaxMeanProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_min, _min+nComponents, +std::numeric_limits<double>::infinity());
-        std::fill(_max, _max+nComponents, -std::numeric_limits<double>::infinity());
-        std::fill(_sum, _sum+nComponents, 0.);
-    }
+    std::vector<unsigned int> counts; // nComps histograms of HistogramBins<T>::nBins() bins
 
-    ~ImageMinMaxMeanProcessor()
+    HistogramAccumulator()
+    : counts()
     {
     }
 
-    void setPrevResults(const Results &/*results*/) OVERRIDE FINAL {}
-
-    void getResults(Results *results) OVERRIDE FINAL
+    void add(const T *x)
     {
-        if (_count > 0) {
-            toRGBA<double, nComponents, 1>(_min, &results->min);
-            toRGBA<double, nComponents, 1>(_max, &results->max);
-            double mean[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
-                mean[c] = _sum[c]/_count;
+        if (counts.empty()) {
+            // allocated by the thread that uses it
+            counts.assign(nComps * HistogramBins<T>::nBins(), 0);
+        }
+        const unsigned int nBins = HistogramBins<T>::nBins();
+        for (int c = 0; c < nComps; ++c) {
+            if (HistogramBins<T>::isValid(x[c])) {
+                ++counts[c * nBins + HistogramBins<T>::bin(x[c])];
             }
-            toRGBA<double, nComponents, 1>(mean, &results->mean);
         }
     }
 
-private:
-
-    void addResults(double min[nComponents], double max[nComponents], double sum[nComponents], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _min[c] = std::min(_min[c], min[c]);
-            _max[c] = std::max(_max[c], max[c]);
-            _sum[c] += sum[c];
+    void merge(const HistogramAccumulator &other)
+    {
+        if (other.counts.empty()) {
+            return;
+        }
+        if (counts.empty()) {
+            counts = other.counts;
+            return;
+        }
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            counts[i] += other.counts[i];
         }
-        _count += count;
-        _mutex.unlock();
     }
 
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    // value of the k-th smallest value (0-based) of component c, assuming the values are evenly spread within each bin
+    double orderStatistic(int c, unsigned long k) const
     {
-        double min[nComponents], max[nComponents], sum[nComponents];
-        std::fill(min, min+nComponents, +std::numeric_limits<double>::infinity());
-        std::fill(max, max+nComponents, -std::numeric_limits<double>::infinity());
-        std::fill(sum, sum + nComponents, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
+        const unsigned int nBins = HistogramBins<T>::nBins();
+        const unsigned int *h = &counts[c * nBins];
+        unsigned long cum = 0;
+        for (unsigned int b = 0; b < nBins; ++b) {
+            if (k < cum + h[b]) {
+                double lo = HistogramBins<T>::lower(b);
+                double hi = HistogramBins<T>::upper(b);
+                if (lo == hi) {
+                    return lo; // also avoids inf-inf in the infinite bins
+                }
+                return lo + (hi - lo) * ((k - cum) + 0.5) / h[b];
             }
+            cum += h[b];
+        }
+        assert(false);
+        return 0.;
+    }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponents, 0.);
+    // p-th percentile of component c, with linear interpolation between the closest ranks
+    double percentile(int c, double p) const
+    {
+        const unsigned int nBins = HistogramBins<T>::nBins();
+        unsigned long n = 0;
+        for (unsigned int b = 0; b < nBins; ++b) {
+            n += counts[c * nBins + b];
+        }
+        if (n == 0) {
+            return 0.;
+        }
+        double r = p / 100. * (n - 1);
+        unsigned long k = (unsigned long)std::floor(r);
+        double v = orderStatistic(c, k);
+        if (k + 1 < n && r > k) {
+            double v1 = orderStatistic(c, k + 1);
+            if (v1 != v) {
+                v += (r - k) * (v1 - v);
+            }
+        }
+        return v;
+    }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = *dstPix;
-                    min[c] = std::min(min[c], v);
-                    max[c] = std::max(max[c], v);
-                    sumLine[c] += v;
-                    ++dstPix;
-                }
+    // resample the histogram of component c to nOut bins evenly spaced in [vmin,vmax]
+    void resample(int c, double vmin, double vmax, int nOut, std::vector<unsigned long> *out) const
+    {
+        const unsigned int nBins = HistogramBins<T>::nBins();
+        const unsigned int *h = &counts[c * nBins];
+        out->assign(nOut, 0);
+        for (unsigned int b = 0; b < nBins; ++b) {
+            if (h[b] == 0) {
+                continue;
             }
-            for (int c = 0; c < nComponents; ++c) {
-                sum[c] += sumLine[c];
+            double v = (HistogramBins<T>::lower(b) + HistogramBins<T>::upper(b)) / 2;
+            double pos = (vmax > vmin) ? ((v - vmin) / (vmax - vmin) * nOut) : 0.;
+            // clamp before converting to int: pos may be infinite or NaN if the image has infinite values
+            int i = 0;
+            if (v == std::numeric_limits<double>::infinity() || pos >= nOut - 1) {
+                i = nOut - 1;
+            } else if (pos > 0.) {
+                i = (int)pos;
             }
-            count += procWindow.x2 - procWindow.x1;
+            (*out)[i] += h[b];
         }
-
-        addResults(min, max, sum, count);
     }
 };
 
+// The analysis window is split into blocks of kBlockRows rows. The partition only depends on the
+// analysis window, not on the number of threads: each block is accumulated by a single thread into
+// its own slot (so that no lock is needed), and the block results are merged after process() using a
+// pairwise tree reduction whose order only depends on the number of blocks.
+// The results are thus bit-identical whatever the number of threads.
+#define kBlockRows 16
 
-
-
-template <class PIX, int nComponents, int maxValue>
-class ImageSDevProcessor : public ImageStatisticsProcessorBase
+class ImageStatisticsProcessorBase : public OFX::ImageProcessor
 {
-private:
-    double _mean[nComponents];
-    double _sum_p2[nComponents];
+protected:
+    bool _doRGBA;
+    bool _doHSVL;
+    unsigned int _nBlocks;
+    std::vector<unsigned int> _blockThread; //< index of the thread which processed each block
+
 public:
-    ImageSDevProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
+    ImageStatisticsProcessorBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _doRGBA(false)
+    , _doHSVL(false)
+    , _nBlocks(0)
+    , _blockThread()
     {
-        std::fill(_mean, _mean+nComponents, 0.);
-        std::fill(_sum_p2, _sum_p2+nComponents, 0.);
     }
 
-    ~ImageSDevProcessor()
+    virtual ~ImageStatisticsProcessorBase()
     {
     }
 
-    void setPrevResults(const Results &results) OVERRIDE FINAL
+    /** @brief select which statistics are computed during the (single) pass over the image */
+    void setAnalysis(bool doRGBA, bool doHSVL)
     {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
+        _doRGBA = doRGBA;
+        _doHSVL = doHSVL;
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    /** @brief set the analysis window, and allocate one accumulator per block of kBlockRows rows */
+    void setAnalysisWindow(const OfxRectI &analysisWindow)
     {
-        if (_count > 1) {
-            double sdev[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
-                // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt(std::max(0., _sum_p2[c]/(_count-1)));
-            }
-            toRGBA<double, nComponents, 1>(sdev, &results->sdev);
-        }
+        setRenderWindow(analysisWindow);
+        int h = analysisWindow.y2 - analysisWindow.y1;
+        _nBlocks = (h > 0) ? (unsigned int)((h + kBlockRows - 1) / kBlockRows) : 0;
+        _blockThread.assign(_nBlocks, 0);
+        allocateBlocks(_nBlocks);
     }
 
-private:
-
-    void addResults(double sum_p2[nComponents], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p2[c] += sum_p2[c];
+    /** @brief process the analysis window, with at most one thread per block.
+     The analysis runs in the calling thread if it was itself spawned by the host (e.g. when analyzing
+     a sequence), since the multithread suite may not be called recursively. */
+    void processBlocks()
+    {
+        if (_nBlocks == 0 || _effect.abort()) {
+            return;
         }
-        _count += count;
-        _mutex.unlock();
+        unsigned int nThreads = OFX::MultiThread::isSpawnedThread() ? 1 : std::min(OFX::MultiThread::getNumCPUs(), _nBlocks);
+        nThreads = std::max(1u, nThreads);
+        allocateThreads(nThreads);
+        multiThread(nThreads);
     }
 
+    virtual void getResults(Results *resultsRGBA, Results *resultsHSVL) = 0;
 
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
-    {
-        double sum_p2[nComponents];
-        std::fill(sum_p2, sum_p2 + nComponents, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine_p2[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponents, 0.);
+protected:
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = (*dstPix - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                    ++dstPix;
-                }
+    template<int nComps>
+    void toResults(const MomentsAccumulator<nComps> &acc, Results *results)
+    {
+        const unsigned long count = acc.count;
+        if (count > 0) {
+            toRGBA<double, nComps, 1>(acc.min, &results->min);
+            toRGBA<double, nComps, 1>(acc.max, &results->max);
+            toRGBA<double, nComps, 1>(acc.mean, &results->mean);
+        }
+        double sdev[nComps];
+        std::fill(sdev, sdev + nComps, 0.);
+        if (count > 1) {
+            for (int c = 0; c < nComps; ++c) {
+                // sdev^2 is an unbiased estimator for the population variance
+                sdev[c] = std::sqrt(std::max(0., acc.m2[c]/(count-1)));
             }
-            for (int c = 0; c < nComponents; ++c) {
-                sum_p2[c] += sumLine_p2[c];
+            toRGBA<double, nComps, 1>(sdev, &results->sdev);
+        }
+        // sums of the standardized values (x-mean)/sdev to the powers 3 and 4
+        double sum_p3[nComps];
+        double sum_p4[nComps];
+        for (int c = 0; c < nComps; ++c) {
+            if (sdev[c] > 0.) {
+                double sdev2 = sdev[c] * sdev[c];
+                sum_p3[c] = acc.m3[c] / (sdev2 * sdev[c]);
+                sum_p4[c] = acc.m4[c] / (sdev2 * sdev2);
+            } else {
+                sum_p3[c] = sum_p4[c] = 0.;
             }
-            count += procWindow.x2 - procWindow.x1;
         }
-
-        addResults(sum_p2, count);
-    }
-};
-
-
-
-
-template <class PIX, int nComponents, int maxValue>
-class ImageSkewnessKurtosisProcessor : public ImageStatisticsProcessorBase
-{
-private:
-    double _mean[nComponents];
-    double _sdev[nComponents];
-    double _sum_p3[nComponents];
-    double _sum_p4[nComponents];
-public:
-    ImageSkewnessKurtosisProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean+nComponents, 0.);
-        std::fill(_sdev, _sdev+nComponents, 0.);
-        std::fill(_sum_p3, _sum_p3+nComponents, 0.);
-        std::fill(_sum_p4, _sum_p4+nComponents, 0.);
-    }
-
-    ~ImageSkewnessKurtosisProcessor()
-    {
-    }
-
-    void setPrevResults(const Results &results) OVERRIDE FINAL
-    {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
-        toComponents<double, nComponents, 1>(results.sdev, _sdev);
-    }
-
-    void getResults(Results *results) OVERRIDE FINAL
-    {
-        if (_count > 2) {
-            double skewness[nComponents];
+        if (count > 2) {
+            double skewness[nComps];
             // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
-            double skewfac = ((double)_count*_count) / ((double)(_count-1)*(_count-2));
+            double skewfac = ((double)count*count) / ((double)(count-1)*(count-2));
             assert(!isnan(skewfac));
-            for (int c = 0; c < nComponents; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
+            for (int c = 0; c < nComps; ++c) {
+                skewness[c] = skewfac * sum_p3[c] / count;
             }
-            toRGBA<double, nComponents, 1>(skewness, &results->skewness);
+            toRGBA<double, nComps, 1>(skewness, &results->skewness);
             assert(!isnan(results->skewness.r) && !isnan(results->skewness.g) && !isnan(results->skewness.b) && !isnan(results->skewness.a));
         }
-        if (_count > 3) {
-            double kurtosis[nComponents];
-            double kurtfac = ((double)(_count+1)*_count) / ((double)(_count-1)*(_count-2)*(_count-3));
-            double kurtshift = -3 * ((double)(_count-1)*(_count-1)) / ((double)(_count-2)*(_count-3));
+        if (count > 3) {
+            double kurtosis[nComps];
+            double kurtfac = ((double)(count+1)*count) / ((double)(count-1)*(count-2)*(count-3));
+            double kurtshift = -3 * ((double)(count-1)*(count-1)) / ((double)(count-2)*(count-3));
             assert(!isnan(kurtfac) && !isnan(kurtshift));
-            for (int c = 0; c < nComponents; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
+            for (int c = 0; c < nComps; ++c) {
+                kurtosis[c] = kurtfac * sum_p4[c] + kurtshift;
             }
-            toRGBA<double, nComponents, 1>(kurtosis, &results->kurtosis);
+            toRGBA<double, nComps, 1>(kurtosis, &results->kurtosis);
             assert(!isnan(results->kurtosis.r) && !isnan(results->kurtosis.g) && !isnan(results->kurtosis.b) && !isnan(results->kurtosis.a));
         }
     }
 
-private:
-
-    void addResults(double sum_p3[nComponents], double sum_p4[nComponents], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
-        }
-        _count += count;
-        _mutex.unlock();
-    }
-
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    /** @brief index of the thread running multiThreadProcessImages(procWindow) */
+    unsigned int threadIndex(const OfxRectI &procWindow) const
     {
-        double sum_p3[nComponents];
-        double sum_p4[nComponents];
-        std::fill(sum_p3, sum_p3 + nComponents, 0.);
-        std::fill(sum_p4, sum_p4 + nComponents, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine_p3[nComponents]; // partial sum to avoid underflows
-            double sumLine_p4[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponents, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (*dstPix - _mean[c])/_sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
-                    }
-                    ++dstPix;
-                }
-            }
-            for (int c = 0; c < nComponents; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
-        }
-        
-        addResults(sum_p3, sum_p4, count);
+        return _blockThread[blockIndex(procWindow)];
     }
-};
 
-#define nComponentsHSVL 4
-
-template <class PIX, int nComponents, int maxValue>
-class ImageHSVLMinMaxMeanProcessor : public ImageStatisticsProcessorBase
-{
-private:
-    double _min[nComponentsHSVL];
-    double _max[nComponentsHSVL];
-    double _sum[nComponentsHSVL];
-public:
-    ImageHSVLMinMaxMeanProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
+    template<class T, int nComps>
+    void histogramToResults(const HistogramAccumulator<T, nComps> &acc, Results *results)
     {
-        std::fill(_min, _min+nComponentsHSVL, +std::numeric_limits<double>::infinity());
-        std::fill(_max, _max+nComponentsHSVL, -std::numeric_limits<double>::infinity());
-        std::fill(_sum, _sum+nComponentsHSVL, 0.);
-    }
-
-    ~ImageHSVLMinMaxMeanProcessor()
+        if (acc.counts.empty()) {
+            return;
+        }
+        double p1[nComps];
+        double median[nComps];
+        double p99[nComps];
+        for (int c = 0; c < nComps; ++c) {
+            p1[c] = acc.percentile(c, 1.);
+            median[c] = acc.percentile(c, 50.);
+            p99[c] = acc.percentile(c, 99.);
+        }
+        toRGBA<double, nComps, 1>(p1, &results->p1);
+        toRGBA<double, nComps, 1>(median, &results->median);
+        toRGBA<double, nComps, 1>(p99, &results->p99);
+        // same component mapping as toRGBA
+        const double vmin[4] = { results->min.r, results->min.g, results->min.b, results->min.a };
+        const double vmax[4] = { results->max.r, results->max.g, results->max.b, results->max.a };
+        for (int c = 0; c < nComps; ++c) {
+            int i = (nComps == 1) ? 3 : c;
+            acc.resample(c, vmin[i], vmax[i], kHistogramOutputBins, &results->histogram[i]);
+        }
+    }
+
+    /** @brief index of the block processed by multiThreadProcessImages(procWindow) */
+    unsigned int blockIndex(const OfxRectI &procWindow) const
     {
+        assert((procWindow.y1 - _renderWindow.y1) % kBlockRows == 0);
+        unsigned int b = (procWindow.y1 - _renderWindow.y1) / kBlockRows;
+        assert(b < _nBlocks);
+        return b;
     }
 
-    void setPrevResults(const Results &/*results*/) OVERRIDE FINAL {}
-
-    void getResults(Results *results) OVERRIDE FINAL
+    /** @brief merge the block accumulators pairwise, in a fixed order, and return the total in *total */
+    template<class Accumulator>
+    static void reduceBlocks(std::vector<Accumulator> &blocks, Accumulator *total)
     {
-        if (_count > 0) {
-            toRGBA<double, nComponentsHSVL, 1>(_min, &results->min);
-            toRGBA<double, nComponentsHSVL, 1>(_max, &results->max);
-            double mean[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                mean[c] = _sum[c]/_count;
+        const std::size_t n = blocks.size();
+        for (std::size_t stride = 1; stride < n; stride *= 2) {
+            for (std::size_t i = 0; i + stride < n; i += 2 * stride) {
+                blocks[i].merge(blocks[i + stride]);
             }
-            toRGBA<double, nComponentsHSVL, 1>(mean, &results->mean);
         }
+        *total = n ? blocks[0] : Accumulator();
     }
 
 private:
 
-    void addResults(double min[nComponentsHSVL], double max[nComponentsHSVL], double sum[nComponentsHSVL], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _min[c] = std::min(_min[c], min[c]);
-            _max[c] = std::max(_max[c], max[c]);
-            _sum[c] += sum[c];
-        }
-        _count += count;
-        _mutex.unlock();
-    }
+    virtual void allocateBlocks(unsigned int nBlocks) = 0;
 
+    virtual void allocateThreads(unsigned int nThreads) = 0;
 
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    /** @brief overridden from OFX::ImageProcessor: give whole blocks to each thread, so that each
+     block accumulator is only ever written by one thread */
+    void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
     {
-        double min[nComponentsHSVL], max[nComponentsHSVL], sum[nComponentsHSVL];
-        std::fill(min, min+nComponentsHSVL, +std::numeric_limits<double>::infinity());
-        std::fill(max, max+nComponentsHSVL, -std::numeric_limits<double>::infinity());
-        std::fill(sum, sum + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+        unsigned int b1 = (threadId * _nBlocks) / nThreads;
+        unsigned int b2 = ((threadId + 1) * _nBlocks) / nThreads;
+        for (unsigned int b = b1; b < b2; ++b) {
             if (_effect.abort()) {
-                break;
+                return;
             }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = hsvl[c];
-                    min[c] = std::min(min[c], v);
-                    max[c] = std::max(max[c], v);
-                    sumLine[c] += v;
-                }
-                dstPix += nComponents;
-            }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum[c] += sumLine[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
+            OfxRectI win = _renderWindow;
+            win.y1 = _renderWindow.y1 + b * kBlockRows;
+            win.y2 = std::min(win.y1 + kBlockRows, _renderWindow.y2);
+            _blockThread[b] = threadId;
+            multiThreadProcessImages(win);
         }
-
-        addResults(min, max, sum, count);
-    }
-};
-
-
-
-
-template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSDevProcessor : public ImageStatisticsProcessorBase
-{
-private:
-    double _mean[nComponentsHSVL];
-    double _sum_p2[nComponentsHSVL];
-public:
-    ImageHSVLSDevProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean+nComponentsHSVL, 0.);
-        std::fill(_sum_p2, _sum_p2+nComponentsHSVL, 0.);
-    }
-
-    ~ImageHSVLSDevProcessor()
-    {
     }
 
-    void setPrevResults(const Results &results) OVERRIDE FINAL
-    {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
-    }
+protected:
 
-    void getResults(Results *results) OVERRIDE FINAL
+    template<class PIX, int nComponents, int maxValue>
+    void toRGBA(const PIX *p, RGBAValues* rgba)
     {
-        if (_count > 1) {
-            double sdev[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt(std::max(0., _sum_p2[c]/(_count-1)));
-            }
-            toRGBA<double, nComponentsHSVL, 1>(sdev, &results->sdev);
-        }
-    }
-
-private:
-
-    void addResults(double sum_p2[nComponentsHSVL], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p2[c] += sum_p2[c];
+        if (nComponents == 4) {
+            rgba->r = p[0]/(double)maxValue;
+            rgba->g = p[1]/(double)maxValue;
+            rgba->b = p[2]/(double)maxValue;
+            rgba->a = p[3]/(double)maxValue;
+        } else if (nComponents == 3) {
+            rgba->r = p[0]/(double)maxValue;
+            rgba->g = p[1]/(double)maxValue;
+            rgba->b = p[2]/(double)maxValue;
+            rgba->a = 0;
+        } else if (nComponents == 2) {
+            rgba->r = p[0]/(double)maxValue;
+            rgba->g = p[1]/(double)maxValue;
+            rgba->b = 0;
+            rgba->a = 0;
+        } else if (nComponents == 1) {
+            rgba->r = 0;
+            rgba->g = 0;
+            rgba->b = 0;
+            rgba->a = p[0]/(double)maxValue;
+        } else {
+            rgba->r = 0;
+            rgba->g = 0;
+            rgba->b = 0;
+            rgba->a = 0;
         }
-        _count += count;
-        _mutex.unlock();
     }
 
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    template<class PIX, int nComponents, int maxValue>
+    void
+    pixToHSVL(const PIX *p, float hsvl[4])
     {
-        double sum_p2[nComponentsHSVL];
-        std::fill(sum_p2, sum_p2 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine_p2[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = (hsvl[c] - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                }
-                dstPix += nComponents;
-            }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p2[c] += sumLine_p2[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
+        if (nComponents == 4 || nComponents == 3) {
+            float r, g, b;
+            r = p[0]/(float)maxValue;
+            g = p[1]/(float)maxValue;
+            b = p[2]/(float)maxValue;
+            OFX::Color::rgb_to_hsv(r, g, b, &hsvl[0], &hsvl[1], &hsvl[2]);
+            float min = std::min(std::min(r, g), b);
+            float max = std::max(std::max(r, g), b);
+            hsvl[3] = (min + max)/2;
+        } else {
+            hsvl[0] = hsvl[1] = hsvl[2] = hsvl[3] = 0.f;
         }
-
-        addResults(sum_p2, count);
     }
 };
 
 
+#define nComponentsHSVL 4
 
-
+// compute RGBA and/or HSVL statistics in a single pass over the image
 template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSkewnessKurtosisProcessor : public ImageStatisticsProcessorBase
+class ImageStatisticsProcessor : public ImageStatisticsProcessorBase
 {
 private:
-    double _mean[nComponentsHSVL];
-    double _sdev[nComponentsHSVL];
-    double _sum_p3[nComponentsHSVL];
-    double _sum_p4[nComponentsHSVL];
+    typedef MomentsAccumulator<nComponents> AccumulatorRGBA;
+    typedef MomentsAccumulator<nComponentsHSVL> AccumulatorHSVL;
+    typedef HistogramAccumulator<PIX, nComponents> HistogramRGBA;
+    typedef HistogramAccumulator<float, nComponentsHSVL> HistogramHSVL;
+    std::vector<AccumulatorRGBA> _blocksRGBA;
+    std::vector<AccumulatorHSVL> _blocksHSVL;
+    std::vector<HistogramRGBA> _histogramsRGBA; // one per thread
+    std::vector<HistogramHSVL> _histogramsHSVL; // one per thread
 public:
-    ImageHSVLSkewnessKurtosisProcessor(OFX::ImageEffect &instance)
+    ImageStatisticsProcessor(OFX::ImageEffect &instance)
     : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean+nComponentsHSVL, 0.);
-        std::fill(_sdev, _sdev+nComponentsHSVL, 0.);
-        std::fill(_sum_p3, _sum_p3+nComponentsHSVL, 0.);
-        std::fill(_sum_p4, _sum_p4+nComponentsHSVL, 0.);
-    }
-
-    ~ImageHSVLSkewnessKurtosisProcessor()
+    , _blocksRGBA()
+    , _blocksHSVL()
+    , _histogramsRGBA()
+    , _histogramsHSVL()
     {
     }
 
-    void setPrevResults(const Results &results) OVERRIDE FINAL
+    ~ImageStatisticsProcessor()
     {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
-        toComponents<double, nComponentsHSVL, 1>(results.sdev, _sdev);
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    void getResults(Results *resultsRGBA, Results *resultsHSVL) OVERRIDE FINAL
     {
-        if (_count > 2) {
-            double skewness[nComponentsHSVL];
-            // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
-            double skewfac = ((double)_count*_count) / ((double)(_count-1)*(_count-2));
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
+        if (_doRGBA && resultsRGBA) {
+            AccumulatorRGBA total;
+            reduceBlocks(_blocksRGBA, &total);
+            toResults<nComponents>(total, resultsRGBA);
+            HistogramRGBA histogram;
+            for (std::size_t i = 0; i < _histogramsRGBA.size(); ++i) {
+                histogram.merge(_histogramsRGBA[i]);
             }
-            toRGBA<double, nComponentsHSVL, 1>(skewness, &results->skewness);
+            histogramToResults(histogram, resultsRGBA);
         }
-        if (_count > 3) {
-            double kurtosis[nComponentsHSVL];
-            double kurtfac = ((double)(_count+1)*_count) / ((double)(_count-1)*(_count-2)*(_count-3));
-            double kurtshift = -3 * ((double)(_count-1)*(_count-1)) / ((double)(_count-2)*(_count-3));
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
+        if (_doHSVL && resultsHSVL) {
+            AccumulatorHSVL total;
+            reduceBlocks(_blocksHSVL, &total);
+            toResults<nComponentsHSVL>(total, resultsHSVL);
+            HistogramHSVL histogram;
+            for (std::size_t i = 0; i < _histogramsHSVL.size(); ++i) {
+                histogram.merge(_histogramsHSVL[i]);
             }
-            toRGBA<double, nComponentsHSVL, 1>(kurtosis, &results->kurtosis);
+            histogramToResults(histogram, resultsHSVL);
         }
     }
 
 private:
 
-    void addResults(double sum_p3[nComponentsHSVL], double sum_p4[nComponentsHSVL], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
-        }
-        _count += count;
-        _mutex.unlock();
+    void allocateBlocks(unsigned int nBlocks) OVERRIDE FINAL
+    {
+        _blocksRGBA.assign(_doRGBA ? nBlocks : 0, AccumulatorRGBA());
+        _blocksHSVL.assign(_doHSVL ? nBlocks : 0, AccumulatorHSVL());
     }
 
+    void allocateThreads(unsigned int nThreads) OVERRIDE FINAL
+    {
+        // the bins themselves are allocated by each thread on first use
+        _histogramsRGBA.assign(_doRGBA ? nThreads : 0, HistogramRGBA());
+        _histogramsHSVL.assign(_doHSVL ? nThreads : 0, HistogramHSVL());
+    }
 
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
     {
-        double sum_p3[nComponentsHSVL];
-        double sum_p4[nComponentsHSVL];
-        std::fill(sum_p3, sum_p3 + nComponentsHSVL, 0.);
-        std::fill(sum_p4, sum_p4 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
+        const unsigned int b = blockIndex(procWindow);
+        const unsigned int t = threadIndex(procWindow);
         assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
                _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
@@ -844,34 +853,33 @@ private:
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine_p3[nComponentsHSVL]; // partial sum to avoid underflows
-            double sumLine_p4[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponentsHSVL, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponentsHSVL, 0.);
+            const PIX *dstPix = (const PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (hsvl[c] - _mean[c])/_sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
-                    }
+            // accumulate each line separately before merging, to keep the running sums small.
+            // The line is still in cache when it is analyzed a second time as HSVL.
+            if (_doRGBA) {
+                AccumulatorRGBA accLine;
+                const PIX *p = dstPix;
+                for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                    accLine.add(p);
+                    _histogramsRGBA[t].add(p);
+                    p += nComponents;
                 }
-                dstPix += nComponents;
-            }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
+                _blocksRGBA[b].merge(accLine);
+            }
+            if (_doHSVL) {
+                AccumulatorHSVL accLine;
+                const PIX *p = dstPix;
+                for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                    float hsvl[nComponentsHSVL];
+                    pixToHSVL<PIX, nComponents, maxValue>(p, hsvl);
+                    accLine.add(hsvl);
+                    _histogramsHSVL[t].add(hsvl);
+                    p += nComponents;
+                }
+                _blocksHSVL[b].merge(accLine);
             }
-            count += procWindow.x2 - procWindow.x1;
         }
-        
-        addResults(sum_p3, sum_p4, count);
     }
 };
 
@@ -905,14 +913,19 @@ public:
         _interactive = fetchBooleanParam(kParamRectangleInteractInteractive);
         _restrictToRectangle = fetchBooleanParam(kParamRestrictToRectangle);
         _autoUpdate = fetchBooleanParam(kParamAutoUpdate);
-        assert(_btmLeft && _size && _interactive && _restrictToRectangle && _autoUpdate);
+        _outputHistogram = fetchBooleanParam(kParamOutputHistogram);
+        assert(_btmLeft && _size && _interactive && _restrictToRectangle && _autoUpdate && _outputHistogram);
         _statMin = fetchRGBAParam(kParamStatMin);
         _statMax = fetchRGBAParam(kParamStatMax);
         _statMean = fetchRGBAParam(kParamStatMean);
         _statSDev = fetchRGBAParam(kParamStatSDev);
         _statSkewness = fetchRGBAParam(kParamStatSkewness);
         _statKurtosis = fetchRGBAParam(kParamStatKurtosis);
-        assert(_statMin && _statMax && _statMean && _statSDev && _statSkewness);
+        _statP1 = fetchRGBAParam(kParamStatP1);
+        _statMedian = fetchRGBAParam(kParamStatMedian);
+        _statP99 = fetchRGBAParam(kParamStatP99);
+        _histogram = fetchStringParam(kParamHistogram);
+        assert(_statMin && _statMax && _statMean && _statSDev && _statSkewness && _statP1 && _statMedian && _statP99 && _histogram);
         _analyzeFrame = fetchPushButtonParam(kParamAnalyzeFrame);
         _analyzeSequence = fetchPushButtonParam(kParamAnalyzeSequence);
         assert(_analyzeFrame && _analyzeSequence);
@@ -922,7 +935,11 @@ public:
         _statHSVLSDev = fetchRGBAParam(kParamStatHSVLSDev);
         _statHSVLSkewness = fetchRGBAParam(kParamStatHSVLSkewness);
         _statHSVLKurtosis = fetchRGBAParam(kParamStatHSVLKurtosis);
-        assert(_statHSVLMin && _statHSVLMax && _statHSVLMean && _statHSVLSDev && _statHSVLSkewness);
+        _statHSVLP1 = fetchRGBAParam(kParamStatHSVLP1);
+        _statHSVLMedian = fetchRGBAParam(kParamStatHSVLMedian);
+        _statHSVLP99 = fetchRGBAParam(kParamStatHSVLP99);
+        _histogramHSVL = fetchStringParam(kParamHistogramHSVL);
+        assert(_statHSVLMin && _statHSVLMax && _statHSVLMean && _statHSVLSDev && _statHSVLSkewness && _statHSVLP1 && _statHSVLMedian && _statHSVLP99 && _histogramHSVL);
         _analyzeFrameHSVL = fetchPushButtonParam(kParamAnalyzeFrameHSVL);
         _analyzeSequenceHSVL = fetchPushButtonParam(kParamAnalyzeSequenceHSVL);
         assert(_analyzeFrameHSVL && _analyzeSequenceHSVL);
@@ -955,37 +972,128 @@ private:
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
     /* set up and run a processor */
-    void setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results &prevResults, Results *results);
+    void setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, bool doRGBA, bool doHSVL, Results *resultsRGBA, Results *resultsHSVL);
+
+    // compute the analyzed region, in canonical coordinates
+    void computeRegionOfInterest(double time, OfxRectD *regionOfInterest);
 
     // compute computation window in srcImg
     bool computeWindow(const OFX::Image* srcImg, double time, OfxRectI *analysisWindow);
+    static bool computeWindow(const OFX::Image* srcImg, const OfxRectD &regionOfInterest, OfxRectI *analysisWindow);
+
+    // update image statistics (RGBA and/or HSVL, computed in a single pass)
+    void update(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow, bool doRGBA, bool doHSVL);
 
-    // update image statistics
-    void update(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow);
-    void updateHSVL(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow);
+    // set the statistics keyframes at the given time
+    void setResults(double time, bool doRGBA, bool doHSVL, const Results &results, const Results &resultsHSVL);
 
-    template <template<class PIX, int nComponents, int maxValue> class Processor, class PIX, int nComponents, int maxValue>
-    void updateSubComponentsDepth(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results& prevResults, Results* results)
+    static std::string histogramToString(const Results &results, const char* const names[4]);
+
+    // analyze the whole input sequence, several frames at a time
+    void analyzeSequence(const OfxPointD &renderScale, bool doRGBA, bool doHSVL);
+
+    struct FrameAnalysis
+    {
+        double time;
+        OfxRectD regionOfInterest; // computed by the main thread, so that analysis threads only fetch images
+        bool analyzed;
+        bool wrongScale;
+        bool failed;
+        Results results;
+        Results resultsHSVL;
+
+        FrameAnalysis()
+        : time(0.)
+        , analyzed(false)
+        , wrongScale(false)
+        , failed(false)
+        {
+            regionOfInterest.x1 = regionOfInterest.y1 = regionOfInterest.x2 = regionOfInterest.y2 = 0.;
+        }
+    };
+
+    // fetch and analyze one frame of the sequence (called from the analysis threads)
+    void analyzeFrame(FrameAnalysis *frame, const OfxPointD &renderScale, bool doRGBA, bool doHSVL);
+
+    // Fetches and analyzes the frames of the sequence concurrently: each thread takes the next frame which was not
+    // analyzed yet as soon as it is done with the previous one, so that fetching a frame overlaps with the
+    // analysis of the others, and a slow fetch only delays the thread that does it.
+    class SequenceAnalyzer : public OFX::MultiThread::Processor
     {
-        Processor<PIX, nComponents, maxValue> fred(*this);
-        setupAndProcess(fred, srcImg, time, analysisWindow, prevResults, results);
+    public:
+        SequenceAnalyzer(ImageStatisticsPlugin &effect, const OfxPointD &renderScale, bool doRGBA, bool doHSVL, std::vector<FrameAnalysis> &frames)
+        : _effect(effect)
+        , _renderScale(renderScale)
+        , _doRGBA(doRGBA)
+        , _doHSVL(doHSVL)
+        , _frames(frames)
+        , _mutex()
+        , _next(0)
+        , _done(0)
+        , _canceled(false)
+        {
+        }
+
+    private:
+        void multiThreadFunction(unsigned int /*threadId*/, unsigned int /*nThreads*/) OVERRIDE FINAL
+        {
+            for (;;) {
+                std::size_t i;
+                {
+                    OFX::MultiThread::AutoMutex lock(_mutex);
+                    if (_canceled) {
+                        return;
+                    }
+                    i = _next++;
+                }
+                if (i >= _frames.size() || _effect.abort()) {
+                    return;
+                }
+                _effect.analyzeFrame(&_frames[i], _renderScale, _doRGBA, _doHSVL);
+                {
+                    // report progress as frames complete, one thread at a time
+                    OFX::MultiThread::AutoMutex lock(_mutex);
+                    ++_done;
+                    if (!_canceled && !_effect.progressUpdate(_done / (double)_frames.size())) {
+                        _canceled = true;
+                    }
+                }
+            }
+        }
+
+        ImageStatisticsPlugin &_effect;
+        OfxPointD _renderScale;
+        bool _doRGBA;
+        bool _doHSVL;
+        std::vector<FrameAnalysis> &_frames;
+        OFX::MultiThread::Mutex _mutex; //< protects _next, _done, _canceled and the progress calls
+        std::size_t _next;
+        std::size_t _done;
+        bool _canceled;
+    };
+
+    template <class PIX, int nComponents, int maxValue>
+    void updateSubComponentsDepth(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, bool doRGBA, bool doHSVL, Results *resultsRGBA, Results *resultsHSVL)
+    {
+        ImageStatisticsProcessor<PIX, nComponents, maxValue> fred(*this);
+        setupAndProcess(fred, srcImg, time, analysisWindow, doRGBA, doHSVL, resultsRGBA, resultsHSVL);
     }
 
-    template <template<class PIX, int nComponents, int maxValue> class Processor, int nComponents>
-    void updateSubComponents(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results& prevResults, Results* results)
+    template <int nComponents>
+    void updateSubComponents(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, bool doRGBA, bool doHSVL, Results *resultsRGBA, Results *resultsHSVL)
     {
         OFX::BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
         switch (srcBitDepth) {
             case OFX::eBitDepthUByte: {
-                updateSubComponentsDepth<Processor, unsigned char, nComponents, 255>(srcImg, time, analysisWindow, prevResults, results);
+                updateSubComponentsDepth<unsigned char, nComponents, 255>(srcImg, time, analysisWindow, doRGBA, doHSVL, resultsRGBA, resultsHSVL);
                 break;
             }
             case OFX::eBitDepthUShort: {
-                updateSubComponentsDepth<Processor, unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, prevResults, results);
+                updateSubComponentsDepth<unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, doRGBA, doHSVL, resultsRGBA, resultsHSVL);
                 break;
             }
             case OFX::eBitDepthFloat: {
-                updateSubComponentsDepth<Processor, float, nComponents, 1>(srcImg, time, analysisWindow, prevResults, results);
+                updateSubComponentsDepth<float, nComponents, 1>(srcImg, time, analysisWindow, doRGBA, doHSVL, resultsRGBA, resultsHSVL);
                 break;
             }
             default:
@@ -993,17 +1101,16 @@ private:
         }
     }
 
-    template <template<class PIX, int nComponents, int maxValue> class Processor>
-    void updateSub(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results& prevResults, Results* results)
+    void updateSub(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, bool doRGBA, bool doHSVL, Results *resultsRGBA, Results *resultsHSVL)
     {
         OFX::PixelComponentEnum srcComponents  = srcImg->getPixelComponents();
         assert(srcComponents == OFX::ePixelComponentAlpha ||srcComponents == OFX::ePixelComponentRGB || srcComponents == OFX::ePixelComponentRGBA);
         if (srcComponents == OFX::ePixelComponentAlpha) {
-            updateSubComponents<Processor, 1>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<1>(srcImg, time, analysisWindow, doRGBA, doHSVL, resultsRGBA, resultsHSVL);
         } else if (srcComponents == OFX::ePixelComponentRGBA) {
-            updateSubComponents<Processor, 4>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<4>(srcImg, time, analysisWindow, doRGBA, doHSVL, resultsRGBA, resultsHSVL);
         } else if (srcComponents == OFX::ePixelComponentRGB) {
-            updateSubComponents<Processor, 3>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<3>(srcImg, time, analysisWindow, doRGBA, doHSVL, resultsRGBA, resultsHSVL);
         } else {
             // coverity[dead_error_line]
             OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
@@ -1021,12 +1128,17 @@ private:
     BooleanParam* _interactive;
     BooleanParam* _restrictToRectangle;
     BooleanParam* _autoUpdate;
+    BooleanParam* _outputHistogram;
     RGBAParam* _statMin;
     RGBAParam* _statMax;
     RGBAParam* _statMean;
     RGBAParam* _statSDev;
     RGBAParam* _statSkewness;
     RGBAParam* _statKurtosis;
+    RGBAParam* _statP1;
+    RGBAParam* _statMedian;
+    RGBAParam* _statP99;
+    StringParam* _histogram;
     PushButtonParam* _analyzeFrame;
     PushButtonParam* _analyzeSequence;
     RGBAParam* _statHSVLMin;
@@ -1035,6 +1147,10 @@ private:
     RGBAParam* _statHSVLSDev;
     RGBAParam* _statHSVLSkewness;
     RGBAParam* _statHSVLKurtosis;
+    RGBAParam* _statHSVLP1;
+    RGBAParam* _statHSVLMedian;
+    RGBAParam* _statHSVLP99;
+    StringParam* _histogramHSVL;
     PushButtonParam* _analyzeFrameHSVL;
     PushButtonParam* _analyzeSequenceHSVL;
 };
@@ -1090,17 +1206,12 @@ ImageStatisticsPlugin::render(const OFX::RenderArguments &args)
         assert(autoUpdate); // render should only be called if autoUpdate is true: in other cases isIdentity returns true
         if (autoUpdate) {
             // check if there is already a Keyframe, if yes update it
-            int k = _statMean->getKeyIndex(args.time, eKeySearchNear);
+            bool doRGBA = (_statMean->getKeyIndex(args.time, eKeySearchNear) != -1);
+            bool doHSVL = (_statHSVLMean->getKeyIndex(args.time, eKeySearchNear) != -1);
             OfxRectI analysisWindow;
             bool intersect = computeWindow(src.get(), args.time, &analysisWindow);
-            if (intersect) {
-                if (k != -1) {
-                    update(src.get(), args.time, analysisWindow);
-                }
-                k = _statHSVLMean->getKeyIndex(args.time, eKeySearchNear);
-                if (k != -1) {
-                    updateHSVL(src.get(), args.time, analysisWindow);
-                }
+            if (intersect && (doRGBA || doHSVL)) {
+                update(src.get(), args.time, analysisWindow, doRGBA, doHSVL);
             }
         }
     }
@@ -1218,6 +1329,10 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statSDev->deleteKeyAtTime(args.time);
         _statSkewness->deleteKeyAtTime(args.time);
         _statKurtosis->deleteKeyAtTime(args.time);
+        _statP1->deleteKeyAtTime(args.time);
+        _statMedian->deleteKeyAtTime(args.time);
+        _statP99->deleteKeyAtTime(args.time);
+        _histogram->deleteKeyAtTime(args.time);
     }
     if (paramName == kParamClearSequence) {
         _statMin->deleteAllKeys();
@@ -1226,6 +1341,10 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statSDev->deleteAllKeys();
         _statSkewness->deleteAllKeys();
         _statKurtosis->deleteAllKeys();
+        _statP1->deleteAllKeys();
+        _statMedian->deleteAllKeys();
+        _statP99->deleteAllKeys();
+        _histogram->deleteAllKeys();
     }
     if (paramName == kParamClearFrameHSVL) {
         _statHSVLMin->deleteKeyAtTime(args.time);
@@ -1234,6 +1353,10 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statHSVLSDev->deleteKeyAtTime(args.time);
         _statHSVLSkewness->deleteKeyAtTime(args.time);
         _statHSVLKurtosis->deleteKeyAtTime(args.time);
+        _statHSVLP1->deleteKeyAtTime(args.time);
+        _statHSVLMedian->deleteKeyAtTime(args.time);
+        _statHSVLP99->deleteKeyAtTime(args.time);
+        _histogramHSVL->deleteKeyAtTime(args.time);
     }
     if (paramName == kParamClearSequenceHSVL) {
         _statHSVLMin->deleteAllKeys();
@@ -1242,6 +1365,10 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statHSVLSDev->deleteAllKeys();
         _statHSVLSkewness->deleteAllKeys();
         _statHSVLKurtosis->deleteAllKeys();
+        _statHSVLP1->deleteAllKeys();
+        _statHSVLMedian->deleteAllKeys();
+        _statHSVLP99->deleteAllKeys();
+        _histogramHSVL->deleteAllKeys();
     }
     if (doUpdate) {
         // check if there is already a Keyframe, if yes update it
@@ -1265,12 +1392,7 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
 #             ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
                 getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
 #             endif
-                if (doAnalyzeRGBA) {
-                    update(src.get(), args.time, analysisWindow);
-                }
-                if (doAnalyzeHSVL) {
-                    updateHSVL(src.get(), args.time, analysisWindow);
-                }
+                update(src.get(), args.time, analysisWindow, doAnalyzeRGBA, doAnalyzeHSVL);
 #             ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
                 getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
 #             endif
@@ -1281,37 +1403,7 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
 #     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
         getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
 #     endif
-        progressStart("Analyzing sequence...");
-        OfxRangeD range = _srcClip->getFrameRange();
-        //timeLineGetBounds(range.min, range.max); // wrong: we want the input frame range only
-        int tmin = (int)std::ceil(range.min);
-        int tmax = (int)std::floor(range.max);
-        for (int t = tmin; t <= tmax; ++t) {
-            std::auto_ptr<OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
-                                          _srcClip->fetchImage(t) : 0);
-            if (src.get()) {
-                if (src->getRenderScale().x != args.renderScale.x ||
-                    src->getRenderScale().y != args.renderScale.y) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
-                bool intersect = computeWindow(src.get(), t, &analysisWindow);
-                if (intersect) {
-                    if (doAnalyzeSequenceRGBA) {
-                        update(src.get(), t, analysisWindow);
-                    }
-                    if (doAnalyzeSequenceHSVL) {
-                        updateHSVL(src.get(), t, analysisWindow);
-                    }
-                }
-            }
-            if (tmax != tmin) {
-                if (!progressUpdate((t-tmin)/(double)(tmax-tmin))) {
-                    break;
-                }
-            }
-        }
-        progressEnd();
+        analyzeSequence(args.renderScale, doAnalyzeSequenceRGBA, doAnalyzeSequenceHSVL);
 #     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
         getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
 #     endif
@@ -1320,29 +1412,29 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
 
 /* set up and run a processor */
 void
-ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double /*time*/, const OfxRectI &analysisWindow, const Results &prevResults, Results *results)
+ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double /*time*/, const OfxRectI &analysisWindow, bool doRGBA, bool doHSVL, Results *resultsRGBA, Results *resultsHSVL)
 {
 
     // set the images
     processor.setDstImg(const_cast<OFX::Image*>(srcImg)); // not a bug: we only set dst
 
-    // set the render window
-    processor.setRenderWindow(analysisWindow);
+    processor.setAnalysis(doRGBA, doHSVL);
 
-    processor.setPrevResults(prevResults);
+    // set the render window, split into blocks
+    processor.setAnalysisWindow(analysisWindow);
 
     // Call the base class process member, this will call the derived templated process code
-    processor.process();
+    processor.processBlocks();
 
     if (!abort()) {
-        processor.getResults(results);
+        processor.getResults(resultsRGBA, resultsHSVL);
     }
 }
 
-bool
-ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg, double time, OfxRectI *analysisWindow)
+void
+ImageStatisticsPlugin::computeRegionOfInterest(double time, OfxRectD *regionOfInterestResult)
 {
-    OfxRectD regionOfInterest;
+    OfxRectD &regionOfInterest = *regionOfInterestResult;
     bool restrictToRectangle;
     _restrictToRectangle->getValueAtTime(time, restrictToRectangle);
     if (!restrictToRectangle && _srcClip) {
@@ -1368,65 +1460,172 @@ ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg, double time, OfxR
         regionOfInterest.x2 += regionOfInterest.x1;
         regionOfInterest.y2 += regionOfInterest.y1;
     }
+}
+
+bool
+ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg, double time, OfxRectI *analysisWindow)
+{
+    OfxRectD regionOfInterest;
+    computeRegionOfInterest(time, &regionOfInterest);
+    return computeWindow(srcImg, regionOfInterest, analysisWindow);
+}
+
+bool
+ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg, const OfxRectD &regionOfInterest, OfxRectI *analysisWindow)
+{
     Coords::toPixelEnclosing(regionOfInterest,
                                     srcImg->getRenderScale(),
                                     srcImg->getPixelAspectRatio(),
                                     analysisWindow);
     return OFX::Coords::rectIntersection(*analysisWindow, srcImg->getBounds(), analysisWindow);
 }
+
 // update image statistics
 void
-ImageStatisticsPlugin::update(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow)
+ImageStatisticsPlugin::update(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, bool doRGBA, bool doHSVL)
 {
     // TODO: CHECK if checkDoubleAnalysis param is true and analysisWindow is the same as btmLeft/sizeAnalysis
-    Results results;
-    if (!abort()) {
-        updateSub<ImageMinMaxMeanProcessor>(srcImg, time, analysisWindow, results, &results);
-    }
-    if (!abort()) {
-        updateSub<ImageSDevProcessor>(srcImg, time, analysisWindow, results, &results);
+    if (!doRGBA && !doHSVL) {
+        return;
     }
+    Results results;
+    Results resultsHSVL;
     if (!abort()) {
-        updateSub<ImageSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, results, &results);
+        updateSub(srcImg, time, analysisWindow, doRGBA, doHSVL, &results, &resultsHSVL);
     }
     if (abort()) {
         return;
     }
-    beginEditBlock("updateStatisticsRGBA");
-    _statMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
-    _statMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
-    _statMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
-    _statSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
-    _statSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
-   // printf("skewness = %g %g %g %g\n", results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
-    _statKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
-    endEditBlock();
+    setResults(time, doRGBA, doHSVL, results, resultsHSVL);
 }
 
 void
-ImageStatisticsPlugin::updateHSVL(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow)
+ImageStatisticsPlugin::setResults(double time, bool doRGBA, bool doHSVL, const Results &results, const Results &resultsHSVL)
 {
-    Results results;
-    if (!abort()) {
-        updateSub<ImageHSVLMinMaxMeanProcessor>(srcImg, time, analysisWindow, results, &results);
+    bool outputHistogram = _outputHistogram->getValue();
+    if (doRGBA) {
+        beginEditBlock("updateStatisticsRGBA");
+        _statMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
+        _statMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
+        _statMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
+        _statSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
+        _statSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
+       // printf("skewness = %g %g %g %g\n", results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
+        _statKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
+        _statP1->setValueAtTime(time, results.p1.r, results.p1.g, results.p1.b, results.p1.a);
+        _statMedian->setValueAtTime(time, results.median.r, results.median.g, results.median.b, results.median.a);
+        _statP99->setValueAtTime(time, results.p99.r, results.p99.g, results.p99.b, results.p99.a);
+        if (outputHistogram) {
+            static const char* const names[4] = { "r", "g", "b", "a" };
+            _histogram->setValueAtTime(time, histogramToString(results, names));
+        }
+        endEditBlock();
+    }
+    if (doHSVL) {
+        beginEditBlock("updateStatisticsHSVL");
+        _statHSVLMin->setValueAtTime(time, resultsHSVL.min.r, resultsHSVL.min.g, resultsHSVL.min.b, resultsHSVL.min.a);
+        _statHSVLMax->setValueAtTime(time, resultsHSVL.max.r, resultsHSVL.max.g, resultsHSVL.max.b, resultsHSVL.max.a);
+        _statHSVLMean->setValueAtTime(time, resultsHSVL.mean.r, resultsHSVL.mean.g, resultsHSVL.mean.b, resultsHSVL.mean.a);
+        _statHSVLSDev->setValueAtTime(time, resultsHSVL.sdev.r, resultsHSVL.sdev.g, resultsHSVL.sdev.b, resultsHSVL.sdev.a);
+        _statHSVLSkewness->setValueAtTime(time, resultsHSVL.skewness.r, resultsHSVL.skewness.g, resultsHSVL.skewness.b, resultsHSVL.skewness.a);
+        _statHSVLKurtosis->setValueAtTime(time, resultsHSVL.kurtosis.r, resultsHSVL.kurtosis.g, resultsHSVL.kurtosis.b, resultsHSVL.kurtosis.a);
+        _statHSVLP1->setValueAtTime(time, resultsHSVL.p1.r, resultsHSVL.p1.g, resultsHSVL.p1.b, resultsHSVL.p1.a);
+        _statHSVLMedian->setValueAtTime(time, resultsHSVL.median.r, resultsHSVL.median.g, resultsHSVL.median.b, resultsHSVL.median.a);
+        _statHSVLP99->setValueAtTime(time, resultsHSVL.p99.r, resultsHSVL.p99.g, resultsHSVL.p99.b, resultsHSVL.p99.a);
+        if (outputHistogram) {
+            static const char* const names[4] = { "h", "s", "v", "l" };
+            _histogramHSVL->setValueAtTime(time, histogramToString(resultsHSVL, names));
+        }
+        endEditBlock();
     }
-    if (!abort()) {
-        updateSub<ImageHSVLSDevProcessor>(srcImg, time, analysisWindow, results, &results);
+}
+
+std::string
+ImageStatisticsPlugin::histogramToString(const Results &results, const char* const names[4])
+{
+    const double vmin[4] = { results.min.r, results.min.g, results.min.b, results.min.a };
+    const double vmax[4] = { results.max.r, results.max.g, results.max.b, results.max.a };
+    std::ostringstream ss;
+    for (int c = 0; c < 4; ++c) {
+        if (results.histogram[c].empty()) {
+            continue;
+        }
+        ss << names[c] << ' ' << vmin[c] << ' ' << vmax[c];
+        for (std::size_t i = 0; i < results.histogram[c].size(); ++i) {
+            ss << ' ' << results.histogram[c][i];
+        }
+        ss << '\n';
     }
-    if (!abort()) {
-        updateSub<ImageHSVLSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, results, &results);
+    return ss.str();
+}
+
+void
+ImageStatisticsPlugin::analyzeFrame(FrameAnalysis *frame, const OfxPointD &renderScale, bool doRGBA, bool doHSVL)
+{
+    // no exception may cross the host thread boundary: errors are reported to the main thread
+    try {
+        std::auto_ptr<const OFX::Image> src(_srcClip->fetchImage(frame->time));
+        if (!src.get()) {
+            return;
+        }
+        if (src->getRenderScale().x != renderScale.x ||
+            src->getRenderScale().y != renderScale.y) {
+            frame->wrongScale = true;
+            return;
+        }
+        OfxRectI analysisWindow;
+        bool intersect = computeWindow(src.get(), frame->regionOfInterest, &analysisWindow);
+        if (intersect) {
+            updateSub(src.get(), frame->time, analysisWindow, doRGBA, doHSVL, &frame->results, &frame->resultsHSVL);
+            frame->analyzed = !abort();
+        }
+    } catch (...) {
+        frame->failed = true;
     }
-    if (abort()) {
+}
+
+void
+ImageStatisticsPlugin::analyzeSequence(const OfxPointD &renderScale, bool doRGBA, bool doHSVL)
+{
+    progressStart("Analyzing sequence...");
+    OfxRangeD range = _srcClip->getFrameRange();
+    //timeLineGetBounds(range.min, range.max); // wrong: we want the input frame range only
+    int tmin = (int)std::ceil(range.min);
+    int tmax = (int)std::floor(range.max);
+    if (tmax < tmin) {
+        progressEnd();
+
         return;
     }
-    beginEditBlock("updateStatisticsHSVL");
-    _statHSVLMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
-    _statHSVLMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
-    _statHSVLMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
-    _statHSVLSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
-    _statHSVLSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
-    _statHSVLKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
-    endEditBlock();
+    // at most one frame in flight per analysis thread (the results of each frame are small, only the images are big)
+    unsigned int framesInFlight = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)kSequenceAnalysisMaxFramesInFlight);
+    framesInFlight = std::max(1u, std::min(framesInFlight, (unsigned int)(tmax - tmin + 1)));
+    std::vector<FrameAnalysis> frames(tmax - tmin + 1);
+    for (int t = tmin; t <= tmax; ++t) {
+        FrameAnalysis &frame = frames[t - tmin];
+        frame.time = t;
+        computeRegionOfInterest(t, &frame.regionOfInterest);
+    }
+
+    // the analysis threads run through the whole sequence, without waiting for each other
+    SequenceAnalyzer analyzer(*this, renderScale, doRGBA, doHSVL, frames);
+    analyzer.multiThread(framesInFlight);
+
+    // set the keyframes in time order (if the analysis was canceled, only the frames that were analyzed get keyframes)
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+        const FrameAnalysis &frame = frames[i];
+        if (frame.wrongScale) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        if (frame.failed) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        if (frame.analyzed) {
+            setResults(frame.time, doRGBA, doHSVL, frame.results, frame.resultsHSVL);
+        }
+    }
+    progressEnd();
 }
 
 class ImageStatisticsInteract : public RectangleInteract
@@ -1618,6 +1817,18 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
         }
     }
 
+    // outputHistogram
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamOutputHistogram);
+        param->setLabel(kParamOutputHistogramLabel);
+        param->setHint(kParamOutputHistogramHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     // interactive
     {
         BooleanParamDescriptor* param = desc.defineBooleanParam(kParamRectangleInteractInteractive);
@@ -1725,6 +1936,67 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
             }
         }
 
+        // statP1
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatP1);
+            param->setLabel(kParamStatP1Label);
+            param->setHint(kParamStatP1Hint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statMedian
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatMedian);
+            param->setLabel(kParamStatMedianLabel);
+            param->setHint(kParamStatMedianHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statP99
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatP99);
+            param->setLabel(kParamStatP99Label);
+            param->setHint(kParamStatP99Hint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // histogram
+        {
+            StringParamDescriptor* param = desc.defineStringParam(kParamHistogram);
+            param->setLabel(kParamHistogramLabel);
+            param->setHint(kParamHistogramHint);
+            param->setStringType(eStringTypeMultiLine);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // analyzeFrame
         {
             PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamAnalyzeFrame);
@@ -1883,6 +2155,70 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
             }
         }
 
+        // statHSVLP1
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLP1);
+            param->setLabel(kParamStatHSVLP1Label);
+            param->setHint(kParamStatHSVLP1Hint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLMedian
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLMedian);
+            param->setLabel(kParamStatHSVLMedianLabel);
+            param->setHint(kParamStatHSVLMedianHint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLP99
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLP99);
+            param->setLabel(kParamStatHSVLP99Label);
+            param->setHint(kParamStatHSVLP99Hint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // histogramHSVL
+        {
+            StringParamDescriptor* param = desc.defineStringParam(kParamHistogramHSVL);
+            param->setLabel(kParamHistogramHSVLLabel);
+            param->setHint(kParamHistogramHSVLHint);
+            param->setStringType(eStringTypeMultiLine);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // analyzeFrameHSVL
         {
             PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamAnalyzeFrameHSVL);
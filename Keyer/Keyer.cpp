@@ -29,8 +29,13 @@
 #include <windows.h>
 #endif
 
+#include <memory>
+#include <vector>
+
 #include "ofxsProcessing.H"
 #include "ofxsMacros.h"
+#include "ofxsChannelLut.h"
+#include "ofxsColorRow.h"
 
 #define kPluginName "KeyerOFX"
 #define kPluginGrouping "Keyer"
@@ -49,7 +54,7 @@
 
 #define kPluginIdentifier "net.sf.openfx.KeyerPlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -165,6 +170,47 @@ double rgb2luminance(double r, double g, double b)
     return 0.2126 * r + 0.7152 * g + 0.0722 * b;
 }
 
+// the luminance, the scalar product with the key color, and the distance to the key color axis,
+// for OFX::ColorRow::processRow()
+struct KeyerFeatures
+{
+    float kr, kg, kb;
+    float invKeyColorNorm2;
+
+    KeyerFeatures(const OfxRGBColourD &keyColor)
+    : kr((float)keyColor.r)
+    , kg((float)keyColor.g)
+    , kb((float)keyColor.b)
+    {
+        const double keyColorNorm2 = (keyColor.r*keyColor.r) + (keyColor.g*keyColor.g) + (keyColor.b*keyColor.b);
+        invKeyColorNorm2 = (keyColorNorm2 == 0) ? 0.f : (float)(1. / keyColorNorm2);
+    }
+
+    template <class V>
+    void operator()(V r, V g, V b, V *lum, V *scalarProd, V *d) const
+    {
+        const V sp = r * V(kr) + g * V(kg) + b * V(kb);
+        *lum = r * V(0.2126f) + g * V(0.7152f) + b * V(0.0722f);
+        *scalarProd = sp;
+        *d = distance(r, g, b, sp);
+    }
+
+    // the distance to the key color axis, given the scalar product sp with the key color.
+    // It is the norm of the difference with the projection on the axis: computing it as
+    // sqrt(norm2 - sp*sp/keyColorNorm2) cancels catastrophically near the axis.
+    template <class V>
+    V distance(V r, V g, V b, V sp) const
+    {
+        using namespace OFX::ColorRow;
+        const V t = sp * V(invKeyColorNorm2);
+        const V dr = r - t * V(kr);
+        const V dg = g - t * V(kg);
+        const V db = b - t * V(kb);
+
+        return vsqrt(dr * dr + dg * dg + db * db);
+    }
+};
+
 class KeyerProcessorBase : public OFX::ImageProcessor
 {
 protected:
@@ -232,6 +278,16 @@ public:
         _sourceAlpha = sourceAlpha;
     }
 
+    // the terms of channel c with value v in the luminance and the scalar product with the key color
+    // (see OFX::ChannelLut)
+    void fillEntry(int c, double v, float *entry) const
+    {
+        const double lumCoeff[3] = { 0.2126, 0.7152, 0.0722 };
+        const double keyCoeff[3] = { _keyColor.r, _keyColor.g, _keyColor.b };
+        entry[0] = (float)(lumCoeff[c] * v);
+        entry[1] = (float)(keyCoeff[c] * v);
+    }
+
     double key_bg(double Kfg)
     {
         if ((_center + _toleranceLower) <= 0. && Kfg <= 0.) { // special case: everything below 0 is 1. if center-toleranceLower<=0
@@ -293,11 +349,90 @@ class KeyerProcessor : public KeyerProcessorBase
 public:
     KeyerProcessor(OFX::ImageEffect &instance)
     : KeyerProcessorBase(instance)
+    , _lut()
     {
     }
 
 private:
+    void preProcess()
+    {
+        // integer images: tabulate the contribution of each channel to the luminance
+        // and the scalar product with the key color
+        const double nPixels = (double)(_renderWindow.x2 - _renderWindow.x1) * (_renderWindow.y2 - _renderWindow.y1);
+        if (OFX::ChannelLut<2>::isWorthBuilding(maxValue, nPixels)) {
+            _lut.reset(new OFX::ChannelLut<2>(maxValue, *this));
+        }
+    }
+
+    // the luminance, scalar product with the key color, and distance to the key color axis
+    // of the source pixels of row y, from x1 to x2
+    void featuresRow(int x1, int x2, int y, float *lum, float *scalarProd, float *d)
+    {
+        if (_lut.get()) {
+            const KeyerFeatures features(_keyColor);
+            for (int x = x1; x < x2; ++x) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                float f[2] = {0.f, 0.f};
+                float rgb[3] = {0.f, 0.f, 0.f};
+                if (srcPix) {
+                    _lut->features(srcPix, f);
+                    for (int c = 0; c < 3; ++c) {
+                        rgb[c] = sampleToFloat<PIX,maxValue>(srcPix[c]);
+                    }
+                }
+                lum[x - x1] = f[0];
+                scalarProd[x - x1] = f[1];
+                d[x - x1] = features.distance<OFX::ColorRow::Vec1>(rgb[0], rgb[1], rgb[2], f[1]).x;
+            }
+        } else {
+            for (int x = x1; x < x2; ++x) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                lum[x - x1] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[0]) : 0.f;
+                scalarProd[x - x1] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[1]) : 0.f;
+                d[x - x1] = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[2]) : 0.f;
+            }
+            // compute the whole row at once, in place
+            OFX::ColorRow::processRow(KeyerFeatures(_keyColor), x2 - x1, lum, scalarProd, d, lum, scalarProd, d);
+        }
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        // select the kernel specialized for the output mode and the source alpha
+        switch (_outputMode) {
+            case eOutputModeIntermediate:
+                processForOutputMode<eOutputModeIntermediate>(procWindow);
+                break;
+            case eOutputModePremultiplied:
+                processForOutputMode<eOutputModePremultiplied>(procWindow);
+                break;
+            case eOutputModeUnpremultiplied:
+                processForOutputMode<eOutputModeUnpremultiplied>(procWindow);
+                break;
+            case eOutputModeComposite:
+                processForOutputMode<eOutputModeComposite>(procWindow);
+                break;
+        }
+    }
+
+    template <OutputModeEnum outputMode>
+    void processForOutputMode(const OfxRectI &procWindow)
+    {
+        switch (_sourceAlpha) {
+            case eSourceAlphaIgnore:
+                process<outputMode, eSourceAlphaIgnore>(procWindow);
+                break;
+            case eSourceAlphaAddToInsideMask:
+                process<outputMode, eSourceAlphaAddToInsideMask>(procWindow);
+                break;
+            case eSourceAlphaNormal:
+                process<outputMode, eSourceAlphaNormal>(procWindow);
+                break;
+        }
+    }
+
+    template <OutputModeEnum outputMode, SourceAlphaEnum sourceAlpha>
+    void process(const OfxRectI &procWindow)
     {
         // for Color and Screen modes, how much the scalar product between RGB and the keyColor must be
         // multiplied by to get the foreground key value 1, which corresponds to the maximum
@@ -307,12 +442,19 @@ private:
         // const double keyColorFactor = (keyColor111 == 0.) ? 1. : 1./keyColor111;
         // squared norm of keyColor, used for Screen mode
         const double keyColorNorm2 = (_keyColor.r*_keyColor.r) + (_keyColor.g*_keyColor.g) + (_keyColor.b*_keyColor.b);
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> rowBuf((size_t)width * 3);
+        float *rowLum = &rowBuf[0];
+        float *rowScalarProd = &rowBuf[width];
+        float *rowD = &rowBuf[(size_t)2 * width];
 
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
 
+            featuresRow(procWindow.x1, procWindow.x2, y, rowLum, rowScalarProd, rowD);
+
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
             assert(dstPix);
 
@@ -324,7 +466,7 @@ private:
                 const PIX *outMaskPix = (const PIX *)  (_outMaskImg ? _outMaskImg->getPixelAddress(x, y) : 0);
 
                 float inMask = inMaskPix ? *inMaskPix : 0.f;
-                if (_sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4 && srcPix) {
+                if (sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4 && srcPix) {
                     // take the max of inMask and the source Alpha
                     inMask = std::max(inMask, sampleToFloat<PIX,maxValue>(srcPix[3]));
                 }
@@ -354,32 +496,25 @@ private:
                 } else {
                     // from fgr, fgg, fgb, compute Kbg and update fgr, fgg, fgb
 
-                    double Kfg;
-                    double scalarProd = 0.;
-                    double norm2 = 0.;
-                    double d = 0.;
+                    double Kfg = 0.;
+                    const double lum = rowLum[x - procWindow.x1];
+                    const double scalarProd = rowScalarProd[x - procWindow.x1];
+                    const double d = rowD[x - procWindow.x1];
                     switch (_keyerMode) {
                         case eKeyerModeLuminance: {
-                            Kfg = rgb2luminance(fgr, fgg, fgb);
+                            Kfg = lum;
                             break;
                         }
                         case eKeyerModeColor: {
-                            scalarProd = fgr * _keyColor.r + fgg * _keyColor.g + fgb * _keyColor.b;
-                            Kfg = (keyColor111 == 0) ? rgb2luminance(fgr, fgg, fgb) : (scalarProd / keyColor111);
+                            Kfg = (keyColor111 == 0) ? lum : (scalarProd / keyColor111);
                             break;
                         }
                         case eKeyerModeScreen: {
-                            scalarProd = fgr * _keyColor.r + fgg * _keyColor.g + fgb * _keyColor.b;
-                            norm2 = fgr * fgr + fgg * fgg + fgb * fgb;
-                            d = std::sqrt(std::max(0., norm2 - ((keyColorNorm2 == 0) ? 0. : (scalarProd * scalarProd / keyColorNorm2))));
-                            Kfg = (keyColor111 == 0) ? rgb2luminance(fgr, fgg, fgb) : (scalarProd / keyColor111);
+                            Kfg = (keyColor111 == 0) ? lum : (scalarProd / keyColor111);
                             Kfg -= d;
                             break;
                         }
                         case eKeyerModeNone: {
-                            scalarProd = fgr * _keyColor.r + fgg * _keyColor.g + fgb * _keyColor.b;
-                            norm2 = fgr * fgr + fgg * fgg + fgb * fgb;
-                            d = std::sqrt(std::max(0., norm2 - ((keyColorNorm2 == 0) ? 0. : (scalarProd * scalarProd / keyColorNorm2))));
                             break;
                         }
                     }
@@ -401,7 +536,7 @@ private:
 
 
                     // despill fgr, fgg, fgb
-                    if ((_despill > 0.) && (_keyerMode == eKeyerModeNone || _keyerMode == eKeyerModeScreen) && _outputMode != eOutputModeIntermediate && keyColorNorm2 > 0.) {
+                    if ((_despill > 0.) && (_keyerMode == eKeyerModeNone || _keyerMode == eKeyerModeScreen) && outputMode != eOutputModeIntermediate && keyColorNorm2 > 0.) {
                         double keyColorNorm = std::sqrt(keyColorNorm2);
                         // color in the direction of keyColor
                         if (scalarProd/keyColorNorm > d) {
@@ -417,7 +552,7 @@ private:
                     }
 
                     // premultiply foreground
-                    if (_outputMode != eOutputModeUnpremultiplied) {
+                    if (outputMode != eOutputModeUnpremultiplied) {
                         fgr *= (1.-Kbg);
                         fgg *= (1.-Kbg);
                         fgb *= (1.-Kbg);
@@ -435,10 +570,10 @@ private:
                 double fga = 1. - Kbg;
                 //double fga = Kbg;
                 assert(fga >= 0. && fga <= 1.);
-                double compAlpha = (_outputMode == eOutputModeComposite &&
-                                    _sourceAlpha == eSourceAlphaNormal &&
+                double compAlpha = (outputMode == eOutputModeComposite &&
+                                    sourceAlpha == eSourceAlphaNormal &&
                                     srcPix) ? sampleToFloat<PIX,maxValue>(srcPix[3]) : 1.;
-                switch (_outputMode) {
+                switch (outputMode) {
                     case eOutputModeIntermediate:
                         for (int c = 0; c < 3; ++c) {
                             dstPix[c] = srcPix ? srcPix[c] : 0;
@@ -464,6 +599,8 @@ private:
         }
     }
 
+private:
+    std::auto_ptr<OFX::ChannelLut<2> > _lut;
 };
 
 
@@ -24,6 +24,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <vector>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -97,6 +98,15 @@
 
 #define kMaximumAInputs 64
 
+// size of the tiles processed by MergeProcessor (the float RGBA tile should fit in the L2 cache)
+#define kTileWidth 256
+#define kTileHeight 32
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MERGE_SSE2
+#endif
+
 using namespace OFX;
 using namespace MergeImages2D;
 
@@ -153,6 +163,135 @@ public:
 
 
 
+// resolve the part of row y of img that intersects [x1,x2), and convert it to float RGBA in row
+// (indexed from x1). Components that are not in the image are set to 0, and alpha is set to 1 if the
+// image has no alpha. Returns false if the row does not intersect img, else [*rx1,*rx2) is the span.
+template <class PIX, int nComponents, int maxValue>
+static bool
+loadRow(const OFX::Image *img,
+        int y,
+        int x1,
+        int x2,
+        float *row,
+        int *rx1,
+        int *rx2)
+{
+    if (!img) {
+        return false;
+    }
+    const OfxRectI& bounds = img->getBounds();
+    if (y < bounds.y1 || bounds.y2 <= y) {
+        return false;
+    }
+    *rx1 = std::max(x1, bounds.x1);
+    *rx2 = std::min(x2, bounds.x2);
+    if (*rx1 >= *rx2) {
+        return false;
+    }
+    const PIX *srcPix = (const PIX *) img->getPixelAddress(*rx1, y);
+    assert(srcPix);
+    float *rowPix = row + 4 * (*rx1 - x1);
+    for (int x = *rx1; x < *rx2; ++x, srcPix += nComponents, rowPix += 4) {
+        for (int c = 0; c < 4; ++c) {
+            rowPix[c] = (c < nComponents) ? ((float)srcPix[c] / maxValue) : 0.f;
+        }
+        if (nComponents != 4) {
+            // set alpha (1 inside, 0 outside)
+            rowPix[3] = 1.f;
+        }
+    }
+
+    return true;
+}
+
+// merge n float RGBA pixels. B and dst may be the same buffer.
+template <MergingFunctionEnum f, int nComponents>
+static void
+mergeRowGeneric(bool alphaMasking,
+                const float *A,
+                const float *B,
+                float *dst,
+                int n)
+{
+    float tmpPix[4];
+    for (int i = 0; i < n; ++i, A += 4, B += 4, dst += 4) {
+        // components that are not written by mergePixel keep the value from B
+        for (int c = 0; c < 4; ++c) {
+            tmpPix[c] = B[c];
+        }
+        // work in float: clamping is done when mixing
+        mergePixel<f, float, nComponents, 1>(alphaMasking, A, B, tmpPix);
+        for (int c = 0; c < 4; ++c) {
+            dst[c] = tmpPix[c];
+        }
+    }
+}
+
+#ifdef MERGE_SSE2
+// SSE2 versions of the most common operators, processing one RGBA pixel per vector
+template <MergingFunctionEnum f>
+struct MergeSSE2
+{
+    static const bool supported = false;
+    static __m128 merge(__m128 A, __m128 /*B*/, __m128 /*a*/, __m128 /*b*/) { return A; }
+};
+
+#define MERGE_SSE2_OPERATOR(f, expr) \
+template <> \
+struct MergeSSE2<f> \
+{ \
+    static const bool supported = true; \
+    static __m128 merge(__m128 A, __m128 B, __m128 a, __m128 b) { (void)A; (void)B; (void)a; (void)b; return (expr); } \
+}
+
+MERGE_SSE2_OPERATOR(eMergeOver, _mm_add_ps(A, _mm_mul_ps(B, _mm_sub_ps(_mm_set1_ps(1.f), a))));
+MERGE_SSE2_OPERATOR(eMergePlus, _mm_add_ps(A, B));
+MERGE_SSE2_OPERATOR(eMergeMultiply, _mm_mul_ps(A, B));
+MERGE_SSE2_OPERATOR(eMergeMax, _mm_max_ps(A, B));
+MERGE_SSE2_OPERATOR(eMergeMin, _mm_min_ps(A, B));
+MERGE_SSE2_OPERATOR(eMergeIn, _mm_mul_ps(A, b));
+MERGE_SSE2_OPERATOR(eMergeOut, _mm_mul_ps(A, _mm_sub_ps(_mm_set1_ps(1.f), b)));
+MERGE_SSE2_OPERATOR(eMergeATop, _mm_add_ps(_mm_mul_ps(A, b), _mm_mul_ps(B, _mm_sub_ps(_mm_set1_ps(1.f), a))));
+
+#undef MERGE_SSE2_OPERATOR
+#endif // MERGE_SSE2
+
+// merge n float RGBA pixels, using a SIMD kernel if there is one for this operator.
+// B and dst may be the same buffer.
+template <MergingFunctionEnum f, int nComponents>
+static void
+mergeRow(bool alphaMasking,
+         const float *A,
+         const float *B,
+         float *dst,
+         int n)
+{
+#ifdef MERGE_SSE2
+    if (nComponents == 4 && MergeSSE2<f>::supported) {
+        // same alpha rule as mergePixel
+        const bool doAlphaMasking = alphaMasking && isMaskable(f);
+        for (int i = 0; i < n; ++i, A += 4, B += 4, dst += 4) {
+            const __m128 vA = _mm_loadu_ps(A);
+            const __m128 vB = _mm_loadu_ps(B);
+            const __m128 a = _mm_shuffle_ps(vA, vA, _MM_SHUFFLE(3, 3, 3, 3));
+            const __m128 b = _mm_shuffle_ps(vB, vB, _MM_SHUFFLE(3, 3, 3, 3));
+            __m128 result = MergeSSE2<f>::merge(vA, vB, a, b);
+            if (doAlphaMasking) {
+                // output alpha is a+b-a*b
+                float alpha = A[3] + B[3] - A[3] * B[3];
+                _mm_storeu_ps(dst, result);
+                dst[3] = alpha;
+            } else {
+                _mm_storeu_ps(dst, result);
+            }
+        }
+
+        return;
+    }
+#endif
+    mergeRowGeneric<f, nComponents>(alphaMasking, A, B, dst, n);
+}
+
 template <MergingFunctionEnum f, class PIX, int nComponents, int maxValue>
 class MergeProcessor : public MergeProcessorBase
 {
@@ -165,116 +304,134 @@ public:
 private:
     void multiThreadProcessImages(OfxRectI procWindow)
     {
-        float tmpPix[4];
-        float tmpA[4];
-        float tmpB[4];
+        assert(_optionalAImages.size() == 0 || _optionalAImages.size() == (kMaximumAInputs - 1));
 
-        for (int c = 0; c < 4; ++c) {
-            tmpA[c] = tmpB[c] = 0.;
-        }
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
+        // the connected optional A inputs, in merging order
+        std::vector<const OFX::Image*> optionalAImages;
+        for (unsigned int i = 0; i < _optionalAImages.size(); ++i) {
+            if (_optionalAImages[i]) {
+                optionalAImages.push_back(_optionalAImages[i]);
             }
+        }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+        // The procWindow is processed by tiles small enough to stay in the cache while all the
+        // inputs are merged into them, one input after the other. Inputs that do not intersect
+        // a tile are skipped.
+        const int tileWidth = std::min(kTileWidth, procWindow.x2 - procWindow.x1);
+        if (tileWidth <= 0) {
+            return;
+        }
+        std::vector<float> rowA(4 * tileWidth);
+        std::vector<float> rowB(4 * tileWidth);
+        std::vector<float> tileDst(4 * tileWidth * kTileHeight);
+        std::vector<const OFX::Image*> tileImages;
+        tileImages.reserve(optionalAImages.size());
+
+        for (int ty = procWindow.y1; ty < procWindow.y2; ty += kTileHeight) {
+            for (int tx = procWindow.x1; tx < procWindow.x2; tx += kTileWidth) {
+                if (_effect.abort()) {
+                    return;
+                }
+                OfxRectI tile;
+                tile.x1 = tx;
+                tile.x2 = std::min(tx + kTileWidth, procWindow.x2);
+                tile.y1 = ty;
+                tile.y2 = std::min(ty + kTileHeight, procWindow.y2);
+
+                // the optional inputs that intersect this tile
+                tileImages.clear();
+                for (unsigned int i = 0; i < optionalAImages.size(); ++i) {
+                    if (OFX::Coords::rectIntersection<OfxRectI>(tile, optionalAImages[i]->getBounds(), 0)) {
+                        tileImages.push_back(optionalAImages[i]);
+                    }
+                }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                
-                const PIX *srcPixA = (const PIX *)  (_srcImgA ? _srcImgA->getPixelAddress(x, y) : 0);
-                const PIX *srcPixB = (const PIX *)  (_srcImgB ? _srcImgB->getPixelAddress(x, y) : 0);
-                
-                assert(_optionalAImages.size() == 0 || _optionalAImages.size() == (kMaximumAInputs - 1));
-                
-                
-                if (srcPixA || srcPixB) {
+                processTile(tile, tileImages, &rowA[0], &rowB[0], &tileDst[0]);
+            }
+        }
+    }
 
-                    for (int c = 0; c < nComponents; ++c) {
-#                     ifdef DEBUG
-                        // check for NaN
-                        assert(!srcPixA || srcPixA[c] == srcPixA[c]);
-                        assert(!srcPixB || srcPixB[c] == srcPixB[c]);
-#                     endif
-                        // all images are supposed to be black and transparent outside o
-                        tmpA[c] = srcPixA ? ((float)srcPixA[c] / maxValue) : 0.f;
-                        tmpB[c] = srcPixB ? ((float)srcPixB[c] / maxValue) : 0.f;
-#                     ifdef DEBUG
-                        // check for NaN
-                        assert(tmpA[c] == tmpA[c]);
-                        assert(tmpB[c] == tmpB[c]);
-#                     endif
-                    }
-                    if (nComponents != 4) {
-                        // set alpha (1 inside, 0 outside)
-                        tmpA[3] = srcPixA ? 1. : 0.;
-                        tmpB[3] = srcPixB ? 1. : 0.;
-                    }
-                    // work in float: clamping is done when mixing
-                    mergePixel<f, float, 4, 1>(_alphaMasking, tmpA, tmpB, tmpPix);
-    
-                    
-                } else {
-                    // everything is black and transparent
-                    for (int c = 0; c < 4; ++c) {
-                        tmpPix[c] = 0;
-                    }
+    // merge all the inputs in tile, using the buffers rowA, rowB (one row of the tile) and tileDst
+    void processTile(const OfxRectI& tile,
+                     const std::vector<const OFX::Image*>& tileImages,
+                     float *rowA,
+                     float *rowB,
+                     float *tileDst)
+    {
+        const int width = tile.x2 - tile.x1;
+        const int rowSize = 4 * width;
+
+        // merge A and B
+        for (int y = tile.y1; y < tile.y2; ++y) {
+            float *rowDst = tileDst + (size_t)(y - tile.y1) * rowSize;
+            // all images are supposed to be black and transparent outside of their bounds
+            std::fill(rowA, rowA + rowSize, 0.f);
+            std::fill(rowB, rowB + rowSize, 0.f);
+            std::fill(rowDst, rowDst + rowSize, 0.f);
+            int ax1 = tile.x1, ax2 = tile.x1, bx1 = tile.x1, bx2 = tile.x1;
+            bool hasA = loadRow<PIX, nComponents, maxValue>(_srcImgA, y, tile.x1, tile.x2, rowA, &ax1, &ax2);
+            bool hasB = loadRow<PIX, nComponents, maxValue>(_srcImgB, y, tile.x1, tile.x2, rowB, &bx1, &bx2);
+            if (hasA || hasB) {
+                // merge over the span that contains A and B
+                int x1 = hasA ? (hasB ? std::min(ax1, bx1) : ax1) : bx1;
+                int x2 = hasA ? (hasB ? std::max(ax2, bx2) : ax2) : bx2;
+                int offset = 4 * (x1 - tile.x1);
+                mergeRow<f, 4>(_alphaMasking, rowA + offset, rowB + offset, rowDst + offset, x2 - x1);
+                if (hasA && hasB && (ax2 < bx1 || bx2 < ax1)) {
+                    // everything is black and transparent between A and B
+                    int gx1 = std::min(ax2, bx2);
+                    int gx2 = std::max(ax1, bx1);
+                    std::fill(rowDst + 4 * (gx1 - tile.x1), rowDst + 4 * (gx2 - tile.x1), 0.f);
+                }
+            }
+        }
+
+        // merge the optional A inputs, one after the other, while the tile is in the cache
+        for (unsigned int i = 0; i < tileImages.size(); ++i) {
+            const OfxRectI& bounds = tileImages[i]->getBounds();
+            const int y1 = std::max(tile.y1, bounds.y1);
+            const int y2 = std::min(tile.y2, bounds.y2);
+            for (int y = y1; y < y2; ++y) {
+                int x1, x2;
+                if (loadRow<PIX, nComponents, maxValue>(tileImages[i], y, tile.x1, tile.x2, rowA, &x1, &x2)) {
+                    float *rowDst = tileDst + (size_t)(y - tile.y1) * rowSize;
+                    int offset = 4 * (x1 - tile.x1);
+                    mergeRow<f, nComponents>(_alphaMasking, rowA + offset, rowDst + offset, rowDst + offset, x2 - x1);
                 }
+            }
+        }
 
+        // write the tile to dst
+        const OfxRectI boundsB = _srcImgB ? _srcImgB->getBounds() : tile;
+        for (int y = tile.y1; y < tile.y2; ++y) {
+            // tileDst has 4 components, but we only need the first nComponents
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(tile.x1, y);
+            const float *tmpPix = tileDst + (size_t)(y - tile.y1) * rowSize;
+            const bool hasB = _srcImgB && boundsB.y1 <= y && y < boundsB.y2;
+            const int bx1 = hasB ? std::max(tile.x1, boundsB.x1) : tile.x1;
+            const int bx2 = hasB ? std::min(tile.x2, boundsB.x2) : tile.x1;
+            const PIX *srcRowB = (hasB && bx1 < bx2) ? (const PIX *) _srcImgB->getPixelAddress(bx1, y) : 0;
+            for (int x = tile.x1; x < tile.x2; ++x, tmpPix += 4, dstPix += nComponents) {
 #             ifdef DEBUG
                 // check for NaN
                 for (int c = 0; c < 4; ++c) {
                     assert(tmpPix[c] == tmpPix[c]);
                 }
 #             endif
-
-                for (unsigned int i = 0; i < _optionalAImages.size(); ++i) {
-                    srcPixA = (const PIX *)  (_optionalAImages[i] ? _optionalAImages[i]->getPixelAddress(x, y) : 0);
-                    
-                    if (srcPixA) {
-                        
-                        for (int c = 0; c < nComponents; ++c) {
-#                     ifdef DEBUG
-                            // check for NaN
-                            assert(srcPixA[c] == srcPixA[c]);
-#                     endif
-                            // all images are supposed to be black and transparent outside o
-                            tmpA[c] = (float)srcPixA[c] / maxValue;
-#                         ifdef DEBUG
-                            // check for NaN
-                            assert(tmpA[c] == tmpA[c]);
-#                         endif
-                        }
-                        if (nComponents != 4) {
-                            // set alpha (1 inside, 0 outside)
-                            assert(srcPixA);
-                            tmpA[3] = 1.;
-                        }
-                        for (int c = 0; c < 4; ++c) {
-                            tmpB[c] = tmpPix[c];
-                        }
-
-                        // work in float: clamping is done when mixing
-                        mergePixel<f, float, nComponents, 1>(_alphaMasking, tmpA, tmpB, tmpPix);
-
-#                     ifdef DEBUG
-                        // check for NaN
-                        for (int c = 0; c < 4; ++c) {
-                            assert(tmpPix[c] == tmpPix[c]);
-                        }
-#                     endif
+                if (maxValue == 1 && !_doMasking && _mix == 1.) {
+                    // float and no mix: just copy
+                    for (int c = 0; c < nComponents; ++c) {
+                        dstPix[c] = (PIX)tmpPix[c];
                     }
+                } else {
+                    const PIX *srcPixB = (srcRowB && bx1 <= x && x < bx2) ? (srcRowB + (x - bx1) * nComponents) : 0;
+                    // denormalize
+                    float dstVal[4];
+                    for (int c = 0; c < 4; ++c) {
+                        dstVal[c] = tmpPix[c] * maxValue;
+                    }
+                    ofxsMaskMixPix<PIX, nComponents, maxValue, true>(dstVal, x, y, srcPixB, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
                 }
-                
-                // tmpPix has 4 components, but we only need the first nComponents
-
-                // denormalize
-                for (int c = 0; c < nComponents; ++c) {
-                    tmpPix[c] *= maxValue;
-                }
-                
-                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPixB, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
-                
-                dstPix += nComponents;
             }
         }
     }
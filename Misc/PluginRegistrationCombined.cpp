@@ -43,6 +43,7 @@
 #include "Rectangle.h"
 #include "Retime.h"
 #include "ColorLookup.h"
+#include "ColorLUT3D.h"
 #include "Roto.h"
 #include "Saturation.h"
 #include "Shuffle.h"
@@ -110,6 +111,7 @@ namespace OFX
             getRectanglePluginID(ids);
             getRetimePluginID(ids);
             getColorLookupPluginID(ids);
+            getColorLUT3DPluginID(ids);
             getRotoPluginID(ids);
             getSaturationPluginID(ids);
             getShufflePluginID(ids);
@@ -120,7 +122,7 @@ namespace OFX
             getNoTimeBlurPluginID(ids);
             getTimeDissolvePluginID(ids);
             getTimeOffsetPluginID(ids);
-            getTrackerPMPluginID(ids);
+            getTrackerPMPluginIDs(ids);
             getTransformPluginIDs(ids);
             getVectorToColorPluginID(ids);
         }
@@ -0,0 +1,681 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Block matching tools, shared by the tracker and the motion-compensated retiming.
+ *
+ * MotionField is a dense (one vector per block) motion field between two
+ * images, computed by coarse-to-fine block matching: exhaustive search at the
+ * coarsest level of a Gaussian pyramid of the luminance, then at each finer
+ * level the best of the parent block vectors (and of its neighbors) is refined
+ * locally. The vectors are refined to subpixel precision at the finest level,
+ * and median-filtered to remove isolated mismatches.
+ *
+ * The last field is cached by MotionFieldCache, keyed on the times and unique
+ * identifiers of the two images, so that all the tiles and all the output
+ * frames that interpolate between the same two input frames share it.
+ */
+
+#ifndef Misc_ofxsBlockMatch_h
+#define Misc_ofxsBlockMatch_h
+
+#include <cmath>
+#include <cassert>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsRefCountedCache.h"
+#include "ofxsProcessing.H"
+#include "ofxsMacros.h"
+
+#define kMotionFieldBlockSize 8 // block size, at every pyramid level
+#define kMotionFieldCoarseRadius 4 // exhaustive search radius at the coarsest level
+#define kMotionFieldRefineRadius 2 // the best candidate is refined within +/- this radius at the finer levels
+#define kMotionFieldMinLevelSize 32 // smallest width or height of the coarsest level
+#define kMotionFieldMaxLevels 6 // including the full-resolution level
+
+namespace OFX {
+
+// 5-tap binomial approximation of a Gaussian, used to build the pyramids
+static const float kPyramidFilter[5] = { 1.f/16, 4.f/16, 6.f/16, 4.f/16, 1.f/16 };
+
+/**
+ * @brief Subpixel position of the minimum of the scores s[dy+1][dx+1] around an integer minimum s[1][1].
+ *
+ * A quadratic surface is fitted to the 3x3 neighborhood (least squares). If it has no minimum close to
+ * the center (e.g. along a straight edge), fall back to separate parabolic fits along x and y.
+ */
+inline void
+subpixelMinimum(const double s[3][3], double *dx, double *dy)
+{
+    *dx = 0.;
+    *dy = 0.;
+    bool finite = true;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            finite = finite && (std::abs(s[i][j]) < std::numeric_limits<double>::infinity());
+        }
+    }
+    if (finite) {
+        // f(x,y) = a + b x + c y + d x^2 + e x y + f y^2
+        double b = ((s[0][2] - s[0][0]) + (s[1][2] - s[1][0]) + (s[2][2] - s[2][0])) / 6.;
+        double c = ((s[2][0] - s[0][0]) + (s[2][1] - s[0][1]) + (s[2][2] - s[0][2])) / 6.;
+        double d = ((s[0][0] - s[0][1]) + (s[0][2] - s[0][1]) +
+                    (s[1][0] - s[1][1]) + (s[1][2] - s[1][1]) +
+                    (s[2][0] - s[2][1]) + (s[2][2] - s[2][1])) / 6.;
+        double f = ((s[0][0] - s[1][0]) + (s[2][0] - s[1][0]) +
+                    (s[0][1] - s[1][1]) + (s[2][1] - s[1][1]) +
+                    (s[0][2] - s[1][2]) + (s[2][2] - s[1][2])) / 6.;
+        double e = ((s[2][2] - s[2][0]) - (s[0][2] - s[0][0])) / 4.;
+        double det = 4 * d * f - e * e;
+        if (d > 0. && f > 0. && det > 0.) {
+            double x = (e * c - 2 * f * b) / det;
+            double y = (e * b - 2 * d * c) / det;
+            if (std::abs(x) <= 0.5 && std::abs(y) <= 0.5) {
+                *dx = x;
+                *dy = y;
+
+                return;
+            }
+        }
+    }
+
+    const double bestScore = s[1][1];
+    if (bestScore < s[1][0] && bestScore <= s[1][2]) {
+        // don't simplify the denominator in the following expression,
+        // 2*bestScore - scorenc - scorepc may cause an underflow.
+        double factor = 1./((bestScore - s[1][2]) + (bestScore - s[1][0]));
+        if (factor != 0.) {
+            *dx = 0.5 * (s[1][2] - s[1][0]) * factor;
+            assert(-0.5 < *dx && *dx <= 0.5);
+        }
+    }
+    if (bestScore < s[0][1] && bestScore <= s[2][1]) {
+        double factor = 1./((bestScore - s[2][1]) + (bestScore - s[0][1]));
+        if (factor != 0.) {
+            *dy = 0.5 * (s[2][1] - s[0][1]) * factor;
+            assert(-0.5 < *dy && *dy <= 0.5);
+        }
+    }
+}
+
+/// Forward motion field from image A to image B, one vector per block: A(p) ~ B(p + v(p)).
+/// Coordinates are in pixels.
+class MotionField
+: public RefCountedCacheEntry
+{
+public:
+    MotionField(const OFX::Image *a, double timeA, const OFX::Image *b, double timeB, const OfxRectI &rect)
+    : RefCountedCacheEntry()
+    , _timeA(timeA)
+    , _timeB(timeB)
+    , _uniqueIDA(a->getUniqueIdentifier())
+    , _uniqueIDB(b->getUniqueIdentifier())
+    , _renderScale(a->getRenderScale())
+    , _rect(rect)
+    , _nbx((rect.x2 - rect.x1 + kMotionFieldBlockSize - 1) / kMotionFieldBlockSize)
+    , _nby((rect.y2 - rect.y1 + kMotionFieldBlockSize - 1) / kMotionFieldBlockSize)
+    , _vectors((size_t)_nbx * _nby * 2, 0.f)
+    {
+    }
+
+    bool isCacheable() const
+    {
+        return !_uniqueIDA.empty() && !_uniqueIDB.empty();
+    }
+
+    bool matches(const OFX::Image *a, double timeA, const OFX::Image *b, double timeB, const OfxRectI &rect) const
+    {
+        const OfxPointD &rs = a->getRenderScale();
+
+        return (isCacheable() && timeA == _timeA && timeB == _timeB &&
+                rs.x == _renderScale.x && rs.y == _renderScale.y &&
+                rect.x1 == _rect.x1 && rect.y1 == _rect.y1 && rect.x2 == _rect.x2 && rect.y2 == _rect.y2 &&
+                a->getUniqueIdentifier() == _uniqueIDA && b->getUniqueIdentifier() == _uniqueIDB);
+    }
+
+    const OfxRectI &getRect() const { return _rect; }
+
+    int getBlockCountX() const { return _nbx; }
+
+    int getBlockCountY() const { return _nby; }
+
+    float *getBlockVector(int bx, int by) { return &_vectors[((size_t)by * _nbx + bx) * 2]; }
+
+    const float *getBlockVector(int bx, int by) const { return &_vectors[((size_t)by * _nbx + bx) * 2]; }
+
+    /// The motion at (x,y), linearly interpolated between the block centers.
+    void getVector(double x, double y, double *vx, double *vy) const
+    {
+        double u = (x - _rect.x1) / kMotionFieldBlockSize - 0.5;
+        double v = (y - _rect.y1) / kMotionFieldBlockSize - 0.5;
+        int i0 = (int)std::floor(u);
+        int j0 = (int)std::floor(v);
+        double fu = u - i0;
+        double fv = v - j0;
+        int i1 = std::max(0, std::min(i0 + 1, _nbx - 1));
+        int j1 = std::max(0, std::min(j0 + 1, _nby - 1));
+        i0 = std::max(0, std::min(i0, _nbx - 1));
+        j0 = std::max(0, std::min(j0, _nby - 1));
+        const float *v00 = getBlockVector(i0, j0);
+        const float *v10 = getBlockVector(i1, j0);
+        const float *v01 = getBlockVector(i0, j1);
+        const float *v11 = getBlockVector(i1, j1);
+        *vx = (v00[0] * (1 - fu) + v10[0] * fu) * (1 - fv) + (v01[0] * (1 - fu) + v11[0] * fu) * fv;
+        *vy = (v00[1] * (1 - fu) + v10[1] * fu) * (1 - fv) + (v01[1] * (1 - fu) + v11[1] * fu) * fv;
+    }
+
+private:
+    double _timeA;
+    double _timeB;
+    std::string _uniqueIDA;
+    std::string _uniqueIDB;
+    OfxPointD _renderScale;
+    OfxRectI _rect;
+    int _nbx;
+    int _nby;
+    std::vector<float> _vectors; // vx,vy per block, row-major
+};
+
+/// Computes a MotionField: luminance pyramids of both images, then block matching from the
+/// coarsest level to the finest. Each stage is split between threads by rows.
+template <class PIX, int nComponents>
+class MotionFieldBuilder : public OFX::MultiThread::Processor
+{
+public:
+    MotionFieldBuilder(OFX::ImageEffect &effect, const OFX::Image *a, const OFX::Image *b, MotionField &field)
+    : _effect(effect)
+    , _a(a)
+    , _b(b)
+    , _field(field)
+    , _stage(eStageLuminance)
+    , _level(0)
+    , _levels()
+    {
+    }
+
+    void build()
+    {
+        const OfxRectI &rect = _field.getRect();
+        int w = rect.x2 - rect.x1;
+        int h = rect.y2 - rect.y1;
+        Level l0;
+        l0.init(w, h);
+        _levels.push_back(l0);
+        while ((int)_levels.size() < kMotionFieldMaxLevels && w / 2 >= kMotionFieldMinLevelSize && h / 2 >= kMotionFieldMinLevelSize) {
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+            Level l;
+            l.init(w, h);
+            _levels.push_back(l);
+        }
+
+        _stage = eStageLuminance;
+        _level = 0;
+        multiThread();
+        for (_level = 1; _level < (int)_levels.size() && !_effect.abort(); ++_level) {
+            _stage = eStageDownsample;
+            multiThread();
+        }
+        for (_level = (int)_levels.size() - 1; _level >= 0 && !_effect.abort(); --_level) {
+            _stage = eStageSearch;
+            multiThread();
+        }
+        if (!_effect.abort()) {
+            _stage = eStageMedian;
+            _level = 0;
+            _medians.resize((size_t)_field.getBlockCountX() * _field.getBlockCountY() * 2);
+            multiThread();
+            for (int by = 0; by < _field.getBlockCountY(); ++by) {
+                for (int bx = 0; bx < _field.getBlockCountX(); ++bx) {
+                    float *v = _field.getBlockVector(bx, by);
+                    v[0] = _medians[((size_t)by * _field.getBlockCountX() + bx) * 2];
+                    v[1] = _medians[((size_t)by * _field.getBlockCountX() + bx) * 2 + 1];
+                }
+            }
+        }
+    }
+
+private:
+    enum StageEnum
+    {
+        eStageLuminance,
+        eStageDownsample,
+        eStageSearch,
+        eStageMedian,
+    };
+
+    struct Level
+    {
+        int width;
+        int height;
+        int nbx;
+        int nby;
+        std::vector<float> a; // luminance of A
+        std::vector<float> b; // luminance of B
+        std::vector<int> vectors; // integer block vectors, vx,vy per block
+
+        void init(int w, int h)
+        {
+            width = w;
+            height = h;
+            nbx = (w + kMotionFieldBlockSize - 1) / kMotionFieldBlockSize;
+            nby = (h + kMotionFieldBlockSize - 1) / kMotionFieldBlockSize;
+            a.resize((size_t)w * h);
+            b.resize((size_t)w * h);
+            vectors.resize((size_t)nbx * nby * 2, 0);
+        }
+
+        // B is extended by repeating the edge pixels
+        float getB(int x, int y) const
+        {
+            x = std::max(0, std::min(x, width - 1));
+            y = std::max(0, std::min(y, height - 1));
+
+            return b[(size_t)y * width + x];
+        }
+    };
+
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const Level &l = _levels[_level];
+        const int rows = (_stage == eStageSearch || _stage == eStageMedian) ? l.nby : l.height;
+        const int r1 = (int)(((long long)rows * threadId) / nThreads);
+        const int r2 = (int)(((long long)rows * (threadId + 1)) / nThreads);
+        for (int r = r1; r < r2; ++r) {
+            if (_effect.abort()) {
+                return;
+            }
+            switch (_stage) {
+                case eStageLuminance:
+                    luminanceRow(r);
+                    break;
+                case eStageDownsample:
+                    downsampleRow(r);
+                    break;
+                case eStageSearch:
+                    searchRow(r);
+                    break;
+                case eStageMedian:
+                    medianRow(r);
+                    break;
+            }
+        }
+    }
+
+    void luminanceRow(int y)
+    {
+        Level &l = _levels[0];
+        const OfxRectI &rect = _field.getRect();
+        for (int x = 0; x < l.width; ++x) {
+            l.a[(size_t)y * l.width + x] = luminance((const PIX *)_a->getPixelAddress(rect.x1 + x, rect.y1 + y));
+            l.b[(size_t)y * l.width + x] = luminance((const PIX *)_b->getPixelAddress(rect.x1 + x, rect.y1 + y));
+        }
+    }
+
+    static float luminance(const PIX *p)
+    {
+        if (!p) {
+            return 0.f;
+        }
+        if (nComponents == 1) {
+            return (float)p[0];
+        }
+        // the mean of the color components (alpha is not used)
+        const int n = (nComponents == 4) ? 3 : nComponents;
+        float sum = 0.f;
+        for (int c = 0; c < n; ++c) {
+            sum += (float)p[c];
+        }
+
+        return sum / n;
+    }
+
+    void downsampleRow(int j)
+    {
+        const Level &prev = _levels[_level - 1];
+        Level &cur = _levels[_level];
+        for (int i = 0; i < cur.width; ++i) {
+            float sa = 0.f;
+            float sb = 0.f;
+            for (int m = -2; m <= 2; ++m) {
+                const int y = std::max(0, std::min(2 * j + m, prev.height - 1));
+                for (int k = -2; k <= 2; ++k) {
+                    const int x = std::max(0, std::min(2 * i + k, prev.width - 1));
+                    const float w = kPyramidFilter[m + 2] * kPyramidFilter[k + 2];
+                    sa += w * prev.a[(size_t)y * prev.width + x];
+                    sb += w * prev.b[(size_t)y * prev.width + x];
+                }
+            }
+            cur.a[(size_t)j * cur.width + i] = sa;
+            cur.b[(size_t)j * cur.width + i] = sb;
+        }
+    }
+
+    // mean absolute difference between the block (bx,by) of A and the same block of B moved by (vx,vy)
+    static double blockScore(const Level &l, int bx, int by, int vx, int vy)
+    {
+        const int x1 = bx * kMotionFieldBlockSize;
+        const int y1 = by * kMotionFieldBlockSize;
+        const int x2 = std::min(x1 + kMotionFieldBlockSize, l.width);
+        const int y2 = std::min(y1 + kMotionFieldBlockSize, l.height);
+        double sad = 0.;
+        for (int y = y1; y < y2; ++y) {
+            const float *pa = &l.a[(size_t)y * l.width];
+            if (y + vy >= 0 && y + vy < l.height && x1 + vx >= 0 && x2 + vx <= l.width) {
+                const float *pb = &l.b[(size_t)(y + vy) * l.width + vx];
+                for (int x = x1; x < x2; ++x) {
+                    sad += std::abs(pa[x] - pb[x]);
+                }
+            } else {
+                for (int x = x1; x < x2; ++x) {
+                    sad += std::abs(pa[x] - l.getB(x + vx, y + vy));
+                }
+            }
+        }
+
+        return sad / ((x2 - x1) * (y2 - y1));
+    }
+
+    void searchRow(int by)
+    {
+        Level &l = _levels[_level];
+        const bool coarsest = (_level == (int)_levels.size() - 1);
+        for (int bx = 0; bx < l.nbx; ++bx) {
+            int best[2] = {0, 0};
+            double bestScore = blockScore(l, bx, by, 0, 0);
+            int radius = kMotionFieldCoarseRadius;
+            if (!coarsest) {
+                // candidates: the vectors of the parent block and of its neighbors, at this scale
+                const Level &parent = _levels[_level + 1];
+                const int px = std::min(bx / 2, parent.nbx - 1);
+                const int py = std::min(by / 2, parent.nby - 1);
+                static const int neighbors[5][2] = { {0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+                for (int n = 0; n < 5; ++n) {
+                    const int qx = px + neighbors[n][0];
+                    const int qy = py + neighbors[n][1];
+                    if (qx < 0 || qx >= parent.nbx || qy < 0 || qy >= parent.nby) {
+                        continue;
+                    }
+                    const int *pv = &parent.vectors[((size_t)qy * parent.nbx + qx) * 2];
+                    double score = blockScore(l, bx, by, 2 * pv[0], 2 * pv[1]);
+                    if (score < bestScore) {
+                        bestScore = score;
+                        best[0] = 2 * pv[0];
+                        best[1] = 2 * pv[1];
+                    }
+                }
+                radius = kMotionFieldRefineRadius;
+            }
+            const int cx = best[0];
+            const int cy = best[1];
+            for (int dy = -radius; dy <= radius; ++dy) {
+                for (int dx = -radius; dx <= radius; ++dx) {
+                    if (dx == 0 && dy == 0) {
+                        continue;
+                    }
+                    double score = blockScore(l, bx, by, cx + dx, cy + dy);
+                    // prefer the smallest motion on ties
+                    if (score < bestScore ||
+                        (score == bestScore && std::abs(cx + dx) + std::abs(cy + dy) < std::abs(best[0]) + std::abs(best[1]))) {
+                        bestScore = score;
+                        best[0] = cx + dx;
+                        best[1] = cy + dy;
+                    }
+                }
+            }
+            int *v = &l.vectors[((size_t)by * l.nbx + bx) * 2];
+            v[0] = best[0];
+            v[1] = best[1];
+            if (_level == 0) {
+                double s[3][3];
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        s[dy + 1][dx + 1] = (dx == 0 && dy == 0) ? bestScore : blockScore(l, bx, by, best[0] + dx, best[1] + dy);
+                    }
+                }
+                double sx, sy;
+                subpixelMinimum(s, &sx, &sy);
+                float *fv = _field.getBlockVector(bx, by);
+                fv[0] = (float)(best[0] + sx);
+                fv[1] = (float)(best[1] + sy);
+            }
+        }
+    }
+
+    // 3x3 median of the field vectors, component by component, into _medians
+    void medianRow(int by)
+    {
+        const Level &l = _levels[0];
+        std::vector<float> vx, vy;
+        vx.reserve(9);
+        vy.reserve(9);
+        for (int bx = 0; bx < l.nbx; ++bx) {
+            vx.clear();
+            vy.clear();
+            for (int qy = std::max(0, by - 1); qy <= std::min(by + 1, l.nby - 1); ++qy) {
+                for (int qx = std::max(0, bx - 1); qx <= std::min(bx + 1, l.nbx - 1); ++qx) {
+                    const float *v = _field.getBlockVector(qx, qy);
+                    vx.push_back(v[0]);
+                    vy.push_back(v[1]);
+                }
+            }
+            std::nth_element(vx.begin(), vx.begin() + vx.size() / 2, vx.end());
+            std::nth_element(vy.begin(), vy.begin() + vy.size() / 2, vy.end());
+            _medians[((size_t)by * l.nbx + bx) * 2] = vx[vx.size() / 2];
+            _medians[((size_t)by * l.nbx + bx) * 2 + 1] = vy[vy.size() / 2];
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_a;
+    const OFX::Image *_b;
+    MotionField &_field;
+    StageEnum _stage;
+    int _level;
+    std::vector<Level> _levels;
+    std::vector<float> _medians; // the median-filtered field
+};
+
+/// Computes a MotionField for MotionFieldCache::acquire(), see RefCountedCache::acquire().
+template <class PIX, int nComponents>
+class MotionFieldCacheBuilder
+{
+public:
+    MotionFieldCacheBuilder(OFX::ImageEffect &effect,
+                            const OFX::Image *a,
+                            double timeA,
+                            const OFX::Image *b,
+                            double timeB,
+                            const OfxRectI &rect)
+    : _effect(effect)
+    , _a(a)
+    , _timeA(timeA)
+    , _b(b)
+    , _timeB(timeB)
+    , _rect(rect)
+    {
+    }
+
+    bool isCacheable() const
+    {
+        return !_a->getUniqueIdentifier().empty() && !_b->getUniqueIdentifier().empty();
+    }
+
+    bool matches(const MotionField &field) const
+    {
+        return field.matches(_a, _timeA, _b, _timeB, _rect);
+    }
+
+    MotionField *build()
+    {
+        std::auto_ptr<MotionField> field(new MotionField(_a, _timeA, _b, _timeB, _rect));
+        MotionFieldBuilder<PIX, nComponents> builder(_effect, _a, _b, *field);
+        builder.build();
+        if (_effect.abort()) {
+            // the field may be incomplete
+            return 0;
+        }
+
+        return field.release();
+    }
+
+private:
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_a;
+    double _timeA;
+    const OFX::Image *_b;
+    double _timeB;
+    OfxRectI _rect;
+};
+
+/// The last motion field computed by an effect instance, shared by all its renders.
+class MotionFieldCache
+: public RefCountedCache<MotionField>
+{
+public:
+    /// Returns the motion field from a to b over rect (which must be within the bounds of both
+    /// images), computing it if it is not cached, or NULL if the render was aborted.
+    /// The result must be given back to release().
+    template <class PIX, int nComponents>
+    const MotionField *acquire(OFX::ImageEffect &effect,
+                               const OFX::Image *a,
+                               double timeA,
+                               const OFX::Image *b,
+                               double timeB,
+                               const OfxRectI &rect)
+    {
+        assert(a && b);
+        MotionFieldCacheBuilder<PIX, nComponents> builder(effect, a, timeA, b, timeB, rect);
+
+        // if the host does not identify images, the field cannot be shared
+        return RefCountedCache<MotionField>::acquire(builder, builder.isCacheable());
+    }
+};
+
+/// Releases a motion field, even in case of exceptions.
+typedef RefCountedCacheHolder_RAII<MotionField> MotionFieldHolder_RAII;
+
+class MotionInterpolatorBase : public OFX::ImageProcessor
+{
+protected:
+    const OFX::Image *_fromImg;
+    const OFX::Image *_toImg;
+    const MotionField *_field;
+    float _blend;
+
+public:
+    MotionInterpolatorBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _fromImg(0)
+    , _toImg(0)
+    , _field(0)
+    , _blend(0.5f)
+    {
+    }
+
+    void setFromImg(const OFX::Image *v) {_fromImg = v;}
+
+    void setToImg(const OFX::Image *v) {_toImg = v;}
+
+    /// the motion field from the "from" image to the "to" image
+    void setField(const MotionField *v) {_field = v;}
+
+    void setBlend(float v) {_blend = v;}
+};
+
+/// Motion-compensated interpolation between two images: each output pixel p blends
+/// from(p - blend.v) and to(p + (1-blend).v), where v is the motion at p.
+template <class PIX, int nComponents, int maxValue>
+class MotionInterpolator : public MotionInterpolatorBase
+{
+public:
+    MotionInterpolator(OFX::ImageEffect &instance)
+    : MotionInterpolatorBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        assert(_fromImg && _toImg && _field);
+        float fromPix[nComponents];
+        float toPix[nComponents];
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                double vx, vy;
+                _field->getVector(x + 0.5, y + 0.5, &vx, &vy);
+                sample(_fromImg, x + 0.5 - _blend * vx, y + 0.5 - _blend * vy, fromPix);
+                sample(_toImg, x + 0.5 + (1 - _blend) * vx, y + 0.5 + (1 - _blend) * vy, toPix);
+                for (int c = 0; c < nComponents; ++c) {
+                    float v = fromPix[c] + _blend * (toPix[c] - fromPix[c]);
+                    if (maxValue == 1) { // floating point
+                        dstPix[c] = (PIX)v;
+                    } else {
+                        dstPix[c] = (PIX)std::max(0.f, std::min(v + 0.5f, (float)maxValue));
+                    }
+                }
+            }
+        }
+    }
+
+    // bilinear interpolation at (fx,fy) in pixel coordinates, the image is extended by repeating the edge pixels
+    static void sample(const OFX::Image *img, double fx, double fy, float *out)
+    {
+        const OfxRectI &bounds = img->getBounds();
+        double u = fx - 0.5;
+        double v = fy - 0.5;
+        int x0 = (int)std::floor(u);
+        int y0 = (int)std::floor(v);
+        float fu = (float)(u - x0);
+        float fv = (float)(v - y0);
+        int x1 = std::max(bounds.x1, std::min(x0 + 1, bounds.x2 - 1));
+        int y1 = std::max(bounds.y1, std::min(y0 + 1, bounds.y2 - 1));
+        x0 = std::max(bounds.x1, std::min(x0, bounds.x2 - 1));
+        y0 = std::max(bounds.y1, std::min(y0, bounds.y2 - 1));
+        const PIX *p00 = (const PIX *)img->getPixelAddress(x0, y0);
+        const PIX *p10 = (const PIX *)img->getPixelAddress(x1, y0);
+        const PIX *p01 = (const PIX *)img->getPixelAddress(x0, y1);
+        const PIX *p11 = (const PIX *)img->getPixelAddress(x1, y1);
+        if (!p00 || !p10 || !p01 || !p11) {
+            // empty image
+            std::fill(out, out + nComponents, 0.f);
+
+            return;
+        }
+        for (int c = 0; c < nComponents; ++c) {
+            out[c] = ((p00[c] * (1 - fu) + p10[c] * fu) * (1 - fv) +
+                      (p01[c] * (1 - fu) + p11[c] * fu) * fv);
+        }
+    }
+};
+
+} // namespace OFX
+
+#endif // Misc_ofxsBlockMatch_h
@@ -0,0 +1,88 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Per-channel lookup tables for integer images.
+ *
+ * Many per-pixel quantities (luminance, chrominance, scalar product with a
+ * key color, squared norm...) are sums of one term per RGB channel. For
+ * integer images, ChannelLut tabulates the terms of each channel for every
+ * sample value, so that these quantities cost three table lookups and
+ * nFeatures*3 additions per pixel, instead of the conversion to float and
+ * the products.
+ *
+ * The tables have 3*(maxValue+1) entries of nFeatures floats, stored
+ * contiguously for each sample value, and are worth building only when the
+ * render window has more pixels than that (see ChannelLut::isWorthBuilding).
+ */
+
+#ifndef Misc_ofxsChannelLut_h
+#define Misc_ofxsChannelLut_h
+
+#include <cassert>
+#include <vector>
+
+namespace OFX {
+
+template <int nFeatures>
+class ChannelLut
+{
+public:
+    /// Builds the tables: filler.fillEntry(c, v, entry) must set the nFeatures terms
+    /// of channel c (0, 1 or 2) for the normalized sample value v (in [0,1]).
+    template <class FILLER>
+    ChannelLut(int maxValue,
+               const FILLER &filler)
+    : _maxValue(maxValue)
+    , _data((size_t)3 * (maxValue + 1) * nFeatures)
+    {
+        assert(maxValue > 1);
+        for (int c = 0; c < 3; ++c) {
+            for (int i = 0; i <= maxValue; ++i) {
+                filler.fillEntry(c, i / (double)maxValue, &_data[((size_t)c * (maxValue + 1) + i) * nFeatures]);
+            }
+        }
+    }
+
+    /// True if building the tables costs less than what they save on a render window of nPixels pixels.
+    static bool isWorthBuilding(int maxValue, double nPixels)
+    {
+        return maxValue > 1 && nPixels > 3. * (maxValue + 1);
+    }
+
+    /// The sums of the terms of the three channels of an integer pixel.
+    template <class PIX>
+    void features(const PIX *pix,
+                  float out[nFeatures]) const
+    {
+        const float *e0 = &_data[(size_t)pix[0] * nFeatures];
+        const float *e1 = &_data[((size_t)(_maxValue + 1) + pix[1]) * nFeatures];
+        const float *e2 = &_data[((size_t)2 * (_maxValue + 1) + pix[2]) * nFeatures];
+        for (int k = 0; k < nFeatures; ++k) {
+            out[k] = e0[k] + e1[k] + e2[k];
+        }
+    }
+
+private:
+    int _maxValue;
+    std::vector<float> _data;
+};
+
+} // namespace OFX
+
+#endif // Misc_ofxsChannelLut_h
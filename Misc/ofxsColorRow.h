@@ -0,0 +1,531 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Row-batched color model conversions.
+ *
+ * The functions of OFX::Color (ofxsLut.h) convert one pixel at a time, and
+ * branch on the hue sector or on the largest component. These convert a
+ * whole row of n pixels stored as separate channel arrays (one array per
+ * channel), four pixels at a time with SSE2 when available. Each conversion
+ * is written once, branch-free, as a kernel templated on the vector type,
+ * so that the leftover pixels (and builds without SSE2) go through the
+ * exact same code one float at a time.
+ *
+ * The results are those of the OFX::Color functions up to float rounding.
+ * The transcendental functions are replaced by polynomials accurate to
+ * float precision: atan2 in RGB to HSI, cos in HSI to RGB, and the cube root
+ * in XYZ to Lab (Newton iterations). Grey pixels get a zero HSL saturation
+ * where OFX::Color::rgb_to_hsl may return NaN.
+ *
+ * The output arrays may be the input arrays (the conversions can be done in place).
+ */
+
+#ifndef Misc_ofxsColorRow_h
+#define Misc_ofxsColorRow_h
+
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COLORROW_SSE2
+#endif
+
+namespace OFX {
+namespace ColorRow {
+
+/// One pixel of the row.
+struct Vec1
+{
+    typedef bool Mask;
+
+    float x;
+
+    Vec1() : x(0.f) {}
+
+    Vec1(float v) : x(v) {}
+
+    static Vec1 load(const float *p) { return Vec1(*p); }
+
+    void store(float *p) const { *p = x; }
+};
+
+inline Vec1 operator+(Vec1 a, Vec1 b) { return Vec1(a.x + b.x); }
+inline Vec1 operator-(Vec1 a, Vec1 b) { return Vec1(a.x - b.x); }
+inline Vec1 operator*(Vec1 a, Vec1 b) { return Vec1(a.x * b.x); }
+inline Vec1 operator/(Vec1 a, Vec1 b) { return Vec1(a.x / b.x); }
+inline Vec1 vmin(Vec1 a, Vec1 b) { return Vec1(std::min(a.x, b.x)); }
+inline Vec1 vmax(Vec1 a, Vec1 b) { return Vec1(std::max(a.x, b.x)); }
+inline Vec1 vabs(Vec1 a) { return Vec1(std::abs(a.x)); }
+inline Vec1 vfloor(Vec1 a) { return Vec1(std::floor(a.x)); }
+inline Vec1 vsqrt(Vec1 a) { return Vec1(std::sqrt(a.x)); }
+inline bool veq(Vec1 a, Vec1 b) { return a.x == b.x; }
+inline bool vlt(Vec1 a, Vec1 b) { return a.x < b.x; }
+inline bool vle(Vec1 a, Vec1 b) { return a.x <= b.x; }
+inline bool vor(bool a, bool b) { return a || b; }
+inline bool vandnot(bool a, bool b) { return !a && b; }
+inline Vec1 vselect(bool m, Vec1 a, Vec1 b) { return m ? a : b; }
+// cube root of a positive value
+inline Vec1 vcbrt(Vec1 a) { return Vec1(std::pow(a.x, 1.f / 3)); }
+
+#ifdef COLORROW_SSE2
+/// Four pixels of the row.
+struct Vec4
+{
+    typedef __m128 Mask;
+
+    __m128 x;
+
+    Vec4() : x(_mm_setzero_ps()) {}
+
+    Vec4(float v) : x(_mm_set1_ps(v)) {}
+
+    Vec4(__m128 v) : x(v) {}
+
+    static Vec4 load(const float *p) { return Vec4(_mm_loadu_ps(p)); }
+
+    void store(float *p) const { _mm_storeu_ps(p, x); }
+};
+
+inline Vec4 operator+(Vec4 a, Vec4 b) { return _mm_add_ps(a.x, b.x); }
+inline Vec4 operator-(Vec4 a, Vec4 b) { return _mm_sub_ps(a.x, b.x); }
+inline Vec4 operator*(Vec4 a, Vec4 b) { return _mm_mul_ps(a.x, b.x); }
+inline Vec4 operator/(Vec4 a, Vec4 b) { return _mm_div_ps(a.x, b.x); }
+inline Vec4 vmin(Vec4 a, Vec4 b) { return _mm_min_ps(a.x, b.x); }
+inline Vec4 vmax(Vec4 a, Vec4 b) { return _mm_max_ps(a.x, b.x); }
+inline Vec4 vabs(Vec4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.x); }
+inline Vec4 vfloor(Vec4 a)
+{
+    // truncate, and subtract 1 where that rounded up (negative values)
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.x));
+
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.x), _mm_set1_ps(1.f)));
+}
+inline Vec4 vsqrt(Vec4 a) { return _mm_sqrt_ps(a.x); }
+inline __m128 veq(Vec4 a, Vec4 b) { return _mm_cmpeq_ps(a.x, b.x); }
+inline __m128 vlt(Vec4 a, Vec4 b) { return _mm_cmplt_ps(a.x, b.x); }
+inline __m128 vle(Vec4 a, Vec4 b) { return _mm_cmple_ps(a.x, b.x); }
+inline __m128 vor(__m128 a, __m128 b) { return _mm_or_ps(a, b); }
+inline __m128 vandnot(__m128 a, __m128 b) { return _mm_andnot_ps(a, b); }
+inline Vec4 vselect(__m128 m, Vec4 a, Vec4 b) { return _mm_or_ps(_mm_and_ps(m, a.x), _mm_andnot_ps(m, b.x)); }
+inline Vec4 vcbrt(Vec4 a)
+{
+    // divide the exponent by 3 to get a first approximation, then three Newton iterations
+    __m128i i = _mm_castps_si128(a.x);
+    i = _mm_add_epi32(_mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.f / 3))), _mm_set1_epi32(709921077));
+    Vec4 y(_mm_castsi128_ps(i));
+    for (int k = 0; k < 3; ++k) {
+        y = (y + y + a / (y * y)) * Vec4(1.f / 3);
+    }
+
+    return y;
+}
+#endif
+
+// hue in degrees of the largest component, as in OFX::Color::rgb_to_hsv (0 for grey and black pixels)
+template <class V>
+inline V
+hue(V r, V g, V b, V mx, V delta, typename V::Mask grey)
+{
+    const V d = vselect(grey, V(1.f), delta);
+    V h = vselect(veq(r, mx), (g - b) / d,
+                  vselect(veq(g, mx), V(2.f) + (b - r) / d,
+                          V(4.f) + (r - g) / d));
+    h = h * V(60.f);
+    h = vselect(vlt(h, V(0.f)), h + V(360.f), h);
+
+    return vselect(grey, V(0.f), h);
+}
+
+// hue in [0,6), as in OFX::Color::hsv_to_rgb
+template <class V>
+inline V
+hueSector(V h)
+{
+    return (h - V(360.f) * vfloor(h * V(1.f / 360))) * V(1.f / 60);
+}
+
+struct RgbToHsv
+{
+    template <class V>
+    void operator()(V r, V g, V b, V *h, V *s, V *v) const
+    {
+        const V mx = vmax(vmax(r, g), b);
+        const V mn = vmin(vmin(r, g), b);
+        const V delta = mx - mn;
+        const typename V::Mask black = veq(mx, V(0.f));
+        *h = hue(r, g, b, mx, delta, vor(black, veq(delta, V(0.f))));
+        *s = vselect(black, V(0.f), delta / vselect(black, V(1.f), mx));
+        *v = mx;
+    }
+};
+
+struct HsvToRgb
+{
+    // channel n (5 for red, 3 for green, 1 for blue) is v * (1 - s * clamp(min(k, 4 - k), 0, 1)),
+    // with k = (n + h / 60) mod 6: the six hue sectors without branches
+    template <class V>
+    static V channel(float n, V h6, V s, V v)
+    {
+        V k = V(n) + h6;
+        k = vselect(vlt(k, V(6.f)), k, k - V(6.f));
+
+        return v - v * s * vmax(V(0.f), vmin(vmin(k, V(4.f) - k), V(1.f)));
+    }
+
+    template <class V>
+    void operator()(V h, V s, V v, V *r, V *g, V *b) const
+    {
+        const V h6 = hueSector(h);
+        *r = channel(5.f, h6, s, v);
+        *g = channel(3.f, h6, s, v);
+        *b = channel(1.f, h6, s, v);
+    }
+};
+
+struct RgbToHsl
+{
+    template <class V>
+    void operator()(V r, V g, V b, V *h, V *s, V *l) const
+    {
+        const V mx = vmax(vmax(r, g), b);
+        const V mn = vmin(vmin(r, g), b);
+        const V delta = mx - mn;
+        const typename V::Mask grey = vor(veq(mx, V(0.f)), veq(delta, V(0.f)));
+        const V ll = (mx + mn) * V(0.5f);
+        const V den = vselect(vle(ll, V(0.5f)), mx + mn, V(2.f) - mx - mn);
+        *h = hue(r, g, b, mx, delta, grey);
+        *s = vselect(grey, V(0.f), delta / vselect(grey, V(1.f), den));
+        *l = ll;
+    }
+};
+
+struct HslToRgb
+{
+    // channel n (0 for red, 8 for green, 4 for blue) is l - a * clamp(min(k - 3, 9 - k), -1, 1),
+    // with a = s * min(l, 1 - l) and k = (n + h / 30) mod 12
+    template <class V>
+    static V channel(float n, V h12, V a, V l)
+    {
+        V k = V(n) + h12;
+        k = vselect(vlt(k, V(12.f)), k, k - V(12.f));
+
+        return l - a * vmax(V(-1.f), vmin(vmin(k - V(3.f), V(9.f) - k), V(1.f)));
+    }
+
+    template <class V>
+    void operator()(V h, V s, V l, V *r, V *g, V *b) const
+    {
+        const V h12 = hueSector(h) * V(2.f);
+        const V a = s * vmin(l, V(1.f) - l);
+        *r = channel(0.f, h12, a, l);
+        *g = channel(8.f, h12, a, l);
+        *b = channel(4.f, h12, a, l);
+    }
+};
+
+struct RgbToHsi
+{
+    // atan2(y, x), in degrees in [0,360)
+    template <class V>
+    static V atan2Degrees(V y, V x)
+    {
+        const V ax = vabs(x);
+        const V ay = vabs(y);
+        const V mx = vmax(ax, ay);
+        const V a = vmin(ax, ay) / vselect(veq(mx, V(0.f)), V(1.f), mx); // in [0,1]
+        // reduce to [-tan(pi/8),tan(pi/8)], where the polynomial (from Cephes atanf) is accurate to float precision
+        const typename V::Mask big = vlt(V(0.414213562373f), a);
+        const V t = vselect(big, (a - V(1.f)) / (a + V(1.f)), a);
+        const V z = t * t;
+        V p = ((((V(8.05374449538e-2f) * z - V(1.38776856032e-1f)) * z + V(1.99777106478e-1f)) * z - V(3.33329491539e-1f)) * z) * t + t;
+        p = vselect(big, p + V((float)(M_PI / 4)), p);
+        p = vselect(vlt(ax, ay), V((float)(M_PI / 2)) - p, p);
+        p = vselect(vlt(x, V(0.f)), V((float)M_PI) - p, p);
+        p = vselect(vlt(y, V(0.f)), V(0.f) - p, p);
+        p = p * V((float)(180. / M_PI));
+
+        return vselect(vlt(p, V(0.f)), p + V(360.f), p);
+    }
+
+    template <class V>
+    void operator()(V r, V g, V b, V *h, V *s, V *i) const
+    {
+        const V mn = vmin(vmin(r, g), b);
+        const V sum = r + g + b;
+        const typename V::Mask dark = vle(sum, V(0.f));
+        // the angle of the projection of RGB on the plane orthogonal to the grey axis, red being 0
+        *h = atan2Degrees(V(1.73205080757f) * (g - b), V(2.f) * r - g - b);
+        *s = vselect(dark, V(0.f), V(1.f) - V(3.f) * mn / vselect(dark, V(1.f), sum));
+        *i = sum * V(1.f / 3);
+    }
+};
+
+struct HsiToRgb
+{
+    template <class V>
+    void operator()(V h, V s, V i, V *r, V *g, V *b) const
+    {
+        const V h6 = hueSector(h);
+        const typename V::Mask s1 = vlt(h6, V(2.f)); // first sector, red to green
+        const typename V::Mask s3 = vle(V(4.f), h6); // third sector, blue to red
+        const V hs = h6 - vselect(s1, V(0.f), vselect(s3, V(4.f), V(2.f))); // in [0,2)
+        // cos(hs) / cos(60 - hs) = 0.5 - sqrt(3)/2 tan(u), with u = hs - 60 in [-60,60] degrees
+        const V u = (hs - V(1.f)) * V((float)(M_PI / 3));
+        const V u2 = u * u;
+        const V sinu = u * (V(1.f) + u2 * (V(-1.f / 6) + u2 * (V(1.f / 120) + u2 * (V(-1.f / 5040) + u2 * (V(1.f / 362880) + u2 * V(-1.f / 39916800))))));
+        const V cosu = V(1.f) + u2 * (V(-1.f / 2) + u2 * (V(1.f / 24) + u2 * (V(-1.f / 720) + u2 * (V(1.f / 40320) + u2 * (V(-1.f / 3628800) + u2 * V(1.f / 479001600))))));
+        const V ratio = V(0.5f) - V(0.866025403784f) * sinu / cosu;
+        const V lo = i * (V(1.f) - s);
+        const V hi = i * (V(1.f) + s * ratio);
+        const V mid = V(3.f) * i - (lo + hi);
+        const typename V::Mask s2 = vor(s1, s3);
+        *r = vselect(s1, hi, vselect(s3, mid, lo));
+        *g = vselect(s1, mid, vselect(s3, lo, hi));
+        *b = vselect(s2, vselect(s1, lo, hi), mid);
+    }
+};
+
+/// The matrix of an affine color conversion, e.g. OFX::Color::rgb_to_ycbcr.
+struct Matrix34
+{
+    typedef void (*ConversionFunction)(float, float, float, float *, float *, float *);
+
+    float m[3][4]; // the fourth column is the offset
+
+    Matrix34()
+    {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                m[i][j] = (i == j) ? 1.f : 0.f;
+            }
+        }
+    }
+
+    /// Computes the matrix from the images of black and of the three primaries by the conversion f.
+    explicit Matrix34(ConversionFunction f)
+    {
+        float o[3];
+        f(0.f, 0.f, 0.f, &o[0], &o[1], &o[2]);
+        for (int j = 0; j < 3; ++j) {
+            float p[3];
+            f(j == 0 ? 1.f : 0.f, j == 1 ? 1.f : 0.f, j == 2 ? 1.f : 0.f, &p[0], &p[1], &p[2]);
+            for (int i = 0; i < 3; ++i) {
+                m[i][j] = p[i] - o[i];
+            }
+        }
+        for (int i = 0; i < 3; ++i) {
+            m[i][3] = o[i];
+        }
+    }
+
+    template <class V>
+    void operator()(V x, V y, V z, V *ox, V *oy, V *oz) const
+    {
+        *ox = V(m[0][0]) * x + V(m[0][1]) * y + V(m[0][2]) * z + V(m[0][3]);
+        *oy = V(m[1][0]) * x + V(m[1][1]) * y + V(m[1][2]) * z + V(m[1][3]);
+        *oz = V(m[2][0]) * x + V(m[2][1]) * y + V(m[2][2]) * z + V(m[2][3]);
+    }
+};
+
+/// CIE XYZ to L*a*b*, relative to the given white point.
+struct XyzToLab
+{
+    float w[3];
+
+    explicit XyzToLab(const float white[3])
+    {
+        for (int i = 0; i < 3; ++i) {
+            w[i] = white[i];
+        }
+    }
+
+    template <class V>
+    static V f(V t)
+    {
+        const typename V::Mask lin = vlt(t, V(0.008856f));
+
+        return vselect(lin, V(7.787f) * t + V(16.f / 116), vcbrt(vmax(t, V(0.008856f))));
+    }
+
+    template <class V>
+    void operator()(V x, V y, V z, V *l, V *a, V *b) const
+    {
+        const V fx = f(x / V(w[0]));
+        const V fy = f(y / V(w[1]));
+        const V fz = f(z / V(w[2]));
+        *l = V(116.f) * fy - V(16.f);
+        *a = V(500.f) * (fx - fy);
+        *b = V(200.f) * (fy - fz);
+    }
+};
+
+/// CIE L*a*b* to XYZ, relative to the given white point.
+struct LabToXyz
+{
+    float w[3];
+
+    explicit LabToXyz(const float white[3])
+    {
+        for (int i = 0; i < 3; ++i) {
+            w[i] = white[i];
+        }
+    }
+
+    template <class V>
+    static V finv(V t)
+    {
+        return vselect(vlt(t, V(0.206893f)), (t - V(16.f / 116)) * V(1.f / 7.787f), t * t * t);
+    }
+
+    template <class V>
+    void operator()(V l, V a, V b, V *x, V *y, V *z) const
+    {
+        const V fy = (l + V(16.f)) * V(1.f / 116);
+        *x = V(w[0]) * finv(fy + a * V(1.f / 500));
+        *y = V(w[1]) * finv(fy);
+        *z = V(w[2]) * finv(fy - b * V(1.f / 200));
+    }
+};
+
+/// Applies the three-channel kernel k to the n pixels of a row.
+template <class KERNEL>
+inline void
+processRow(const KERNEL &k,
+           int n,
+           const float *x,
+           const float *y,
+           const float *z,
+           float *ox,
+           float *oy,
+           float *oz)
+{
+    int i = 0;
+#ifdef COLORROW_SSE2
+    for (; i + 4 <= n; i += 4) {
+        Vec4 a, b, c;
+        k(Vec4::load(x + i), Vec4::load(y + i), Vec4::load(z + i), &a, &b, &c);
+        a.store(ox + i);
+        b.store(oy + i);
+        c.store(oz + i);
+    }
+#endif
+    for (; i < n; ++i) {
+        Vec1 a, b, c;
+        k(Vec1::load(x + i), Vec1::load(y + i), Vec1::load(z + i), &a, &b, &c);
+        a.store(ox + i);
+        b.store(oy + i);
+        c.store(oz + i);
+    }
+}
+
+/// Applies the four-channel kernel k to the n pixels of a row.
+template <class KERNEL>
+inline void
+processRow(const KERNEL &k,
+           int n,
+           const float *x,
+           const float *y,
+           const float *z,
+           const float *w,
+           float *ox,
+           float *oy,
+           float *oz,
+           float *ow)
+{
+    int i = 0;
+#ifdef COLORROW_SSE2
+    for (; i + 4 <= n; i += 4) {
+        Vec4 a, b, c, d;
+        k(Vec4::load(x + i), Vec4::load(y + i), Vec4::load(z + i), Vec4::load(w + i), &a, &b, &c, &d);
+        a.store(ox + i);
+        b.store(oy + i);
+        c.store(oz + i);
+        d.store(ow + i);
+    }
+#endif
+    for (; i < n; ++i) {
+        Vec1 a, b, c, d;
+        k(Vec1::load(x + i), Vec1::load(y + i), Vec1::load(z + i), Vec1::load(w + i), &a, &b, &c, &d);
+        a.store(ox + i);
+        b.store(oy + i);
+        c.store(oz + i);
+        d.store(ow + i);
+    }
+}
+
+inline void
+rgb_to_hsv(int n, const float *r, const float *g, const float *b, float *h, float *s, float *v)
+{
+    processRow(RgbToHsv(), n, r, g, b, h, s, v);
+}
+
+inline void
+hsv_to_rgb(int n, const float *h, const float *s, const float *v, float *r, float *g, float *b)
+{
+    processRow(HsvToRgb(), n, h, s, v, r, g, b);
+}
+
+inline void
+rgb_to_hsl(int n, const float *r, const float *g, const float *b, float *h, float *s, float *l)
+{
+    processRow(RgbToHsl(), n, r, g, b, h, s, l);
+}
+
+inline void
+hsl_to_rgb(int n, const float *h, const float *s, const float *l, float *r, float *g, float *b)
+{
+    processRow(HslToRgb(), n, h, s, l, r, g, b);
+}
+
+inline void
+rgb_to_hsi(int n, const float *r, const float *g, const float *b, float *h, float *s, float *i)
+{
+    processRow(RgbToHsi(), n, r, g, b, h, s, i);
+}
+
+inline void
+hsi_to_rgb(int n, const float *h, const float *s, const float *i, float *r, float *g, float *b)
+{
+    processRow(HsiToRgb(), n, h, s, i, r, g, b);
+}
+
+/// Affine conversions: YCbCr, YUV, XYZ (see Matrix34).
+inline void
+affine(const Matrix34 &m, int n, const float *x, const float *y, const float *z, float *ox, float *oy, float *oz)
+{
+    processRow(m, n, x, y, z, ox, oy, oz);
+}
+
+inline void
+xyz_to_lab(const float white[3], int n, const float *x, const float *y, const float *z, float *l, float *a, float *b)
+{
+    processRow(XyzToLab(white), n, x, y, z, l, a, b);
+}
+
+inline void
+lab_to_xyz(const float white[3], int n, const float *l, const float *a, const float *b, float *x, float *y, float *z)
+{
+    processRow(LabToXyz(white), n, l, a, b, x, y, z);
+}
+
+} // namespace ColorRow
+} // namespace OFX
+
+#endif // Misc_ofxsColorRow_h
@@ -0,0 +1,353 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Per-instance cache of input frames, for time effects (FrameBlend, TimeBlur).
+ *
+ * When rendering a sequence, consecutive output frames share most of their
+ * input frames. The cache keeps a copy of the pixels of the last fetched input
+ * frames (only the part that is within the render window), so that rendering
+ * the next frame only requires fetching the new input frames.
+ *
+ * The host does not tell us when the upstream graph changes, so the cache must
+ * only be enabled between beginSequenceRender and endSequenceRender of a
+ * non-interactive render, and cleared in purgeCaches.
+ */
+
+#ifndef Misc_ofxsFrameCache_h
+#define Misc_ofxsFrameCache_h
+
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <list>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+
+// times computed from fractional shutter intervals may differ by rounding errors: two times are
+// the same if they differ by less than kFrameCacheTimeTolerance times the spacing between samples
+#define kFrameCacheTimeTolerance 1e-4
+
+namespace OFX {
+
+/// Read-only access to the pixels of an OFX::Image or of a cached frame.
+/// getPixelAddress() returns NULL outside of the bounds, like OFX::Image.
+struct FrameView
+{
+    const void *data;
+    OfxRectI bounds;
+    int rowBytes;
+    int pixelBytes;
+
+    FrameView()
+    : data(0)
+    , rowBytes(0)
+    , pixelBytes(0)
+    {
+        bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+    }
+
+    explicit FrameView(const OFX::Image *img)
+    : data(0)
+    , rowBytes(0)
+    , pixelBytes(0)
+    {
+        bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+        if (img) {
+            data = img->getPixelData();
+            bounds = img->getBounds();
+            rowBytes = img->getRowBytes();
+            pixelBytes = img->getPixelComponentCount() * getComponentBytes(img->getPixelDepth());
+        }
+    }
+
+    const void *getPixelAddress(int x, int y) const
+    {
+        if (!data || x < bounds.x1 || x >= bounds.x2 || y < bounds.y1 || y >= bounds.y2) {
+            return 0;
+        }
+        return (const char*)data + (size_t)(y - bounds.y1) * rowBytes + (size_t)(x - bounds.x1) * pixelBytes;
+    }
+
+    static int getComponentBytes(OFX::BitDepthEnum depth)
+    {
+        switch (depth) {
+            case OFX::eBitDepthUByte:
+                return 1;
+            case OFX::eBitDepthUShort:
+            case OFX::eBitDepthHalf:
+                return 2;
+            case OFX::eBitDepthFloat:
+                return 4;
+            default:
+                return 0;
+        }
+    }
+};
+
+class FrameCache
+{
+public:
+    /// A cached frame. Entries returned by acquire() or insert() are pinned
+    /// (they cannot be evicted) until they are given back to release().
+    struct Entry
+    {
+        int clipIndex;
+        double time;
+        OfxPointD renderScale;
+        OfxRectI srcBounds; // bounds of the image the host gave us
+        FrameView view;     // copy of srcBounds inter render window
+        OFX::ImageMemory *mem;
+        size_t nBytes;
+        int refCount;
+    };
+
+    FrameCache(OFX::ImageEffect *effect)
+    : _effect(effect)
+    , _mutex()
+    , _entries()
+    , _maxBytes(0)
+    , _usedBytes(0)
+    {
+    }
+
+    ~FrameCache()
+    {
+        clear();
+    }
+
+    /// Set the memory cap. 0 disables the cache (acquire() and insert() return NULL).
+    void setMaxBytes(size_t maxBytes)
+    {
+        {
+            OFX::MultiThread::AutoMutex l(_mutex);
+            _maxBytes = maxBytes;
+        }
+        if (maxBytes == 0) {
+            clear();
+        } else {
+            trim(0);
+        }
+    }
+
+    /// Remove all entries that are not in use.
+    void clear()
+    {
+        OFX::MultiThread::AutoMutex l(_mutex);
+        std::list<Entry*>::iterator it = _entries.begin();
+        while (it != _entries.end()) {
+            if ((*it)->refCount == 0) {
+                _usedBytes -= (*it)->nBytes;
+                destroy(*it);
+                it = _entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /// Look for a cached frame covering window (intersected with the frame bounds).
+    /// timeSpacing is the smallest difference between two distinct times that are fetched (1 for integer frames).
+    const Entry *acquire(int clipIndex, double time, const OfxPointD &renderScale, const OfxRectI &window, double timeSpacing = 1.)
+    {
+        const double timeTolerance = kFrameCacheTimeTolerance * std::fabs(timeSpacing);
+        OFX::MultiThread::AutoMutex l(_mutex);
+        if (_maxBytes == 0) {
+            return 0;
+        }
+        for (std::list<Entry*>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            Entry *e = *it;
+            if (e->clipIndex != clipIndex ||
+                std::fabs(e->time - time) > timeTolerance ||
+                e->renderScale.x != renderScale.x ||
+                e->renderScale.y != renderScale.y) {
+                continue;
+            }
+            OfxRectI needed;
+            if (intersect(window, e->srcBounds, &needed) && !contains(e->view.bounds, needed)) {
+                // cached for a smaller render window
+                continue;
+            }
+            ++e->refCount;
+            // most recently used entries are at the front
+            _entries.splice(_entries.begin(), _entries, it);
+            return e;
+        }
+        return 0;
+    }
+
+    /// Copy the part of img within window into the cache. Returns NULL if the
+    /// cache is disabled or if the frame does not fit.
+    const Entry *insert(int clipIndex, double time, const OfxPointD &renderScale, const OFX::Image *img, const OfxRectI &window)
+    {
+        if (!img) {
+            return 0;
+        }
+        OfxRectI srcBounds = img->getBounds();
+        OfxRectI region;
+        if (!intersect(window, srcBounds, &region)) {
+            region.x1 = region.y1 = region.x2 = region.y2 = 0;
+        }
+        int pixelBytes = img->getPixelComponentCount() * FrameView::getComponentBytes(img->getPixelDepth());
+        size_t rowBytes = (size_t)(region.x2 - region.x1) * pixelBytes;
+        size_t nBytes = rowBytes * (region.y2 - region.y1);
+        {
+            OFX::MultiThread::AutoMutex l(_mutex);
+            if (_maxBytes == 0 || nBytes > _maxBytes) {
+                return 0;
+            }
+        }
+        if (!trim(nBytes)) {
+            return 0;
+        }
+
+        // copy outside of the lock, the entry is not visible yet
+        Entry *e = new Entry;
+        e->clipIndex = clipIndex;
+        e->time = time;
+        e->renderScale = renderScale;
+        e->srcBounds = srcBounds;
+        e->mem = 0;
+        e->nBytes = nBytes;
+        e->refCount = 1;
+        e->view.bounds = region;
+        e->view.rowBytes = (int)rowBytes;
+        e->view.pixelBytes = pixelBytes;
+        if (nBytes) {
+            try {
+                e->mem = new OFX::ImageMemory(nBytes, _effect);
+            } catch (...) {
+                delete e;
+                OFX::MultiThread::AutoMutex l(_mutex);
+                _usedBytes -= nBytes;
+                return 0;
+            }
+            char *data = (char*)e->mem->lock();
+            e->view.data = data;
+            for (int y = region.y1; y < region.y2; ++y) {
+                std::memcpy(data + (size_t)(y - region.y1) * rowBytes, img->getPixelAddress(region.x1, y), rowBytes);
+            }
+        }
+
+        OFX::MultiThread::AutoMutex l(_mutex);
+        _entries.push_front(e);
+        return e;
+    }
+
+    void release(const Entry *entry)
+    {
+        if (!entry) {
+            return;
+        }
+        OFX::MultiThread::AutoMutex l(_mutex);
+        Entry *e = const_cast<Entry*>(entry);
+        assert(e->refCount > 0);
+        --e->refCount;
+        if (_usedBytes > _maxBytes && e->refCount == 0) {
+            // the cache was shrunk or disabled while this entry was in use
+            _entries.remove(e);
+            _usedBytes -= e->nBytes;
+            destroy(e);
+        }
+    }
+
+private:
+    // Reserve nBytes, evicting the least recently used entries that are not in use.
+    bool trim(size_t nBytes)
+    {
+        OFX::MultiThread::AutoMutex l(_mutex);
+        std::list<Entry*>::iterator it = _entries.end();
+        while (_usedBytes + nBytes > _maxBytes && it != _entries.begin()) {
+            --it;
+            if ((*it)->refCount == 0) {
+                _usedBytes -= (*it)->nBytes;
+                destroy(*it);
+                it = _entries.erase(it);
+            }
+        }
+        if (_usedBytes + nBytes > _maxBytes) {
+            return false;
+        }
+        _usedBytes += nBytes;
+
+        return true;
+    }
+
+    static void destroy(Entry *e)
+    {
+        if (e->mem) {
+            e->mem->unlock();
+            delete e->mem;
+        }
+        delete e;
+    }
+
+    static bool intersect(const OfxRectI &a, const OfxRectI &b, OfxRectI *r)
+    {
+        r->x1 = std::max(a.x1, b.x1);
+        r->y1 = std::max(a.y1, b.y1);
+        r->x2 = std::min(a.x2, b.x2);
+        r->y2 = std::min(a.y2, b.y2);
+
+        return r->x1 < r->x2 && r->y1 < r->y2;
+    }
+
+    static bool contains(const OfxRectI &a, const OfxRectI &b)
+    {
+        return a.x1 <= b.x1 && a.y1 <= b.y1 && b.x2 <= a.x2 && b.y2 <= a.y2;
+    }
+
+    OFX::ImageEffect *_effect;
+    OFX::MultiThread::Mutex _mutex;
+    std::list<Entry*> _entries; // most recently used first
+    size_t _maxBytes;
+    size_t _usedBytes;
+};
+
+/// Releases the cache entries and deletes the images fetched during a render pass,
+/// even in case of exceptions.
+struct FrameCacheHolder_RAII
+{
+    FrameCache *cache;
+    std::vector<const FrameCache::Entry*> entries;
+    std::vector<const OFX::Image*> images;
+
+    FrameCacheHolder_RAII(FrameCache *c)
+    : cache(c)
+    , entries()
+    , images()
+    {
+    }
+
+    ~FrameCacheHolder_RAII()
+    {
+        for (unsigned int i = 0; i < entries.size(); ++i) {
+            cache->release(entries[i]);
+        }
+        for (unsigned int i = 0; i < images.size(); ++i) {
+            delete images[i];
+        }
+    }
+};
+
+} // namespace OFX
+
+#endif // Misc_ofxsFrameCache_h
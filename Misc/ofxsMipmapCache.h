@@ -0,0 +1,736 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Mipmapped rendering of minifying 3x3 transforms.
+ *
+ * ofxsFilterInterpolate2DSuper supersamples the source according to the
+ * Jacobian of the transform, so its cost grows with the minification factor.
+ * Here, a box-filtered pyramid of the source is built once, and each output
+ * pixel samples it with anisotropic trilinear filtering: a few trilinear probes
+ * along the major axis of the pixel footprint, at the level given by the minor
+ * axis. The cost per pixel is bounded by kMipmapMaxAnisotropy.
+ *
+ * The pyramid covers the region of definition of the source, so that its levels
+ * do not depend on the tile being rendered, and it is cached using the unique
+ * identifier that the host gives to the source image, so that all the tiles of a
+ * frame share it.
+ */
+
+#ifndef Misc_ofxsMipmapCache_h
+#define Misc_ofxsMipmapCache_h
+
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsCoords.h"
+#include "ofxsMultiThread.h"
+#include "ofxsRefCountedCache.h"
+#include "ofxsProcessing.H"
+#include "ofxsMaskMix.h"
+#include "ofxsFilter.h"
+#include "ofxsMatrix2D.h"
+#include "ofxsMacros.h"
+
+#define kParamMipmap "mipmap"
+#define kParamMipmapLabel "Mipmap"
+#define kParamMipmapHint "When the transform minifies the image, sample a prefiltered pyramid of the source with anisotropic trilinear filtering, rather than supersampling the source. This is much faster for large downscales, and slightly softer. The filter is still used where the image is magnified."
+
+#define kMipmapMaxAnisotropy 16 // maximum number of trilinear probes per pixel
+
+namespace OFX {
+
+inline void
+ofxsMipmapDescribeParams(OFX::ImageEffectDescriptor &desc, OFX::PageParamDescriptor *page)
+{
+    OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamMipmap);
+    param->setLabel(kParamMipmapLabel);
+    param->setHint(kParamMipmapHint);
+    param->setDefault(false);
+    param->setAnimates(false);
+    if (page) {
+        page->addChild(*param);
+    }
+}
+
+/// Levels 1..n of a box-filtered pyramid of a source image, in float.
+/// Level l pixel (i,j) covers the source pixels [x1+i*2^l, x1+(i+1)*2^l) x [y1+j*2^l, y1+(j+1)*2^l),
+/// where (x1,y1) is the origin of the source region of definition, in pixels.
+/// Level 0 is the source image itself, which is not stored here.
+/// The effect must ask for the whole source RoD as the region of interest, since each tile may
+/// use the coarse levels. Source pixels outside of the bounds of the image it was built from
+/// (if the host ignored the RoI) are black.
+class MipmapPyramid
+: public RefCountedCacheEntry
+{
+public:
+    struct Level
+    {
+        int width;
+        int height;
+        float *data; // nComponents floats per pixel
+    };
+
+    MipmapPyramid(const OFX::Image *src, const OfxRectI &srcRoD, int nComponents, const std::string &uniqueID, OFX::ImageEffect *effect)
+    : RefCountedCacheEntry()
+    , _uniqueID(uniqueID)
+    , _bounds(srcRoD)
+    , _renderScale(src->getRenderScale())
+    , _nComponents(nComponents)
+    , _levels()
+    , _mem()
+    {
+        int w = std::max(0, _bounds.x2 - _bounds.x1);
+        int h = std::max(0, _bounds.y2 - _bounds.y1);
+        Level l0 = {w, h, 0};
+        _levels.push_back(l0);
+        size_t size = 0;
+        while (w > 1 || h > 1) {
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+            Level l = {w, h, 0};
+            _levels.push_back(l);
+            size += (size_t)w * h * nComponents;
+        }
+        if (size) {
+            _mem.reset(new OFX::ImageMemory(size * sizeof(float), effect));
+            float *data = (float*)_mem->lock();
+            for (unsigned int i = 1; i < _levels.size(); ++i) {
+                _levels[i].data = data;
+                data += (size_t)_levels[i].width * _levels[i].height * nComponents;
+            }
+        }
+    }
+
+    ~MipmapPyramid()
+    {
+        if (_mem.get()) {
+            _mem->unlock();
+        }
+    }
+
+    /// The pyramid can be used to render from src if it was built from the same image.
+    bool matches(const OFX::Image *src, const OfxRectI &srcRoD, const std::string &uniqueID) const
+    {
+        const OfxPointD &rs = src->getRenderScale();
+
+        return (!_uniqueID.empty() && _uniqueID == uniqueID &&
+                srcRoD.x1 == _bounds.x1 && srcRoD.y1 == _bounds.y1 && srcRoD.x2 == _bounds.x2 && srcRoD.y2 == _bounds.y2 &&
+                rs.x == _renderScale.x && rs.y == _renderScale.y &&
+                src->getPixelComponentCount() == _nComponents);
+    }
+
+    int getLevelCount() const { return (int)_levels.size(); }
+
+    const Level &getLevel(int l) const { return _levels[l]; }
+
+    Level &getLevel(int l) { return _levels[l]; }
+
+    const OfxRectI &getBounds() const { return _bounds; }
+
+private:
+    std::string _uniqueID;
+    OfxRectI _bounds;
+    OfxPointD _renderScale;
+    int _nComponents;
+    std::vector<Level> _levels;
+    std::auto_ptr<OFX::ImageMemory> _mem;
+};
+
+// Computes the pyramid levels, one level at a time, splitting the rows between threads.
+template <class PIX, int nComponents>
+class MipmapBuilder : public OFX::MultiThread::Processor
+{
+public:
+    MipmapBuilder(OFX::ImageEffect &effect, const OFX::Image *src, MipmapPyramid &pyramid)
+    : _effect(effect)
+    , _src(src)
+    , _pyramid(pyramid)
+    , _level(1)
+    {
+    }
+
+    void build()
+    {
+        for (_level = 1; _level < _pyramid.getLevelCount(); ++_level) {
+            multiThread();
+            if (_effect.abort()) {
+                return;
+            }
+        }
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const MipmapPyramid::Level &prev = _pyramid.getLevel(_level - 1);
+        MipmapPyramid::Level &cur = _pyramid.getLevel(_level);
+        const OfxRectI &bounds = _pyramid.getBounds();
+        int j1 = (int)(((long long)cur.height * threadId) / nThreads);
+        int j2 = (int)(((long long)cur.height * (threadId + 1)) / nThreads);
+        for (int j = j1; j < j2; ++j) {
+            if (_effect.abort()) {
+                return;
+            }
+            // at the right and top edges of odd-sized levels, the last row/column is repeated
+            const int pj0 = 2 * j;
+            const int pj1 = std::min(2 * j + 1, prev.height - 1);
+            float *out = cur.data + (size_t)j * cur.width * nComponents;
+            for (int i = 0; i < cur.width; ++i, out += nComponents) {
+                const int pi0 = 2 * i;
+                const int pi1 = std::min(2 * i + 1, prev.width - 1);
+                for (int c = 0; c < nComponents; ++c) {
+                    out[c] = 0.25f * (get(prev, bounds, pi0, pj0, c) + get(prev, bounds, pi1, pj0, c) +
+                                      get(prev, bounds, pi0, pj1, c) + get(prev, bounds, pi1, pj1, c));
+                }
+            }
+        }
+    }
+
+    float get(const MipmapPyramid::Level &level, const OfxRectI &bounds, int i, int j, int c) const
+    {
+        if (_level == 1) {
+            const PIX *p = (const PIX *)_src->getPixelAddress(bounds.x1 + i, bounds.y1 + j);
+
+            return p ? (float)p[c] : 0.f;
+        }
+
+        return level.data[((size_t)j * level.width + i) * nComponents + c];
+    }
+
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_src;
+    MipmapPyramid &_pyramid;
+    int _level;
+};
+
+/// Builds a MipmapPyramid for MipmapCache::acquire(), see RefCountedCache::acquire().
+template <class PIX, int nComponents>
+class MipmapCacheBuilder
+{
+public:
+    MipmapCacheBuilder(OFX::ImageEffect &effect, const OFX::Image *src, const OfxRectI &srcRoD)
+    : _effect(effect)
+    , _src(src)
+    , _srcRoD(srcRoD)
+    , _uniqueID(src->getUniqueIdentifier())
+    {
+    }
+
+    bool isCacheable() const { return !_uniqueID.empty(); }
+
+    bool matches(const MipmapPyramid &pyramid) const
+    {
+        return pyramid.matches(_src, _srcRoD, _uniqueID);
+    }
+
+    MipmapPyramid *build()
+    {
+        std::auto_ptr<MipmapPyramid> pyramid(new MipmapPyramid(_src, _srcRoD, nComponents, _uniqueID, &_effect));
+        MipmapBuilder<PIX, nComponents> builder(_effect, _src, *pyramid);
+        builder.build();
+        if (_effect.abort()) {
+            // the pyramid may be incomplete
+            return 0;
+        }
+
+        return pyramid.release();
+    }
+
+private:
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_src;
+    OfxRectI _srcRoD;
+    std::string _uniqueID;
+};
+
+/// The last pyramid built by an effect instance, shared by all its renders.
+class MipmapCache
+: public RefCountedCache<MipmapPyramid>
+{
+public:
+    /// Returns the pyramid of src over srcRoD (the source region of definition, in pixels),
+    /// building it if it is not cached, or NULL if the render was aborted.
+    /// The result must be given back to release().
+    template <class PIX, int nComponents>
+    const MipmapPyramid *acquire(OFX::ImageEffect &effect, const OFX::Image *src, const OfxRectI &srcRoD)
+    {
+        assert(src);
+        MipmapCacheBuilder<PIX, nComponents> builder(effect, src, srcRoD);
+
+        // if the host does not identify images, the pyramid cannot be shared
+        return RefCountedCache<MipmapPyramid>::acquire(builder, builder.isCacheable());
+    }
+};
+
+class MipmapTransformProcessorBase : public OFX::ImageProcessor
+{
+protected:
+    const OFX::Image *_srcImg;
+    const OFX::Image *_maskImg;
+    const MipmapPyramid *_pyramid;
+    OFX::Matrix3x3 _invtransform;
+    bool _blackOutside;
+    bool _doMasking;
+    double _mix;
+    bool _maskInvert;
+
+public:
+    MipmapTransformProcessorBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _maskImg(0)
+    , _pyramid(0)
+    , _invtransform()
+    , _blackOutside(false)
+    , _doMasking(false)
+    , _mix(1.)
+    , _maskInvert(false)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    void setMaskImg(const OFX::Image *v, bool maskInvert) {_maskImg = v; _maskInvert = maskInvert;}
+
+    void doMasking(bool v) {_doMasking = v;}
+
+    /// invtransform goes from destination to source pixel coordinates
+    void setValues(const MipmapPyramid *pyramid, const OFX::Matrix3x3 &invtransform, bool blackOutside, double mix)
+    {
+        _pyramid = pyramid;
+        _invtransform = invtransform;
+        _blackOutside = blackOutside;
+        _mix = mix;
+    }
+};
+
+// The "filter" and "clamp" template parameters are used where the image is magnified.
+template <class PIX, int nComponents, int maxValue, FilterEnum filter, bool clamp>
+class MipmapTransformProcessor : public MipmapTransformProcessorBase
+{
+public:
+    MipmapTransformProcessor(OFX::ImageEffect &instance)
+    : MipmapTransformProcessorBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        assert(_dstImg);
+        float tmpPix[nComponents];
+        const OFX::Matrix3x3 & H = _invtransform;
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            OFX::Point3D canonicalCoords;
+            canonicalCoords.z = 1;
+            canonicalCoords.y = (double)y + 0.5;
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                canonicalCoords.x = (double)x + 0.5;
+                OFX::Point3D transformed = H * canonicalCoords;
+                if (!_srcImg || !_pyramid || transformed.z == 0.) {
+                    // the back-transformed point is at infinity
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = 0;
+                    }
+                } else {
+                    double fx = transformed.x / transformed.z;
+                    double fy = transformed.y / transformed.z;
+                    double Jxx = (H.a*transformed.z - transformed.x*H.g)/(transformed.z*transformed.z);
+                    double Jxy = (H.b*transformed.z - transformed.x*H.h)/(transformed.z*transformed.z);
+                    double Jyx = (H.d*transformed.z - transformed.y*H.g)/(transformed.z*transformed.z);
+                    double Jyy = (H.e*transformed.z - transformed.y*H.h)/(transformed.z*transformed.z);
+                    // lengths of the footprint of the pixel along x and y
+                    double lx = std::sqrt(Jxx*Jxx + Jyx*Jyx);
+                    double ly = std::sqrt(Jxy*Jxy + Jyy*Jyy);
+                    double major = std::max(lx, ly);
+                    if (major <= 1.) {
+                        // magnification
+                        if (filter == eFilterImpulse) {
+                            ofxsFilterInterpolate2D<PIX,nComponents,filter,clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
+                        } else {
+                            ofxsFilterInterpolate2DSuper<PIX,nComponents,filter,clamp>(fx, fy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
+                        }
+                    } else {
+                        double minor = std::max(1., std::min(lx, ly));
+                        int nProbes = std::min(kMipmapMaxAnisotropy, (int)std::ceil(major / minor));
+                        double lod = std::log(major / nProbes) / std::log(2.);
+                        // probes are spread along the major axis
+                        double ax = (lx >= ly) ? Jxx : Jxy;
+                        double ay = (lx >= ly) ? Jyx : Jyy;
+                        double acc[nComponents];
+                        std::fill(acc, acc + nComponents, 0.);
+                        for (int i = 0; i < nProbes; ++i) {
+                            double t = (i + 0.5) / nProbes - 0.5;
+                            sampleTrilinear(fx + t * ax, fy + t * ay, lod, tmpPix);
+                            for (int c = 0; c < nComponents; ++c) {
+                                acc[c] += tmpPix[c];
+                            }
+                        }
+                        for (int c = 0; c < nComponents; ++c) {
+                            tmpPix[c] = (float)(acc[c] / nProbes);
+                        }
+                    }
+                }
+
+                ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _srcImg, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+            }
+        }
+    }
+
+    void sampleTrilinear(double sx, double sy, double lod, float *out) const
+    {
+        const int maxLevel = _pyramid->getLevelCount() - 1;
+        lod = std::max(0., std::min(lod, (double)maxLevel));
+        int l0 = (int)lod;
+        double f = lod - l0;
+        sampleBilinear(l0, sx, sy, out);
+        if (f > 0. && l0 < maxLevel) {
+            float pix1[nComponents];
+            sampleBilinear(l0 + 1, sx, sy, pix1);
+            for (int c = 0; c < nComponents; ++c) {
+                out[c] = (float)(out[c] * (1. - f) + pix1[c] * f);
+            }
+        }
+    }
+
+    void sampleBilinear(int level, double sx, double sy, float *out) const
+    {
+        const MipmapPyramid::Level &l = _pyramid->getLevel(level);
+        const OfxRectI &bounds = _pyramid->getBounds();
+        const double scale = 1. / (1 << level);
+        // position in the level, relative to the pixel centers
+        double u = (sx - bounds.x1) * scale - 0.5;
+        double v = (sy - bounds.y1) * scale - 0.5;
+        int i0 = (int)std::floor(u);
+        int j0 = (int)std::floor(v);
+        float fu = (float)(u - i0);
+        float fv = (float)(v - j0);
+        float w[4] = { (1 - fu) * (1 - fv), fu * (1 - fv), (1 - fu) * fv, fu * fv };
+        for (int c = 0; c < nComponents; ++c) {
+            out[c] = 0.f;
+        }
+        for (int k = 0; k < 4; ++k) {
+            int i = i0 + (k & 1);
+            int j = j0 + (k >> 1);
+            if (i < 0 || i >= l.width || j < 0 || j >= l.height) {
+                if (_blackOutside) {
+                    continue;
+                }
+                i = std::max(0, std::min(i, l.width - 1));
+                j = std::max(0, std::min(j, l.height - 1));
+            }
+            if (level == 0) {
+                const PIX *p = (const PIX *)_srcImg->getPixelAddress(bounds.x1 + i, bounds.y1 + j);
+                if (p) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        out[c] += w[k] * p[c];
+                    }
+                }
+            } else {
+                const float *p = l.data + ((size_t)j * l.width + i) * nComponents;
+                for (int c = 0; c < nComponents; ++c) {
+                    out[c] += w[k] * p[c];
+                }
+            }
+        }
+    }
+};
+
+/// Releases a pyramid acquired from a MipmapCache, even in case of exceptions.
+typedef RefCountedCacheHolder_RAII<MipmapPyramid> MipmapPyramidHolder_RAII;
+
+template <class PIX, int nComponents, int maxValue, FilterEnum filter, bool clamp>
+void
+ofxsMipmapProcess(OFX::ImageEffect &effect,
+                  MipmapCache &cache,
+                  OFX::Image *dst,
+                  const OFX::Image *src,
+                  const OfxRectI &srcRoD,
+                  const OFX::Image *mask,
+                  bool maskInvert,
+                  const OfxRectI &renderWindow,
+                  const OFX::Matrix3x3 &invtransform,
+                  bool blackOutside,
+                  double mix)
+{
+    MipmapPyramidHolder_RAII holder(cache);
+    if (src) {
+        holder.obj = cache.acquire<PIX, nComponents>(effect, src, srcRoD);
+        if (!holder.obj) {
+            // aborted
+            return;
+        }
+    }
+    MipmapTransformProcessor<PIX, nComponents, maxValue, filter, clamp> processor(effect);
+    if (mask) {
+        processor.doMasking(true);
+        processor.setMaskImg(mask, maskInvert);
+    }
+    processor.setDstImg(dst);
+    processor.setSrcImg(src);
+    processor.setRenderWindow(renderWindow);
+    processor.setValues(holder.obj, invtransform, blackOutside, mix);
+    processor.process();
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+ofxsMipmapRenderForBitDepth(OFX::ImageEffect &effect,
+                            MipmapCache &cache,
+                            OFX::Image *dst,
+                            const OFX::Image *src,
+                            const OfxRectI &srcRoD,
+                            const OFX::Image *mask,
+                            bool maskInvert,
+                            const OfxRectI &renderWindow,
+                            const OFX::Matrix3x3 &invtransform,
+                            FilterEnum filter,
+                            bool clamp,
+                            bool blackOutside,
+                            double mix)
+{
+    // as you may see below, some filters don't need explicit clamping, since they are
+    // "clamped" by construction.
+#define MIPMAP_PROCESS(f, c) ofxsMipmapProcess<PIX, nComponents, maxValue, f, c>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, blackOutside, mix)
+    switch (filter) {
+        case eFilterImpulse:
+            MIPMAP_PROCESS(eFilterImpulse, false);
+            break;
+        case eFilterBilinear:
+            MIPMAP_PROCESS(eFilterBilinear, false);
+            break;
+        case eFilterCubic:
+            MIPMAP_PROCESS(eFilterCubic, false);
+            break;
+        case eFilterKeys:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterKeys, true);
+            } else {
+                MIPMAP_PROCESS(eFilterKeys, false);
+            }
+            break;
+        case eFilterSimon:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterSimon, true);
+            } else {
+                MIPMAP_PROCESS(eFilterSimon, false);
+            }
+            break;
+        case eFilterRifman:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterRifman, true);
+            } else {
+                MIPMAP_PROCESS(eFilterRifman, false);
+            }
+            break;
+        case eFilterMitchell:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterMitchell, true);
+            } else {
+                MIPMAP_PROCESS(eFilterMitchell, false);
+            }
+            break;
+        case eFilterParzen:
+            MIPMAP_PROCESS(eFilterParzen, false);
+            break;
+        case eFilterNotch:
+            MIPMAP_PROCESS(eFilterNotch, false);
+            break;
+    }
+#undef MIPMAP_PROCESS
+}
+
+template <int nComponents>
+void
+ofxsMipmapRenderForComponents(OFX::ImageEffect &effect,
+                              MipmapCache &cache,
+                              OFX::Image *dst,
+                              const OFX::Image *src,
+                              const OfxRectI &srcRoD,
+                              const OFX::Image *mask,
+                              bool maskInvert,
+                              const OfxRectI &renderWindow,
+                              const OFX::Matrix3x3 &invtransform,
+                              FilterEnum filter,
+                              bool clamp,
+                              bool blackOutside,
+                              double mix)
+{
+    switch (dst->getPixelDepth()) {
+        case OFX::eBitDepthUByte:
+            ofxsMipmapRenderForBitDepth<unsigned char, nComponents, 255>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, filter, clamp, blackOutside, mix);
+            break;
+        case OFX::eBitDepthUShort:
+            ofxsMipmapRenderForBitDepth<unsigned short, nComponents, 65535>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, filter, clamp, blackOutside, mix);
+            break;
+        case OFX::eBitDepthFloat:
+            ofxsMipmapRenderForBitDepth<float, nComponents, 1>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, filter, clamp, blackOutside, mix);
+            break;
+        default:
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+/// Render renderWindow of dst, sampling src through invtransform (from dst to src pixel coordinates).
+/// srcRoD is the region of definition of the source clip, in pixels.
+/// src and dst must have the same depth and components.
+inline void
+ofxsMipmapRender(OFX::ImageEffect &effect,
+                 MipmapCache &cache,
+                 OFX::Image *dst,
+                 const OFX::Image *src,
+                 const OfxRectI &srcRoD,
+                 const OFX::Image *mask,
+                 bool maskInvert,
+                 const OfxRectI &renderWindow,
+                 const OFX::Matrix3x3 &invtransform,
+                 FilterEnum filter,
+                 bool clamp,
+                 bool blackOutside,
+                 double mix)
+{
+    OFX::PixelComponentEnum dstComponents = dst->getPixelComponents();
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        ofxsMipmapRenderForComponents<4>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, filter, clamp, blackOutside, mix);
+    } else if (dstComponents == OFX::ePixelComponentRGB) {
+        ofxsMipmapRenderForComponents<3>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, filter, clamp, blackOutside, mix);
+    } else if (dstComponents == OFX::ePixelComponentXY) {
+        ofxsMipmapRenderForComponents<2>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, filter, clamp, blackOutside, mix);
+    } else {
+        assert(dstComponents == OFX::ePixelComponentAlpha);
+        ofxsMipmapRenderForComponents<1>(effect, cache, dst, src, srcRoD, mask, maskInvert, renderWindow, invtransform, filter, clamp, blackOutside, mix);
+    }
+}
+
+/// Returns invtransformCanonical in pixel coordinates, composed with the inverse of the transform
+/// that the host attached to src, if any. If src is NULL, the pixel aspect ratio of dstClip is used.
+inline OFX::Matrix3x3
+ofxsMipmapInverseTransformPixel(const OFX::Matrix3x3 &invtransformCanonical,
+                                const OFX::RenderArguments &args,
+                                const OFX::Image *src,
+                                OFX::Clip *dstClip)
+{
+    const bool fielded = args.fieldToRender == OFX::eFieldLower || args.fieldToRender == OFX::eFieldUpper;
+    const double pixelAspectRatio = src ? src->getPixelAspectRatio() : dstClip->getPixelAspectRatio();
+    OFX::Matrix3x3 invtransform = (OFX::ofxsMatCanonicalToPixel(pixelAspectRatio, args.renderScale.x, args.renderScale.y, fielded) *
+                                   invtransformCanonical *
+                                   OFX::ofxsMatPixelToCanonical(pixelAspectRatio, args.renderScale.x, args.renderScale.y, fielded));
+    // compose with the input transform
+    if (src && !src->getTransformIsIdentity()) {
+        double srcTransform[9]; // transform to apply to the source image, in pixel coordinates, from source to destination
+        src->getTransform(srcTransform);
+        OFX::Matrix3x3 srcTransformMat;
+        srcTransformMat.a = srcTransform[0];
+        srcTransformMat.b = srcTransform[1];
+        srcTransformMat.c = srcTransform[2];
+        srcTransformMat.d = srcTransform[3];
+        srcTransformMat.e = srcTransform[4];
+        srcTransformMat.f = srcTransform[5];
+        srcTransformMat.g = srcTransform[6];
+        srcTransformMat.h = srcTransform[7];
+        srcTransformMat.i = srcTransform[8];
+        // invert it
+        double det = ofxsMatDeterminant(srcTransformMat);
+        if (det != 0.) {
+            invtransform = ofxsMatInverse(srcTransformMat, det) * invtransform;
+        }
+    }
+
+    return invtransform;
+}
+
+/// Render args.renderWindow of the output of a transform effect, using the mipmap.
+/// The clips and parameters are those of the effect; maskClip, filterParam, maskApplyParam and
+/// maskInvertParam may be NULL.
+inline void
+ofxsMipmapRenderTransform(OFX::ImageEffect &effect,
+                          MipmapCache &cache,
+                          const OFX::RenderArguments &args,
+                          const OFX::Image *src,
+                          const OFX::Matrix3x3 &invtransform,
+                          OFX::Clip *srcClip,
+                          OFX::Clip *dstClip,
+                          OFX::Clip *maskClip,
+                          OFX::ChoiceParam *filterParam,
+                          OFX::BooleanParam *clampParam,
+                          OFX::BooleanParam *blackOutsideParam,
+                          OFX::DoubleParam *mixParam,
+                          OFX::BooleanParam *maskApplyParam,
+                          OFX::BooleanParam *maskInvertParam)
+{
+    const double time = args.time;
+    std::auto_ptr<OFX::Image> dst( dstClip->fetchImage(time) );
+    if ( !dst.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getPixelDepth() != dstClip->getPixelDepth() ||
+        dst->getPixelComponents() != dstClip->getPixelComponents()) {
+        effect.setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if ( (dst->getRenderScale().x != args.renderScale.x) ||
+        ( dst->getRenderScale().y != args.renderScale.y) ||
+        ( (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) ) {
+        effect.setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    OfxRectI srcRoD = {0, 0, 0, 0};
+    if (src) {
+        if ( (src->getPixelDepth() != dst->getPixelDepth()) || (src->getPixelComponents() != dst->getPixelComponents()) ) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        OFX::Coords::toPixelEnclosing(srcClip->getRegionOfDefinition(time), args.renderScale, src->getPixelAspectRatio(), &srcRoD);
+    }
+
+    int filter = args.renderQualityDraft ? eFilterImpulse : eFilterCubic;
+    if (!args.renderQualityDraft && filterParam) {
+        filterParam->getValueAtTime(time, filter);
+    }
+    bool clamp;
+    clampParam->getValueAtTime(time, clamp);
+    bool blackOutside = true;
+    blackOutsideParam->getValueAtTime(time, blackOutside);
+    double mix = 1.;
+    mixParam->getValueAtTime(time, mix);
+
+    bool doMasking = ((!maskApplyParam || maskApplyParam->getValueAtTime(time)) && maskClip && maskClip->isConnected());
+    std::auto_ptr<const OFX::Image> mask(doMasking ? maskClip->fetchImage(time) : 0);
+    bool maskInvert = false;
+    if (doMasking && maskInvertParam) {
+        maskInvertParam->getValueAtTime(time, maskInvert);
+    }
+
+    ofxsMipmapRender(effect, cache, dst.get(), src, srcRoD, mask.get(), maskInvert, args.renderWindow, invtransform, (FilterEnum)filter, clamp, blackOutside, mix);
+}
+
+} // namespace OFX
+
+#endif // Misc_ofxsMipmapCache_h
@@ -0,0 +1,181 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Lookup tables sampled from parametric parameters, cached across renders.
+ *
+ * Sampling a parametric parameter costs one host call per sample, which
+ * for 16-bit images means hundreds of thousands of calls per render (and
+ * per tile). The last table built by an effect instance is kept by
+ * ParametricLutCache, keyed on the control points of the curves (which
+ * take only a few host calls to fetch) and on everything else the table
+ * depends on, so that it is rebuilt only when the curves, the range or
+ * the image format change.
+ */
+
+#ifndef Misc_ofxsParametricLut_h
+#define Misc_ofxsParametricLut_h
+
+#include <cassert>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsRefCountedCache.h"
+
+namespace OFX {
+
+/// Everything a lookup table depends on.
+struct ParametricLutKey
+{
+    std::vector<double> curves; // the control points of the curves, see ofxsParametricParamGetCurves()
+    double rangeMin;
+    double rangeMax;
+    int nbValues; // each table has nbValues+1 entries, sampling [rangeMin,rangeMax]
+    int nTables;
+    int variant; // anything else the tables depend on, e.g. bit depth and clamping
+    std::vector<double> values; // other parameters the tables depend on
+
+    ParametricLutKey()
+    : curves()
+    , rangeMin(0.)
+    , rangeMax(1.)
+    , nbValues(0)
+    , nTables(0)
+    , variant(0)
+    , values()
+    {
+    }
+
+    bool operator==(const ParametricLutKey &other) const
+    {
+        return (rangeMin == other.rangeMin &&
+                rangeMax == other.rangeMax &&
+                nbValues == other.nbValues &&
+                nTables == other.nTables &&
+                variant == other.variant &&
+                values == other.values &&
+                curves == other.curves);
+    }
+};
+
+/// Appends the control points of the first nCurves curves of param at the given time to *curves.
+/// Two parametric parameters with the same control points evaluate to the same curves.
+inline void
+ofxsParametricParamGetCurves(OFX::ParametricParam *param,
+                             int nCurves,
+                             double time,
+                             std::vector<double> *curves)
+{
+    assert(param && curves);
+    for (int c = 0; c < nCurves; ++c) {
+        int n = param->getNControlPoints(c, time);
+        curves->push_back(n);
+        for (int i = 0; i < n; ++i) {
+            std::pair<double, double> p = param->getNthControlPoint(c, time, i);
+            curves->push_back(p.first);
+            curves->push_back(p.second);
+        }
+    }
+}
+
+/// nTables lookup tables of nbValues+1 entries each.
+class ParametricLut
+: public RefCountedCacheEntry
+{
+public:
+    explicit ParametricLut(const ParametricLutKey &key)
+    : RefCountedCacheEntry()
+    , _key(key)
+    , _data((size_t)key.nTables * (key.nbValues + 1))
+    {
+    }
+
+    const ParametricLutKey &getKey() const { return _key; }
+
+    float *getTable(int i)
+    {
+        assert(0 <= i && i < _key.nTables);
+        return &_data[(size_t)i * (_key.nbValues + 1)];
+    }
+
+    const float *getTable(int i) const
+    {
+        assert(0 <= i && i < _key.nTables);
+        return &_data[(size_t)i * (_key.nbValues + 1)];
+    }
+
+private:
+    ParametricLutKey _key;
+    std::vector<float> _data;
+};
+
+/// Builds a ParametricLut for ParametricLutCache::acquire(), see RefCountedCache::acquire().
+template <class FILLER>
+class ParametricLutBuilder
+{
+public:
+    ParametricLutBuilder(const ParametricLutKey &key, FILLER &filler)
+    : _key(key)
+    , _filler(filler)
+    {
+    }
+
+    bool matches(const ParametricLut &lut) const
+    {
+        return lut.getKey() == _key;
+    }
+
+    ParametricLut *build()
+    {
+        std::auto_ptr<ParametricLut> lut(new ParametricLut(_key));
+        _filler.fillLut(*lut);
+
+        return lut.release();
+    }
+
+private:
+    const ParametricLutKey &_key;
+    FILLER &_filler;
+};
+
+/// The last lookup table built by an effect instance, shared by all its renders.
+class ParametricLutCache
+: public RefCountedCache<ParametricLut>
+{
+public:
+    /// Returns the lookup table for key, calling filler.fillLut(ParametricLut&) to build it if it is not cached.
+    /// Concurrent renders with the same key wait for the first one to build it.
+    /// The result must be given back to release().
+    template <class FILLER>
+    const ParametricLut *acquire(const ParametricLutKey &key,
+                                 FILLER &filler)
+    {
+        ParametricLutBuilder<FILLER> builder(key, filler);
+
+        return RefCountedCache<ParametricLut>::acquire(builder);
+    }
+};
+
+/// Releases a lookup table, even in case of exceptions.
+typedef RefCountedCacheHolder_RAII<ParametricLut> ParametricLutHolder_RAII;
+
+} // namespace OFX
+
+#endif // Misc_ofxsParametricLut_h
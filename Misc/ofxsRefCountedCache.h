@@ -0,0 +1,159 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * A single-slot cache of the last object built by an effect instance.
+ *
+ * Objects that are expensive to build but usually the same from one render
+ * to the next (lookup tables, distortion maps, image pyramids, motion
+ * fields...) are kept by the instance and shared by all its renders.
+ * The objects are reference-counted, so that an object replaced or purged
+ * while a render is still using it is deleted when that render releases it.
+ */
+
+#ifndef Misc_ofxsRefCountedCache_h
+#define Misc_ofxsRefCountedCache_h
+
+#include <cassert>
+#include <memory>
+
+#include "ofxsMultiThread.h"
+
+namespace OFX {
+
+template <class T>
+class RefCountedCache;
+
+/// Base class of the objects held by a RefCountedCache.
+class RefCountedCacheEntry
+{
+public:
+    RefCountedCacheEntry()
+    : _refCount(0)
+    {
+    }
+
+private:
+    template <class T>
+    friend class RefCountedCache;
+
+    // renders using the object, plus one if it is the cached object. Protected by the cache's mutex.
+    int _refCount;
+};
+
+/// The last object of type T (derived from RefCountedCacheEntry) built by an effect instance,
+/// shared by all its renders.
+template <class T>
+class RefCountedCache
+{
+public:
+    RefCountedCache()
+    : _mutex()
+    , _cached(0)
+    {
+    }
+
+    ~RefCountedCache()
+    {
+        clear();
+    }
+
+    /// Returns the cached object if builder.matches(const T&) accepts it, else a new object
+    /// returned by builder.build(), or NULL if build() returned NULL (e.g. the render was aborted).
+    /// The object is built while holding the lock: concurrent renders would need the same object anyway.
+    /// If cacheable is false (e.g. the host does not identify images), the new object is not kept.
+    /// The result must be given back to release().
+    template <class BUILDER>
+    const T *acquire(BUILDER &builder,
+                     bool cacheable = true)
+    {
+        OFX::MultiThread::AutoMutex l(_mutex);
+        if (_cached && builder.matches(*_cached)) {
+            ++_cached->_refCount;
+
+            return _cached;
+        }
+        std::auto_ptr<T> obj(builder.build());
+        if (!obj.get()) {
+            return 0;
+        }
+        if (!cacheable) {
+            obj->_refCount = 1;
+
+            return obj.release();
+        }
+        if (_cached && --_cached->_refCount == 0) {
+            delete _cached;
+        }
+        _cached = obj.release();
+        _cached->_refCount = 2;
+
+        return _cached;
+    }
+
+    void release(const T *obj)
+    {
+        if (!obj) {
+            return;
+        }
+        OFX::MultiThread::AutoMutex l(_mutex);
+        T *p = const_cast<T*>(obj);
+        assert(p->_refCount > 0);
+        if (--p->_refCount == 0) {
+            // the object was replaced or purged while in use
+            assert(p != _cached);
+            delete p;
+        }
+    }
+
+    void clear()
+    {
+        OFX::MultiThread::AutoMutex l(_mutex);
+        if (_cached && --_cached->_refCount == 0) {
+            delete _cached;
+        }
+        _cached = 0;
+    }
+
+private:
+    OFX::MultiThread::Mutex _mutex;
+    T *_cached; // protected by _mutex
+};
+
+/// Releases an object acquired from a RefCountedCache, even in case of exceptions.
+template <class T>
+struct RefCountedCacheHolder_RAII
+{
+    RefCountedCache<T> &cache;
+    const T *obj;
+
+    RefCountedCacheHolder_RAII(RefCountedCache<T> &c, const T *o = 0)
+    : cache(c)
+    , obj(o)
+    {
+    }
+
+    ~RefCountedCacheHolder_RAII()
+    {
+        cache.release(obj);
+    }
+};
+
+} // namespace OFX
+
+#endif // Misc_ofxsRefCountedCache_h
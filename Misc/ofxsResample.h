@@ -0,0 +1,443 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Separable resampling of an image by an axis-aligned transform (scale + translate).
+ *
+ * ofxsFilterInterpolate2D/ofxsFilterInterpolate2DSuper evaluate the 2D filter
+ * at each output pixel, which is required for general 3x3 transforms. When the
+ * transform only scales and translates the image (e.g. a reformat), the filter
+ * is separable: a horizontal pass resamples the source rows using a table of
+ * weights computed once per output column, and a vertical pass combines these
+ * rows using a table of weights computed once per output row.
+ *
+ * As in ofxsFilterInterpolate2DSuper, the filter is stretched when minifying,
+ * so that all the source pixels contribute to the result.
+ */
+
+#ifndef Misc_ofxsResample_h
+#define Misc_ofxsResample_h
+
+#include <cmath>
+#include <climits>
+#include <limits>
+#include <algorithm>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsProcessing.H"
+#include "ofxsMaskMix.h"
+#include "ofxsFilter.h"
+#include "ofxsMatrix2D.h"
+#include "ofxsMacros.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RESAMPLE_SSE2
+#endif
+
+// number of output rows resampled at once by each thread: the horizontal pass only has to
+// keep the source rows needed by these output rows
+#define kResampleStripHeight 64
+
+namespace OFX {
+
+/// true if the (inverse) transform maps (x,y) to (a*x+c, e*y+f).
+inline bool
+ofxsMatIsAxisAligned(const OFX::Matrix3x3 &H)
+{
+    return (H.b == 0. && H.d == 0. && H.g == 0. && H.h == 0. &&
+            H.i != 0. && H.a != 0. && H.e != 0.);
+}
+
+// cubic convolution, see ofxsFilter.h
+inline double
+ofxsResampleKeys(double t, double a)
+{
+    t = std::fabs(t);
+    if (t < 1.) {
+        return ((a + 2.) * t - (a + 3.)) * t * t + 1.;
+    } else if (t < 2.) {
+        return ((a * t - 5. * a) * t + 8. * a) * t - 4. * a;
+    }
+
+    return 0.;
+}
+
+// Mitchell-Netravali filters, see ofxsFilter.h
+inline double
+ofxsResampleMitchell(double t, double B, double C)
+{
+    t = std::fabs(t);
+    if (t < 1.) {
+        return ((12. - 9. * B - 6. * C) * t * t * t + (-18. + 12. * B + 6. * C) * t * t + (6. - 2. * B)) / 6.;
+    } else if (t < 2.) {
+        return ((-B - 6. * C) * t * t * t + (6. * B + 30. * C) * t * t + (-12. * B - 48. * C) * t + (8. * B + 24. * C)) / 6.;
+    }
+
+    return 0.;
+}
+
+/// radius of the filter kernel, in source pixels (before stretching)
+inline int
+ofxsResampleRadius(FilterEnum filter)
+{
+    switch (filter) {
+        case eFilterImpulse:
+        case eFilterBilinear:
+        case eFilterCubic:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+/// margin of the source region used by the resampler, in source pixels, for the given
+/// scale (source pixels per output pixel)
+inline double
+ofxsResampleMargin(FilterEnum filter,
+                   double scale)
+{
+    // the kernel is stretched when minifying, plus one pixel for the rounding of the support
+    return ofxsResampleRadius(filter) * std::max(1., std::fabs(scale)) + 1.;
+}
+
+inline double
+ofxsResampleKernel(FilterEnum filter, double t)
+{
+    switch (filter) {
+        case eFilterImpulse:
+            return (t >= -0.5 && t < 0.5) ? 1. : 0.;
+        case eFilterBilinear:
+            t = std::fabs(t);
+            return (t < 1.) ? 1. - t : 0.;
+        case eFilterCubic:
+            t = std::fabs(t);
+            return (t < 1.) ? (2. * t - 3.) * t * t + 1. : 0.;
+        case eFilterKeys:
+            return ofxsResampleKeys(t, -0.5);
+        case eFilterSimon:
+            return ofxsResampleKeys(t, -0.75);
+        case eFilterRifman:
+            return ofxsResampleKeys(t, -1.);
+        case eFilterMitchell:
+            return ofxsResampleMitchell(t, 1./3., 1./3.);
+        case eFilterParzen:
+            return ofxsResampleMitchell(t, 1., 0.);
+        case eFilterNotch:
+            return ofxsResampleMitchell(t, 1.5, -0.25);
+    }
+
+    return 0.;
+}
+
+/// Weights along one axis: output pixel i (dst1 <= i < dst2) is the weighted sum of
+/// the source pixels index[(i-dst1)*nTaps+k], with weights weight[(i-dst1)*nTaps+k].
+/// Indices are always within the source image bounds. Taps outside of the source RoD are either
+/// clamped to its edge or given a zero weight if blackOutside is set (the effect must ask for
+/// a region of interest that contains the other taps, see ofxsResampleMargin()).
+struct ResampleTable
+{
+    int dst1;
+    int dst2;
+    int nTaps;
+    std::vector<int> index;
+    std::vector<float> weight;
+
+    ResampleTable()
+    : dst1(0)
+    , dst2(0)
+    , nTaps(0)
+    , index()
+    , weight()
+    {
+    }
+
+    /// The source position of the center of output pixel i is scale*(i+0.5)+offset.
+    /// srcRoD1,srcRoD2 is the source RoD and srcBound1,srcBound2 the bounds of the source image, in pixels.
+    /// Returns false if the source is empty.
+    bool build(FilterEnum filter,
+               double scale,
+               double offset,
+               int d1,
+               int d2,
+               int srcRoD1,
+               int srcRoD2,
+               int srcBound1,
+               int srcBound2,
+               bool blackOutside)
+    {
+        dst1 = d1;
+        dst2 = std::max(d1, d2);
+        // the available source pixels
+        const int src1 = std::max(srcRoD1, srcBound1);
+        const int src2 = std::min(srcRoD2, srcBound2);
+        if (src2 <= src1) {
+            nTaps = 0;
+            index.clear();
+            weight.clear();
+
+            return false;
+        }
+        // stretch the filter when minifying (impulse is always a point sample)
+        const double fs = (filter == eFilterImpulse) ? 1. : std::max(1., std::fabs(scale));
+        const double radius = (filter == eFilterImpulse) ? 0.5 : ofxsResampleRadius(filter) * fs;
+        // the kernel vanishes at +-radius, so at most ceil(2*radius) source pixels contribute
+        nTaps = (filter == eFilterImpulse) ? 1 : std::max(1, (int)std::ceil(2 * radius));
+        index.resize((size_t)(dst2 - dst1) * nTaps);
+        weight.resize((size_t)(dst2 - dst1) * nTaps);
+        std::vector<double> w(nTaps);
+        for (int i = dst1; i < dst2; ++i) {
+            const double s = scale * (i + 0.5) + offset;
+            int *idx = &index[(size_t)(i - dst1) * nTaps];
+            float *wgt = &weight[(size_t)(i - dst1) * nTaps];
+            // first source pixel whose center is within the filter support
+            const int k0 = (filter == eFilterImpulse) ? (int)std::floor(s) : (int)std::floor(s - radius - 0.5) + 1;
+            double sum = 0.;
+            for (int k = 0; k < nTaps; ++k) {
+                w[k] = (filter == eFilterImpulse) ? 1. : ofxsResampleKernel(filter, (k0 + k + 0.5 - s) / fs);
+                sum += w[k];
+            }
+            for (int k = 0; k < nTaps; ++k) {
+                int p = k0 + k;
+                bool outside = (p < srcRoD1 || p >= srcRoD2);
+                idx[k] = std::max(src1, std::min(p, src2 - 1));
+                wgt[k] = (sum == 0. || (outside && blackOutside)) ? 0.f : (float)(w[k] / sum);
+            }
+        }
+
+        return true;
+    }
+
+    /// range of the source indices used by output pixels [i1,i2)
+    void getSourceRange(int i1, int i2, int *s1, int *s2) const
+    {
+        *s1 = INT_MAX;
+        *s2 = INT_MIN;
+        for (int i = std::max(i1, dst1); i < std::min(i2, dst2); ++i) {
+            const int *idx = &index[(size_t)(i - dst1) * nTaps];
+            for (int k = 0; k < nTaps; ++k) {
+                *s1 = std::min(*s1, idx[k]);
+                *s2 = std::max(*s2, idx[k] + 1);
+            }
+        }
+    }
+};
+
+class SeparableResamplerBase : public OFX::ImageProcessor
+{
+protected:
+    const OFX::Image *_srcImg;
+    const OFX::Image *_maskImg;
+    const ResampleTable *_xTable;
+    const ResampleTable *_yTable;
+    bool _doMasking;
+    double _mix;
+    bool _maskInvert;
+
+public:
+    SeparableResamplerBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _maskImg(0)
+    , _xTable(0)
+    , _yTable(0)
+    , _doMasking(false)
+    , _mix(1.)
+    , _maskInvert(false)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    void setMaskImg(const OFX::Image *v, bool maskInvert) {_maskImg = v; _maskInvert = maskInvert;}
+
+    void doMasking(bool v) {_doMasking = v;}
+
+    /// the tables must cover the render window, and are not copied
+    void setValues(const ResampleTable *xTable, const ResampleTable *yTable, double mix)
+    {
+        _xTable = xTable;
+        _yTable = yTable;
+        _mix = mix;
+    }
+};
+
+// The "filter" and "clamp" template parameters allow filter-specific optimization
+// by the compiler, using the same generic code for all filters.
+template <class PIX, int nComponents, int maxValue, FilterEnum filter, bool clamp>
+class SeparableResampler : public SeparableResamplerBase
+{
+public:
+    SeparableResampler(OFX::ImageEffect &instance)
+    : SeparableResamplerBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        assert(_dstImg && _xTable && _yTable);
+        const int width = procWindow.x2 - procWindow.x1;
+        if (width <= 0) {
+            return;
+        }
+        std::vector<float> tmpRow((size_t)width * nComponents);
+        if (!_srcImg || _xTable->nTaps == 0 || _yTable->nTaps == 0) {
+            // no source: black
+            std::fill(tmpRow.begin(), tmpRow.end(), 0.f);
+            for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+                if (_effect.abort()) {
+                    break;
+                }
+                PIX *dstPix = (PIX *)_dstImg->getPixelAddress(procWindow.x1, y);
+                for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                    ofxsMaskMix<PIX, nComponents, maxValue, true>(&tmpRow[(size_t)(x - procWindow.x1) * nComponents], x, y, _srcImg, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+                }
+            }
+
+            return;
+        }
+        int sx1, sx2;
+        _xTable->getSourceRange(procWindow.x1, procWindow.x2, &sx1, &sx2);
+        std::vector<float> srcRow((size_t)(sx2 - sx1) * nComponents);
+        std::vector<float> hBuf;
+
+        for (int ys = procWindow.y1; ys < procWindow.y2; ys += kResampleStripHeight) {
+            const int ye = std::min(ys + kResampleStripHeight, procWindow.y2);
+            int sy1, sy2;
+            _yTable->getSourceRange(ys, ye, &sy1, &sy2);
+            hBuf.resize((size_t)(sy2 - sy1) * width * nComponents);
+
+            // horizontal pass: resample the source rows used by this strip
+            for (int sy = sy1; sy < sy2; ++sy) {
+                if (_effect.abort()) {
+                    return;
+                }
+                const PIX *srcPix = (const PIX *)_srcImg->getPixelAddress(sx1, sy);
+                assert(srcPix);
+                for (size_t i = 0; i < srcRow.size(); ++i) {
+                    srcRow[i] = (float)srcPix[i];
+                }
+                resampleRow(&srcRow[0], sx1, procWindow.x1, procWindow.x2, &hBuf[(size_t)(sy - sy1) * width * nComponents]);
+            }
+
+            // vertical pass
+            for (int y = ys; y < ye; ++y) {
+                if (_effect.abort()) {
+                    return;
+                }
+                const int *idx = &_yTable->index[(size_t)(y - _yTable->dst1) * _yTable->nTaps];
+                const float *wgt = &_yTable->weight[(size_t)(y - _yTable->dst1) * _yTable->nTaps];
+                combineRows(idx, wgt, _yTable->nTaps, sy1, hBuf, width, &tmpRow[0]);
+
+                PIX *dstPix = (PIX *)_dstImg->getPixelAddress(procWindow.x1, y);
+                for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                    ofxsMaskMix<PIX, nComponents, maxValue, true>(&tmpRow[(size_t)(x - procWindow.x1) * nComponents], x, y, _srcImg, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+                }
+            }
+        }
+    }
+
+    // resample columns [x1,x2) from a source row starting at sx1
+    void resampleRow(const float *srcRow, int sx1, int x1, int x2, float *out) const
+    {
+        const int nTaps = _xTable->nTaps;
+        for (int x = x1; x < x2; ++x, out += nComponents) {
+            const int *idx = &_xTable->index[(size_t)(x - _xTable->dst1) * nTaps];
+            const float *wgt = &_xTable->weight[(size_t)(x - _xTable->dst1) * nTaps];
+#ifdef RESAMPLE_SSE2
+            if (nComponents == 4 && !clamp) {
+                __m128 acc = _mm_setzero_ps();
+                for (int k = 0; k < nTaps; ++k) {
+                    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(wgt[k]), _mm_loadu_ps(srcRow + (size_t)(idx[k] - sx1) * 4)));
+                }
+                _mm_storeu_ps(out, acc);
+                continue;
+            }
+#endif
+            float acc[nComponents];
+            float vmin[nComponents];
+            float vmax[nComponents];
+            for (int c = 0; c < nComponents; ++c) {
+                acc[c] = 0.f;
+                vmin[c] = std::numeric_limits<float>::infinity();
+                vmax[c] = -std::numeric_limits<float>::infinity();
+            }
+            for (int k = 0; k < nTaps; ++k) {
+                const float *p = srcRow + (size_t)(idx[k] - sx1) * nComponents;
+                for (int c = 0; c < nComponents; ++c) {
+                    acc[c] += wgt[k] * p[c];
+                }
+                if (clamp && wgt[k] != 0.f) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        vmin[c] = std::min(vmin[c], p[c]);
+                        vmax[c] = std::max(vmax[c], p[c]);
+                    }
+                }
+            }
+            for (int c = 0; c < nComponents; ++c) {
+                out[c] = (clamp && vmin[c] <= vmax[c]) ? std::max(vmin[c], std::min(acc[c], vmax[c])) : acc[c];
+            }
+        }
+    }
+
+    // weighted sum of the rows of hBuf (the first one being source row sy1)
+    void combineRows(const int *idx, const float *wgt, int nTaps, int sy1, const std::vector<float> &hBuf, int width, float *out) const
+    {
+        const size_t n = (size_t)width * nComponents;
+        std::fill(out, out + n, 0.f);
+        for (int k = 0; k < nTaps; ++k) {
+            if (wgt[k] == 0.f) {
+                continue;
+            }
+            const float *in = &hBuf[(size_t)(idx[k] - sy1) * n];
+            const float w = wgt[k];
+            size_t i = 0;
+#ifdef RESAMPLE_SSE2
+            const __m128 w4 = _mm_set1_ps(w);
+            for (; i + 4 <= n; i += 4) {
+                _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(w4, _mm_loadu_ps(in + i))));
+            }
+#endif
+            for (; i < n; ++i) {
+                out[i] += w * in[i];
+            }
+        }
+        if (clamp) {
+            for (size_t i = 0; i < n; ++i) {
+                float vmin = std::numeric_limits<float>::infinity();
+                float vmax = -std::numeric_limits<float>::infinity();
+                for (int k = 0; k < nTaps; ++k) {
+                    if (wgt[k] != 0.f) {
+                        float v = hBuf[(size_t)(idx[k] - sy1) * n + i];
+                        vmin = std::min(vmin, v);
+                        vmax = std::max(vmax, v);
+                    }
+                }
+                if (vmin <= vmax) {
+                    out[i] = std::max(vmin, std::min(out[i], vmax));
+                }
+            }
+        }
+    }
+};
+
+} // namespace OFX
+
+#endif // Misc_ofxsResample_h
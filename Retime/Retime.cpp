@@ -26,8 +26,6 @@
  - propose a "timewarp" curve (as ParametricParam)
  - selection of the integration filter (box or nearest) and shutter time
  - handle fielded input correctly
- 
- - retiming based on optical flow computation will be done separately
  */
 
 #include "Retime.h"
@@ -35,6 +33,7 @@
 #include <cmath> // for floor
 #include <cfloat> // for FLT_MAX
 #include <cassert>
+#include <algorithm>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
@@ -42,14 +41,18 @@
 #include "ofxsProcessing.H"
 #include "ofxsImageBlender.H"
 #include "ofxsCopier.h"
+#include "ofxsBlockMatch.h"
 #include "ofxsMacros.h"
 
 #define kPluginName "RetimeOFX"
 #define kPluginGrouping "Time"
 #define kPluginDescription "Change the timing of the input clip."
 #define kPluginIdentifier "net.sf.openfx.Retime"
+// History:
+// version 1.0: initial version
+// version 1.1: add the Motion filter
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -80,6 +83,8 @@
 #define kParamFilterOptionNearestHint "Pick input image with nearest integer time."
 #define kParamFilterOptionLinear "Linear"
 #define kParamFilterOptionLinearHint "Blend the two nearest images with linear interpolation."
+#define kParamFilterOptionMotion "Motion"
+#define kParamFilterOptionMotionHint "Blend the two nearest images along the motion estimated by block matching (coarse-to-fine search over an image pyramid). Avoids the ghosting of Linear on moving objects. The motion is computed once for each pair of input frames, so it is faster to render all the output frames between two input frames in sequence."
 // TODO:
 #define kParamFilterOptionBox "Box"
 #define kParamFilterOptionBoxHint "Weighted average of images over the shutter time (shutter time is defined in the output sequence)." // requires shutter parameter
@@ -88,6 +93,7 @@ enum FilterEnum {
     eFilterNone,
     eFilterNearest,
     eFilterLinear,
+    eFilterMotion,
     //eFilterBox,
 };
 #define kParamFilterDefault eFilterLinear
@@ -118,6 +124,8 @@ protected:
     OFX::DoubleParam  *_duration;   /**< @brief how long the output should be as a proportion of input. General context only. */
     OFX::ChoiceParam  *_filter;   /**< @brief how images are interpolated (or not). */
 
+    OFX::MotionFieldCache _motionCache; /**< @brief the last motion field, for the Motion filter */
+
 public:
     /** @brief ctor */
     RetimePlugin(OfxImageEffectHandle handle, bool supportsParametricParameter)
@@ -130,6 +138,7 @@ public:
     , _warp(0)
     , _duration(0)
     , _filter(0)
+    , _motionCache()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         _srcClip = getContext() == OFX::eContextGenerator ? NULL : fetchClip(kOfxImageEffectSimpleSourceClipName);
@@ -163,9 +172,17 @@ public:
     template <int nComponents>
     void renderInternal(const OFX::RenderArguments &args, double sourceTime, FilterEnum filter, OFX::BitDepthEnum dstBitDepth);
 
+    template <int nComponents>
+    void renderMotion(const OFX::RenderArguments &args, double sourceTime, OFX::BitDepthEnum dstBitDepth);
+
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
 
+    // the Motion filter needs the whole input images
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
     virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
 
     /* override the time domain action, only for the general context */
@@ -175,9 +192,13 @@ public:
     
     /* set up and run a processor */
     void setupAndProcess(OFX::ImageBlenderBase &, const OFX::RenderArguments &args, double sourceTime, FilterEnum filter);
+
+    template <class PIX, int nComponents>
+    void setupAndProcessMotion(OFX::MotionInterpolatorBase &, const OFX::RenderArguments &args, double sourceTime);
     
 private:
     
+    double getSourceTime(double time);
     
     bool isIdentityInternal(OfxTime time, OFX::Clip* &identityClip, OfxTime &identityTime);
 };
@@ -329,20 +350,115 @@ RetimePlugin::setupAndProcess(OFX::ImageBlenderBase &processor,
     processor.process();
 }
 
+/* set up and run a processor for the Motion filter */
+template <class PIX, int nComponents>
 void
-RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
-                               OFX::FramesNeededSetter &frames)
+RetimePlugin::setupAndProcessMotion(OFX::MotionInterpolatorBase &processor,
+                                    const OFX::RenderArguments &args,
+                                    double sourceTime)
 {
-    if (!_srcClip) {
+    const double time = args.time;
+
+    // figure the two images we are blending between
+    double fromTime, toTime;
+    double blend;
+    framesNeeded(sourceTime, args.fieldToRender, &fromTime, &toTime, &blend);
+
+    // fetch the two source images
+    std::auto_ptr<const OFX::Image> fromImg((_srcClip && _srcClip->isConnected()) ?
+                                            _srcClip->fetchImage(fromTime) : 0);
+    std::auto_ptr<const OFX::Image> toImg((_srcClip && _srcClip->isConnected()) ?
+                                          _srcClip->fetchImage(toTime) : 0);
+    OfxRectI rect = {0, 0, 0, 0};
+    if (fromImg.get() && toImg.get()) {
+        const OfxRectI &fromBounds = fromImg->getBounds();
+        const OfxRectI &toBounds = toImg->getBounds();
+        rect.x1 = std::max(fromBounds.x1, toBounds.x1);
+        rect.y1 = std::max(fromBounds.y1, toBounds.y1);
+        rect.x2 = std::min(fromBounds.x2, toBounds.x2);
+        rect.y2 = std::min(fromBounds.y2, toBounds.y2);
+    }
+    if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2) {
+        // no motion can be computed, blend linearly
+        fromImg.reset();
+        toImg.reset();
+        OFX::ImageBlender<PIX, nComponents> fred(*this);
+        setupAndProcess(fred, args, sourceTime, eFilterLinear);
+
         return;
     }
-    const double time = args.time;
-    double sourceTime;
+
+    // get a dst image
+    std::auto_ptr<OFX::Image>  dst(_dstClip->fetchImage(time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    OFX::BitDepthEnum         dstBitDepth    = dst->getPixelDepth();
+    OFX::PixelComponentEnum   dstComponents  = dst->getPixelComponents();
+    if (dstBitDepth != _dstClip->getPixelDepth() ||
+        dstComponents != _dstClip->getPixelComponents()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    // make sure bit depths are sane
+    if (fromImg->getRenderScale().x != args.renderScale.x ||
+        fromImg->getRenderScale().y != args.renderScale.y ||
+        (fromImg->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && fromImg->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    checkComponents(*fromImg, dstBitDepth, dstComponents);
+    if (toImg->getRenderScale().x != args.renderScale.x ||
+        toImg->getRenderScale().y != args.renderScale.y ||
+        (toImg->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && toImg->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    checkComponents(*toImg, dstBitDepth, dstComponents);
+
+    // the motion field is shared by all the renders between these two frames
+    const OFX::MotionField *field = _motionCache.acquire<PIX, nComponents>(*this, fromImg.get(), fromTime, toImg.get(), toTime, rect);
+    OFX::MotionFieldHolder_RAII fieldHolder(_motionCache, field);
+    if (!field) {
+        // aborted
+        return;
+    }
+
+    // set the images
+    processor.setDstImg(dst.get());
+    processor.setFromImg(fromImg.get());
+    processor.setToImg(toImg.get());
+    processor.setField(field);
+
+    // set the render window
+    processor.setRenderWindow(args.renderWindow);
+
+    // set the blend between
+    processor.setBlend((float)blend);
+
+    // Call the base class process member, this will call the derived templated process code
+    processor.process();
+}
+
+// the frame we should be retiming from
+double
+RetimePlugin::getSourceTime(double time)
+{
+    double sourceTime = time;
+
     if (getContext() == OFX::eContextRetimer) {
         // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
         sourceTime = _sourceTime->getValueAtTime(time);
-    } else {
+    } else if (_srcClip) {
         bool reverse_input;
+
         OfxRangeD srcRange = _srcClip->getFrameRange();
         _reverse_input->getValueAtTime(time, reverse_input);
         // we have our own param, which is a speed, so we integrate it to get the time we want
@@ -359,6 +475,19 @@ RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
         }
     }
 
+    return sourceTime;
+}
+
+void
+RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
+                               OFX::FramesNeededSetter &frames)
+{
+    if (!_srcClip) {
+        return;
+    }
+    const double time = args.time;
+    double sourceTime = getSourceTime(time);
+
     int filter_i;
     _filter->getValueAtTime(time, filter_i);
     FilterEnum filter = (FilterEnum)filter_i;
@@ -369,7 +498,7 @@ RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
         range.max = sourceTime;
     } else if (filter == eFilterNearest) {
         range.min = range.max = std::floor(sourceTime + 0.5);
-    } else if (filter == eFilterLinear) {
+    } else if (filter == eFilterLinear || filter == eFilterMotion) {
         // figure the two images we are blending between
         double fromTime, toTime;
         double blend;
@@ -383,6 +512,46 @@ RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
     frames.setFramesNeeded(*_srcClip, range);
 }
 
+void
+RetimePlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                   OFX::RegionOfInterestSetter &rois)
+{
+    if (!_srcClip) {
+        return;
+    }
+    const double time = args.time;
+    int filter_i;
+    _filter->getValueAtTime(time, filter_i);
+    FilterEnum filter = (FilterEnum)filter_i;
+    double sourceTime = getSourceTime(time);
+    if (filter != eFilterMotion || sourceTime == (int)sourceTime) {
+        // the default RoI
+        return;
+    }
+    double fromTime, toTime;
+    double blend;
+    framesNeeded(sourceTime, OFX::eFieldNone, &fromTime, &toTime, &blend);
+    OfxRectD fromRoD = _srcClip->getRegionOfDefinition(fromTime);
+    OfxRectD toRoD = _srcClip->getRegionOfDefinition(toTime);
+    OfxRectD roi;
+    roi.x1 = std::min(fromRoD.x1, toRoD.x1);
+    roi.y1 = std::min(fromRoD.y1, toRoD.y1);
+    roi.x2 = std::max(fromRoD.x2, toRoD.x2);
+    roi.y2 = std::max(fromRoD.y2, toRoD.y2);
+    if (roi.x1 <= kOfxFlagInfiniteMin || kOfxFlagInfiniteMax <= roi.x2 ||
+        roi.y1 <= kOfxFlagInfiniteMin || kOfxFlagInfiniteMax <= roi.y2) {
+        // the motion is computed on what the host gives
+        return;
+    }
+    rois.setRegionOfInterest(*_srcClip, roi);
+}
+
+void
+RetimePlugin::purgeCaches()
+{
+    _motionCache.clear();
+}
+
 bool
 RetimePlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod)
 {
@@ -402,27 +571,7 @@ RetimePlugin::isIdentityInternal(OfxTime time, OFX::Clip* &identityClip, OfxTime
     if (!_srcClip) {
         return false;
     }
-    double sourceTime;
-    if (getContext() == OFX::eContextRetimer) {
-        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
-        sourceTime = _sourceTime->getValueAtTime(time);
-    } else {
-        bool reverse_input;
-        OfxRangeD srcRange = _srcClip->getFrameRange();
-        _reverse_input->getValueAtTime(time, reverse_input);
-        // we have our own param, which is a speed, so we integrate it to get the time we want
-        if (reverse_input) {
-            sourceTime = srcRange.max - _speed->integrate(srcRange.min, time);
-        } else {
-            sourceTime = srcRange.min + _speed->integrate(srcRange.min, time);
-        }
-        if (_warp) {
-            double r = srcRange.max - srcRange.min;
-            if (r != 0.) {
-                sourceTime = srcRange.min + r * _warp->getValue(0, time, (sourceTime-srcRange.min)/r);
-            }
-        }
-    }
+    double sourceTime = getSourceTime(time);
     int filter_i;
     _filter->getValueAtTime(time, filter_i);
     FilterEnum filter = (FilterEnum)filter_i;
@@ -504,6 +653,33 @@ RetimePlugin::renderInternal(const OFX::RenderArguments &args,
     }
 }
 
+template <int nComponents>
+void
+RetimePlugin::renderMotion(const OFX::RenderArguments &args,
+                           double sourceTime,
+                           OFX::BitDepthEnum dstBitDepth)
+{
+    switch (dstBitDepth) {
+        case OFX::eBitDepthUByte: {
+            OFX::MotionInterpolator<unsigned char, nComponents, 255> fred(*this);
+            setupAndProcessMotion<unsigned char, nComponents>(fred, args, sourceTime);
+            break;
+        }
+        case OFX::eBitDepthUShort: {
+            OFX::MotionInterpolator<unsigned short, nComponents, 65535> fred(*this);
+            setupAndProcessMotion<unsigned short, nComponents>(fred, args, sourceTime);
+            break;
+        }
+        case OFX::eBitDepthFloat: {
+            OFX::MotionInterpolator<float, nComponents, 1> fred(*this);
+            setupAndProcessMotion<float, nComponents>(fred, args, sourceTime);
+            break;
+        }
+        default:
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
 // the overridden render function
 void
 RetimePlugin::render(const OFX::RenderArguments &args)
@@ -517,29 +693,7 @@ RetimePlugin::render(const OFX::RenderArguments &args)
     assert(kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth());
 
     // figure the frame we should be retiming from
-    double sourceTime = time;
-
-    if (getContext() == OFX::eContextRetimer) {
-        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
-        sourceTime = _sourceTime->getValueAtTime(time);
-    } else if (_srcClip) {
-        bool reverse_input;
-
-        OfxRangeD srcRange = _srcClip->getFrameRange();
-        _reverse_input->getValueAtTime(time, reverse_input);
-        // we have our own param, which is a speed, so we integrate it to get the time we want
-        if (reverse_input) {
-            sourceTime = srcRange.max - _speed->integrate(srcRange.min, time);
-        } else {
-            sourceTime = srcRange.min + _speed->integrate(srcRange.min, time);
-        }
-        if (_warp) {
-            double r = srcRange.max - srcRange.min;
-            if (r != 0.) {
-                sourceTime = srcRange.min + r * _warp->getValue(0, time, (sourceTime-srcRange.min)/r);
-            }
-        }
-    }
+    double sourceTime = getSourceTime(time);
 
     int filter_i;
     _filter->getValueAtTime(time, filter_i);
@@ -554,7 +708,18 @@ RetimePlugin::render(const OFX::RenderArguments &args)
 #endif
 
     // do the rendering
-    if (dstComponents == OFX::ePixelComponentRGBA) {
+    if (filter == eFilterMotion) {
+        if (dstComponents == OFX::ePixelComponentRGBA) {
+            renderMotion<4>(args, sourceTime, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentRGB) {
+            renderMotion<3>(args, sourceTime, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentXY) {
+            renderMotion<2>(args, sourceTime, dstBitDepth);
+        } else {
+            assert(dstComponents == OFX::ePixelComponentAlpha);
+            renderMotion<1>(args, sourceTime, dstBitDepth);
+        }
+    } else if (dstComponents == OFX::ePixelComponentRGBA) {
         renderInternal<4>(args, sourceTime, filter, dstBitDepth);
     } else if (dstComponents == OFX::ePixelComponentRGB) {
         renderInternal<3>(args, sourceTime, filter, dstBitDepth);
@@ -743,6 +908,8 @@ void RetimePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, Co
         param->appendOption(kParamFilterOptionNearest, kParamFilterOptionNearestHint);
         assert(param->getNOptions() == eFilterLinear);
         param->appendOption(kParamFilterOptionLinear, kParamFilterOptionLinearHint);
+        assert(param->getNOptions() == eFilterMotion);
+        param->appendOption(kParamFilterOptionMotion, kParamFilterOptionMotionHint);
         //assert(param->getNOptions() == eFilterBox);
         //param->appendOption(kParamFilterOptionBox, kParamFilterOptionBoxHint);
         param->setDefault((int)kParamFilterDefault);
@@ -38,6 +38,7 @@
 #include "ofxsShutter.h"
 #include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
+#include "ofxsFrameCache.h"
 
 #define kPluginName "TimeBlurOFX"
 #define kPluginGrouping "Time"
@@ -47,9 +48,10 @@
 #define kPluginIdentifier "net.sf.openfx.TimeBlur"
 // History:
 // version 1.0: initial version
+// version 1.1: frame cache for sequence renders
 // version 2.0: use kNatronOfxParamProcess* parameters
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -62,6 +64,10 @@
 #define kParamDivisionsLabel "Divisions"
 #define kParamDivisionsHint  "Number of time samples along the shutter time."
 
+#define kParamFrameCacheSize "frameCacheSize"
+#define kParamFrameCacheSizeLabel "Frame Cache (MB)"
+#define kParamFrameCacheSizeHint "Maximum amount of memory (in megabytes) used to keep the time samples of the input between two output frames when rendering a sequence (e.g. when rendering to disk). This only helps when the shutter is larger than one frame, so that consecutive output frames share time samples. 0 disables the cache. The cache is never used in interactive renders."
+
 #define kFrameChunk 4 // how many frames to process simultaneously
 
 using namespace OFX;
@@ -69,7 +75,7 @@ using namespace OFX;
 class TimeBlurProcessorBase : public OFX::PixelProcessor
 {
 protected:
-    std::vector<const OFX::Image*> _srcImgs;
+    std::vector<OFX::FrameView> _srcImgs;
     float *_accumulatorData;
     int _divisions; // 0 for all passes except the last one
 
@@ -83,7 +89,7 @@ public:
     {
     }
 
-    void setSrcImgs(const std::vector<const OFX::Image*> &v) {_srcImgs = v;}
+    void setSrcImgs(const std::vector<OFX::FrameView> &v) {_srcImgs = v;}
     void setAccumulator(float *accumulatorData) {_accumulatorData = accumulatorData;}
 
     void setValues(int divisions)
@@ -135,7 +141,7 @@ private:
                 }
                 // accumulate
                 for (unsigned i = 0; i < _srcImgs.size(); ++i) {
-                    const PIX *srcPixi = (const PIX *)  (_srcImgs[i] ? _srcImgs[i]->getPixelAddress(x, y) : 0);
+                    const PIX *srcPixi = (const PIX *) _srcImgs[i].getPixelAddress(x, y);
                     if (srcPixi) {
                         for (int c = 0; c < nComponents; ++c) {
                             tmpPix[c] += srcPixi[c];
@@ -175,6 +181,8 @@ public:
     , _shutter(0)
     , _shutteroffset(0)
     , _shuttercustomoffset(0)
+    , _frameCacheSize(0)
+    , _frameCache(this)
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         assert(_dstClip && (_dstClip->getPixelComponents() == ePixelComponentAlpha ||
@@ -192,6 +200,8 @@ public:
         _shutteroffset = fetchChoiceParam(kParamShutterOffset);
         _shuttercustomoffset = fetchDoubleParam(kParamShutterCustomOffset);
         assert(_divisions && _shutter && _shutteroffset && _shuttercustomoffset);
+        _frameCacheSize = fetchIntParam(kParamFrameCacheSize);
+        assert(_frameCacheSize);
     }
 
 private:
@@ -208,6 +218,12 @@ private:
 
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
 
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void purgeCaches(void) OVERRIDE FINAL;
+
 private:
 
     template<int nComponents>
@@ -223,6 +239,8 @@ private:
     OFX::DoubleParam* _shutter;
     OFX::ChoiceParam* _shutteroffset;
     OFX::DoubleParam* _shuttercustomoffset;
+    OFX::IntParam* _frameCacheSize;
+    OFX::FrameCache _frameCache;
 };
 
 
@@ -232,28 +250,6 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 // basic plugin render function, just a skelington to instantiate templates from
 
-namespace {
-// Since we cannot hold a std::auto_ptr in the vector we must hold a raw pointer.
-// To ensure that images are always freed even in case of exceptions, use a RAII class.
-struct OptionalImagesHolder_RAII
-{
-    std::vector<const OFX::Image*> images;
-    
-    OptionalImagesHolder_RAII()
-    : images()
-    {
-        
-    }
-    
-    ~OptionalImagesHolder_RAII()
-    {
-        for (unsigned int i = 0; i < images.size(); ++i) {
-            delete images[i];
-        }
-    }
-};
-}
-
 /* set up and run a processor */
 void
 TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor, const OFX::RenderArguments &args)
@@ -318,15 +314,24 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor, const OFX::Ren
             }
         }
 
-        // fetch the source images
-        OptionalImagesHolder_RAII srcImgs;
+        // fetch the source images (time samples shared with the previous output frame may be in the cache)
+        OFX::FrameCacheHolder_RAII frames(&_frameCache);
+        std::vector<OFX::FrameView> srcImgs;
         for (int i = imin; i < imax; ++i) {
             if (abort()) {
                 return;
             }
-            const OFX::Image* src = _srcClip ? _srcClip->fetchImage(range.min + i * interval) : 0;
-            //std::printf("TimeBlur: fetchimage(%g)\n", range.min + i * interval);
+            const double t = range.min + i * interval;
+            const OFX::FrameCache::Entry *entry = _frameCache.acquire(0, t, args.renderScale, renderWindow, interval);
+            if (entry) {
+                frames.entries.push_back(entry);
+                srcImgs.push_back(entry->view);
+                continue;
+            }
+            const OFX::Image* src = _srcClip ? _srcClip->fetchImage(t) : 0;
+            //std::printf("TimeBlur: fetchimage(%g)\n", t);
             if (src) {
+                frames.images.push_back(src);
                 if (src->getRenderScale().x != args.renderScale.x ||
                     src->getRenderScale().y != args.renderScale.y ||
                     (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
@@ -338,15 +343,24 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor, const OFX::Ren
                 if (srcBitDepth != dstBitDepth || srcComponents != dstComponents) {
                     OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
                 }
+                entry = _frameCache.insert(0, t, args.renderScale, src, renderWindow);
+                if (entry) {
+                    // the pixels were copied, release the host image now
+                    frames.entries.push_back(entry);
+                    frames.images.pop_back();
+                    delete src;
+                    srcImgs.push_back(entry->view);
+                    continue;
+                }
             }
-            srcImgs.images.push_back(src);
+            srcImgs.push_back(OFX::FrameView(src));
         }
 
         // set the images
         if (lastPass) {
             processor.setDstImg(dst.get());
         }
-        processor.setSrcImgs(srcImgs.images);
+        processor.setSrcImgs(srcImgs);
         // set the render window
         processor.setRenderWindow(renderWindow);
         processor.setAccumulator(accumulatorData);
@@ -498,6 +512,28 @@ TimeBlurPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &ar
     }
     return true;
 }
+void
+TimeBlurPlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments &args)
+{
+    // never cache during interactive renders: the input may change at any time
+    int cacheSize = 0;
+    if (!args.isInteractive) {
+        _frameCacheSize->getValue(cacheSize);
+    }
+    _frameCache.setMaxBytes((size_t)std::max(cacheSize, 0) * 1024 * 1024);
+}
+
+void
+TimeBlurPlugin::endSequenceRender(const OFX::EndSequenceRenderArguments &/*args*/)
+{
+    _frameCache.setMaxBytes(0);
+}
+
+void
+TimeBlurPlugin::purgeCaches(void)
+{
+    _frameCache.clear();
+}
 
 mDeclarePluginFactory(TimeBlurPluginFactory, {}, {});
 
@@ -569,6 +605,20 @@ void TimeBlurPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
     }
 
     OFX::shutterDescribeInContext(desc, context, page);
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamFrameCacheSize);
+        param->setLabel(kParamFrameCacheSizeLabel);
+        param->setHint(kParamFrameCacheSizeHint);
+        param->setDefault(0);
+        param->setRange(0, kOfxFlagInfiniteMax);
+        param->setDisplayRange(0, 4096);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 }
 
 OFX::ImageEffect* TimeBlurPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
@@ -6,7 +6,7 @@ namespace OFX
     {
         void getPluginIDs(OFX::PluginFactoryArray &ids)
         {
-            getTrackerPMPluginID(ids);
+            getTrackerPMPluginIDs(ids);
         }
     }
 }
@@ -23,18 +23,39 @@
 #include "TrackerPM.h"
 
 #include <cmath>
+#include <new>
+#include <sstream>
+#include <complex>
 #include <map>
 #include <limits>
+#include <vector>
 #include <algorithm>
 
 #include "ofxsProcessing.H"
 #include "ofxsTracking.h"
 #include "ofxsCoords.h"
+#include "ofxsBlockMatch.h"
+
+#ifndef M_PI
+#define M_PI        3.14159265358979323846264338327950288   /* pi             */
+#endif
+
+// SSE2 is always available on x86-64, and may be enabled on x86.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRACKERPM_SSE2
+#include <emmintrin.h>
+#endif
+// AVX kernels are compiled using function attributes, and selected at runtime if the CPU supports AVX.
+#if defined(TRACKERPM_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define TRACKERPM_AVX
+#include <immintrin.h>
+#endif
 
 #define kPluginName "TrackerPM"
 #define kPluginGrouping "Transform"
 #define kPluginDescription \
-"Point tracker based on pattern matching using an exhaustive search within an image region.\n" \
+"Point tracker based on pattern matching using an exhaustive or coarse-to-fine search within an image region.\n" \
 "The Mask input is used to weight the pattern, so that only pixels from the Mask will be tracked. \n" \
 "The tracker always takes the previous/next frame as reference when searching for a pattern in an image. This can " \
 "overtime make a track drift from its original pattern.\n"\
@@ -44,6 +65,27 @@
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
 
+#define kPluginMultiName "TrackerPMMulti"
+#define kPluginMultiDescription \
+"Multiple point tracker based on pattern matching, using the same algorithm as TrackerPM.\n" \
+"All the tracks share the same pattern and search windows, relative to their center. " \
+"The reference and target images are fetched only once for all the tracks, and the tracks are processed in parallel.\n" \
+"The Mask input is used to weight the pattern, so that only pixels from the Mask will be tracked. "
+#define kPluginMultiIdentifier "net.sf.openfx.TrackerPMMulti"
+
+#define kParamTrackCount "trackCount"
+#define kParamTrackCountLabel "Tracks"
+#define kParamTrackCountHint "Number of tracks."
+#define kTrackCountMax 64
+
+#define kParamTrackEnabled "trackEnabled"
+#define kParamTrackEnabledLabel "Enable Track "
+#define kParamTrackEnabledHint "Track this point when tracking. Tracks that are not enabled keep their keyframes."
+
+#define kParamTrackCenter "trackCenter"
+#define kParamTrackCenterLabel "Center "
+#define kParamTrackCenterHint "The center of the pattern, which is tracked."
+
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
@@ -63,6 +105,29 @@
 #define kParamScoreOptionZNCC "ZNCC"
 #define kParamScoreOptionZNCCHint "Zero-mean Normalized Cross-Correlation, less sensitive to illumination changes"
 
+#define kParamSearchMethod "searchMethod"
+#define kParamSearchMethodLabel "Search Method"
+#define kParamSearchMethodHint "Method used to find the best match within the search window."
+#define kParamSearchMethodOptionExhaustive "Exhaustive"
+#define kParamSearchMethodOptionExhaustiveHint "Compute the score at every integer position in the search window. Always finds the best match, but the cost is proportional to the search area times the pattern area."
+#define kParamSearchMethodOptionCoarseToFine "Coarse to Fine"
+#define kParamSearchMethodOptionCoarseToFineHint "Search exhaustively in a downscaled version of the images (a Gaussian pyramid), then refine the match locally at each finer level. Much faster with large search windows, but may miss the best match if the pattern has few low-frequency features."
+#define kParamSearchMethodOptionFFT "FFT"
+#define kParamSearchMethodOptionFFTHint "Exhaustive search, with the SSD, NCC and ZNCC scores computed for all positions at once in the Fourier domain, and the local sums of the image computed using summed-area tables. Finds the same match as Exhaustive, and is much faster with large search windows and patterns. The SAD score cannot be computed this way, and uses the Exhaustive method."
+
+#define kParamPyramidLevels "pyramidLevels"
+#define kParamPyramidLevelsLabel "Pyramid Levels"
+#define kParamPyramidLevelsHint "Maximum number of levels of the image pyramid used by the Coarse to Fine search method, including the full-resolution level. Fewer levels are used if the pattern would be smaller than 4 pixels at the coarsest level."
+#define kParamPyramidLevelsDefault 4
+
+// smallest pattern width or height at the coarsest pyramid level
+#define kPyramidMinPatternSize 4
+// the match found at a given level is refined within +/- kPyramidRefineRadius pixels at the next level
+#define kPyramidRefineRadius 2
+// NCC and ZNCC: the sum of the squared (centered) values of the other image at a position is considered
+// zero, and the position is rejected, if it is below this fraction of the energy from which it was computed
+#define kTrackerVarianceEpsilon 1e-9
+
 using namespace OFX;
 
 enum TrackerScoreEnum
@@ -73,6 +138,13 @@ enum TrackerScoreEnum
     eTrackerZNCC
 };
 
+enum TrackerSearchMethodEnum
+{
+    eTrackerSearchExhaustive = 0,
+    eTrackerSearchCoarseToFine,
+    eTrackerSearchFFT
+};
+
 class TrackerPMProcessorBase;
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -89,12 +161,16 @@ public:
     , _innerTopRight(0)
     , _outerBtmLeft(0)
     , _outerTopRight(0)
+    , _searchMethod(0)
+    , _pyramidLevels(0)
     {
         _maskClip = fetchClip(getContext() == OFX::eContextPaint ? "Brush" : "Mask");
         assert(!_maskClip || _maskClip->getPixelComponents() == ePixelComponentAlpha);
         _score = fetchChoiceParam(kParamScore);
-        assert(_score);
-        
+        _searchMethod = fetchChoiceParam(kParamSearchMethod);
+        _pyramidLevels = fetchIntParam(kParamPyramidLevels);
+        assert(_score && _searchMethod && _pyramidLevels);
+
         _center = fetchDouble2DParam(kParamTrackingCenterPoint);
         _offset = fetchDouble2DParam(kParamTrackingOffset);
         _innerBtmLeft = fetchDouble2DParam(kParamTrackingPatternBoxBtmLeft);
@@ -149,6 +225,8 @@ private:
     OFX::Double2DParam* _innerTopRight;
     OFX::Double2DParam* _outerBtmLeft;
     OFX::Double2DParam* _outerTopRight;
+    ChoiceParam* _searchMethod;
+    IntParam* _pyramidLevels;
 };
 
 
@@ -160,6 +238,7 @@ protected:
     OfxPointI _refCenterI;
     std::pair<OfxPointD,double> _bestMatch; //< the results for the current processor
     OFX::MultiThread::Mutex _bestMatchMutex; //< this is used so we can multi-thread the tracking and protect the shared results
+    bool _singleThreaded; //< process in the calling thread (e.g. when tracking several patterns in parallel)
     
 public:
     TrackerPMProcessorBase(OFX::ImageEffect &instance)
@@ -167,6 +246,7 @@ public:
     , _otherImg(0)
     , _refRectPixel()
     , _refCenterI()
+    , _singleThreaded(false)
     {
         _bestMatch.second = std::numeric_limits<double>::infinity();
 
@@ -180,13 +260,414 @@ public:
     virtual bool setValues(const OFX::Image *ref, const OFX::Image *other, const OFX::Image *mask,
                            const OfxRectI& pattern, const OfxPointI& centeri) = 0;
 
+    /** @brief process in the calling thread. The host multithread suite may not be called from a thread it spawned. */
+    void setSingleThreaded(bool singleThreaded) { _singleThreaded = singleThreaded; }
+
+    /** @brief exhaustive search over the render window */
+    void processWindow()
+    {
+        if (_singleThreaded) {
+            multiThreadFunction(0, 1);
+        } else {
+            process();
+        }
+    }
+
     /**
      * @brief Retrieves the results of the track. Must be called once process() returns so it is thread safe.
      **/
     const OfxPointD& getBestMatch() const { return _bestMatch.first; }
     double getBestScore() const { return _bestMatch.second; }
+
+    /**
+     * @brief Search the best match using a Gaussian pyramid of at most nLevels levels (including the
+     * full-resolution level): exhaustive search at the coarsest level, then local refinement at each finer level.
+     * The search window at full resolution is the render window. Must be called after setValues().
+     **/
+    virtual void processCoarseToFine(int nLevels) = 0;
+
+    /**
+     * @brief Exhaustive search over the render window, with the scores computed in the Fourier domain.
+     * Must be called after setValues(). Returns false if the score cannot be computed this way.
+     **/
+    virtual bool processFFT() = 0;
+};
+
+// The pattern is packed as one float plane per component, with rows padded to a multiple of
+// kPackWidth floats (the widest SIMD vector) and aligned. The kernels mask out the padding lanes
+// of the last vector of each row (rather than giving them a zero weight, which would still
+// propagate an Inf or NaN read from the other image).
+#define kPackWidth 8
+
+enum TrackerKernelEnum
+{
+    eTrackerKernelScalar = 0,
+    eTrackerKernelSSE2,
+    eTrackerKernelAVX
+};
+
+/** @brief the fastest score kernels supported by the CPU */
+static TrackerKernelEnum
+getTrackerKernel()
+{
+#ifdef TRACKERPM_AVX
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        return eTrackerKernelAVX;
+    }
+#endif
+#ifdef TRACKERPM_SSE2
+    return eTrackerKernelSSE2;
+#else
+    return eTrackerKernelScalar;
+#endif
+}
+
+// the CPU is only checked once, when the plugin is loaded
+static const TrackerKernelEnum gTrackerKernel = getTrackerKernel();
+
+/**
+ * @brief Score kernel for one component of a packed pattern.
+ *
+ * a and b are the packed pattern coefficients (with stride aStride), o is the other image (with stride oStride),
+ * width is the pattern width (the kernels do not read the coefficients beyond the next multiple of kPackWidth).
+ * offset is subtracted from the other image, so that ZNCC can center it before squaring.
+ * Each row is accumulated in float, and the rows are summed in double:
+ * - SSD: sums[0] = sum a.(b-o)^2, with a = w^2 and b = ref
+ * - SAD: sums[0] = sum a.|b-o|, with a = w and b = ref
+ * - NCC: sums[0] = sum a.o, sums[2] = sum b.o^2, with a = w.ref and b = w
+ * - ZNCC: sums[0] = sum a.o, sums[1] = sum b.o, sums[2] = sum b.o^2, with a = w.(ref-refMean) and b = w
+ */
+typedef void (*TrackerPatternKernel)(const float *a, const float *b, const float *o, int width, int height, int aStride, int oStride, float offset, double sums[3]);
+
+template<enum TrackerScoreEnum scoreTypeE>
+static void
+patternKernelScalar(const float *a, const float *b, const float *o, int width, int height, int aStride, int oStride, float offset, double sums[3])
+{
+    for (int i = 0; i < height; ++i, a += aStride, b += aStride, o += oStride) {
+        float acc0 = 0.f, acc1 = 0.f, acc2 = 0.f;
+        for (int k = 0; k < width; ++k) {
+            const float ok = o[k] - offset;
+            switch (scoreTypeE) {
+                case eTrackerSSD: {
+                    float d = b[k] - ok;
+                    acc0 += a[k] * d * d;
+                }   break;
+                case eTrackerSAD:
+                    acc0 += a[k] * std::abs(b[k] - ok);
+                    break;
+                case eTrackerNCC:
+                    acc0 += a[k] * ok;
+                    acc2 += b[k] * ok * ok;
+                    break;
+                case eTrackerZNCC:
+                    acc0 += a[k] * ok;
+                    acc1 += b[k] * ok;
+                    acc2 += b[k] * ok * ok;
+                    break;
+            }
+        }
+        sums[0] += acc0;
+        sums[1] += acc1;
+        sums[2] += acc2;
+    }
+}
+
+#ifdef TRACKERPM_SSE2
+static inline double
+hsumSSE2(__m128 v)
+{
+    __m128d sum = _mm_add_pd(_mm_cvtps_pd(v), _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+template<enum TrackerScoreEnum scoreTypeE>
+static inline void
+accumulateSSE2(__m128 va, __m128 vb, __m128 vo, __m128 absMask, __m128 &acc0, __m128 &acc1, __m128 &acc2)
+{
+    switch (scoreTypeE) {
+        case eTrackerSSD: {
+            __m128 d = _mm_sub_ps(vb, vo);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(va, _mm_mul_ps(d, d)));
+        }   break;
+        case eTrackerSAD:
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(va, _mm_and_ps(absMask, _mm_sub_ps(vb, vo))));
+            break;
+        case eTrackerNCC:
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(va, vo));
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(vb, _mm_mul_ps(vo, vo)));
+            break;
+        case eTrackerZNCC: {
+            __m128 bo = _mm_mul_ps(vb, vo);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(va, vo));
+            acc1 = _mm_add_ps(acc1, bo);
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(bo, vo));
+        }   break;
+    }
+}
+
+template<enum TrackerScoreEnum scoreTypeE>
+static void
+patternKernelSSE2(const float *a, const float *b, const float *o, int width, int height, int aStride, int oStride, float offset, double sums[3])
+{
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 voffset = _mm_set1_ps(offset);
+    const int fullWidth = width & ~3;
+    // the lanes of the last vector which are inside the pattern
+    const __m128 lastMask = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(width - fullWidth)));
+    for (int i = 0; i < height; ++i, a += aStride, b += aStride, o += oStride) {
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        __m128 acc2 = _mm_setzero_ps();
+        for (int k = 0; k < fullWidth; k += 4) {
+            // the pattern is aligned, the other image is not
+            accumulateSSE2<scoreTypeE>(_mm_load_ps(a + k), _mm_load_ps(b + k), _mm_sub_ps(_mm_loadu_ps(o + k), voffset),
+                                       absMask, acc0, acc1, acc2);
+        }
+        if (fullWidth < width) {
+            accumulateSSE2<scoreTypeE>(_mm_load_ps(a + fullWidth), _mm_load_ps(b + fullWidth),
+                                       _mm_and_ps(lastMask, _mm_sub_ps(_mm_loadu_ps(o + fullWidth), voffset)),
+                                       absMask, acc0, acc1, acc2);
+        }
+        sums[0] += hsumSSE2(acc0);
+        if (scoreTypeE == eTrackerZNCC) {
+            sums[1] += hsumSSE2(acc1);
+        }
+        if (scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) {
+            sums[2] += hsumSSE2(acc2);
+        }
+    }
+}
+#endif
+
+#ifdef TRACKERPM_AVX
+__attribute__((target("avx"))) static inline double
+hsumAVX(__m256 v)
+{
+    __m256d sum = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+
+    return _mm_cvtsd_f64(_mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2)));
+}
+
+template<enum TrackerScoreEnum scoreTypeE>
+__attribute__((target("avx"))) static inline void
+accumulateAVX(__m256 va, __m256 vb, __m256 vo, __m256 absMask, __m256 &acc0, __m256 &acc1, __m256 &acc2)
+{
+    switch (scoreTypeE) {
+        case eTrackerSSD: {
+            __m256 d = _mm256_sub_ps(vb, vo);
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(va, _mm256_mul_ps(d, d)));
+        }   break;
+        case eTrackerSAD:
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(va, _mm256_and_ps(absMask, _mm256_sub_ps(vb, vo))));
+            break;
+        case eTrackerNCC:
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(va, vo));
+            acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(vb, _mm256_mul_ps(vo, vo)));
+            break;
+        case eTrackerZNCC: {
+            __m256 bo = _mm256_mul_ps(vb, vo);
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(va, vo));
+            acc1 = _mm256_add_ps(acc1, bo);
+            acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(bo, vo));
+        }   break;
+    }
+}
+
+template<enum TrackerScoreEnum scoreTypeE>
+__attribute__((target("avx"))) static void
+patternKernelAVX(const float *a, const float *b, const float *o, int width, int height, int aStride, int oStride, float offset, double sums[3])
+{
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 voffset = _mm256_set1_ps(offset);
+    const int fullWidth = width & ~7;
+    // the lanes of the last vector which are inside the pattern
+    const __m256 lastMask = _mm256_cmp_ps(_mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f),
+                                          _mm256_set1_ps((float)(width - fullWidth)), _CMP_LT_OQ);
+    for (int i = 0; i < height; ++i, a += aStride, b += aStride, o += oStride) {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        for (int k = 0; k < fullWidth; k += 8) {
+            accumulateAVX<scoreTypeE>(_mm256_load_ps(a + k), _mm256_load_ps(b + k), _mm256_sub_ps(_mm256_loadu_ps(o + k), voffset),
+                                      absMask, acc0, acc1, acc2);
+        }
+        if (fullWidth < width) {
+            accumulateAVX<scoreTypeE>(_mm256_load_ps(a + fullWidth), _mm256_load_ps(b + fullWidth),
+                                      _mm256_and_ps(lastMask, _mm256_sub_ps(_mm256_loadu_ps(o + fullWidth), voffset)),
+                                      absMask, acc0, acc1, acc2);
+        }
+        sums[0] += hsumAVX(acc0);
+        if (scoreTypeE == eTrackerZNCC) {
+            sums[1] += hsumAVX(acc1);
+        }
+        if (scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) {
+            sums[2] += hsumAVX(acc2);
+        }
+    }
+}
+#endif
+
+template<enum TrackerScoreEnum scoreTypeE>
+static TrackerPatternKernel
+getPatternKernel(TrackerKernelEnum kernel)
+{
+    switch (kernel) {
+#ifdef TRACKERPM_AVX
+        case eTrackerKernelAVX:
+            return &patternKernelAVX<scoreTypeE>;
+#endif
+#ifdef TRACKERPM_SSE2
+        case eTrackerKernelSSE2:
+            return &patternKernelSSE2<scoreTypeE>;
+#endif
+        default:
+            return &patternKernelScalar<scoreTypeE>;
+    }
+}
+
+/** @brief a float buffer whose data is aligned for the SIMD kernels */
+class AlignedFloatBuffer
+{
+public:
+    AlignedFloatBuffer()
+    : _storage()
+    , _data(0)
+    {
+    }
+
+    void assign(size_t n)
+    {
+        _storage.assign(n + kPackWidth, 0.f);
+        size_t misalign = ((size_t)&_storage[0] / sizeof(float)) % kPackWidth;
+        _data = &_storage[0] + (misalign ? (kPackWidth - misalign) : 0);
+    }
+
+    float* data() { return _data; }
+    const float* data() const { return _data; }
+
+private:
+    std::vector<float> _storage;
+    float *_data;
 };
 
+static unsigned int
+nextPowerOfTwo(unsigned int n)
+{
+    unsigned int p = 1;
+    while (p < n) {
+        p *= 2;
+    }
+    return p;
+}
+
+/** @brief in-place radix-2 FFT of the n values data[0], data[stride], ..., n must be a power of two */
+static void
+fft1D(std::complex<double> *data, size_t n, size_t stride, bool inverse)
+{
+    // bit-reversal permutation
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i * stride], data[j * stride]);
+        }
+    }
+    for (size_t len = 2; len <= n; len <<= 1) {
+        double angle = (inverse ? 2 : -2) * M_PI / len;
+        std::complex<double> wlen(std::cos(angle), std::sin(angle));
+        for (size_t i = 0; i < n; i += len) {
+            std::complex<double> w(1.);
+            for (size_t k = 0; k < len / 2; ++k) {
+                std::complex<double> u = data[(i + k) * stride];
+                std::complex<double> v = data[(i + k + len / 2) * stride] * w;
+                data[(i + k) * stride] = u + v;
+                data[(i + k + len / 2) * stride] = u - v;
+                w *= wlen;
+            }
+        }
+    }
+    if (inverse) {
+        for (size_t i = 0; i < n; ++i) {
+            data[i * stride] /= (double)n;
+        }
+    }
+}
+
+/** @brief in-place 2D FFT of a w x h buffer (w and h must be powers of two) */
+static void
+fft2D(std::vector<std::complex<double> > &data, size_t w, size_t h, bool inverse)
+{
+    for (size_t y = 0; y < h; ++y) {
+        fft1D(&data[y * w], w, 1, inverse);
+    }
+    for (size_t x = 0; x < w; ++x) {
+        fft1D(&data[x], h, w, inverse);
+    }
+}
+
+/** @brief summed-area table of a w x h buffer, with an extra row and column of zeros */
+static void
+summedAreaTable(const std::vector<double> &data, int w, int h, std::vector<double> *sat)
+{
+    sat->assign((size_t)(w + 1) * (h + 1), 0.);
+    for (int y = 0; y < h; ++y) {
+        double rowSum = 0.;
+        for (int x = 0; x < w; ++x) {
+            rowSum += data[(size_t)y * w + x];
+            (*sat)[(size_t)(y + 1) * (w + 1) + (x + 1)] = (*sat)[(size_t)y * (w + 1) + (x + 1)] + rowSum;
+        }
+    }
+}
+
+/** @brief sum of the values in [x1,x2[ x [y1,y2[ using the summed-area table of a buffer of width w */
+static inline double
+summedAreaTableSum(const std::vector<double> &sat, int w, int x1, int y1, int x2, int y2)
+{
+    const size_t w1 = w + 1;
+    return sat[y2 * w1 + x2] - sat[y1 * w1 + x2] - sat[y2 * w1 + x1] + sat[y1 * w1 + x1];
+}
+
+/** @brief true if the NCC or ZNCC denominator ssq, computed from values of energy (sum of squares) energy,
+    is zero up to rounding errors (see kTrackerVarianceEpsilon). All the score computations use it,
+    so that a position accepted by the FFT search is also accepted by the direct computation. */
+static inline bool
+trackerVarianceIsZero(double ssq, double energy)
+{
+    return !(ssq > kTrackerVarianceEpsilon * energy);
+}
+
+// floor(a/2), also for negative values
+static inline int
+floorDiv2(int a)
+{
+    return (a >= 0) ? (a / 2) : -((1 - a) / 2);
+}
+
+// the rectangle covering the pixels of rect after downscaling by a factor 2 (pixel X samples pixel 2X)
+static inline OfxRectI
+downscaleRect(const OfxRectI& rect)
+{
+    OfxRectI r;
+    r.x1 = floorDiv2(rect.x1 + 1);
+    r.x2 = floorDiv2(rect.x2 - 1) + 1;
+    r.y1 = floorDiv2(rect.y1 + 1);
+    r.y2 = floorDiv2(rect.y2 - 1) + 1;
+    if (r.x2 <= r.x1) {
+        r.x1 = floorDiv2(rect.x1);
+        r.x2 = r.x1 + 1;
+    }
+    if (r.y2 <= r.y1) {
+        r.y1 = floorDiv2(rect.y1);
+        r.y2 = r.y1 + 1;
+    }
+    return r;
+}
 
 // The "masked", "filter" and "clamp" template parameters allow filter-specific optimization
 // by the compiler, using the same generic code for all filters.
@@ -199,6 +680,39 @@ protected:
     std::auto_ptr<OFX::ImageMemory> _weightImg;
     float *_weightData;
     double _weightTotal;
+
+    /** @brief one level of the pyramid used by the coarse-to-fine search */
+    struct PyramidLevel
+    {
+        OfxRectI patternRect; //< pattern rectangle, relative to the center
+        std::vector<float> pattern; //< the pattern, nComponents values per pixel
+        std::vector<float> weight; //< the pattern weight
+        double weightTotal;
+        double patternMean[3]; //< the weighted mean of the pattern, used by ZNCC
+        OfxRectI otherBounds; //< bounds of the other image at this level
+        std::vector<float> other; //< the other image, nComponents values per pixel
+        OfxRectI searchWindow; //< the search window at this level
+
+        const float* getOtherPixel(int x, int y) const
+        {
+            // take nearest pixel in other image (more chance to get a track than with black)
+            x = std::max(otherBounds.x1, std::min(x, otherBounds.x2 - 1));
+            y = std::max(otherBounds.y1, std::min(y, otherBounds.y2 - 1));
+            return &other[((y - otherBounds.y1) * (otherBounds.x2 - otherBounds.x1) + (x - otherBounds.x1)) * nComponents];
+        }
+    };
+    std::vector<PyramidLevel> _pyramid;
+    int _level; //< the pyramid level being searched, 0 for the exhaustive search at full resolution
+
+    // packed pattern and other image, used by computeScore() (see kPackWidth)
+    int _packedStride; //< row stride of the packed pattern (a multiple of kPackWidth)
+    AlignedFloatBuffer _packedA[3]; //< first pattern coefficient, for each component
+    AlignedFloatBuffer _packedB[3]; //< second pattern coefficient, for each component
+    OfxRectI _packedOtherRect; //< the part of the other image that was packed
+    int _packedOtherStride;
+    std::vector<float> _packedOther[3]; //< the other image, for each component
+    TrackerPatternKernel _kernel;
+
 public:
     TrackerPMProcessor(OFX::ImageEffect &instance)
     : TrackerPMProcessorBase(instance)
@@ -207,6 +721,12 @@ public:
     , _weightImg(0)
     , _weightData(0)
     , _weightTotal(0.)
+    , _pyramid()
+    , _level(0)
+    , _packedStride(0)
+    , _packedOtherRect()
+    , _packedOtherStride(0)
+    , _kernel(0)
     {
     }
 
@@ -271,157 +791,363 @@ private:
                 _weightTotal += *weightPtr;
             }
         }
-        return (_weightTotal > 0);
-    }
-
-    void multiThreadProcessImages(OfxRectI procWindow) {
-        switch (scoreType) {
-            case eTrackerSSD:
-                return multiThreadProcessImagesForScore<eTrackerSSD>(procWindow);
-            case eTrackerSAD:
-                return multiThreadProcessImagesForScore<eTrackerSAD>(procWindow);
-            case eTrackerNCC:
-                return multiThreadProcessImagesForScore<eTrackerNCC>(procWindow);
-            case eTrackerZNCC:
-                return multiThreadProcessImagesForScore<eTrackerZNCC>(procWindow);
+        if (_weightTotal > 0) {
+            packPattern();
         }
+
+        return (_weightTotal > 0);
     }
 
-    template<enum TrackerScoreEnum scoreTypeE>
-    double computeScore(int x, int y, const double refMean[3])
+    /**
+     * @brief pack the pattern coefficients and the part of the other image used by the search, which is the
+     * render window plus a one-pixel margin for the subpixel refinement.
+     **/
+    void packPattern()
     {
-        double score = 0;
-        double otherSsq = 0.;
-        double otherMean[3];
         const int scoreComps = std::min(nComponents, 3);
-        if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                otherMean[c] = 0;
-            }
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
-                   // take nearest pixel in other image (more chance to get a track than with black)
-                    int otherx = x + j;
-                    int othery = y + i;
-                    otherx = std::max(_otherImg->getBounds().x1,std::min(otherx,_otherImg->getBounds().x2-1));
-                    othery = std::max(_otherImg->getBounds().y1,std::min(othery,_otherImg->getBounds().y2-1));
-                    const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
-                    for (int c = 0; c < scoreComps; ++c) {
-                        otherMean[c] += *weightPtr * otherPix[c];
-                    }
+        const int pw = _refRectPixel.x2 - _refRectPixel.x1;
+        const int ph = _refRectPixel.y2 - _refRectPixel.y1;
+        _packedStride = (pw + kPackWidth - 1) / kPackWidth * kPackWidth;
+        double refMean[3] = {0., 0., 0.};
+        if (scoreType == eTrackerZNCC) {
+            for (int p = 0; p < pw * ph; ++p) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    refMean[c] += _weightData[p] * _patternData[p * nComponents + c];
                 }
             }
             for (int c = 0; c < scoreComps; ++c) {
-                otherMean[c] /= _weightTotal;
+                refMean[c] /= _weightTotal;
             }
         }
-
-        // sliding pointers
-        long patternIdx = 0; // sliding index
-        const PIX *patternPtr = _patternData;
-        float *weightPtr = _weightData;
-
-        for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
-                const PIX * const refPix = patternPtr;
-
-                const float weight = *weightPtr;
-
-                // take nearest pixel in other image (more chance to get a track than with black)
-                int otherx = x + j;
-                int othery = y + i;
-                otherx = std::max(_otherImg->getBounds().x1,std::min(otherx,_otherImg->getBounds().x2-1));
-                othery = std::max(_otherImg->getBounds().y1,std::min(othery,_otherImg->getBounds().y2-1));
-                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
-
-                ///the search window & pattern window have been intersected to the reference image's bounds
-                assert(refPix && otherPix);
-                for (int c = 0; c < scoreComps; ++c) {
-                    switch (scoreTypeE) {
+        for (int c = 0; c < scoreComps; ++c) {
+            _packedA[c].assign((size_t)_packedStride * ph);
+            _packedB[c].assign((size_t)_packedStride * ph);
+            float *a = _packedA[c].data();
+            float *b = _packedB[c].data();
+            for (int i = 0; i < ph; ++i) {
+                for (int j = 0; j < pw; ++j) {
+                    const int p = i * pw + j;
+                    const float w = _weightData[p];
+                    const float r = (float)_patternData[p * nComponents + c];
+                    float *pa = &a[i * _packedStride + j];
+                    float *pb = &b[i * _packedStride + j];
+                    switch (scoreType) {
                         case eTrackerSSD:
                             // reference is squared in SSD, so is the weight
-                            score += weight * weight * aggregateSD(refPix[c], otherPix[c]);
+                            *pa = w * w;
+                            *pb = r;
                             break;
                         case eTrackerSAD:
-                            score += weight * aggregateAD(refPix[c], otherPix[c]);
+                            *pa = w;
+                            *pb = r;
                             break;
                         case eTrackerNCC:
-                            score += weight * aggregateCC(refPix[c], otherPix[c]);
-                            otherSsq -= weight * aggregateCC(otherPix[c], otherPix[c]);
+                            *pa = w * r;
+                            *pb = w;
                             break;
                         case eTrackerZNCC:
-                            score += weight * aggregateNCC(refPix[c], refMean[c], otherPix[c], otherMean[c]);
-                            otherSsq -= weight * aggregateNCC(otherPix[c], otherMean[c], otherPix[c], otherMean[c]);
+                            *pa = (float)(w * (r - refMean[c]));
+                            *pb = w;
                             break;
                     }
                 }
             }
         }
-        if (scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) {
-            double sdev = std::sqrt(otherSsq);
-            if (sdev != 0.) {
-                score /= sdev;
-            } else {
-                score = std::numeric_limits<double>::infinity();
+
+        // the other image, with the nearest pixel outside of its bounds (as in computeScoreGeneric()).
+        // For ZNCC, it is centered on the pattern mean, so that the sums of squares are computed on small
+        // values near a match (the score does not change, since the first coefficients of the pattern sum to zero).
+        _packedOtherRect.x1 = _renderWindow.x1 - 1 + _refRectPixel.x1;
+        _packedOtherRect.x2 = _renderWindow.x2 + 1 + _refRectPixel.x2 - 1;
+        _packedOtherRect.y1 = _renderWindow.y1 - 1 + _refRectPixel.y1;
+        _packedOtherRect.y2 = _renderWindow.y2 + 1 + _refRectPixel.y2 - 1;
+        const int ow = _packedOtherRect.x2 - _packedOtherRect.x1;
+        const int oh = _packedOtherRect.y2 - _packedOtherRect.y1;
+        // the kernels may read up to _packedStride values from the last candidate position in a row
+        _packedOtherStride = ow + _packedStride - pw;
+        for (int c = 0; c < scoreComps; ++c) {
+            _packedOther[c].assign((size_t)_packedOtherStride * oh, 0.f);
+        }
+        const OfxRectI otherBounds = _otherImg->getBounds();
+        for (int y = 0; y < oh; ++y) {
+            int othery = std::max(otherBounds.y1, std::min(_packedOtherRect.y1 + y, otherBounds.y2 - 1));
+            for (int x = 0; x < ow; ++x) {
+                int otherx = std::max(otherBounds.x1, std::min(_packedOtherRect.x1 + x, otherBounds.x2 - 1));
+                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                for (int c = 0; c < scoreComps; ++c) {
+                    _packedOther[c][(size_t)y * _packedOtherStride + x] = (float)(otherPix[c] - refMean[c]);
+                }
             }
         }
-        return score;
+        _kernel = getPatternKernel<scoreType>(gTrackerKernel);
     }
 
-    template<enum TrackerScoreEnum scoreTypeE>
-    void multiThreadProcessImagesForScore(const OfxRectI& procWindow)
+    virtual void processCoarseToFine(int nLevels)
     {
-        assert(_patternImg.get() && _patternData && _weightImg.get() && _weightData && _otherImg && _weightTotal > 0.);
-        assert(scoreType == scoreTypeE);
-        double bestScore = std::numeric_limits<double>::infinity();
-        OfxPointI point;
-        point.x = -1;
-        point.y = -1;
-
-        ///For every pixel in the sub window of the search area we find the pixel
-        ///that minimize the sum of squared differences between the pattern in the ref image
-        ///and the pattern in the other image.
-
-        const int scoreComps = std::min(nComponents,3);
-        double refMean[3];
-        if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                refMean[c] = 0;
+        const OfxRectI searchWindow = _renderWindow;
+        // reduce the number of levels so that the pattern is not too small at the coarsest level
+        int nCoarseLevels = 0;
+        {
+            int w = _refRectPixel.x2 - _refRectPixel.x1;
+            int h = _refRectPixel.y2 - _refRectPixel.y1;
+            while (nCoarseLevels + 1 < nLevels && w / 2 >= kPyramidMinPatternSize && h / 2 >= kPyramidMinPatternSize) {
+                ++nCoarseLevels;
+                w /= 2;
+                h /= 2;
             }
         }
-        if (scoreTypeE == eTrackerZNCC) {
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
-                    const PIX *refPix = patternPtr;
+        if (nCoarseLevels == 0) {
+            _level = 0;
+            processWindow();
+
+            return;
+        }
+        buildPyramid(searchWindow, nCoarseLevels);
+
+        // exhaustive search at the coarsest level, local search at the finer levels
+        OfxRectI window = _pyramid[nCoarseLevels].searchWindow;
+        for (_level = nCoarseLevels; _level >= 0; --_level) {
+            _bestMatch.second = std::numeric_limits<double>::infinity();
+            setRenderWindow(window);
+            processWindow();
+            if (_effect.abort()) {
+                break;
+            }
+            if (_bestMatch.second == std::numeric_limits<double>::infinity()) {
+                // no valid score at this level (e.g. uniform image with NCC): fall back to the exhaustive search
+                _level = 0;
+                setRenderWindow(searchWindow);
+                processWindow();
+                break;
+            }
+            if (_level > 0) {
+                const OfxRectI& finerWindow = (_level == 1) ? searchWindow : _pyramid[_level - 1].searchWindow;
+                int x = (int)_bestMatch.first.x * 2;
+                int y = (int)_bestMatch.first.y * 2;
+                window.x1 = std::max(finerWindow.x1, x - kPyramidRefineRadius);
+                window.x2 = std::min(finerWindow.x2, x + kPyramidRefineRadius + 1);
+                window.y1 = std::max(finerWindow.y1, y - kPyramidRefineRadius);
+                window.y2 = std::min(finerWindow.y2, y + kPyramidRefineRadius + 1);
+                if (window.x2 <= window.x1 || window.y2 <= window.y1) {
+                    window = finerWindow;
+                }
+            }
+        }
+        _level = 0;
+        _pyramid.clear();
+    }
+
+    /** @brief build the levels 1..nCoarseLevels of the pyramid (level 0 is the full-resolution data, used to build level 1). */
+    void buildPyramid(const OfxRectI& searchWindow, int nCoarseLevels)
+    {
+        _pyramid.resize(nCoarseLevels + 1);
+
+        // level 0: copy the pattern and the part of the other image used by the search
+        PyramidLevel& l0 = _pyramid[0];
+        l0.patternRect = _refRectPixel;
+        size_t nPix = (size_t)(_refRectPixel.x2 - _refRectPixel.x1) * (_refRectPixel.y2 - _refRectPixel.y1);
+        l0.pattern.assign(_patternData, _patternData + nPix * nComponents);
+        l0.weight.assign(_weightData, _weightData + nPix);
+        l0.weightTotal = _weightTotal;
+        l0.searchWindow = searchWindow;
+        OfxRectI used;
+        used.x1 = searchWindow.x1 + _refRectPixel.x1;
+        used.x2 = searchWindow.x2 + _refRectPixel.x2 - 1;
+        used.y1 = searchWindow.y1 + _refRectPixel.y1;
+        used.y2 = searchWindow.y2 + _refRectPixel.y2 - 1;
+        if (!OFX::Coords::rectIntersection(used, _otherImg->getBounds(), &l0.otherBounds)) {
+            // the search area is outside of the image: the nearest pixels will be used
+            l0.otherBounds = used;
+        }
+        const OfxRectI& ob = l0.otherBounds;
+        l0.other.resize((size_t)(ob.x2 - ob.x1) * (ob.y2 - ob.y1) * nComponents);
+        float *otherPtr = &l0.other[0];
+        for (int y = ob.y1; y < ob.y2; ++y) {
+            for (int x = ob.x1; x < ob.x2; ++x, otherPtr += nComponents) {
+                int otherx = std::max(_otherImg->getBounds().x1, std::min(x, _otherImg->getBounds().x2 - 1));
+                int othery = std::max(_otherImg->getBounds().y1, std::min(y, _otherImg->getBounds().y2 - 1));
+                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                for (int c = 0; c < nComponents; ++c) {
+                    otherPtr[c] = otherPix[c];
+                }
+            }
+        }
+
+        for (int l = 1; l <= nCoarseLevels; ++l) {
+            downscaleLevel(_pyramid[l - 1], &_pyramid[l]);
+            // the finer level is not needed anymore (level 0 is never searched using the pyramid)
+            std::vector<float>().swap(_pyramid[l - 1].pattern);
+            std::vector<float>().swap(_pyramid[l - 1].weight);
+            std::vector<float>().swap(_pyramid[l - 1].other);
+        }
+    }
+
+    /** @brief Gaussian filtering and decimation by a factor 2 of a pyramid level */
+    static void downscaleLevel(const PyramidLevel& src, PyramidLevel* dst)
+    {
+        const int scoreComps = std::min(nComponents, 3);
+
+        // pattern: the weights are filtered, and the pattern is the weighted average (pixels outside of the pattern have a zero weight)
+        dst->patternRect = downscaleRect(src.patternRect);
+        const OfxRectI& sp = src.patternRect;
+        const OfxRectI& dp = dst->patternRect;
+        const int spw = sp.x2 - sp.x1;
+        size_t nPix = (size_t)(dp.x2 - dp.x1) * (dp.y2 - dp.y1);
+        dst->pattern.assign(nPix * nComponents, 0.f);
+        dst->weight.assign(nPix, 0.f);
+        dst->weightTotal = 0.;
+        float *patternPtr = &dst->pattern[0];
+        float *weightPtr = &dst->weight[0];
+        for (int i = dp.y1; i < dp.y2; ++i) {
+            for (int j = dp.x1; j < dp.x2; ++j, ++weightPtr, patternPtr += nComponents) {
+                double sum[nComponents];
+                std::fill(sum, sum + nComponents, 0.);
+                double sumw = 0.;
+                for (int m = -2; m <= 2; ++m) {
+                    int si = 2 * i + m;
+                    if (si < sp.y1 || sp.y2 <= si) {
+                        continue;
+                    }
+                    for (int k = -2; k <= 2; ++k) {
+                        int sj = 2 * j + k;
+                        if (sj < sp.x1 || sp.x2 <= sj) {
+                            continue;
+                        }
+                        size_t idx = (size_t)(si - sp.y1) * spw + (sj - sp.x1);
+                        double w = kPyramidFilter[m + 2] * kPyramidFilter[k + 2] * src.weight[idx];
+                        for (int c = 0; c < nComponents; ++c) {
+                            sum[c] += w * src.pattern[idx * nComponents + c];
+                        }
+                        sumw += w;
+                    }
+                }
+                *weightPtr = (float)sumw;
+                if (sumw > 0.) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        patternPtr[c] = (float)(sum[c] / sumw);
+                    }
+                }
+                dst->weightTotal += sumw;
+            }
+        }
+        std::fill(dst->patternMean, dst->patternMean + 3, 0.);
+        if (dst->weightTotal > 0.) {
+            for (size_t p = 0; p < nPix; ++p) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    dst->patternMean[c] += dst->weight[p] * dst->pattern[p * nComponents + c];
+                }
+            }
+            for (int c = 0; c < scoreComps; ++c) {
+                dst->patternMean[c] /= dst->weightTotal;
+            }
+        }
+
+        // other image: pixels outside of the bounds are the nearest pixels, as in computeScore()
+        dst->otherBounds = downscaleRect(src.otherBounds);
+        const OfxRectI& db = dst->otherBounds;
+        dst->other.resize((size_t)(db.x2 - db.x1) * (db.y2 - db.y1) * nComponents);
+        float *otherPtr = &dst->other[0];
+        for (int y = db.y1; y < db.y2; ++y) {
+            for (int x = db.x1; x < db.x2; ++x, otherPtr += nComponents) {
+                double sum[nComponents];
+                std::fill(sum, sum + nComponents, 0.);
+                for (int m = -2; m <= 2; ++m) {
+                    for (int k = -2; k <= 2; ++k) {
+                        const float *srcPix = src.getOtherPixel(2 * x + k, 2 * y + m);
+                        double w = kPyramidFilter[m + 2] * kPyramidFilter[k + 2];
+                        for (int c = 0; c < nComponents; ++c) {
+                            sum[c] += w * srcPix[c];
+                        }
+                    }
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    otherPtr[c] = (float)sum[c];
+                }
+            }
+        }
+
+        dst->searchWindow = downscaleRect(src.searchWindow);
+    }
+
+    /** @brief same as computeScore(), but on a coarse level of the pyramid */
+    template<enum TrackerScoreEnum scoreTypeE>
+    double computeLevelScore(const PyramidLevel& level, int x, int y)
+    {
+        double score = 0;
+        double otherSsq = 0.;
+        double otherMean[3];
+        const int scoreComps = std::min(nComponents, 3);
+        const OfxRectI& pr = level.patternRect;
+        if (scoreTypeE == eTrackerZNCC) {
+            std::fill(otherMean, otherMean + 3, 0.);
+            const float *weightPtr = &level.weight[0];
+            for (int i = pr.y1; i < pr.y2; ++i) {
+                for (int j = pr.x1; j < pr.x2; ++j, ++weightPtr) {
+                    const float *otherPix = level.getOtherPixel(x + j, y + i);
                     for (int c = 0; c < scoreComps; ++c) {
-                        refMean[c] += *weightPtr * refPix[c];
+                        otherMean[c] += *weightPtr * otherPix[c];
                     }
                 }
             }
             for (int c = 0; c < scoreComps; ++c) {
-                refMean[c] /= _weightTotal;
+                otherMean[c] /= level.weightTotal;
             }
         }
 
-        ///we're not interested in the alpha channel for RGBA images
+        const float *patternPtr = &level.pattern[0];
+        const float *weightPtr = &level.weight[0];
+        for (int i = pr.y1; i < pr.y2; ++i) {
+            for (int j = pr.x1; j < pr.x2; ++j, ++weightPtr, patternPtr += nComponents) {
+                const float weight = *weightPtr;
+                const float *otherPix = level.getOtherPixel(x + j, y + i);
+                for (int c = 0; c < scoreComps; ++c) {
+                    double refv = patternPtr[c];
+                    double otherv = otherPix[c];
+                    switch (scoreTypeE) {
+                        case eTrackerSSD:
+                            score += weight * weight * (refv - otherv) * (refv - otherv);
+                            break;
+                        case eTrackerSAD:
+                            score += weight * std::abs(refv - otherv);
+                            break;
+                        case eTrackerNCC:
+                            score -= weight * refv * otherv;
+                            otherSsq += weight * otherv * otherv;
+                            break;
+                        case eTrackerZNCC:
+                            score -= weight * (refv - level.patternMean[c]) * (otherv - otherMean[c]);
+                            otherSsq += weight * (otherv - otherMean[c]) * (otherv - otherMean[c]);
+                            break;
+                    }
+                }
+            }
+        }
+        if (scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) {
+            // the values are centered on their exact mean: the energy is the variance itself
+            if (!trackerVarianceIsZero(otherSsq, otherSsq)) {
+                score /= std::sqrt(otherSsq);
+            } else {
+                score = std::numeric_limits<double>::infinity();
+            }
+        }
+        return score;
+    }
+
+    /** @brief integer-pixel search on a coarse level of the pyramid */
+    template<enum TrackerScoreEnum scoreTypeE>
+    void multiThreadProcessLevelForScore(const OfxRectI& procWindow)
+    {
+        const PyramidLevel& level = _pyramid[_level];
+        double bestScore = std::numeric_limits<double>::infinity();
+        OfxPointI point;
+        point.x = -1;
+        point.y = -1;
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
-            
             for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                double score = computeScore<scoreTypeE>(x, y, refMean);
+                double score = computeLevelScore<scoreTypeE>(level, x, y);
                 if (score < bestScore) {
                     bestScore = score;
                     point.x = x;
@@ -429,105 +1155,562 @@ private:
                 }
             }
         }
-        
-        // do the subpixel refinement, only if the score is a possible winner
-        // TODO: only do this for the best match
-        double dx = 0.;
-        double dy = 0.;
+        OFX::MultiThread::AutoMutex lock(_bestMatchMutex);
+        if (_bestMatch.second > bestScore) {
+            _bestMatch.second = bestScore;
+            _bestMatch.first.x = point.x;
+            _bestMatch.first.y = point.y;
+        }
+    }
 
-        _bestMatchMutex.lock();
-        if (_bestMatch.second < bestScore) {
-            _bestMatchMutex.unlock();
+    virtual bool processFFT()
+    {
+        if (scoreType == eTrackerSAD) {
+            return false;
+        }
+        assert(_patternImg.get() && _patternData && _weightImg.get() && _weightData && _otherImg && _weightTotal > 0.);
+        const int scoreComps = std::min(nComponents, 3);
+        const OfxRectI searchWindow = _renderWindow;
+        const OfxRectI& pr = _refRectPixel;
+        const int sw = searchWindow.x2 - searchWindow.x1;
+        const int sh = searchWindow.y2 - searchWindow.y1;
+        const int pw = pr.x2 - pr.x1;
+        const int ph = pr.y2 - pr.y1;
+        if (sw <= 0 || sh <= 0 || pw <= 0 || ph <= 0) {
+            return false;
+        }
+
+        // the part of the other image used by the search: candidate (x,y) and pattern pixel (j,i) give
+        // region pixel (x - searchWindow.x1 + j - pr.x1, y - searchWindow.y1 + i - pr.y1)
+        const int rw = sw + pw - 1;
+        const int rh = sh + ph - 1;
+        const size_t fw = nextPowerOfTwo(rw);
+        const size_t fh = nextPowerOfTwo(rh);
+        const size_t fSize = fw * fh;
+        std::vector<double> region((size_t)rw * rh * scoreComps);
+        for (int ry = 0; ry < rh; ++ry) {
+            for (int rx = 0; rx < rw; ++rx) {
+                // take nearest pixel in other image (more chance to get a track than with black)
+                int otherx = searchWindow.x1 + pr.x1 + rx;
+                int othery = searchWindow.y1 + pr.y1 + ry;
+                otherx = std::max(_otherImg->getBounds().x1, std::min(otherx, _otherImg->getBounds().x2 - 1));
+                othery = std::max(_otherImg->getBounds().y1, std::min(othery, _otherImg->getBounds().y2 - 1));
+                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                for (int c = 0; c < scoreComps; ++c) {
+                    region[((size_t)ry * rw + rx) * scoreComps + c] = otherPix[c];
+                }
+            }
+        }
+        if (_effect.abort()) {
+            return true;
+        }
+
+        double refMean[3] = {0., 0., 0.};
+        if (scoreType == eTrackerZNCC) {
+            for (int p = 0; p < pw * ph; ++p) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    refMean[c] += _weightData[p] * _patternData[p * nComponents + c];
+                }
+            }
+            for (int c = 0; c < scoreComps; ++c) {
+                refMean[c] /= _weightTotal;
+            }
+        }
+        bool uniformWeight = true;
+        double refSsq = 0.; // sum of w^2.ref^2, for SSD
+        for (int p = 0; p < pw * ph; ++p) {
+            uniformWeight = uniformWeight && (_weightData[p] == 1.f);
+            for (int c = 0; c < scoreComps; ++c) {
+                double r = _patternData[p * nComponents + c];
+                refSsq += (double)_weightData[p] * _weightData[p] * r * r;
+            }
+        }
+
+        // cross[s] = sum over the pattern of kernel.other, with kernel = w^2.ref (SSD), w.ref (NCC), w.(ref-refMean) (ZNCC)
+        std::vector<std::complex<double> > crossF(fSize, 0.);
+        std::vector<std::complex<double> > otherF(fSize);
+        std::vector<std::complex<double> > kernelF(fSize);
+        for (int c = 0; c < scoreComps; ++c) {
+            std::fill(otherF.begin(), otherF.end(), std::complex<double>(0.));
+            for (int ry = 0; ry < rh; ++ry) {
+                for (int rx = 0; rx < rw; ++rx) {
+                    otherF[ry * fw + rx] = region[((size_t)ry * rw + rx) * scoreComps + c];
+                }
+            }
+            std::fill(kernelF.begin(), kernelF.end(), std::complex<double>(0.));
+            for (int i = 0; i < ph; ++i) {
+                for (int j = 0; j < pw; ++j) {
+                    int p = i * pw + j;
+                    double w = _weightData[p];
+                    double r = _patternData[p * nComponents + c];
+                    kernelF[i * fw + j] = (scoreType == eTrackerSSD) ? (w * w * r) : (scoreType == eTrackerNCC) ? (w * r) : (w * (r - refMean[c]));
+                }
+            }
+            fft2D(otherF, fw, fh, false);
+            fft2D(kernelF, fw, fh, false);
+            for (size_t k = 0; k < fSize; ++k) {
+                crossF[k] += std::conj(kernelF[k]) * otherF[k];
+            }
+            if (_effect.abort()) {
+                return true;
+            }
+        }
+        fft2D(crossF, fw, fh, true);
+
+        // local sums of the other image over the pattern: sum of w'.other^2 over all components
+        // (w' = w^2 for SSD, w else), and sum of w.other for each component (ZNCC).
+        std::vector<double> otherSsq((size_t)sw * sh);
+        std::vector<double> otherSum[3];
+        if (uniformWeight) {
+            std::vector<double> tmp((size_t)rw * rh);
+            std::vector<double> sat;
+            for (size_t k = 0; k < tmp.size(); ++k) {
+                double sq = 0.;
+                for (int c = 0; c < scoreComps; ++c) {
+                    sq += region[k * scoreComps + c] * region[k * scoreComps + c];
+                }
+                tmp[k] = sq;
+            }
+            summedAreaTable(tmp, rw, rh, &sat);
+            for (int y = 0; y < sh; ++y) {
+                for (int x = 0; x < sw; ++x) {
+                    otherSsq[(size_t)y * sw + x] = summedAreaTableSum(sat, rw, x, y, x + pw, y + ph);
+                }
+            }
+            if (scoreType == eTrackerZNCC) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    for (size_t k = 0; k < tmp.size(); ++k) {
+                        tmp[k] = region[k * scoreComps + c];
+                    }
+                    summedAreaTable(tmp, rw, rh, &sat);
+                    otherSum[c].resize((size_t)sw * sh);
+                    for (int y = 0; y < sh; ++y) {
+                        for (int x = 0; x < sw; ++x) {
+                            otherSum[c][(size_t)y * sw + x] = summedAreaTableSum(sat, rw, x, y, x + pw, y + ph);
+                        }
+                    }
+                }
+            }
         } else {
-            // don't block other threads
-            _bestMatchMutex.unlock();
-            // compute subpixel position.
-            double scorepc = computeScore<scoreTypeE>(point.x - 1, point.y, refMean);
-            double scorenc = computeScore<scoreTypeE>(point.x + 1, point.y, refMean);
-            if (bestScore < scorepc && bestScore <= scorenc) {
-                // don't simplify the denominator in the following expression,
-                // 2*bestScore - scorenc - scorepc may cause an underflow.
-                double factor = 1./((bestScore - scorenc) + (bestScore - scorepc));
-                if (factor != 0.) {
-                    dx = 0.5 * (scorenc - scorepc) * factor;
-                    assert(-0.5 < dx && dx <= 0.5);
+            // weighted sums are correlations with the weights
+            std::vector<std::complex<double> > &weightF = kernelF;
+            std::fill(weightF.begin(), weightF.end(), std::complex<double>(0.));
+            for (int i = 0; i < ph; ++i) {
+                for (int j = 0; j < pw; ++j) {
+                    double w = _weightData[i * pw + j];
+                    weightF[i * fw + j] = (scoreType == eTrackerSSD) ? (w * w) : w;
                 }
             }
-            double scorecp = computeScore<scoreTypeE>(point.x, point.y - 1, refMean);
-            double scorecn = computeScore<scoreTypeE>(point.x, point.y + 1, refMean);
-            if (bestScore < scorecp && bestScore <= scorecn) {
-                // don't simplify the denominator in the following expression,
-                // 2*bestScore - scorenc - scorepc may cause an underflow.
-                double factor = 1./((bestScore - scorecn) + (bestScore - scorecp));
-                if (factor != 0.) {
-                    dy = 0.5 * (scorecn - scorecp) /((bestScore - scorecn) + (bestScore - scorecp));
-                    assert(-0.5 < dy && dy <= 0.5);
+            fft2D(weightF, fw, fh, false);
+            std::fill(otherF.begin(), otherF.end(), std::complex<double>(0.));
+            for (int ry = 0; ry < rh; ++ry) {
+                for (int rx = 0; rx < rw; ++rx) {
+                    double sq = 0.;
+                    for (int c = 0; c < scoreComps; ++c) {
+                        double v = region[((size_t)ry * rw + rx) * scoreComps + c];
+                        sq += v * v;
+                    }
+                    otherF[ry * fw + rx] = sq;
                 }
             }
-            // check again...
-            {
-                OFX::MultiThread::AutoMutex lock(_bestMatchMutex);
-                if (_bestMatch.second > bestScore) {
-                    _bestMatch.second = bestScore;
-                    _bestMatch.first.x = point.x + dx;
-                    _bestMatch.first.y = point.y + dy;
+            fft2D(otherF, fw, fh, false);
+            for (size_t k = 0; k < fSize; ++k) {
+                otherF[k] *= std::conj(weightF[k]);
+            }
+            fft2D(otherF, fw, fh, true);
+            for (int y = 0; y < sh; ++y) {
+                for (int x = 0; x < sw; ++x) {
+                    otherSsq[(size_t)y * sw + x] = otherF[y * fw + x].real();
+                }
+            }
+            if (scoreType == eTrackerZNCC) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    std::fill(otherF.begin(), otherF.end(), std::complex<double>(0.));
+                    for (int ry = 0; ry < rh; ++ry) {
+                        for (int rx = 0; rx < rw; ++rx) {
+                            otherF[ry * fw + rx] = region[((size_t)ry * rw + rx) * scoreComps + c];
+                        }
+                    }
+                    fft2D(otherF, fw, fh, false);
+                    for (size_t k = 0; k < fSize; ++k) {
+                        otherF[k] *= std::conj(weightF[k]);
+                    }
+                    fft2D(otherF, fw, fh, true);
+                    otherSum[c].resize((size_t)sw * sh);
+                    for (int y = 0; y < sh; ++y) {
+                        for (int x = 0; x < sw; ++x) {
+                            otherSum[c][(size_t)y * sw + x] = otherF[y * fw + x].real();
+                        }
+                    }
                 }
             }
+        }
+        if (_effect.abort()) {
+            return true;
+        }
 
+        // find the best integer position
+        double bestScore = std::numeric_limits<double>::infinity();
+        OfxPointI point;
+        point.x = -1;
+        point.y = -1;
+        for (int y = 0; y < sh; ++y) {
+            for (int x = 0; x < sw; ++x) {
+                const size_t k = (size_t)y * sw + x;
+                const double cross = crossF[y * fw + x].real();
+                double score;
+                if (scoreType == eTrackerSSD) {
+                    score = refSsq + otherSsq[k] - 2 * cross;
+                } else {
+                    double ssq = otherSsq[k];
+                    if (scoreType == eTrackerZNCC) {
+                        for (int c = 0; c < scoreComps; ++c) {
+                            ssq -= otherSum[c][k] * otherSum[c][k] / _weightTotal;
+                        }
+                    }
+                    // the FFT is not exact: its rounding errors are relative to the energy of the
+                    // uncentered values, from which the variance is computed
+                    if (!trackerVarianceIsZero(ssq, otherSsq[k])) {
+                        score = -cross / std::sqrt(ssq);
+                    } else {
+                        score = std::numeric_limits<double>::infinity();
+                    }
+                }
+                if (score < bestScore) {
+                    bestScore = score;
+                    point.x = searchWindow.x1 + x;
+                    point.y = searchWindow.y1 + y;
+                }
+            }
+        }
+        if (bestScore == std::numeric_limits<double>::infinity()) {
+            return true;
         }
-    }
 
-    double aggregateSD(PIX refPix, PIX otherPix)
-    {
-        double d = (double)refPix - otherPix;
-        return d * d;
-    }
+        // the subpixel refinement uses the direct computation of the score, as in the exhaustive search
+        double dx, dy;
+        bestScore = refineSubpixel<scoreType>(point, refMean, &dx, &dy);
+        _bestMatch.second = bestScore;
+        _bestMatch.first.x = point.x + dx;
+        _bestMatch.first.y = point.y + dy;
 
-    double aggregateAD(PIX refPix, PIX otherPix)
-    {
-        return std::abs((double)refPix - otherPix);
+        return true;
     }
 
-    double aggregateCC(PIX refPix, PIX otherPix)
+    /** @brief compute the scores around an integer position and the subpixel position of the minimum. Returns the score at point. */
+    template<enum TrackerScoreEnum scoreTypeE>
+    double refineSubpixel(const OfxPointI& point, const double refMean[3], double *dx, double *dy)
     {
-        return - (double)refPix * otherPix;
-    }
+        double s[3][3];
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                s[i][j] = computeScore<scoreTypeE>(point.x + j - 1, point.y + i - 1, refMean);
+            }
+        }
+        subpixelMinimum(s, dx, dy);
 
-    double aggregateNCC(PIX refPix, double refMean, PIX otherPix, double otherMean)
-    {
-        return - (refPix - refMean) * (otherPix - otherMean);
+        return s[1][1];
     }
-};
-
 
-void
-TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
-{
-    if (!_srcClip) {
-        return;
+    void multiThreadProcessImages(OfxRectI procWindow) {
+        switch (scoreType) {
+            case eTrackerSSD:
+                return multiThreadProcessImagesForScore<eTrackerSSD>(procWindow);
+            case eTrackerSAD:
+                return multiThreadProcessImagesForScore<eTrackerSAD>(procWindow);
+            case eTrackerNCC:
+                return multiThreadProcessImagesForScore<eTrackerNCC>(procWindow);
+            case eTrackerZNCC:
+                return multiThreadProcessImagesForScore<eTrackerZNCC>(procWindow);
+        }
     }
-# ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
-    // Although the following property has been there since OFX 1.0,
-    // it's not in the HostSupport library.
-    getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
-#  endif
-    //double t1, t2;
-    // get the first and last times available on the effect's timeline
-    //timeLineGetBounds(t1, t2);
 
-    OfxTime t = args.first;
-    bool changeTime = (args.reason == eChangeUserEdit && t == timeLineGetTime());
-    std::string name;
-    _instanceName->getValueAtTime(t, name);
-    assert((args.forward && args.last >= args.first) || (!args.forward && args.last <= args.first));
-    bool showProgress = std::abs(args.last - args.first) > 1;
-    if (showProgress) {
-        progressStart(name);
+    /** @brief score at position (x,y), computed using the packed pattern if possible */
+    template<enum TrackerScoreEnum scoreTypeE>
+    double computeScore(int x, int y, const double refMean[3])
+    {
+        const int ox = x + _refRectPixel.x1 - _packedOtherRect.x1;
+        const int oy = y + _refRectPixel.y1 - _packedOtherRect.y1;
+        const int pw = _refRectPixel.x2 - _refRectPixel.x1;
+        const int ph = _refRectPixel.y2 - _refRectPixel.y1;
+        if (!_kernel || ox < 0 || oy < 0 ||
+            _packedOtherRect.x2 - _packedOtherRect.x1 < ox + pw || _packedOtherRect.y2 - _packedOtherRect.y1 < oy + ph) {
+            return computeScoreGeneric<scoreTypeE>(x, y, refMean);
+        }
+        const int scoreComps = std::min(nComponents, 3);
+        double score = 0.;
+        double otherSsq = 0.;
+        double otherSsqTotal = 0.;
+        for (int c = 0; c < scoreComps; ++c) {
+            const float *a = _packedA[c].data();
+            const float *b = _packedB[c].data();
+            const float *o = &_packedOther[c][(size_t)oy * _packedOtherStride + ox];
+            double sums[3] = {0., 0., 0.};
+            _kernel(a, b, o, pw, ph, _packedStride, _packedOtherStride, 0.f, sums);
+            if (scoreTypeE == eTrackerZNCC) {
+                const double otherMean = sums[1] / _weightTotal;
+                if (otherMean * sums[1] > 0.5 * sums[2]) {
+                    // most of the energy is in the mean, and the one-pass variance would cancel:
+                    // compute it again on the values centered on their mean (two-pass variance)
+                    const double cross = sums[0];
+                    sums[0] = sums[1] = sums[2] = 0.;
+                    _kernel(a, b, o, pw, ph, _packedStride, _packedOtherStride, (float)otherMean, sums);
+                    sums[0] = cross;
+                }
+            }
+            switch (scoreTypeE) {
+                case eTrackerSSD:
+                case eTrackerSAD:
+                    score += sums[0];
+                    break;
+                case eTrackerNCC:
+                    score -= sums[0];
+                    otherSsq += sums[2];
+                    otherSsqTotal += sums[2];
+                    break;
+                case eTrackerZNCC:
+                    score -= sums[0];
+                    otherSsq += sums[2] - sums[1] * sums[1] / _weightTotal;
+                    // the energy of the values the variance was computed from (centered if it was recomputed)
+                    otherSsqTotal += sums[2];
+                    break;
+            }
+        }
+        if (scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) {
+            if (!trackerVarianceIsZero(otherSsq, otherSsqTotal)) {
+                score /= std::sqrt(otherSsq);
+            } else {
+                score = std::numeric_limits<double>::infinity();
+            }
+        }
+
+        return score;
     }
 
-    while (args.forward ? (t <= args.last) : (t >= args.last)) {
-        OfxTime other = args.forward ? (t + 1) : (t - 1);
-        
+    /** @brief score at position (x,y), computed directly from the pattern and the other image */
+    template<enum TrackerScoreEnum scoreTypeE>
+    double computeScoreGeneric(int x, int y, const double refMean[3])
+    {
+        double score = 0;
+        double otherSsq = 0.;
+        double otherMean[3];
+        const int scoreComps = std::min(nComponents, 3);
+        if (scoreTypeE == eTrackerZNCC) {
+            for (int c = 0; c < 3; ++c) {
+                otherMean[c] = 0;
+            }
+            // sliding pointers
+            long patternIdx = 0; // sliding index
+            const PIX *patternPtr = _patternData;
+            float *weightPtr = _weightData;
+            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
+                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
+                    assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
+                   // take nearest pixel in other image (more chance to get a track than with black)
+                    int otherx = x + j;
+                    int othery = y + i;
+                    otherx = std::max(_otherImg->getBounds().x1,std::min(otherx,_otherImg->getBounds().x2-1));
+                    othery = std::max(_otherImg->getBounds().y1,std::min(othery,_otherImg->getBounds().y2-1));
+                    const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                    for (int c = 0; c < scoreComps; ++c) {
+                        otherMean[c] += *weightPtr * otherPix[c];
+                    }
+                }
+            }
+            for (int c = 0; c < scoreComps; ++c) {
+                otherMean[c] /= _weightTotal;
+            }
+        }
+
+        // sliding pointers
+        long patternIdx = 0; // sliding index
+        const PIX *patternPtr = _patternData;
+        float *weightPtr = _weightData;
+
+        for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
+            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
+                assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
+                const PIX * const refPix = patternPtr;
+
+                const float weight = *weightPtr;
+
+                // take nearest pixel in other image (more chance to get a track than with black)
+                int otherx = x + j;
+                int othery = y + i;
+                otherx = std::max(_otherImg->getBounds().x1,std::min(otherx,_otherImg->getBounds().x2-1));
+                othery = std::max(_otherImg->getBounds().y1,std::min(othery,_otherImg->getBounds().y2-1));
+                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+
+                ///the search window & pattern window have been intersected to the reference image's bounds
+                assert(refPix && otherPix);
+                for (int c = 0; c < scoreComps; ++c) {
+                    switch (scoreTypeE) {
+                        case eTrackerSSD:
+                            // reference is squared in SSD, so is the weight
+                            score += weight * weight * aggregateSD(refPix[c], otherPix[c]);
+                            break;
+                        case eTrackerSAD:
+                            score += weight * aggregateAD(refPix[c], otherPix[c]);
+                            break;
+                        case eTrackerNCC:
+                            score += weight * aggregateCC(refPix[c], otherPix[c]);
+                            otherSsq -= weight * aggregateCC(otherPix[c], otherPix[c]);
+                            break;
+                        case eTrackerZNCC:
+                            score += weight * aggregateNCC(refPix[c], refMean[c], otherPix[c], otherMean[c]);
+                            otherSsq -= weight * aggregateNCC(otherPix[c], otherMean[c], otherPix[c], otherMean[c]);
+                            break;
+                    }
+                }
+            }
+        }
+        if (scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) {
+            // the values are centered on their exact mean: the energy is the variance itself
+            if (!trackerVarianceIsZero(otherSsq, otherSsq)) {
+                score /= std::sqrt(otherSsq);
+            } else {
+                score = std::numeric_limits<double>::infinity();
+            }
+        }
+        return score;
+    }
+
+    template<enum TrackerScoreEnum scoreTypeE>
+    void multiThreadProcessImagesForScore(const OfxRectI& procWindow)
+    {
+        assert(_patternImg.get() && _patternData && _weightImg.get() && _weightData && _otherImg && _weightTotal > 0.);
+        assert(scoreType == scoreTypeE);
+        if (_level > 0) {
+            return multiThreadProcessLevelForScore<scoreTypeE>(procWindow);
+        }
+        double bestScore = std::numeric_limits<double>::infinity();
+        OfxPointI point;
+        point.x = -1;
+        point.y = -1;
+
+        ///For every pixel in the sub window of the search area we find the pixel
+        ///that minimize the sum of squared differences between the pattern in the ref image
+        ///and the pattern in the other image.
+
+        const int scoreComps = std::min(nComponents,3);
+        double refMean[3];
+        if (scoreTypeE == eTrackerZNCC) {
+            for (int c = 0; c < 3; ++c) {
+                refMean[c] = 0;
+            }
+        }
+        if (scoreTypeE == eTrackerZNCC) {
+            // sliding pointers
+            long patternIdx = 0; // sliding index
+            const PIX *patternPtr = _patternData;
+            float *weightPtr = _weightData;
+            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
+                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
+                    assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
+                    const PIX *refPix = patternPtr;
+                    for (int c = 0; c < scoreComps; ++c) {
+                        refMean[c] += *weightPtr * refPix[c];
+                    }
+                }
+            }
+            for (int c = 0; c < scoreComps; ++c) {
+                refMean[c] /= _weightTotal;
+            }
+        }
+
+        ///we're not interested in the alpha channel for RGBA images
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+            
+            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                double score = computeScore<scoreTypeE>(x, y, refMean);
+                if (score < bestScore) {
+                    bestScore = score;
+                    point.x = x;
+                    point.y = y;
+                }
+            }
+        }
+        
+        // do the subpixel refinement, only if the score is a possible winner
+        // TODO: only do this for the best match
+        double dx = 0.;
+        double dy = 0.;
+
+        _bestMatchMutex.lock();
+        if (_bestMatch.second < bestScore) {
+            _bestMatchMutex.unlock();
+        } else {
+            // don't block other threads
+            _bestMatchMutex.unlock();
+            // compute subpixel position.
+            refineSubpixel<scoreTypeE>(point, refMean, &dx, &dy);
+            // check again...
+            {
+                OFX::MultiThread::AutoMutex lock(_bestMatchMutex);
+                if (_bestMatch.second > bestScore) {
+                    _bestMatch.second = bestScore;
+                    _bestMatch.first.x = point.x + dx;
+                    _bestMatch.first.y = point.y + dy;
+                }
+            }
+
+        }
+    }
+
+    double aggregateSD(PIX refPix, PIX otherPix)
+    {
+        double d = (double)refPix - otherPix;
+        return d * d;
+    }
+
+    double aggregateAD(PIX refPix, PIX otherPix)
+    {
+        return std::abs((double)refPix - otherPix);
+    }
+
+    double aggregateCC(PIX refPix, PIX otherPix)
+    {
+        return - (double)refPix * otherPix;
+    }
+
+    double aggregateNCC(PIX refPix, double refMean, PIX otherPix, double otherMean)
+    {
+        return - (refPix - refMean) * (otherPix - otherMean);
+    }
+};
+
+
+void
+TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
+{
+    if (!_srcClip) {
+        return;
+    }
+# ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
+    // Although the following property has been there since OFX 1.0,
+    // it's not in the HostSupport library.
+    getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
+#  endif
+    //double t1, t2;
+    // get the first and last times available on the effect's timeline
+    //timeLineGetBounds(t1, t2);
+
+    OfxTime t = args.first;
+    bool changeTime = (args.reason == eChangeUserEdit && t == timeLineGetTime());
+    std::string name;
+    _instanceName->getValueAtTime(t, name);
+    assert((args.forward && args.last >= args.first) || (!args.forward && args.last <= args.first));
+    bool showProgress = std::abs(args.last - args.first) > 1;
+    if (showProgress) {
+        progressStart(name);
+    }
+
+    while (args.forward ? (t <= args.last) : (t >= args.last)) {
+        OfxTime other = args.forward ? (t + 1) : (t - 1);
+        
         OFX::PixelComponentEnum srcComponents  = _srcClip->getPixelComponents();
         assert(srcComponents == OFX::ePixelComponentRGB || srcComponents == OFX::ePixelComponentRGBA ||
                srcComponents == OFX::ePixelComponentAlpha);
@@ -629,23 +1812,23 @@ getOtherBounds(const OfxPointD &refCenter, const OfxRectD& searchRect, OfxRectD
     }
 }
 
-/* set up and run a processor */
-void
-TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
-                                 OfxTime refTime,
-                                 const OfxRectD& refBounds,
-                                 const OfxPointD& refCenter,
-                                 const OfxPointD& refCenterWithOffset,
-                                 const OFX::Image* refImg,
-                                 const OFX::Image* maskImg,
-                                 OfxTime otherTime,
-                                 const OfxRectD& trackSearchBounds,
-                                 const OFX::Image* otherImg)
+/**
+ * @brief Track a pattern using the given processor.
+ * Returns false if the pattern cannot be tracked, else the position of the pattern center in the other image.
+ */
+static bool
+trackPattern(TrackerPMProcessorBase &processor,
+             TrackerSearchMethodEnum searchMethod,
+             int pyramidLevels,
+             double par,
+             const OfxRectD& refBounds,
+             const OfxPointD& refCenterWithOffset,
+             const OFX::Image* refImg,
+             const OFX::Image* maskImg,
+             const OfxRectD& trackSearchBounds,
+             const OFX::Image* otherImg,
+             OfxPointD *newCenterWithOffset)
 {
-    if (!_srcClip) {
-        return;
-    }
-    const double par = _srcClip->getPixelAspectRatio();
     const OfxPointD rsOne = {1., 1.};
     OfxRectI trackSearchBoundsPixel;
     OFX::Coords::toPixelEnclosing(trackSearchBounds, rsOne, par, &trackSearchBoundsPixel);
@@ -664,8 +1847,7 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
     bool intersect = OFX::Coords::rectIntersection(refRectPixel, refImg->getBounds(), &refRectPixel);
     
     if (!intersect) {
-        // can't track: erase any existing track
-        _center->deleteKeyAtTime(otherTime);
+        return false;
     }
     refRectPixel.x1 -= refCenterI.x;
     refRectPixel.x2 -= refCenterI.x;
@@ -678,54 +1860,83 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
     bool canProcess = processor.setValues(refImg, otherImg, maskImg, refRectPixel, refCenterI);
     
     if (!canProcess) {
-        // can't track: erase any existing track
-        _center->deleteKeyAtTime(otherTime);
+        return false;
+    }
+    if (searchMethod == eTrackerSearchCoarseToFine) {
+        processor.processCoarseToFine(pyramidLevels);
+    } else if (searchMethod == eTrackerSearchFFT && processor.processFFT()) {
+        // done
     } else {
         // Call the base class process member, this will call the derived templated process code
-        processor.process();
+        processor.processWindow();
+    }
 
-        //////////////////////////////////
-        // TODO: subpixel interpolation //
-        //////////////////////////////////
+    ///ok the score is now computed, update the center
+    if (processor.getBestScore() == std::numeric_limits<double>::infinity()) {
+        return false;
+    }
+    OfxPointD newCenterPixelSub;
+    const OfxPointD& bestMatch = processor.getBestMatch();
 
-        ///ok the score is now computed, update the center
-        if (processor.getBestScore() == std::numeric_limits<double>::infinity()) {
-            // can't track: erase any existing track
-            _center->deleteKeyAtTime(otherTime);
-        } else {
-            
-            // Offset the newCenter by the offset a thaat time
-            OfxPointD otherOffset;
-            _offset->getValueAtTime(otherTime, otherOffset.x, otherOffset.y);
-            
-            OfxPointD newCenterPixelSub;
-            OfxPointD newCenter;
-            const OfxPointD& bestMatch = processor.getBestMatch();
+    newCenterPixelSub.x = refCenterPixelSub.x + bestMatch.x - refCenterI.x;
+    newCenterPixelSub.y = refCenterPixelSub.y + bestMatch.y - refCenterI.y;
+    OFX::Coords::toCanonicalSub(newCenterPixelSub, rsOne, par, newCenterWithOffset);
 
-            newCenterPixelSub.x = refCenterPixelSub.x + bestMatch.x - refCenterI.x;
-            newCenterPixelSub.y = refCenterPixelSub.y + bestMatch.y - refCenterI.y;
-            OFX::Coords::toCanonicalSub(newCenterPixelSub, rsOne, par, &newCenter);
-            
-            //Commented-out for Natron compat: Natron does beginEditBlock in the main-thread, hence
-            //since the instanceChanged action is executed in multiple separated thread by Natron when tracking, there's no
-            //telling that the actual setting of the value will be done when the next frame is tracked
-            //beginEditBlock("trackerUpdate");
-            // create a keyframe at starting point
-            _center->setValueAtTime(refTime, refCenter.x, refCenter.y);
-            // create a keyframe at end point
-            _center->setValueAtTime(otherTime, newCenter.x - otherOffset.x, newCenter.y - otherOffset.y);
-           // endEditBlock();
-        }
-    }
+    return true;
 }
 
-template <class PIX, int nComponents, int maxValue>
+/* set up and run a processor */
 void
-TrackerPMPlugin::trackInternalForDepth(OfxTime refTime,
-                                       const OfxRectD& refBounds,
-                                       const OfxPointD& refCenter,
-                                       const OfxPointD& refCenterWithOffset,
-                                       const OFX::Image* refImg,
+TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
+                                 OfxTime refTime,
+                                 const OfxRectD& refBounds,
+                                 const OfxPointD& refCenter,
+                                 const OfxPointD& refCenterWithOffset,
+                                 const OFX::Image* refImg,
+                                 const OFX::Image* maskImg,
+                                 OfxTime otherTime,
+                                 const OfxRectD& trackSearchBounds,
+                                 const OFX::Image* otherImg)
+{
+    if (!_srcClip) {
+        return;
+    }
+    const double par = _srcClip->getPixelAspectRatio();
+    int searchMethodI;
+    _searchMethod->getValueAtTime(refTime, searchMethodI);
+    int pyramidLevels;
+    _pyramidLevels->getValueAtTime(refTime, pyramidLevels);
+
+    OfxPointD newCenter;
+    bool tracked = trackPattern(processor, (TrackerSearchMethodEnum)searchMethodI, pyramidLevels, par,
+                                refBounds, refCenterWithOffset, refImg, maskImg, trackSearchBounds, otherImg, &newCenter);
+    if (!tracked) {
+        // can't track: erase any existing track
+        _center->deleteKeyAtTime(otherTime);
+    } else {
+        // Offset the newCenter by the offset a thaat time
+        OfxPointD otherOffset;
+        _offset->getValueAtTime(otherTime, otherOffset.x, otherOffset.y);
+
+        //Commented-out for Natron compat: Natron does beginEditBlock in the main-thread, hence
+        //since the instanceChanged action is executed in multiple separated thread by Natron when tracking, there's no
+        //telling that the actual setting of the value will be done when the next frame is tracked
+        //beginEditBlock("trackerUpdate");
+        // create a keyframe at starting point
+        _center->setValueAtTime(refTime, refCenter.x, refCenter.y);
+        // create a keyframe at end point
+        _center->setValueAtTime(otherTime, newCenter.x - otherOffset.x, newCenter.y - otherOffset.y);
+       // endEditBlock();
+    }
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+TrackerPMPlugin::trackInternalForDepth(OfxTime refTime,
+                                       const OfxRectD& refBounds,
+                                       const OfxPointD& refCenter,
+                                       const OfxPointD& refCenterWithOffset,
+                                       const OFX::Image* refImg,
                                        const OFX::Image* maskImg,
                                        OfxTime otherTime,
                                        const OfxRectD& trackSearchBounds,
@@ -755,54 +1966,683 @@ TrackerPMPlugin::trackInternalForDepth(OfxTime refTime,
     }
 }
 
-
-// the internal render function
+
+// the internal render function
+template <int nComponents>
+void
+TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args)
+{
+    OfxRectD refRect;
+    _innerBtmLeft->getValueAtTime(refTime, refRect.x1, refRect.y1);
+    _innerTopRight->getValueAtTime(refTime, refRect.x2, refRect.y2);
+    OfxPointD refCenter;
+    _center->getValueAtTime(refTime, refCenter.x, refCenter.y);
+    OfxRectD searchRect;
+    _outerBtmLeft->getValueAtTime(refTime, searchRect.x1, searchRect.y1);
+    _outerTopRight->getValueAtTime(refTime, searchRect.x2, searchRect.y2);
+
+    OfxPointD offset;
+    _offset->getValueAtTime(refTime, offset.x, offset.y);
+    
+    OfxPointD refCenterWithOffset;
+    refCenterWithOffset.x = refCenter.x + offset.x;
+    refCenterWithOffset.y = refCenter.y + offset.y;
+    
+    OfxRectD refBounds;
+    getRefBounds(refRect, refCenterWithOffset, &refBounds);
+
+    OfxRectD otherBounds;
+    getOtherBounds(refCenterWithOffset, searchRect, &otherBounds);
+
+    std::auto_ptr<const OFX::Image> srcRef((_srcClip && _srcClip->isConnected()) ?
+                                           _srcClip->fetchImage(refTime, refBounds) : 0);
+    std::auto_ptr<const OFX::Image> srcOther((_srcClip && _srcClip->isConnected()) ?
+                                             _srcClip->fetchImage(otherTime, otherBounds) : 0);
+    if (!srcRef.get() || !srcOther.get()) {
+        return;
+    }
+    if (srcRef.get()) {
+        if (srcRef->getRenderScale().x != args.renderScale.x ||
+            srcRef->getRenderScale().y != args.renderScale.y) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+    if (srcOther.get()) {
+        if (srcOther->getRenderScale().x != args.renderScale.x ||
+            srcOther->getRenderScale().y != args.renderScale.y) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+    // renderScale should never be something else than 1 when called from ActionInstanceChanged
+    if ((srcRef->getPixelDepth() != srcOther->getPixelDepth()) ||
+        (srcRef->getPixelComponents() != srcOther->getPixelComponents()) ||
+        srcRef->getRenderScale().x != 1. || srcRef->getRenderScale().y != 1 ||
+        srcOther->getRenderScale().x != 1. || srcOther->getRenderScale().y != 1) {
+        OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+    }
+
+    OFX::BitDepthEnum srcBitDepth = srcRef->getPixelDepth();
+
+    //  mask cannot be black and transparent, so an empty mask means mask is disabled.
+    // auto ptr for the mask.
+    std::auto_ptr<const OFX::Image> mask((_maskClip && _maskClip->isConnected()) ?
+                                         _maskClip->fetchImage(refTime) : 0);
+    if (mask.get()) {
+        if (mask->getRenderScale().x != args.renderScale.x ||
+            mask->getRenderScale().y != args.renderScale.y) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+
+    OfxRectD trackSearchBounds;
+    getTrackSearchBounds(refRect, refCenterWithOffset, searchRect, &trackSearchBounds);
+
+    switch (srcBitDepth) {
+        case OFX::eBitDepthUByte: {
+            trackInternalForDepth<unsigned char, nComponents, 255>(refTime, refBounds, refCenter, refCenterWithOffset, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
+        }   break;
+        case OFX::eBitDepthUShort: {
+            trackInternalForDepth<unsigned short, nComponents, 65535>(refTime, refBounds, refCenter, refCenterWithOffset, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
+        }   break;
+        case OFX::eBitDepthFloat: {
+            trackInternalForDepth<float, nComponents, 1>(refTime, refBounds, refCenter, refCenterWithOffset, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
+        }   break;
+        default:
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+
+using namespace OFX;
+
+mDeclarePluginFactory(TrackerPMPluginFactory, {}, {});
+
+void TrackerPMPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
+{
+    // basic labels
+    desc.setLabel(kPluginName);
+    desc.setPluginGrouping(kPluginGrouping);
+    desc.setPluginDescription(kPluginDescription);
+
+    // description common to all trackers
+    genericTrackerDescribe(desc);
+
+    // add the additional supported contexts
+    desc.addSupportedContext(eContextPaint); // this tracker can be masked
+
+    // supported bit depths depend on the tracking algorithm.
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
+    desc.addSupportedBitDepth(eBitDepthFloat);
+
+    // single instance depends on the algorithm
+    desc.setSingleInstance(false);
+
+    // rendertwicealways must be set to true if the tracker cannot handle interlaced content (most don't)
+    desc.setRenderTwiceAlways(true);
+    desc.setRenderThreadSafety(kRenderThreadSafety);
+    desc.setOverlayInteractDescriptor(new TrackerRegionOverlayDescriptor);
+}
+
+/** @brief describe the parameters which are common to TrackerPM and TrackerPMMulti */
+static void
+trackerPMDescribeParameters(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, PageParamDescriptor* page)
+{
+    // innerBtmLeft
+    {
+        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingPatternBoxBtmLeft);
+        param->setLabel(kParamTrackingPatternBoxBtmLeftLabel);
+        param->setHint(kParamTrackingPatternBoxBtmLeftHint);
+        param->setDoubleType(eDoubleTypeXY);
+        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
+        param->setDefault(-15,-15);
+        param->setDisplayRange(-50., -50., 50., 50.);
+        param->setIncrement(1.);
+        //param->setIsSecret(true);
+        param->setEvaluateOnChange(false); // The tracker is identity always
+#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
+        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
+#     endif
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    
+    // innerTopRight
+    {
+        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingPatternBoxTopRight);
+        param->setLabel(kParamTrackingPatternBoxTopRightLabel);
+        param->setHint(kParamTrackingPatternBoxTopRightHint);
+        param->setDoubleType(eDoubleTypeXY);
+        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
+        param->setDefault(15, 15);
+        param->setDisplayRange(-50., -50., 50., 50.);
+        param->setIncrement(1.);
+        //innerTopRight->setIsSecret(true);
+        param->setEvaluateOnChange(false); // The tracker is identity always
+#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
+        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
+#     endif
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    
+    // outerBtmLeft
+    {
+        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingSearchBoxBtmLeft);
+        param->setLabel(kParamTrackingSearchBoxBtmLeftLabel);
+        param->setHint(kParamTrackingSearchBoxBtmLeftHint);
+        param->setDoubleType(eDoubleTypeXY);
+        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
+        param->setDefault(-25,-25);
+        param->setDisplayRange(-100., -100., 100., 100.);
+        param->setIncrement(1.);
+        //param->setIsSecret(true);
+        param->setEvaluateOnChange(false); // The tracker is identity always
+#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
+        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
+#     endif
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    
+    // outerTopRight
+    {
+        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingSearchBoxTopRight);
+        param->setLabel(kParamTrackingSearchBoxTopRightLabel);
+        param->setHint(kParamTrackingSearchBoxBtmLeftHint);
+        param->setDoubleType(eDoubleTypeXY);
+        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
+        param->setDefault(25, 25);
+        param->setDisplayRange(-100., -100., 100., 100.);
+        param->setIncrement(1.);
+        //param->setIsSecret(true);
+        param->setEvaluateOnChange(false); // The tracker is identity always
+#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
+        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
+#     endif
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+
+
+    // this tracker can be masked
+    if (context == eContextGeneral || (context == eContextPaint) || context == eContextTracker) {
+        ClipDescriptor *maskClip = (context == eContextPaint) ? desc.defineClip("Brush") : desc.defineClip("Mask");
+        maskClip->addSupportedComponent(ePixelComponentAlpha);
+        maskClip->setTemporalClipAccess(false);
+        if (context == eContextGeneral  || context == eContextTracker) {
+            maskClip->setOptional(true);
+        }
+        maskClip->setSupportsTiles(kSupportsTiles);
+        maskClip->setIsMask(true);
+    }
+
+    // score
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamScore);
+        param->setLabel(kParamScoreLabel);
+        param->setHint(kParamScoreHint);
+        assert(param->getNOptions() == eTrackerSSD);
+        param->appendOption(kParamScoreOptionSSD, kParamScoreOptionSSDHint);
+        assert(param->getNOptions() == eTrackerSAD);
+        param->appendOption(kParamScoreOptionSAD, kParamScoreOptionSADHint);
+        assert(param->getNOptions() == eTrackerNCC);
+        param->appendOption(kParamScoreOptionNCC, kParamScoreOptionNCCHint);
+        assert(param->getNOptions() == eTrackerZNCC);
+        param->appendOption(kParamScoreOptionZNCC, kParamScoreOptionZNCCHint);
+        param->setDefault((int)eTrackerSAD);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // searchMethod
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamSearchMethod);
+        param->setLabel(kParamSearchMethodLabel);
+        param->setHint(kParamSearchMethodHint);
+        assert(param->getNOptions() == eTrackerSearchExhaustive);
+        param->appendOption(kParamSearchMethodOptionExhaustive, kParamSearchMethodOptionExhaustiveHint);
+        assert(param->getNOptions() == eTrackerSearchCoarseToFine);
+        param->appendOption(kParamSearchMethodOptionCoarseToFine, kParamSearchMethodOptionCoarseToFineHint);
+        assert(param->getNOptions() == eTrackerSearchFFT);
+        param->appendOption(kParamSearchMethodOptionFFT, kParamSearchMethodOptionFFTHint);
+        param->setDefault((int)eTrackerSearchExhaustive);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // pyramidLevels
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamPyramidLevels);
+        param->setLabel(kParamPyramidLevelsLabel);
+        param->setHint(kParamPyramidLevelsHint);
+        param->setRange(2, 8);
+        param->setDisplayRange(2, 8);
+        param->setDefault(kParamPyramidLevelsDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+}
+
+void TrackerPMPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context)
+{
+    PageParamDescriptor* page = genericTrackerDescribeInContextBegin(desc, context);
+    
+    
+    // description common to all trackers
+    genericTrackerDescribePointParameters(desc, page);
+    // center
+    {
+        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingCenterPoint);
+        param->setLabel(kParamTrackingCenterPointLabel);
+        param->setHint(kParamTrackingCenterPointHint);
+        param->setInstanceSpecific(true);
+        param->setDoubleType(eDoubleTypeXYAbsolute);
+        param->setDefaultCoordinateSystem(eCoordinatesNormalised);
+        param->setDefault(0.5, 0.5);
+        param->setDisplayRange(-10000, -10000, 10000, 10000); // Resolve requires display range or values are clamped to (-1,1)
+        param->setIncrement(1.);
+        param->setEvaluateOnChange(false); // The tracker is identity always
+#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
+        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
+#     endif
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    
+    // offset
+    {
+        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingOffset);
+        param->setLabel(kParamTrackingOffsetLabel);
+        param->setHint(kParamTrackingOffsetHint);
+        param->setInstanceSpecific(true);
+        param->setDoubleType(eDoubleTypeXYAbsolute);
+        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
+        param->setDefault(0, 0);
+        param->setDisplayRange(-10000, -10000, 10000, 10000); // Resolve requires display range or values are clamped to (-1,1)
+        param->setIncrement(1.);
+        param->setEvaluateOnChange(false); // The tracker is identity always
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    
+    // parameters common to TrackerPM and TrackerPMMulti
+    trackerPMDescribeParameters(desc, context, page);
+}
+
+
+
+OFX::ImageEffect* TrackerPMPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
+{
+    return new TrackerPMPlugin(handle);
+}
+
+
+
+
+
+template <class PIX, int nComponents, int maxValue>
+static TrackerPMProcessorBase*
+createTrackerPMProcessor(OFX::ImageEffect &instance, TrackerScoreEnum score)
+{
+    switch (score) {
+        case eTrackerSSD:
+            return new TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerSSD>(instance);
+        case eTrackerSAD:
+            return new TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerSAD>(instance);
+        case eTrackerNCC:
+            return new TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerNCC>(instance);
+        case eTrackerZNCC:
+            return new TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerZNCC>(instance);
+    }
+    return 0;
+}
+
+/** @brief name of the parameter of the i-th track (0-based), e.g. "trackCenter1" */
+static std::string
+trackParamName(const char *name, int i)
+{
+    std::stringstream ss;
+    ss << name << (i + 1);
+    return ss.str();
+}
+
+/** @brief one track of TrackerPMMulti, between two frames */
+struct TrackerPMJob
+{
+    int index; //< index of the track
+    OfxPointD refCenter;
+    OfxRectD refBounds;
+    OfxRectD trackSearchBounds;
+    bool tracked; //< result: true if the track was found
+    OfxPointD newCenter; //< result: the center in the other frame
+};
+
+/**
+ * @brief Track all the jobs between the same two images. Each thread processes one job at a time
+ * (in the calling thread, without using the multithread suite), and takes the next unprocessed job
+ * when it is done, so that the load is balanced even if some tracks take longer than others.
+ */
+template <class PIX, int nComponents, int maxValue>
+class TrackerPMBatch : public OFX::MultiThread::Processor
+{
+public:
+    TrackerPMBatch(OFX::ImageEffect &effect,
+                   TrackerScoreEnum score,
+                   TrackerSearchMethodEnum searchMethod,
+                   int pyramidLevels,
+                   double par,
+                   const OFX::Image* refImg,
+                   const OFX::Image* maskImg,
+                   const OFX::Image* otherImg,
+                   std::vector<TrackerPMJob> &jobs)
+    : _effect(effect)
+    , _score(score)
+    , _searchMethod(searchMethod)
+    , _pyramidLevels(pyramidLevels)
+    , _par(par)
+    , _refImg(refImg)
+    , _maskImg(maskImg)
+    , _otherImg(otherImg)
+    , _jobs(jobs)
+    , _nextJob(0)
+    , _mutex()
+    , _status(kOfxStatOK)
+    , _badAlloc(false)
+    {
+    }
+
+    /** @brief process all the jobs, using at most one thread per job */
+    void process()
+    {
+        if (_jobs.empty()) {
+            return;
+        }
+        if (_jobs.size() == 1) {
+            // use all threads for this single job
+            processJob(_jobs[0], false);
+
+            return;
+        }
+        unsigned int nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_jobs.size());
+        multiThread(std::max(1u, nThreads));
+        rethrowError();
+    }
+
+private:
+    // rethrow the first error caught by the processing threads (must be called from the thread that called multiThread())
+    void rethrowError() const
+    {
+        if (_badAlloc) {
+            throw std::bad_alloc();
+        }
+        if (_status != kOfxStatOK) {
+            OFX::throwSuiteStatusException(_status);
+        }
+    }
+
+    virtual void multiThreadFunction(unsigned int /*threadId*/, unsigned int /*nThreads*/)
+    {
+        // no exception may cross the host thread boundary: the first error is kept, and rethrown by rethrowError()
+        for (;;) {
+            size_t i;
+            {
+                OFX::MultiThread::AutoMutex lock(_mutex);
+                if (_nextJob >= _jobs.size() || _status != kOfxStatOK || _badAlloc || _effect.abort()) {
+                    return;
+                }
+                i = _nextJob++;
+            }
+            try {
+                processJob(_jobs[i], true);
+            } catch (const OFX::Exception::Suite &e) {
+                _jobs[i].tracked = false;
+                setError(e.status(), false);
+            } catch (const std::bad_alloc&) {
+                _jobs[i].tracked = false;
+                setError(kOfxStatErrMemory, true);
+            } catch (...) {
+                _jobs[i].tracked = false;
+                setError(kOfxStatFailed, false);
+            }
+        }
+    }
+
+    void setError(OfxStatus status, bool badAlloc)
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        if (_status == kOfxStatOK && !_badAlloc) {
+            _status = (status == kOfxStatOK) ? kOfxStatFailed : status;
+            _badAlloc = badAlloc;
+        }
+    }
+
+    void processJob(TrackerPMJob &job, bool singleThreaded)
+    {
+        std::auto_ptr<TrackerPMProcessorBase> processor(createTrackerPMProcessor<PIX, nComponents, maxValue>(_effect, _score));
+        processor->setSingleThreaded(singleThreaded);
+        job.tracked = trackPattern(*processor, _searchMethod, _pyramidLevels, _par,
+                                   job.refBounds, job.refCenter, _refImg, _maskImg, job.trackSearchBounds, _otherImg, &job.newCenter);
+    }
+
+    OFX::ImageEffect &_effect;
+    TrackerScoreEnum _score;
+    TrackerSearchMethodEnum _searchMethod;
+    int _pyramidLevels;
+    double _par;
+    const OFX::Image* _refImg;
+    const OFX::Image* _maskImg;
+    const OFX::Image* _otherImg;
+    std::vector<TrackerPMJob> &_jobs;
+    size_t _nextJob; //< index of the next job to process, protected by _mutex
+    OFX::MultiThread::Mutex _mutex; //< protects _nextJob, _status and _badAlloc
+    OfxStatus _status; //< the first error, kOfxStatOK if there was none
+    bool _badAlloc; //< the first error was a std::bad_alloc
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** @brief Track several points in a single effect */
+class TrackerPMMultiPlugin : public GenericTrackerPlugin
+{
+public:
+    /** @brief ctor */
+    TrackerPMMultiPlugin(OfxImageEffectHandle handle)
+    : GenericTrackerPlugin(handle)
+    , _maskClip(0)
+    , _score(0)
+    , _searchMethod(0)
+    , _pyramidLevels(0)
+    , _innerBtmLeft(0)
+    , _innerTopRight(0)
+    , _outerBtmLeft(0)
+    , _outerTopRight(0)
+    , _trackCount(0)
+    {
+        _maskClip = fetchClip(getContext() == OFX::eContextPaint ? "Brush" : "Mask");
+        assert(!_maskClip || _maskClip->getPixelComponents() == ePixelComponentAlpha);
+        _score = fetchChoiceParam(kParamScore);
+        _searchMethod = fetchChoiceParam(kParamSearchMethod);
+        _pyramidLevels = fetchIntParam(kParamPyramidLevels);
+        assert(_score && _searchMethod && _pyramidLevels);
+        _innerBtmLeft = fetchDouble2DParam(kParamTrackingPatternBoxBtmLeft);
+        _innerTopRight = fetchDouble2DParam(kParamTrackingPatternBoxTopRight);
+        _outerBtmLeft = fetchDouble2DParam(kParamTrackingSearchBoxBtmLeft);
+        _outerTopRight = fetchDouble2DParam(kParamTrackingSearchBoxTopRight);
+        assert(_innerTopRight && _innerBtmLeft && _outerTopRight && _outerBtmLeft);
+        _trackCount = fetchIntParam(kParamTrackCount);
+        assert(_trackCount);
+        for (int i = 0; i < kTrackCountMax; ++i) {
+            _trackEnabled[i] = fetchBooleanParam(trackParamName(kParamTrackEnabled, i));
+            _trackCenter[i] = fetchDouble2DParam(trackParamName(kParamTrackCenter, i));
+            assert(_trackEnabled[i] && _trackCenter[i]);
+        }
+        updateVisibility();
+    }
+
+private:
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL
+    {
+        if (paramName == kParamTrackCount) {
+            updateVisibility();
+        } else {
+            GenericTrackerPlugin::changedParam(args, paramName);
+        }
+    }
+
+    virtual void trackRange(const OFX::TrackArguments& args);
+
+    template <int nComponents>
+    void trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args);
+
+    void updateVisibility()
+    {
+        int trackCount = _trackCount->getValue();
+        for (int i = 0; i < kTrackCountMax; ++i) {
+            _trackEnabled[i]->setIsSecret(i >= trackCount);
+            _trackCenter[i]->setIsSecret(i >= trackCount);
+        }
+    }
+
+    OFX::Clip *_maskClip;
+    ChoiceParam* _score;
+    ChoiceParam* _searchMethod;
+    IntParam* _pyramidLevels;
+    OFX::Double2DParam* _innerBtmLeft;
+    OFX::Double2DParam* _innerTopRight;
+    OFX::Double2DParam* _outerBtmLeft;
+    OFX::Double2DParam* _outerTopRight;
+    IntParam* _trackCount;
+    BooleanParam* _trackEnabled[kTrackCountMax];
+    OFX::Double2DParam* _trackCenter[kTrackCountMax];
+};
+
+void
+TrackerPMMultiPlugin::trackRange(const OFX::TrackArguments& args)
+{
+    if (!_srcClip) {
+        return;
+    }
+# ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
+    getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
+#  endif
+    OfxTime t = args.first;
+    bool changeTime = (args.reason == eChangeUserEdit && t == timeLineGetTime());
+    std::string name;
+    _instanceName->getValueAtTime(t, name);
+    assert((args.forward && args.last >= args.first) || (!args.forward && args.last <= args.first));
+    bool showProgress = std::abs(args.last - args.first) > 1;
+    if (showProgress) {
+        progressStart(name);
+    }
+
+    while (args.forward ? (t <= args.last) : (t >= args.last)) {
+        OfxTime other = args.forward ? (t + 1) : (t - 1);
+
+        OFX::PixelComponentEnum srcComponents  = _srcClip->getPixelComponents();
+        assert(srcComponents == OFX::ePixelComponentRGB || srcComponents == OFX::ePixelComponentRGBA ||
+               srcComponents == OFX::ePixelComponentAlpha);
+
+        if (srcComponents == OFX::ePixelComponentRGBA) {
+            trackInternal<4>(t, other, args);
+        } else if (srcComponents == OFX::ePixelComponentRGB) {
+            trackInternal<3>(t, other, args);
+        } else {
+            assert(srcComponents == OFX::ePixelComponentAlpha);
+            trackInternal<1>(t, other, args);
+        }
+        if (args.forward) {
+            ++t;
+        } else {
+            --t;
+        }
+        if (changeTime) {
+            // set the timeline to a specific time
+            timeLineGotoTime(t);
+        }
+        if (abort() || (showProgress && !progressUpdate((t - args.first) / (args.last - args.first)))) {
+            break;
+        }
+    }
+    if (showProgress) {
+        progressEnd();
+    }
+# ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
+    getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
+# endif
+}
+
 template <int nComponents>
 void
-TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args)
+TrackerPMMultiPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args)
 {
     OfxRectD refRect;
     _innerBtmLeft->getValueAtTime(refTime, refRect.x1, refRect.y1);
     _innerTopRight->getValueAtTime(refTime, refRect.x2, refRect.y2);
-    OfxPointD refCenter;
-    _center->getValueAtTime(refTime, refCenter.x, refCenter.y);
     OfxRectD searchRect;
     _outerBtmLeft->getValueAtTime(refTime, searchRect.x1, searchRect.y1);
     _outerTopRight->getValueAtTime(refTime, searchRect.x2, searchRect.y2);
 
-    OfxPointD offset;
-    _offset->getValueAtTime(refTime, offset.x, offset.y);
-    
-    OfxPointD refCenterWithOffset;
-    refCenterWithOffset.x = refCenter.x + offset.x;
-    refCenterWithOffset.y = refCenter.y + offset.y;
-    
-    OfxRectD refBounds;
-    getRefBounds(refRect, refCenterWithOffset, &refBounds);
-
-    OfxRectD otherBounds;
-    getOtherBounds(refCenterWithOffset, searchRect, &otherBounds);
+    // the jobs, and the union of the regions used by all the tracks, so that each image is fetched only once
+    std::vector<TrackerPMJob> jobs;
+    OfxRectD refBoundsAll = {0., 0., 0., 0.};
+    OfxRectD otherBoundsAll = {0., 0., 0., 0.};
+    int trackCount;
+    _trackCount->getValueAtTime(refTime, trackCount);
+    trackCount = std::max(0, std::min(trackCount, kTrackCountMax));
+    for (int i = 0; i < trackCount; ++i) {
+        bool enabled;
+        _trackEnabled[i]->getValueAtTime(refTime, enabled);
+        if (!enabled) {
+            continue;
+        }
+        TrackerPMJob job;
+        job.index = i;
+        _trackCenter[i]->getValueAtTime(refTime, job.refCenter.x, job.refCenter.y);
+        getRefBounds(refRect, job.refCenter, &job.refBounds);
+        getTrackSearchBounds(refRect, job.refCenter, searchRect, &job.trackSearchBounds);
+        job.tracked = false;
+        job.newCenter = job.refCenter;
+        OfxRectD otherBounds;
+        getOtherBounds(job.refCenter, searchRect, &otherBounds);
+        if (jobs.empty()) {
+            refBoundsAll = job.refBounds;
+            otherBoundsAll = otherBounds;
+        } else {
+            OFX::Coords::rectBoundingBox(job.refBounds, refBoundsAll, &refBoundsAll);
+            OFX::Coords::rectBoundingBox(otherBounds, otherBoundsAll, &otherBoundsAll);
+        }
+        jobs.push_back(job);
+    }
+    if (jobs.empty()) {
+        return;
+    }
 
     std::auto_ptr<const OFX::Image> srcRef((_srcClip && _srcClip->isConnected()) ?
-                                           _srcClip->fetchImage(refTime, refBounds) : 0);
+                                           _srcClip->fetchImage(refTime, refBoundsAll) : 0);
     std::auto_ptr<const OFX::Image> srcOther((_srcClip && _srcClip->isConnected()) ?
-                                             _srcClip->fetchImage(otherTime, otherBounds) : 0);
+                                             _srcClip->fetchImage(otherTime, otherBoundsAll) : 0);
     if (!srcRef.get() || !srcOther.get()) {
         return;
     }
-    if (srcRef.get()) {
-        if (srcRef->getRenderScale().x != args.renderScale.x ||
-            srcRef->getRenderScale().y != args.renderScale.y) {
-            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-            OFX::throwSuiteStatusException(kOfxStatFailed);
-        }
-    }
-    if (srcOther.get()) {
-        if (srcOther->getRenderScale().x != args.renderScale.x ||
-            srcOther->getRenderScale().y != args.renderScale.y) {
-            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-            OFX::throwSuiteStatusException(kOfxStatFailed);
-        }
+    if (srcRef->getRenderScale().x != args.renderScale.x ||
+        srcRef->getRenderScale().y != args.renderScale.y ||
+        srcOther->getRenderScale().x != args.renderScale.x ||
+        srcOther->getRenderScale().y != args.renderScale.y) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
     }
     // renderScale should never be something else than 1 when called from ActionInstanceChanged
     if ((srcRef->getPixelDepth() != srcOther->getPixelDepth()) ||
@@ -812,10 +2652,7 @@ TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::Tr
         OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
     }
 
-    OFX::BitDepthEnum srcBitDepth = srcRef->getPixelDepth();
-
     //  mask cannot be black and transparent, so an empty mask means mask is disabled.
-    // auto ptr for the mask.
     std::auto_ptr<const OFX::Image> mask((_maskClip && _maskClip->isConnected()) ?
                                          _maskClip->fetchImage(refTime) : 0);
     if (mask.get()) {
@@ -826,35 +2663,60 @@ TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::Tr
         }
     }
 
-    OfxRectD trackSearchBounds;
-    getTrackSearchBounds(refRect, refCenterWithOffset, searchRect, &trackSearchBounds);
+    int scoreI;
+    _score->getValueAtTime(refTime, scoreI);
+    int searchMethodI;
+    _searchMethod->getValueAtTime(refTime, searchMethodI);
+    int pyramidLevels;
+    _pyramidLevels->getValueAtTime(refTime, pyramidLevels);
+    const double par = _srcClip->getPixelAspectRatio();
+    const TrackerScoreEnum score = (TrackerScoreEnum)scoreI;
+    const TrackerSearchMethodEnum searchMethod = (TrackerSearchMethodEnum)searchMethodI;
 
-    switch (srcBitDepth) {
+    switch (srcRef->getPixelDepth()) {
         case OFX::eBitDepthUByte: {
-            trackInternalForDepth<unsigned char, nComponents, 255>(refTime, refBounds, refCenter, refCenterWithOffset, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
+            TrackerPMBatch<unsigned char, nComponents, 255> batch(*this, score, searchMethod, pyramidLevels, par, srcRef.get(), mask.get(), srcOther.get(), jobs);
+            batch.process();
         }   break;
         case OFX::eBitDepthUShort: {
-            trackInternalForDepth<unsigned short, nComponents, 65535>(refTime, refBounds, refCenter, refCenterWithOffset, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
+            TrackerPMBatch<unsigned short, nComponents, 65535> batch(*this, score, searchMethod, pyramidLevels, par, srcRef.get(), mask.get(), srcOther.get(), jobs);
+            batch.process();
         }   break;
         case OFX::eBitDepthFloat: {
-            trackInternalForDepth<float, nComponents, 1>(refTime, refBounds, refCenter, refCenterWithOffset, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
+            TrackerPMBatch<float, nComponents, 1> batch(*this, score, searchMethod, pyramidLevels, par, srcRef.get(), mask.get(), srcOther.get(), jobs);
+            batch.process();
         }   break;
         default:
             OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
     }
-}
-
+    if (abort()) {
+        return;
+    }
 
-using namespace OFX;
+    // write the keyframes of all the tracks at once
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        const TrackerPMJob& job = jobs[j];
+        Double2DParam* center = _trackCenter[job.index];
+        if (!job.tracked) {
+            // can't track: erase any existing track
+            center->deleteKeyAtTime(otherTime);
+        } else {
+            // create a keyframe at starting point
+            center->setValueAtTime(refTime, job.refCenter.x, job.refCenter.y);
+            // create a keyframe at end point
+            center->setValueAtTime(otherTime, job.newCenter.x, job.newCenter.y);
+        }
+    }
+}
 
-mDeclarePluginFactory(TrackerPMPluginFactory, {}, {});
+mDeclarePluginFactory(TrackerPMMultiPluginFactory, {}, {});
 
-void TrackerPMPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
+void TrackerPMMultiPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
 {
     // basic labels
-    desc.setLabel(kPluginName);
+    desc.setLabel(kPluginMultiName);
     desc.setPluginGrouping(kPluginGrouping);
-    desc.setPluginDescription(kPluginDescription);
+    desc.setPluginDescription(kPluginMultiDescription);
 
     // description common to all trackers
     genericTrackerDescribe(desc);
@@ -873,181 +2735,85 @@ void TrackerPMPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
     // rendertwicealways must be set to true if the tracker cannot handle interlaced content (most don't)
     desc.setRenderTwiceAlways(true);
     desc.setRenderThreadSafety(kRenderThreadSafety);
-    desc.setOverlayInteractDescriptor(new TrackerRegionOverlayDescriptor);
+    // the TrackerPM overlay only handles a single track: the track centers use the host overlay handles
 }
 
-void TrackerPMPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context)
+void TrackerPMMultiPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context)
 {
     PageParamDescriptor* page = genericTrackerDescribeInContextBegin(desc, context);
-    
-    
+
     // description common to all trackers
     genericTrackerDescribePointParameters(desc, page);
-    // center
-    {
-        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingCenterPoint);
-        param->setLabel(kParamTrackingCenterPointLabel);
-        param->setHint(kParamTrackingCenterPointHint);
-        param->setInstanceSpecific(true);
-        param->setDoubleType(eDoubleTypeXYAbsolute);
-        param->setDefaultCoordinateSystem(eCoordinatesNormalised);
-        param->setDefault(0.5, 0.5);
-        param->setDisplayRange(-10000, -10000, 10000, 10000); // Resolve requires display range or values are clamped to (-1,1)
-        param->setIncrement(1.);
-        param->setEvaluateOnChange(false); // The tracker is identity always
-#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
-        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
-#     endif
-        if (page) {
-            page->addChild(*param);
-        }
-    }
-    
-    // offset
-    {
-        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingOffset);
-        param->setLabel(kParamTrackingOffsetLabel);
-        param->setHint(kParamTrackingOffsetHint);
-        param->setInstanceSpecific(true);
-        param->setDoubleType(eDoubleTypeXYAbsolute);
-        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
-        param->setDefault(0, 0);
-        param->setDisplayRange(-10000, -10000, 10000, 10000); // Resolve requires display range or values are clamped to (-1,1)
-        param->setIncrement(1.);
-        param->setEvaluateOnChange(false); // The tracker is identity always
-        if (page) {
-            page->addChild(*param);
-        }
-    }
-    
-    // innerBtmLeft
-    {
-        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingPatternBoxBtmLeft);
-        param->setLabel(kParamTrackingPatternBoxBtmLeftLabel);
-        param->setHint(kParamTrackingPatternBoxBtmLeftHint);
-        param->setDoubleType(eDoubleTypeXY);
-        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
-        param->setDefault(-15,-15);
-        param->setDisplayRange(-50., -50., 50., 50.);
-        param->setIncrement(1.);
-        //param->setIsSecret(true);
-        param->setEvaluateOnChange(false); // The tracker is identity always
-#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
-        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
-#     endif
-        if (page) {
-            page->addChild(*param);
-        }
-    }
-    
-    // innerTopRight
-    {
-        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingPatternBoxTopRight);
-        param->setLabel(kParamTrackingPatternBoxTopRightLabel);
-        param->setHint(kParamTrackingPatternBoxTopRightHint);
-        param->setDoubleType(eDoubleTypeXY);
-        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
-        param->setDefault(15, 15);
-        param->setDisplayRange(-50., -50., 50., 50.);
-        param->setIncrement(1.);
-        //innerTopRight->setIsSecret(true);
-        param->setEvaluateOnChange(false); // The tracker is identity always
-#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
-        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
-#     endif
-        if (page) {
-            page->addChild(*param);
-        }
-    }
-    
-    // outerBtmLeft
-    {
-        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingSearchBoxBtmLeft);
-        param->setLabel(kParamTrackingSearchBoxBtmLeftLabel);
-        param->setHint(kParamTrackingSearchBoxBtmLeftHint);
-        param->setDoubleType(eDoubleTypeXY);
-        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
-        param->setDefault(-25,-25);
-        param->setDisplayRange(-100., -100., 100., 100.);
-        param->setIncrement(1.);
-        //param->setIsSecret(true);
-        param->setEvaluateOnChange(false); // The tracker is identity always
-#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
-        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
-#     endif
-        if (page) {
-            page->addChild(*param);
-        }
-    }
-    
-    // outerTopRight
+
+    // trackCount
     {
-        OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(kParamTrackingSearchBoxTopRight);
-        param->setLabel(kParamTrackingSearchBoxTopRightLabel);
-        param->setHint(kParamTrackingSearchBoxBtmLeftHint);
-        param->setDoubleType(eDoubleTypeXY);
-        param->setDefaultCoordinateSystem(eCoordinatesCanonical);
-        param->setDefault(25, 25);
-        param->setDisplayRange(-100., -100., 100., 100.);
-        param->setIncrement(1.);
-        //param->setIsSecret(true);
+        IntParamDescriptor* param = desc.defineIntParam(kParamTrackCount);
+        param->setLabel(kParamTrackCountLabel);
+        param->setHint(kParamTrackCountHint);
+        param->setRange(1, kTrackCountMax);
+        param->setDisplayRange(1, kTrackCountMax);
+        param->setDefault(1);
+        param->setAnimates(false);
         param->setEvaluateOnChange(false); // The tracker is identity always
-#     ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
-        param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
-#     endif
         if (page) {
             page->addChild(*param);
         }
     }
 
-
-
-    // this tracker can be masked
-    if (context == eContextGeneral || (context == eContextPaint) || context == eContextTracker) {
-        ClipDescriptor *maskClip = (context == eContextPaint) ? desc.defineClip("Brush") : desc.defineClip("Mask");
-        maskClip->addSupportedComponent(ePixelComponentAlpha);
-        maskClip->setTemporalClipAccess(false);
-        if (context == eContextGeneral  || context == eContextTracker) {
-            maskClip->setOptional(true);
+    for (int i = 0; i < kTrackCountMax; ++i) {
+        // trackEnabled
+        {
+            BooleanParamDescriptor* param = desc.defineBooleanParam(trackParamName(kParamTrackEnabled, i));
+            param->setLabel(trackParamName(kParamTrackEnabledLabel, i));
+            param->setHint(kParamTrackEnabledHint);
+            param->setDefault(true);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false); // The tracker is identity always
+            param->setLayoutHint(eLayoutHintNoNewLine);
+            if (page) {
+                page->addChild(*param);
+            }
         }
-        maskClip->setSupportsTiles(kSupportsTiles);
-        maskClip->setIsMask(true);
-    }
-
-    // score
-    {
-        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamScore);
-        param->setLabel(kParamScoreLabel);
-        param->setHint(kParamScoreHint);
-        assert(param->getNOptions() == eTrackerSSD);
-        param->appendOption(kParamScoreOptionSSD, kParamScoreOptionSSDHint);
-        assert(param->getNOptions() == eTrackerSAD);
-        param->appendOption(kParamScoreOptionSAD, kParamScoreOptionSADHint);
-        assert(param->getNOptions() == eTrackerNCC);
-        param->appendOption(kParamScoreOptionNCC, kParamScoreOptionNCCHint);
-        assert(param->getNOptions() == eTrackerZNCC);
-        param->appendOption(kParamScoreOptionZNCC, kParamScoreOptionZNCCHint);
-        param->setDefault((int)eTrackerSAD);
-        if (page) {
-            page->addChild(*param);
+        // trackCenter
+        {
+            OFX::Double2DParamDescriptor* param = desc.defineDouble2DParam(trackParamName(kParamTrackCenter, i));
+            param->setLabel(trackParamName(kParamTrackCenterLabel, i));
+            param->setHint(kParamTrackCenterHint);
+            param->setInstanceSpecific(true);
+            param->setDoubleType(eDoubleTypeXYAbsolute);
+            param->setDefaultCoordinateSystem(eCoordinatesNormalised);
+            param->setDefault(0.5, 0.5);
+            param->setDisplayRange(-10000, -10000, 10000, 10000); // Resolve requires display range or values are clamped to (-1,1)
+            param->setIncrement(1.);
+            param->setUseHostNativeOverlayHandle(true);
+            param->setEvaluateOnChange(false); // The tracker is identity always
+#         ifdef kOfxParamPropPluginMayWrite // removed from OFX 1.4
+            param->getPropertySet().propSetInt(kOfxParamPropPluginMayWrite, 1, false);
+#         endif
+            if (page) {
+                page->addChild(*param);
+            }
         }
     }
-}
-
 
+    // parameters common to TrackerPM and TrackerPMMulti
+    trackerPMDescribeParameters(desc, context, page);
+}
 
-OFX::ImageEffect* TrackerPMPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
+OFX::ImageEffect* TrackerPMMultiPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
 {
-    return new TrackerPMPlugin(handle);
+    return new TrackerPMMultiPlugin(handle);
 }
 
-
-
-
-
-void getTrackerPMPluginID(OFX::PluginFactoryArray &ids)
+void getTrackerPMPluginIDs(OFX::PluginFactoryArray &ids)
 {
-    static TrackerPMPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
-    ids.push_back(&p);
+    {
+        static TrackerPMPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+        ids.push_back(&p);
+    }
+    {
+        static TrackerPMMultiPluginFactory p(kPluginMultiIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+        ids.push_back(&p);
+    }
 }
 
@@ -25,6 +25,6 @@
 
 #include "ofxsImageEffect.h"
 
-void getTrackerPMPluginID(OFX::PluginFactoryArray &ids);
+void getTrackerPMPluginIDs(OFX::PluginFactoryArray &ids);
 
 #endif // MISC_ESA_TRACKER_H
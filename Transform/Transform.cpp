@@ -31,6 +31,8 @@
 #include "ofxsTransform3x3.h"
 #include "ofxsTransformInteract.h"
 #include "ofxsCoords.h"
+#include "ofxsResample.h"
+#include "ofxsMipmapCache.h"
 
 #define kPluginName "TransformOFX"
 #define kPluginMaskedName "TransformMaskedOFX"
@@ -46,8 +48,12 @@
 #define kPluginDirBlurDescription "Apply directional blur to an image.\n"\
 "This plugin concatenates transforms upstream."
 #define kPluginDirBlurIdentifier "net.sf.openfx.DirBlur"
+// History:
+// version 1.0: initial version
+// version 1.1: separable resampling of scale/translate transforms
+// version 1.2: add the mipmap parameter
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 using namespace OFX;
 
@@ -69,6 +75,9 @@ public:
     , _skewOrder(0)
     , _center(0)
     , _interactive(0)
+    , _isDirBlur(isDirBlur)
+    , _mipmap(0)
+    , _mipmapCache()
     {
         // NON-GENERIC
         _translate = fetchDouble2DParam(kParamTransformTranslateOld);
@@ -81,6 +90,7 @@ public:
         _center = fetchDouble2DParam(kParamTransformCenterOld);
         _interactive = fetchBooleanParam(kParamTransformInteractiveOld);
         assert(_translate && _rotate && _scale && _scaleUniform && _skewX && _skewY && _skewOrder && _center && _interactive);
+        _mipmap = paramExists(kParamMipmap) ? fetchBooleanParam(kParamMipmap) : 0;
     }
 
 private:
@@ -95,6 +105,28 @@ private:
     /** @brief called when a clip has just been changed in some way (a rewire maybe) */
     virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    // The inverse transform in canonical coordinates, or false if it has to be blurred.
+    bool getInverseTransformCanonicalNoBlur(double time, OFX::Matrix3x3* invtransform) const;
+
+    // Scale/translate transforms (e.g. reformats) are rendered by a separable resampler, and
+    // all transforms are rendered using a mipmap if the mipmap parameter is set.
+    // Other transforms and motion blur go through Transform3x3Plugin::render().
+    bool getInverseTransformPixel(const OFX::RenderArguments &args, const OFX::Image *src, OFX::Matrix3x3* invtransform);
+
+    template <class PIX, int nComponents, int maxValue>
+    void renderSeparableForBitDepth(const OFX::RenderArguments &args, const OFX::Image *src, const OFX::Matrix3x3 &invtransform);
+
+    template <int nComponents>
+    void renderSeparable(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth, const OFX::Image *src, const OFX::Matrix3x3 &invtransform);
+
+    void setupAndProcessSeparable(OFX::SeparableResamplerBase &processor, FilterEnum filter, const OFX::RenderArguments &args, const OFX::Image *src, const OFX::Matrix3x3 &invtransform);
+
     // NON-GENERIC
     OFX::Double2DParam* _translate;
     OFX::DoubleParam* _rotate;
@@ -105,6 +137,9 @@ private:
     OFX::ChoiceParam* _skewOrder;
     OFX::Double2DParam* _center;
     OFX::BooleanParam* _interactive;
+    bool _isDirBlur;
+    OFX::BooleanParam* _mipmap;
+    OFX::MipmapCache _mipmapCache;
 };
 
 // overridden is identity
@@ -287,7 +322,323 @@ TransformPlugin::changedClip(const InstanceChangedArgs &args, const std::string
     }
 }
 
+bool
+TransformPlugin::getInverseTransformCanonicalNoBlur(double time,
+                                                    OFX::Matrix3x3* invtransform) const
+{
+    if (_isDirBlur) {
+        return false;
+    }
+    if (_motionblur && _motionblur->getValueAtTime(time) != 0.) {
+        return false;
+    }
+    if (_directionalBlur && _directionalBlur->getValueAtTime(time)) {
+        return false;
+    }
+    bool invert = false;
+    if (_invert) {
+        _invert->getValueAtTime(time, invert);
+    }
+
+    return getInverseTransformCanonical(time, 1., invert, invtransform);
+}
+
+// Returns the inverse transform in pixel coordinates, or false if it has to be blurred.
+bool
+TransformPlugin::getInverseTransformPixel(const OFX::RenderArguments &args,
+                                          const OFX::Image *src,
+                                          OFX::Matrix3x3* invtransform)
+{
+    OFX::Matrix3x3 invtransformCanonical;
+    if (!getInverseTransformCanonicalNoBlur(args.time, &invtransformCanonical)) {
+        return false;
+    }
+    *invtransform = OFX::ofxsMipmapInverseTransformPixel(invtransformCanonical, args, src, _dstClip);
+
+    return true;
+}
+
+// override the roi call
+// The mipmap is built from the whole source RoD, and the separable resampler stretches the
+// filter when minifying, so that its margin in source pixels is larger than the one added by
+// Transform3x3Plugin.
+void
+TransformPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                      OFX::RegionOfInterestSetter &rois)
+{
+    const double time = args.time;
+    bool mipmap = false;
+    if (_mipmap) {
+        _mipmap->getValueAtTime(time, mipmap);
+    }
+    OFX::Matrix3x3 H;
+    if (!_srcClip || !getInverseTransformCanonicalNoBlur(time, &H) || (!mipmap && !OFX::ofxsMatIsAxisAligned(H))) {
+        Transform3x3Plugin::getRegionsOfInterest(args, rois);
 
+        return;
+    }
+    if (mipmap) {
+        rois.setRegionOfInterest(*_srcClip, _srcClip->getRegionOfDefinition(time));
+
+        return;
+    }
+    int filter = eFilterCubic;
+    if (_filter) {
+        _filter->getValueAtTime(time, filter);
+    }
+    // the scale is the same in canonical and pixel coordinates
+    const double sx = H.a / H.i;
+    const double sy = H.e / H.i;
+    const double x1 = sx * args.regionOfInterest.x1 + H.c / H.i;
+    const double x2 = sx * args.regionOfInterest.x2 + H.c / H.i;
+    const double y1 = sy * args.regionOfInterest.y1 + H.f / H.i;
+    const double y2 = sy * args.regionOfInterest.y2 + H.f / H.i;
+    // the margin, converted from source pixels to canonical coordinates
+    const double mx = OFX::ofxsResampleMargin((FilterEnum)filter, sx) * _srcClip->getPixelAspectRatio() / args.renderScale.x;
+    const double my = OFX::ofxsResampleMargin((FilterEnum)filter, sy) / args.renderScale.y;
+    OfxRectD srcRoI;
+    srcRoI.x1 = std::min(x1, x2) - mx;
+    srcRoI.x2 = std::max(x1, x2) + mx;
+    srcRoI.y1 = std::min(y1, y2) - my;
+    srcRoI.y2 = std::max(y1, y2) + my;
+    rois.setRegionOfInterest(*_srcClip, srcRoI);
+}
+
+void
+TransformPlugin::purgeCaches()
+{
+    _mipmapCache.clear();
+}
+
+void
+TransformPlugin::setupAndProcessSeparable(OFX::SeparableResamplerBase &processor,
+                                          FilterEnum filter,
+                                          const OFX::RenderArguments &args,
+                                          const OFX::Image *src,
+                                          const OFX::Matrix3x3 &invtransform)
+{
+    const double time = args.time;
+    std::auto_ptr<OFX::Image> dst( _dstClip->fetchImage(time) );
+    if ( !dst.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getPixelDepth() != _dstClip->getPixelDepth() ||
+        dst->getPixelComponents() != _dstClip->getPixelComponents()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if ( (dst->getRenderScale().x != args.renderScale.x) ||
+        ( dst->getRenderScale().y != args.renderScale.y) ||
+        ( (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) ) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (src) {
+        if ( (src->getPixelDepth() != dst->getPixelDepth()) || (src->getPixelComponents() != dst->getPixelComponents()) ) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+
+    bool blackOutside = true;
+    _blackOutside->getValueAtTime(time, blackOutside);
+    double mix = 1.;
+    _mix->getValueAtTime(time, mix);
+
+    // the weights, for each column and each row of the render window
+    OFX::ResampleTable xTable;
+    OFX::ResampleTable yTable;
+    if (src) {
+        // the taps outside of the source RoD are black or clamped, the others must be in the source
+        // image (see getRegionsOfInterest())
+        const OfxRectI& srcBounds = src->getBounds();
+        OfxRectI srcRoD;
+        OFX::Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), args.renderScale, _srcClip->getPixelAspectRatio(), &srcRoD);
+        xTable.build(filter, invtransform.a / invtransform.i, invtransform.c / invtransform.i,
+                     args.renderWindow.x1, args.renderWindow.x2, srcRoD.x1, srcRoD.x2, srcBounds.x1, srcBounds.x2, blackOutside);
+        yTable.build(filter, invtransform.e / invtransform.i, invtransform.f / invtransform.i,
+                     args.renderWindow.y1, args.renderWindow.y2, srcRoD.y1, srcRoD.y2, srcBounds.y1, srcBounds.y2, blackOutside);
+    }
+
+    // auto ptr for the mask.
+    bool doMasking = ((!_maskApply || _maskApply->getValueAtTime(args.time)) && _maskClip && _maskClip->isConnected());
+    std::auto_ptr<const OFX::Image> mask(doMasking ? _maskClip->fetchImage(args.time) : 0);
+    if (doMasking) {
+        bool maskInvert;
+        _maskInvert->getValueAtTime(time, maskInvert);
+        processor.doMasking(true);
+        processor.setMaskImg(mask.get(), maskInvert);
+    }
+
+    processor.setDstImg( dst.get() );
+    processor.setSrcImg(src);
+    processor.setRenderWindow(args.renderWindow);
+    processor.setValues(&xTable, &yTable, mix);
+
+    // Call the base class process member, this will call the derived templated process code
+    processor.process();
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+TransformPlugin::renderSeparableForBitDepth(const OFX::RenderArguments &args,
+                                            const OFX::Image *src,
+                                            const OFX::Matrix3x3 &invtransform)
+{
+    const double time = args.time;
+    int filter = args.renderQualityDraft ? eFilterImpulse : eFilterCubic;
+    if (!args.renderQualityDraft && _filter) {
+        _filter->getValueAtTime(time, filter);
+    }
+    bool clamp;
+    _clamp->getValueAtTime(time, clamp);
+
+    // as you may see below, some filters don't need explicit clamping, since they are
+    // "clamped" by construction.
+    switch ( (FilterEnum)filter ) {
+        case eFilterImpulse: {
+            OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterImpulse, false> fred(*this);
+            setupAndProcessSeparable(fred, eFilterImpulse, args, src, invtransform);
+            break;
+        }
+        case eFilterBilinear: {
+            OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterBilinear, false> fred(*this);
+            setupAndProcessSeparable(fred, eFilterBilinear, args, src, invtransform);
+            break;
+        }
+        case eFilterCubic: {
+            OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterCubic, false> fred(*this);
+            setupAndProcessSeparable(fred, eFilterCubic, args, src, invtransform);
+            break;
+        }
+        case eFilterKeys:
+            if (clamp) {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterKeys, true> fred(*this);
+                setupAndProcessSeparable(fred, eFilterKeys, args, src, invtransform);
+            } else {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterKeys, false> fred(*this);
+                setupAndProcessSeparable(fred, eFilterKeys, args, src, invtransform);
+            }
+            break;
+        case eFilterSimon:
+            if (clamp) {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterSimon, true> fred(*this);
+                setupAndProcessSeparable(fred, eFilterSimon, args, src, invtransform);
+            } else {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterSimon, false> fred(*this);
+                setupAndProcessSeparable(fred, eFilterSimon, args, src, invtransform);
+            }
+            break;
+        case eFilterRifman:
+            if (clamp) {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterRifman, true> fred(*this);
+                setupAndProcessSeparable(fred, eFilterRifman, args, src, invtransform);
+            } else {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterRifman, false> fred(*this);
+                setupAndProcessSeparable(fred, eFilterRifman, args, src, invtransform);
+            }
+            break;
+        case eFilterMitchell:
+            if (clamp) {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterMitchell, true> fred(*this);
+                setupAndProcessSeparable(fred, eFilterMitchell, args, src, invtransform);
+            } else {
+                OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterMitchell, false> fred(*this);
+                setupAndProcessSeparable(fred, eFilterMitchell, args, src, invtransform);
+            }
+            break;
+        case eFilterParzen: {
+            OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterParzen, false> fred(*this);
+            setupAndProcessSeparable(fred, eFilterParzen, args, src, invtransform);
+            break;
+        }
+        case eFilterNotch: {
+            OFX::SeparableResampler<PIX, nComponents, maxValue, eFilterNotch, false> fred(*this);
+            setupAndProcessSeparable(fred, eFilterNotch, args, src, invtransform);
+            break;
+        }
+    } // switch
+}
+
+template <int nComponents>
+void
+TransformPlugin::renderSeparable(const OFX::RenderArguments &args,
+                                 OFX::BitDepthEnum dstBitDepth,
+                                 const OFX::Image *src,
+                                 const OFX::Matrix3x3 &invtransform)
+{
+    switch (dstBitDepth) {
+        case OFX::eBitDepthUByte:
+            renderSeparableForBitDepth<unsigned char, nComponents, 255>(args, src, invtransform);
+            break;
+        case OFX::eBitDepthUShort:
+            renderSeparableForBitDepth<unsigned short, nComponents, 65535>(args, src, invtransform);
+            break;
+        case OFX::eBitDepthFloat:
+            renderSeparableForBitDepth<float, nComponents, 1>(args, src, invtransform);
+            break;
+        default:
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+// the overridden render function
+void
+TransformPlugin::render(const OFX::RenderArguments &args)
+{
+    OFX::Matrix3x3 invtransform;
+    bool mipmap = false;
+    if (_mipmap) {
+        _mipmap->getValueAtTime(args.time, mipmap);
+    }
+    // decide from the parameters only, so that the general path does not fetch the source twice
+    if (!getInverseTransformPixel(args, NULL, &invtransform) ||
+        (!mipmap && !OFX::ofxsMatIsAxisAligned(invtransform))) {
+        // general 3x3 transform, or motion blur
+        Transform3x3Plugin::render(args);
+
+        return;
+    }
+    std::auto_ptr<const OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
+                                        _srcClip->fetchImage(args.time) : 0);
+    if (src.get()) {
+        if ( (src->getRenderScale().x != args.renderScale.x) ||
+            ( src->getRenderScale().y != args.renderScale.y) ||
+            ( (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) ) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        // compose with the source pixel aspect ratio and the input transform
+        getInverseTransformPixel(args, src.get(), &invtransform);
+        if (!mipmap && !OFX::ofxsMatIsAxisAligned(invtransform)) {
+            // the input transform is not axis-aligned
+            src.reset();
+            Transform3x3Plugin::render(args);
+
+            return;
+        }
+    }
+    if (mipmap) {
+        OFX::ofxsMipmapRenderTransform(*this, _mipmapCache, args, src.get(), invtransform,
+                                   _srcClip, _dstClip, _maskClip, _filter, _clamp, _blackOutside, _mix, _maskApply, _maskInvert);
+
+        return;
+    }
+
+    // instantiate the render code based on the pixel depth of the dst clip
+    OFX::BitDepthEnum dstBitDepth    = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+    assert(dstComponents == OFX::ePixelComponentAlpha || dstComponents == OFX::ePixelComponentXY || dstComponents == OFX::ePixelComponentRGB || dstComponents == OFX::ePixelComponentRGBA);
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        renderSeparable<4>(args, dstBitDepth, src.get(), invtransform);
+    } else if (dstComponents == OFX::ePixelComponentRGB) {
+        renderSeparable<3>(args, dstBitDepth, src.get(), invtransform);
+    } else if (dstComponents == OFX::ePixelComponentXY) {
+        renderSeparable<2>(args, dstBitDepth, src.get(), invtransform);
+    } else {
+        assert(dstComponents == OFX::ePixelComponentAlpha);
+        renderSeparable<1>(args, dstBitDepth, src.get(), invtransform);
+    }
+}
 
 
 using namespace OFX;
@@ -322,6 +673,8 @@ void TransformPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 
     TransformPluginDescribeInContext(desc, context, page);
 
+    ofxsMipmapDescribeParams(desc, page);
+
     Transform3x3DescribeInContextEnd(desc, context, page, false, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
 }
 
@@ -353,6 +706,8 @@ void TransformMaskedPluginFactory::describeInContext(OFX::ImageEffectDescriptor
 
     TransformPluginDescribeInContext(desc, context, page);
 
+    ofxsMipmapDescribeParams(desc, page);
+
     Transform3x3DescribeInContextEnd(desc, context, page, true, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
 }
 